@@ -0,0 +1,275 @@
+#include "AVIRecorder.h"
+
+#include <string.h>
+
+using namespace std;
+
+/*
+ * The headers have a fixed size: RIFF, LIST hdrl (avih, LIST strl with
+ * strh and strf) and the start of LIST movi. The frames are indexed
+ * from the 'movi' tag, right at the end of the headers.
+ */
+static const uint32_t headersSize = 224;
+static const uint32_t moviOffset = headersSize - 4;
+
+/* Stay well below the 2 GB some players can handle */
+static const uint32_t maxFileSize = 0x7F000000;
+
+static const uint32_t AVIF_HASINDEX = 0x00000010;
+static const uint32_t AVIIF_KEYFRAME = 0x00000010;
+
+static uint32_t fourcc(const char* code)
+{
+	return (uint32_t) code[0] | ((uint32_t) code[1] << 8) |
+		((uint32_t) code[2] << 16) | ((uint32_t) code[3] << 24);
+}
+
+/* AVI is little endian whatever the board */
+static void put16(uint8_t*& putIt, uint16_t value)
+{
+	*putIt++ = value & 0xFF;
+	*putIt++ = value >> 8;
+}
+
+static void put32(uint8_t*& putIt, uint32_t value)
+{
+	*putIt++ = value & 0xFF;
+	*putIt++ = (value >> 8) & 0xFF;
+	*putIt++ = (value >> 16) & 0xFF;
+	*putIt++ = value >> 24;
+}
+
+static void putTag(uint8_t*& putIt, const char* tag)
+{
+	put32(putIt, fourcc(tag));
+}
+
+AVIRecorder::AVIRecorder()
+{
+	m_file = NULL;
+	m_times = NULL;
+
+	m_fourcc = 0;
+	m_width = 0;
+	m_height = 0;
+	m_fps = 0;
+
+	m_movi_size = 0;
+	m_max_frame_size = 0;
+}
+
+AVIRecorder::~AVIRecorder()
+{
+	close();
+}
+
+bool AVIRecorder::isOpen() const
+{
+	return (m_file != NULL);
+}
+
+uint32_t AVIRecorder::frames() const
+{
+	return m_index.size() / 2;
+}
+
+bool AVIRecorder::open(const char* path, const char* code, uint32_t width,
+	uint32_t height, uint32_t fps)
+{
+	close();
+
+	if (strlen(code) != 4)
+		return false;
+
+	m_file = fopen(path, "wb");
+
+	if (m_file == NULL) {
+		perror(path);
+		return false;
+	}
+
+	/* The timestamps go in a .csv file with the same name */
+	char timesPath[256];
+	const char* extension = strrchr(path, '.');
+	size_t length = (extension != NULL ? extension - path : strlen(path));
+
+	if (length > sizeof(timesPath) - 5)
+		length = sizeof(timesPath) - 5;
+
+	memcpy(timesPath, path, length);
+	strcpy(timesPath + length, ".csv");
+
+	m_times = fopen(timesPath, "w");
+
+	if (m_times == NULL)
+		perror(timesPath);
+
+	m_fourcc = fourcc(code);
+	m_width = width;
+	m_height = height;
+	m_fps = (fps > 0 ? fps : 1);
+
+	m_index.clear();
+	m_movi_size = 4;
+	m_max_frame_size = 0;
+
+	/* Written again with the final sizes when the file is closed */
+	writeHeaders();
+
+	return true;
+}
+
+void AVIRecorder::writeHeaders()
+{
+	uint8_t headers[headersSize];
+	uint8_t* putIt = headers;
+	uint32_t frames = m_index.size() / 2;
+	uint32_t indexSize = 8 + frames * 16;
+
+	bzero(headers, sizeof(headers));
+
+	putTag(putIt, "RIFF");
+	put32(putIt, headersSize - 8 + m_movi_size - 4 + indexSize);
+	putTag(putIt, "AVI ");
+
+	putTag(putIt, "LIST");
+	put32(putIt, 192);
+	putTag(putIt, "hdrl");
+
+	/* Main header */
+	putTag(putIt, "avih");
+	put32(putIt, 56);
+	put32(putIt, 1000000 / m_fps);
+	put32(putIt, m_max_frame_size * m_fps);
+	put32(putIt, 0);
+	put32(putIt, AVIF_HASINDEX);
+	put32(putIt, frames);
+	put32(putIt, 0);
+	put32(putIt, 1);
+	put32(putIt, m_max_frame_size);
+	put32(putIt, m_width);
+	put32(putIt, m_height);
+	putIt += 16;
+
+	putTag(putIt, "LIST");
+	put32(putIt, 116);
+	putTag(putIt, "strl");
+
+	/* Stream header, one video stream at 'fps' frames per second */
+	putTag(putIt, "strh");
+	put32(putIt, 56);
+	putTag(putIt, "vids");
+	put32(putIt, m_fourcc);
+	put32(putIt, 0);
+	put16(putIt, 0);
+	put16(putIt, 0);
+	put32(putIt, 0);
+	put32(putIt, 1);
+	put32(putIt, m_fps);
+	put32(putIt, 0);
+	put32(putIt, frames);
+	put32(putIt, m_max_frame_size);
+	put32(putIt, 0xFFFFFFFF);
+	put32(putIt, 0);
+	put16(putIt, 0);
+	put16(putIt, 0);
+	put16(putIt, m_width);
+	put16(putIt, m_height);
+
+	/* Stream format (BITMAPINFOHEADER) */
+	putTag(putIt, "strf");
+	put32(putIt, 40);
+	put32(putIt, 40);
+	put32(putIt, m_width);
+	put32(putIt, m_height);
+	put16(putIt, 1);
+	put16(putIt, (m_fourcc == fourcc("YUY2") ? 16 : 24));
+	put32(putIt, m_fourcc);
+	put32(putIt, m_width * m_height * 3);
+	putIt += 16;
+
+	putTag(putIt, "LIST");
+	put32(putIt, m_movi_size);
+	putTag(putIt, "movi");
+
+	fseek(m_file, 0, SEEK_SET);
+	fwrite(headers, 1, sizeof(headers), m_file);
+}
+
+bool AVIRecorder::writeFrame(const uint8_t* data, size_t size,
+	uint32_t time)
+{
+	if (m_file == NULL)
+		return false;
+
+	/* Chunks are padded to an even size */
+	uint32_t chunkSize = 8 + size + (size & 1);
+
+	if (headersSize + m_movi_size + chunkSize +
+		(m_index.size() / 2 + 1) * 16 + 8 > maxFileSize)
+		return false;
+
+	uint8_t header[8];
+	uint8_t* putIt = header;
+	static const uint8_t padding = 0;
+
+	putTag(putIt, "00dc");
+	put32(putIt, size);
+
+	fseek(m_file, moviOffset + m_movi_size, SEEK_SET);
+
+	if (fwrite(header, 1, 8, m_file) != 8 ||
+		fwrite(data, 1, size, m_file) != size ||
+		((size & 1) && fwrite(&padding, 1, 1, m_file) != 1)) {
+		perror("AVIRecorder");
+		return false;
+	}
+
+	m_index.push_back(m_movi_size);
+	m_index.push_back(size);
+	m_movi_size += chunkSize;
+
+	if (size > m_max_frame_size)
+		m_max_frame_size = size;
+
+	if (m_times != NULL)
+		fprintf(m_times, "%u %u\n", frames(), time);
+
+	return true;
+}
+
+void AVIRecorder::close()
+{
+	if (m_file == NULL)
+		return;
+
+	/* The index goes right after the frames */
+	uint32_t frames = m_index.size() / 2;
+	uint8_t entry[16];
+
+	fseek(m_file, moviOffset + m_movi_size, SEEK_SET);
+
+	uint8_t* putIt = entry;
+	putTag(putIt, "idx1");
+	put32(putIt, frames * 16);
+	fwrite(entry, 1, 8, m_file);
+
+	for (uint32_t i = 0; i < frames; ++i) {
+		putIt = entry;
+		putTag(putIt, "00dc");
+		put32(putIt, AVIIF_KEYFRAME);
+		put32(putIt, m_index[2 * i]);
+		put32(putIt, m_index[2 * i + 1]);
+		fwrite(entry, 1, 16, m_file);
+	}
+
+	writeHeaders();
+
+	fclose(m_file);
+	m_file = NULL;
+
+	if (m_times != NULL)
+		fclose(m_times);
+
+	m_times = NULL;
+}
@@ -0,0 +1,71 @@
+/*
+ * AVIRecorder - Writes the raw frames of the camera, as delivered by
+ * the driver, into an AVI file.
+ *
+ * Nothing is decoded or encoded: MJPEG frames are stored as they are
+ * ("MJPG") and YUYV frames as uncompressed 4:2:2 ("YUY2"), so recording
+ * costs little more than the I/O. The file has an index (idx1) so it
+ * can be played and seeked by the usual tools. AVI has no per-frame
+ * timestamps, the capture time of every frame is written next to it
+ * in a .csv file with the same name ("frame time" per line, like
+ * frames/capture.csv).
+ */
+#ifndef AVIRECORDER_H
+#define AVIRECORDER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+class AVIRecorder
+{
+  public:
+    AVIRecorder();
+    ~AVIRecorder();
+
+    /*
+     * Create the file, 'fourcc' is "MJPG" or "YUY2". Returns false if
+     * the file cannot be created.
+     */
+    bool open(const char* path, const char* fourcc, uint32_t width,
+      uint32_t height, uint32_t fps);
+
+    /*
+     * Append a frame. Returns false when the file is not open, on a
+     * write error or when the file reached its maximum size (AVI 1.0
+     * files are limited to 2 GB).
+     */
+    bool writeFrame(const uint8_t* data, size_t size, uint32_t time);
+
+    /*
+     * Write the index and complete the headers.
+     */
+    void close();
+
+    bool isOpen() const;
+    uint32_t frames() const;
+
+  private:
+    AVIRecorder(const AVIRecorder&);
+    AVIRecorder& operator=(const AVIRecorder&);
+
+    void writeHeaders();
+
+    FILE* m_file;
+    FILE* m_times;
+
+    uint32_t m_fourcc;
+    uint32_t m_width;
+    uint32_t m_height;
+    uint32_t m_fps;
+
+    /*
+     * Offset and size of every frame, for the index.
+     */
+    std::vector<uint32_t> m_index;
+    uint32_t m_movi_size;
+    uint32_t m_max_frame_size;
+};
+#endif
@@ -0,0 +1,537 @@
+#include "EventRecorder.h"
+
+#include <iostream>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+using namespace std;
+
+static const char* messageHeader = "EventRecorder: ";
+
+EventRecorder::EventRecorder()
+{
+	m_running = false;
+	m_stopping = false;
+
+	m_pre_ms = 0;
+	m_post_ms = 0;
+
+	m_head = 0;
+	m_tail = 0;
+	m_used = 0;
+
+	m_records_pushed = 0;
+	m_record_next = 0;
+
+	m_recording = false;
+	m_continuous = false;
+	m_until = 0;
+	m_newest = 0;
+
+	m_records_file = NULL;
+
+	m_width = 0;
+	m_height = 0;
+	m_fps = 0;
+
+	memset(&m_stats, 0, sizeof(m_stats));
+
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_ready, NULL);
+}
+
+EventRecorder::~EventRecorder()
+{
+	stop();
+
+	pthread_mutex_destroy(&m_lock);
+	pthread_cond_destroy(&m_ready);
+}
+
+bool EventRecorder::start(size_t memory, unsigned int records,
+	uint32_t pre_ms, uint32_t post_ms, const char* prefix, const char* fourcc,
+	uint32_t width, uint32_t height, uint32_t fps)
+{
+	if (m_running)
+		stop();
+
+	/* All of it now, the capture must not wait for an allocation */
+	try {
+		m_memory.assign(memory, 0);
+		m_records.assign(records, Record());
+	}
+	catch (const bad_alloc&) {
+		cerr << messageHeader << "ERROR: No memory for the frames" << endl;
+		return false;
+	}
+
+	m_pre_ms = pre_ms;
+	m_post_ms = post_ms;
+
+	m_frames.clear();
+	m_head = 0;
+	m_tail = 0;
+	m_used = 0;
+
+	m_records_pushed = 0;
+	m_record_next = 0;
+
+	m_recording = false;
+	m_continuous = false;
+	m_until = 0;
+	m_newest = 0;
+
+	m_prefix = prefix;
+	m_fourcc = fourcc;
+	m_width = width;
+	m_height = height;
+	m_fps = fps;
+
+	memset(&m_stats, 0, sizeof(m_stats));
+
+	m_stopping = false;
+	m_running = true;
+
+	if (pthread_create(&m_thread, NULL, writer, this) != 0) {
+		cerr << messageHeader << "ERROR: Failed to start the writer" << endl;
+		m_running = false;
+		return false;
+	}
+
+	return true;
+}
+
+void EventRecorder::stop()
+{
+	if (!m_running)
+		return;
+
+	pthread_mutex_lock(&m_lock);
+	m_recording = false;
+	m_stopping = true;
+	pthread_cond_signal(&m_ready);
+	pthread_mutex_unlock(&m_lock);
+
+	pthread_join(m_thread, NULL);
+
+	m_running = false;
+	m_frames.clear();
+
+	/* The memory goes back until the next start */
+	vector<uint8_t>().swap(m_memory);
+	vector<Record>().swap(m_records);
+}
+
+bool EventRecorder::isRunning() const
+{
+	return m_running;
+}
+
+/*
+ * Find room for 'size' bytes after the newest frame, or at the start of
+ * the memory when it does not fit at the end.
+ */
+bool EventRecorder::reserve(size_t size, size_t& offset)
+{
+	if (m_frames.empty()) {
+		m_head = 0;
+		m_tail = 0;
+	}
+
+	if (size > m_memory.size())
+		return false;
+
+	if (m_frames.empty() || m_tail > m_head) {
+		if (m_memory.size() - m_tail >= size) {
+			offset = m_tail;
+			return true;
+		}
+
+		if (m_frames.empty() || m_head >= size) {
+			offset = 0;
+			return true;
+		}
+
+		return false;
+	}
+
+	/* Wrapped, the free space is between the newest and the oldest */
+	if (m_head - m_tail >= size) {
+		offset = m_tail;
+		return true;
+	}
+
+	return false;
+}
+
+void EventRecorder::evictOldest()
+{
+	m_used -= m_frames.front().size;
+	m_frames.pop_front();
+
+	if (!m_frames.empty())
+		m_head = m_frames.front().offset;
+}
+
+bool EventRecorder::push(const uint8_t* data, size_t size, uint32_t time)
+{
+	if (!m_running || size == 0)
+		return false;
+
+	pthread_mutex_lock(&m_lock);
+
+	m_stats.frames++;
+	m_newest = time;
+
+	/* The recording ends with the first frame after the event */
+	if (m_recording && !m_continuous && time > m_until) {
+		m_recording = false;
+		pthread_cond_signal(&m_ready);
+	}
+
+	/* The frames too old to be recorded are not kept */
+	while (!m_frames.empty() && !m_frames.front().record &&
+		time - m_frames.front().time > m_pre_ms)
+		evictOldest();
+
+	size_t offset = 0;
+
+	while (!reserve(size, offset)) {
+		/* Only the frames already written make room */
+		if (m_frames.empty() || m_frames.front().record) {
+			m_stats.dropped++;
+			pthread_mutex_unlock(&m_lock);
+			return false;
+		}
+
+		evictOldest();
+	}
+
+	pthread_mutex_unlock(&m_lock);
+
+	/* Out of the lock, the frame is not in the ring yet and only this
+	 * thread adds frames */
+	memcpy(&m_memory[offset], data, size);
+
+	pthread_mutex_lock(&m_lock);
+
+	Frame frame;
+
+	frame.offset = offset;
+	frame.size = size;
+	frame.time = time;
+	frame.record = m_recording;
+	frame.written = false;
+
+	if (m_frames.empty())
+		m_head = offset;
+
+	m_frames.push_back(frame);
+	m_tail = offset + size;
+	m_used += size;
+
+	if (m_used > m_stats.memory_max)
+		m_stats.memory_max = m_used;
+
+	if (frame.record)
+		pthread_cond_signal(&m_ready);
+
+	pthread_mutex_unlock(&m_lock);
+
+	return true;
+}
+
+void EventRecorder::pushRecords(const struct telemetry_record* records,
+	unsigned int count)
+{
+	if (!m_running || m_records.empty() || count == 0)
+		return;
+
+	pthread_mutex_lock(&m_lock);
+
+	/* The oldest records make room, written or not */
+	for (unsigned int i = 0; i < count; ++i) {
+		Record& record = m_records[m_records_pushed % m_records.size()];
+
+		record.time = m_newest;
+		record.record = records[i];
+		m_records_pushed++;
+	}
+
+	/* The writer may be waiting for them to end an event */
+	pthread_cond_signal(&m_ready);
+	pthread_mutex_unlock(&m_lock);
+}
+
+bool EventRecorder::trigger()
+{
+	pthread_mutex_lock(&m_lock);
+
+	m_stats.triggers++;
+
+	if (!m_running || m_stopping) {
+		pthread_mutex_unlock(&m_lock);
+		return false;
+	}
+
+	bool started = !m_recording;
+
+	/* The frames before the event, unless already in a recording */
+	if (!m_recording) {
+		for (size_t i = 0; i < m_frames.size(); ++i) {
+			Frame& frame = m_frames[i];
+
+			if (!frame.written && m_newest - frame.time <= m_pre_ms)
+				frame.record = true;
+		}
+	}
+
+	m_recording = true;
+	m_until = m_newest + m_post_ms;
+
+	pthread_cond_signal(&m_ready);
+	pthread_mutex_unlock(&m_lock);
+
+	return started;
+}
+
+bool EventRecorder::record()
+{
+	pthread_mutex_lock(&m_lock);
+
+	if (!m_running || m_stopping) {
+		pthread_mutex_unlock(&m_lock);
+		return false;
+	}
+
+	/* The frames already in the ring are not part of it */
+	m_recording = true;
+	m_continuous = true;
+
+	pthread_mutex_unlock(&m_lock);
+
+	return true;
+}
+
+void EventRecorder::getStats(EventRecorderStats& stats) const
+{
+	pthread_mutex_lock(&m_lock);
+	stats = m_stats;
+	pthread_mutex_unlock(&m_lock);
+}
+
+void* EventRecorder::writer(void* args)
+{
+	((EventRecorder*) args)->writeFrames();
+
+	return NULL;
+}
+
+/*
+ * Append the records of the event pushed so far, up to the end of the
+ * event: the ones after it go to the next event if one is triggered
+ * before they leave the ring. With the lock.
+ */
+void EventRecorder::writeRecords()
+{
+	uint8_t data[TELEMETRY_BATCH * TELEMETRY_RECORD_SIZE];
+	size_t ring = m_records.size();
+
+	while (true) {
+		/* Pushed over before they could be written */
+		if (m_records_pushed - m_record_next > ring) {
+			m_stats.records_lost += m_records_pushed - m_record_next - ring;
+			m_record_next = m_records_pushed - ring;
+		}
+
+		unsigned int count = 0;
+
+		while (m_record_next < m_records_pushed && count < TELEMETRY_BATCH) {
+			const Record& record = m_records[m_record_next % ring];
+
+			if (record.time > m_until)
+				break;
+
+			telemetry_pack(&record.record, 
+				&data[count * TELEMETRY_RECORD_SIZE]);
+
+			m_record_next++;
+			count++;
+		}
+
+		if (count == 0)
+			return;
+
+		m_stats.records += count;
+
+		/* Copied, the ring can move on meanwhile */
+		pthread_mutex_unlock(&m_lock);
+
+		if (fwrite(data, TELEMETRY_RECORD_SIZE, count, m_records_file) != 
+			count)
+			perror("EventRecorder");
+
+		pthread_mutex_lock(&m_lock);
+	}
+}
+
+/*
+ * The frames to record are written oldest first, with the records of
+ * their time. The files are closed once the recording ended and all of
+ * them are written, the records of the end of the event being drained
+ * up to TELEMETRY_DRAIN_MS later.
+ */
+void EventRecorder::writeFrames()
+{
+	/* Waiting for the records of the end of the event until 'deadline',
+	 * or given up */
+	bool waiting = false;
+	bool late = false;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&m_lock);
+
+	while (true) {
+		Frame* next = NULL;
+
+		if (m_records_file != NULL)
+			writeRecords();
+
+		for (size_t i = 0; i < m_frames.size() && next == NULL; ++i) {
+			if (m_frames[i].record)
+				next = &m_frames[i];
+		}
+
+		if (next != NULL) {
+			bool continuous = m_continuous;
+
+			waiting = false;
+			late = false;
+
+			/* The frame stays where it is until it is written, and the
+			 * other frames come and go without moving it */
+			pthread_mutex_unlock(&m_lock);
+
+			bool written = false;
+			bool opened = false;
+
+			if (!m_file.isOpen()) {
+				char number[16];
+				sprintf(number, "%u", m_stats.events + 1);
+
+				string path = m_prefix + (continuous ? "" : number) + 
+					".avi";
+
+				if (!m_file.open(path.c_str(), m_fourcc.c_str(), m_width,
+					m_height, m_fps)) {
+					cerr << messageHeader << "ERROR: Failed to create " <<
+						path << endl;
+
+					/* The event is given up, its frames can leave */
+					pthread_mutex_lock(&m_lock);
+
+					for (size_t i = 0; i < m_frames.size(); ++i)
+						m_frames[i].record = false;
+
+					m_recording = false;
+					continue;
+				}
+
+				/* The records in the layout of the telemetry files */
+				if (!continuous && !m_records.empty()) {
+					path = m_prefix + number + ".tlm";
+					m_records_file = fopen(path.c_str(), "wb");
+
+					uint8_t header[TELEMETRY_HEADER_SIZE];
+					telemetry_pack_header(header);
+
+					if (m_records_file == NULL || 
+						fwrite(header, 1, sizeof(header), m_records_file) != 
+						sizeof(header))
+						perror(path.c_str());
+				}
+
+				opened = true;
+			}
+
+			if (m_file.isOpen())
+				written = m_file.writeFrame(&m_memory[next->offset],
+					next->size, next->time);
+
+			pthread_mutex_lock(&m_lock);
+
+			/* The records start with the first frame of the event */
+			if (opened) {
+				size_t ring = m_records.size();
+
+				m_record_next = (m_records_pushed > ring ? 
+					m_records_pushed - ring : 0);
+
+				while (m_record_next < m_records_pushed && 
+					m_records[m_record_next % ring].time < next->time)
+					m_record_next++;
+			}
+
+			next->record = false;
+			next->written = true;
+
+			if (written)
+				m_stats.recorded++;
+
+			continue;
+		}
+
+		if (m_file.isOpen() && !m_recording) {
+			uint32_t drained = (m_records_pushed > 0 ? 
+				m_records[(m_records_pushed - 1) % m_records.size()].time : 0);
+
+			/* Until a record after the end of the event is drained */
+			if (m_records_file != NULL && drained <= m_until && !late && 
+				!m_stopping) {
+				if (!waiting) {
+					clock_gettime(CLOCK_REALTIME, &deadline);
+
+					deadline.tv_nsec += 2 * TELEMETRY_DRAIN_MS * 1000000L;
+					deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+					deadline.tv_nsec %= 1000000000L;
+
+					waiting = true;
+				}
+
+				if (pthread_cond_timedwait(&m_ready, &m_lock, &deadline) == 
+					ETIMEDOUT)
+					late = true;
+
+				continue;
+			}
+
+			FILE* records = m_records_file;
+			m_records_file = NULL;
+
+			waiting = false;
+			late = false;
+
+			pthread_mutex_unlock(&m_lock);
+
+			m_file.close();
+
+			if (records != NULL)
+				fclose(records);
+
+			pthread_mutex_lock(&m_lock);
+
+			m_stats.events++;
+			continue;
+		}
+
+		if (m_stopping)
+			break;
+
+		pthread_cond_wait(&m_ready, &m_lock);
+	}
+
+	pthread_mutex_unlock(&m_lock);
+}
@@ -0,0 +1,184 @@
+/*
+ * EventRecorder - Records the raw frames of the camera around events
+ * instead of all the time.
+ *
+ * Every frame is copied, as delivered by the driver, into a ring in
+ * memory of a fixed size holding the last 'pre' milliseconds. When an
+ * event is triggered (operator, CAN command, processing stage) those
+ * frames and the ones of the next 'post' milliseconds are written by a
+ * background thread to an AVIRecorder file, with their times in the
+ * .csv next to it. A trigger during a recording extends it. Nothing is
+ * written between events, unless every frame is recorded ('record').
+ *
+ * The telemetry records given to 'pushRecords' (capture, processing,
+ * encoders) are kept in a ring of their own too, and the ones of the
+ * same time as the frames of an event go to a .tlm file next to the
+ * .avi, in the layout of the telemetry files. The records and the
+ * frames may not share a clock, so a record takes the time of the
+ * newest frame when it is pushed, i.e. when it is drained.
+ *
+ * The ring never grows: an old frame leaves it when it is older than
+ * 'pre' or its room is needed, but not before it is written; a new
+ * frame that finds the ring full of frames waiting for the card is
+ * dropped and counted.
+ */
+#ifndef EVENTRECORDER_H
+#define EVENTRECORDER_H
+
+#include "AVIRecorder.h"
+#include "telemetry.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+struct EventRecorderStats
+{
+    /* Events triggered and files written */
+    uint32_t triggers;
+    uint32_t events;
+
+    /* Frames pushed, recorded, and dropped because the ring was full
+     * of frames not written yet */
+    uint32_t frames;
+    uint32_t recorded;
+    uint32_t dropped;
+
+    /* Most of the ring ever used */
+    size_t memory_max;
+
+    /* Telemetry records written with the events, and the ones of an
+     * event that left their ring before being written */
+    uint32_t records;
+    uint32_t records_lost;
+};
+
+class EventRecorder
+{
+  public:
+    EventRecorder();
+    ~EventRecorder();
+
+    /*
+     * Keep up to 'memory' bytes of frames and the last 'records'
+     * telemetry records (none for 0), the ones of 'pre_ms' before an
+     * event and of 'post_ms' after it are recorded to
+     * '<prefix><event>.avi' and .tlm ('fourcc' is "MJPG" or "YUY2").
+     * Returns false if the memory or the thread cannot be had.
+     */
+    bool start(size_t memory, unsigned int records, uint32_t pre_ms,
+      uint32_t post_ms, const char* prefix, const char* fourcc,
+      uint32_t width, uint32_t height, uint32_t fps);
+
+    /*
+     * Writes the recording in progress, up to its last frame, and
+     * stops the thread.
+     */
+    void stop();
+    bool isRunning() const;
+
+    /*
+     * Copy a frame into the ring, 'time' in ms. From the capture
+     * thread only. Returns false if it is dropped.
+     */
+    bool push(const uint8_t* data, size_t size, uint32_t time);
+
+    /*
+     * Keep telemetry records, from a single thread (the drainer of the
+     * telemetry). Never waits for the card.
+     */
+    void pushRecords(const struct telemetry_record* records,
+      unsigned int count);
+
+    /*
+     * Record the frames around now. Returns true if this starts a
+     * recording, false if it extends one (or is not running). Can be
+     * called from any thread.
+     */
+    bool trigger();
+
+    /*
+     * Record every frame from now until 'stop', to '<prefix>.avi'
+     * instead of the events. Returns false if it is not running.
+     */
+    bool record();
+
+    void getStats(EventRecorderStats& stats) const;
+
+  private:
+    EventRecorder(const EventRecorder&);
+    EventRecorder& operator=(const EventRecorder&);
+
+    struct Frame {
+      size_t offset;
+      size_t size;
+      uint32_t time;
+
+      /* Waiting to be written, it stays in the ring until then */
+      bool record;
+      bool written;
+    };
+
+    struct Record {
+      uint32_t time;
+      struct telemetry_record record;
+    };
+
+    static void* writer(void* args);
+    void writeFrames();
+    bool reserve(size_t size, size_t& offset);
+    void evictOldest();
+    void writeRecords();
+
+    pthread_t m_thread;
+    bool m_running;
+    bool m_stopping;
+
+    std::vector<uint8_t> m_memory;
+    uint32_t m_pre_ms;
+    uint32_t m_post_ms;
+
+    /*
+     * The frames, oldest first, in one block of memory used as a ring:
+     * the data of the oldest frame starts at m_head, the next frame
+     * goes at m_tail (or at the start when it does not fit at the end).
+     */
+    std::deque<Frame> m_frames;
+    size_t m_head;
+    size_t m_tail;
+    size_t m_used;
+
+    /*
+     * The telemetry records, in a ring of m_records.size(): the ones
+     * pushed so far, and the next one to write to the event (it is
+     * lost once m_records.size() more are pushed)
+     */
+    std::vector<Record> m_records;
+    uint64_t m_records_pushed;
+    uint64_t m_record_next;
+
+    /* Frames are recorded up to m_until while recording, or until
+     * stopped when m_continuous */
+    bool m_recording;
+    bool m_continuous;
+    uint32_t m_until;
+    uint32_t m_newest;
+
+    /* Only used by the writer */
+    AVIRecorder m_file;
+    FILE* m_records_file;
+    std::string m_prefix;
+    std::string m_fourcc;
+    uint32_t m_width;
+    uint32_t m_height;
+    uint32_t m_fps;
+
+    EventRecorderStats m_stats;
+
+    mutable pthread_mutex_t m_lock;
+    pthread_cond_t m_ready;
+};
+#endif
@@ -0,0 +1,155 @@
+#include "FrameAdmission.h"
+
+#include <iostream>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+using namespace std;
+
+static const char* messageHeader = "FrameAdmission: ";
+
+/* A frame over the budget is still admitted after this long, in case
+ * the processing got faster */
+static const uint64_t remeasurePeriod = 1000000000ULL;
+
+static uint64_t monotonicNow()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+FrameAdmission::FrameAdmission()
+{
+	m_policy = kNewest;
+	m_spec = "newest";
+	m_every = 1;
+	m_budget_ns = 0;
+
+	resetStats();
+}
+
+/*
+ * The number after the ':' of a policy, 0 if there is none.
+ */
+static uint32_t policyValue(const char* spec, size_t prefix)
+{
+	char* end;
+	unsigned long value = strtoul(spec + prefix, &end, 10);
+
+	if (end == spec + prefix || *end != '\0')
+		return 0;
+
+	return value;
+}
+
+bool FrameAdmission::setPolicy(const char* spec)
+{
+	if (spec == NULL || strcmp(spec, "newest") == 0) {
+		m_policy = kNewest;
+	}
+	else if (strncmp(spec, "every:", 6) == 0 && policyValue(spec, 6) > 0) {
+		m_policy = kEveryNth;
+		m_every = policyValue(spec, 6);
+	}
+	else if (strncmp(spec, "budget:", 7) == 0 &&
+		policyValue(spec, 7) > 0) {
+		m_policy = kBudget;
+		m_budget_ns = policyValue(spec, 7) * 1000000ULL;
+	}
+	else {
+		cerr << messageHeader << "ERROR: Unknown admission policy " <<
+			spec << endl;
+		return false;
+	}
+
+	m_spec = (spec != NULL ? spec : "newest");
+
+	resetStats();
+
+	return true;
+}
+
+const char* FrameAdmission::policy() const
+{
+	return m_spec.c_str();
+}
+
+bool FrameAdmission::admit(uint32_t sequence, uint64_t capture_ns)
+{
+	/* The frames between two offered ones were replaced upstream */
+	if (m_offered && sequence > m_last_offered + 1)
+		m_stats.superseded += sequence - m_last_offered - 1;
+
+	m_offered = true;
+	m_last_offered = sequence;
+
+	bool accepted = true;
+
+	if (m_policy == kEveryNth) {
+		accepted = (!m_admitted ||
+			sequence - m_last_admitted >= m_every);
+	}
+	else if (m_policy == kBudget) {
+		uint64_t now = monotonicNow();
+		uint64_t age = (now > capture_ns ? now - capture_ns : 0);
+
+		/* Until a frame has been processed the cost is unknown, and
+		 * the frames are admitted to measure it */
+		accepted = (age + m_cost_ns <= m_budget_ns ||
+			now - m_admitted_ns >= remeasurePeriod);
+	}
+
+	if (!accepted) {
+		m_stats.skipped++;
+		return false;
+	}
+
+	m_admitted = true;
+	m_last_admitted = sequence;
+	m_admitted_ns = monotonicNow();
+	m_stats.admitted++;
+
+	return true;
+}
+
+void FrameAdmission::processed(uint64_t capture_ns, uint64_t cost_ns)
+{
+	uint64_t now = monotonicNow();
+	uint64_t age_us = (now > capture_ns ? now - capture_ns : 0) / 1000;
+
+	m_stats.processed++;
+	m_stats.age_total_us += age_us;
+
+	if (age_us > m_stats.age_max_us)
+		m_stats.age_max_us = age_us;
+
+	/* Each new time weighs 1/8, an outlier does not shut the frames
+	 * out for long */
+	if (m_stats.processed == 1)
+		m_cost_ns = cost_ns;
+	else
+		m_cost_ns = (m_cost_ns * 7 + cost_ns) / 8;
+}
+
+void FrameAdmission::getStats(FrameAdmissionStats& stats) const
+{
+	stats = m_stats;
+	stats.cost_us = m_cost_ns / 1000;
+}
+
+void FrameAdmission::resetStats()
+{
+	memset(&m_stats, 0, sizeof(m_stats));
+
+	m_offered = false;
+	m_last_offered = 0;
+	m_admitted = false;
+	m_last_admitted = 0;
+	m_admitted_ns = 0;
+
+	m_cost_ns = 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * FrameAdmission - Decides which of the captured frames are processed
+ * when the processing cannot keep up with the capture.
+ *
+ * The policy is given as a string:
+ *   "newest"     every frame offered, the latest one whenever there is
+ *                room (the frames replaced before that are superseded)
+ *   "every:N"    at most one frame in N, counted on the captured frames
+ *   "budget:MS"  a frame only if it should be processed within MS ms
+ *                of its capture, from its age and the processing time
+ *                measured so far (one frame a second at least, to keep
+ *                measuring it)
+ * The decisions are counted, with the age of the frames from their
+ * capture to the end of their processing, to weigh the CPU time spent
+ * against the responsiveness of each policy.
+ */
+#ifndef FRAMEADMISSION_H
+#define FRAMEADMISSION_H
+
+#include <string>
+#include <stdint.h>
+
+struct FrameAdmissionStats
+{
+    /* Frames admitted, refused by the policy, and never offered
+     * because a newer one replaced them first */
+    uint32_t admitted;
+    uint32_t skipped;
+    uint32_t superseded;
+
+    /* Ages of the processed frames, from the capture to the end of
+     * their processing */
+    uint32_t processed;
+    uint64_t age_total_us;
+    uint64_t age_max_us;
+
+    /* Processing time expected for the next frame */
+    uint64_t cost_us;
+};
+
+class FrameAdmission
+{
+  public:
+    FrameAdmission();
+
+    /*
+     * Set the policy from its description, returns false (keeping the
+     * current one) if it is not valid. The counters are cleared.
+     */
+    bool setPolicy(const char* spec);
+    const char* policy() const;
+
+    /*
+     * Offer the frame number 'sequence' (counted on the captured
+     * frames) captured at 'capture_ns' on the monotonic clock. Returns
+     * true if it is to be processed.
+     */
+    bool admit(uint32_t sequence, uint64_t capture_ns);
+
+    /*
+     * Report an admitted frame processed in 'cost_ns', the estimate of
+     * the processing time follows it.
+     */
+    void processed(uint64_t capture_ns, uint64_t cost_ns);
+
+    void getStats(FrameAdmissionStats& stats) const;
+    void resetStats();
+
+  private:
+    enum admission_policy { kNewest, kEveryNth, kBudget };
+
+    admission_policy m_policy;
+    std::string m_spec;
+    uint32_t m_every;
+    uint64_t m_budget_ns;
+
+    /* Last frame offered and last frame admitted, and when */
+    bool m_offered;
+    uint32_t m_last_offered;
+    bool m_admitted;
+    uint32_t m_last_admitted;
+    uint64_t m_admitted_ns;
+
+    /* Moving average of the processing time */
+    uint64_t m_cost_ns;
+
+    FrameAdmissionStats m_stats;
+};
+#endif
@@ -0,0 +1,544 @@
+#include "FrameArchive.h"
+
+#include <opencv2/highgui/highgui.hpp>
+
+#include <iostream>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace cv;
+using namespace std;
+
+static const char* messageHeader = "FrameArchive: ";
+
+/* How long the index waits for a buffer of the storage (1 s) */
+static const int indexTries = 100;
+static const useconds_t indexRetryUs = 10000;
+
+static uint32_t fourcc(const char* code)
+{
+	return (uint32_t) code[0] | ((uint32_t) code[1] << 8) |
+		((uint32_t) code[2] << 16) | ((uint32_t) code[3] << 24);
+}
+
+/* The archives are little endian whatever the board */
+static void put16(uint8_t*& putIt, uint16_t value)
+{
+	*putIt++ = value & 0xFF;
+	*putIt++ = value >> 8;
+}
+
+static void put32(uint8_t*& putIt, uint32_t value)
+{
+	*putIt++ = value & 0xFF;
+	*putIt++ = (value >> 8) & 0xFF;
+	*putIt++ = (value >> 16) & 0xFF;
+	*putIt++ = value >> 24;
+}
+
+static void put64(uint8_t*& putIt, uint64_t value)
+{
+	put32(putIt, value & 0xFFFFFFFF);
+	put32(putIt, value >> 32);
+}
+
+static void putTag(uint8_t*& putIt, const char* tag)
+{
+	put32(putIt, fourcc(tag));
+}
+
+static uint16_t get16(const uint8_t* getIt)
+{
+	return (uint16_t) getIt[0] | ((uint16_t) getIt[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* getIt)
+{
+	return (uint32_t) getIt[0] | ((uint32_t) getIt[1] << 8) |
+		((uint32_t) getIt[2] << 16) | ((uint32_t) getIt[3] << 24);
+}
+
+static uint64_t get64(const uint8_t* getIt)
+{
+	return get32(getIt) | ((uint64_t) get32(getIt + 4) << 32);
+}
+
+/*
+ * FNV-1a of a record header without its checksum, a torn or foreign
+ * header is not taken for a frame.
+ */
+static uint32_t headerChecksum(const uint8_t* header)
+{
+	uint32_t hash = 2166136261u;
+
+	for (int i = 0; i < FRAME_RECORD_HEADER_SIZE - 4; ++i)
+		hash = (hash ^ header[i]) * 16777619u;
+
+	return hash;
+}
+
+/* The data of the records is padded so every record starts aligned */
+static uint64_t paddedSize(uint64_t size)
+{
+	return (size + 7) & ~7ULL;
+}
+
+FrameArchive::FrameArchive()
+{
+	m_file = NULL;
+	m_stored = NULL;
+	m_offset = 0;
+}
+
+FrameArchive::~FrameArchive()
+{
+	close();
+}
+
+bool FrameArchive::open(const char* path, struct storage* storage)
+{
+	close();
+
+	uint8_t header[FRAME_ARCHIVE_HEADER_SIZE];
+	uint8_t* putIt = header;
+
+	putTag(putIt, "TFAR");
+	put32(putIt, FRAME_ARCHIVE_VERSION);
+
+	/* Opened and preallocated by the storage thread */
+	if (storage != NULL) {
+		m_stored = storage_open(storage, path, FRAME_ARCHIVE_PREALLOC);
+
+		if (m_stored == NULL ||
+			storage_write(m_stored, header, sizeof(header)) != 0) {
+			cerr << messageHeader << "ERROR: Failed to create " << path <<
+				endl;
+			storage_close(m_stored);
+			m_stored = NULL;
+			return false;
+		}
+	}
+	else {
+		m_file = fopen(path, "wb");
+
+		if (m_file == NULL) {
+			perror("FrameArchive");
+			return false;
+		}
+
+		if (fwrite(header, 1, sizeof(header), m_file) != sizeof(header)) {
+			perror("FrameArchive");
+			fclose(m_file);
+			m_file = NULL;
+			return false;
+		}
+	}
+
+	m_offset = sizeof(header);
+	m_index.clear();
+
+	return true;
+}
+
+/*
+ * Append the pieces of a record at m_offset, all of them or none.
+ */
+bool FrameArchive::write(const struct iovec* iov, int count)
+{
+	/* Dropped whole when the storage has no buffer left */
+	if (m_stored != NULL)
+		return (storage_writev(m_stored, iov, count) == 0);
+
+	/* A record cut short is ignored by the reader, and overwritten by
+	 * the next one */
+	fseek(m_file, m_offset, SEEK_SET);
+
+	for (int i = 0; i < count; ++i) {
+		if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, m_file) !=
+			iov[i].iov_len) {
+			perror("FrameArchive");
+			return false;
+		}
+	}
+
+	/* The record is complete in the file even if the program dies */
+	fflush(m_file);
+
+	return true;
+}
+
+static void packRecordHeader(const FrameRecord& record, size_t size,
+	uint8_t* header)
+{
+	uint8_t* putIt = header;
+
+	putTag(putIt, "FRAM");
+	put32(putIt, size);
+	put32(putIt, record.sequence);
+	put32(putIt, record.time);
+	put64(putIt, record.capture_ns);
+	putTag(putIt, record.format);
+	put16(putIt, record.width);
+	put16(putIt, record.height);
+	put32(putIt, 0);
+	put32(putIt, headerChecksum(header));
+}
+
+bool FrameArchive::append(const FrameRecord& record, const uint8_t* data,
+	size_t size)
+{
+	if (!isOpen() || strlen(record.format) != 4 || size > 0xFFFFFFFFu)
+		return false;
+
+	static const uint8_t padding[8] = { 0 };
+	size_t paddingSize = paddedSize(size) - size;
+
+	uint8_t header[FRAME_RECORD_HEADER_SIZE];
+	packRecordHeader(record, size, header);
+
+	struct iovec pieces[3];
+
+	pieces[0].iov_base = header;
+	pieces[0].iov_len = sizeof(header);
+	pieces[1].iov_base = (void*) data;
+	pieces[1].iov_len = size;
+	pieces[2].iov_base = (void*) padding;
+	pieces[2].iov_len = paddingSize;
+
+	if (!write(pieces, 3))
+		return false;
+
+	m_index.push_back(m_offset);
+	m_offset += FRAME_RECORD_HEADER_SIZE + size + paddingSize;
+
+	return true;
+}
+
+bool FrameArchive::append(const Mat& gray, uint32_t sequence,
+	uint32_t time, uint64_t capture_ns)
+{
+	if (gray.type() != CV_8UC1)
+		return false;
+
+	FrameRecord record;
+
+	record.sequence = sequence;
+	record.time = time;
+	record.capture_ns = capture_ns;
+	strcpy(record.format, "GREY");
+	record.width = gray.cols;
+	record.height = gray.rows;
+
+	if (gray.isContinuous())
+		return append(record, gray.data, gray.total());
+
+	Mat packed = gray.clone();
+
+	return append(record, packed.data, packed.total());
+}
+
+void FrameArchive::close()
+{
+	if (!isOpen())
+		return;
+
+	/* The index and its trailer at the end */
+	vector<uint8_t> index(8 + m_index.size() * 8 +
+		FRAME_ARCHIVE_TRAILER_SIZE);
+	uint8_t* putIt = &index[0];
+
+	putTag(putIt, "FIDX");
+	put32(putIt, m_index.size());
+
+	for (size_t i = 0; i < m_index.size(); ++i)
+		put64(putIt, m_index[i]);
+
+	putTag(putIt, "TFIX");
+	put32(putIt, m_index.size());
+	put64(putIt, m_offset);
+
+	if (m_stored != NULL) {
+		/* The frames just appended may hold every buffer for a while */
+		for (int tries = 0;
+			storage_write(m_stored, &index[0], index.size()) != 0; ++tries) {
+			if (tries == indexTries) {
+				cerr << messageHeader << "ERROR: No room for the index, "
+					"the archive will be read without it" << endl;
+				break;
+			}
+
+			usleep(indexRetryUs);
+		}
+
+		/* Closed, and the space reserved and not used given back, by
+		 * the storage thread */
+		storage_close(m_stored);
+		m_stored = NULL;
+		return;
+	}
+
+	fseek(m_file, m_offset, SEEK_SET);
+
+	/* Nothing must follow the trailer, e.g. a record cut short */
+	if (fwrite(&index[0], 1, index.size(), m_file) != index.size() ||
+		fflush(m_file) != 0 ||
+		ftruncate(fileno(m_file), m_offset + index.size()) != 0)
+		perror("FrameArchive");
+
+	fclose(m_file);
+	m_file = NULL;
+}
+
+bool FrameArchive::isOpen() const
+{
+	return (m_file != NULL || m_stored != NULL);
+}
+
+uint32_t FrameArchive::frames() const
+{
+	return m_index.size();
+}
+
+uint64_t FrameArchive::bytes() const
+{
+	return m_offset;
+}
+
+FrameArchiveReader::FrameArchiveReader()
+{
+	m_file_handle = -1;
+	m_map = NULL;
+	m_map_size = 0;
+
+	m_index = NULL;
+	m_frames = 0;
+}
+
+FrameArchiveReader::~FrameArchiveReader()
+{
+	close();
+}
+
+bool FrameArchiveReader::open(const char* path)
+{
+	close();
+
+	m_file_handle = ::open(path, O_RDONLY);
+
+	if (m_file_handle < 0) {
+		cerr << messageHeader << "ERROR: Failed to open " << path <<
+			": " << strerror(errno) << endl;
+		return false;
+	}
+
+	struct stat status;
+
+	if (fstat(m_file_handle, &status) == -1 ||
+		status.st_size < FRAME_ARCHIVE_HEADER_SIZE) {
+		cerr << messageHeader << "ERROR: Not an archive " << path << endl;
+		close();
+		return false;
+	}
+
+	void* mapped = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE,
+		m_file_handle, 0);
+
+	if (mapped == MAP_FAILED) {
+		cerr << messageHeader << "ERROR: Failed to map " << path <<
+			": " << strerror(errno) << endl;
+		close();
+		return false;
+	}
+
+	m_map = (const uint8_t*) mapped;
+	m_map_size = status.st_size;
+
+	if (get32(m_map) != fourcc("TFAR") ||
+		get32(m_map + 4) != FRAME_ARCHIVE_VERSION) {
+		cerr << messageHeader << "ERROR: Not an archive " << path << endl;
+		close();
+		return false;
+	}
+
+	/* Without a valid index the archive was not closed */
+	if (!readIndex())
+		walkRecords();
+
+	return true;
+}
+
+/*
+ * Use the index at the end of the file if there is a complete one.
+ */
+bool FrameArchiveReader::readIndex()
+{
+	if (m_map_size < FRAME_ARCHIVE_HEADER_SIZE + 8 +
+		FRAME_ARCHIVE_TRAILER_SIZE)
+		return false;
+
+	const uint8_t* trailer = m_map + m_map_size -
+		FRAME_ARCHIVE_TRAILER_SIZE;
+
+	if (get32(trailer) != fourcc("TFIX"))
+		return false;
+
+	uint64_t frames = get32(trailer + 4);
+	uint64_t offset = get64(trailer + 8);
+
+	if (offset < FRAME_ARCHIVE_HEADER_SIZE ||
+		offset + 8 + frames * 8 + FRAME_ARCHIVE_TRAILER_SIZE !=
+		m_map_size)
+		return false;
+
+	const uint8_t* index = m_map + offset;
+
+	if (get32(index) != fourcc("FIDX") || get32(index + 4) != frames)
+		return false;
+
+	m_index = index + 8;
+	m_frames = frames;
+
+	return true;
+}
+
+/*
+ * Find the records from the start, up to the first one that is not
+ * complete.
+ */
+void FrameArchiveReader::walkRecords()
+{
+	uint64_t offset = FRAME_ARCHIVE_HEADER_SIZE;
+
+	while (offset + FRAME_RECORD_HEADER_SIZE <= m_map_size) {
+		const uint8_t* header = m_map + offset;
+
+		if (get32(header) != fourcc("FRAM") ||
+			get32(header + 36) != headerChecksum(header))
+			break;
+
+		uint64_t size = FRAME_RECORD_HEADER_SIZE +
+			paddedSize(get32(header + 4));
+
+		if (offset + size > m_map_size)
+			break;
+
+		m_offsets.push_back(offset);
+		offset += size;
+	}
+
+	m_frames = m_offsets.size();
+}
+
+void FrameArchiveReader::close()
+{
+	if (m_map != NULL)
+		munmap((void*) m_map, m_map_size);
+
+	m_map = NULL;
+	m_map_size = 0;
+
+	if (m_file_handle >= 0)
+		::close(m_file_handle);
+
+	m_file_handle = -1;
+
+	m_index = NULL;
+	m_offsets.clear();
+	m_frames = 0;
+}
+
+bool FrameArchiveReader::isOpen() const
+{
+	return (m_map != NULL);
+}
+
+uint32_t FrameArchiveReader::frames() const
+{
+	return m_frames;
+}
+
+bool FrameArchiveReader::complete() const
+{
+	return (m_index != NULL);
+}
+
+uint64_t FrameArchiveReader::recordOffset(uint32_t index) const
+{
+	if (m_index != NULL)
+		return get64(m_index + (size_t) index * 8);
+
+	return m_offsets[index];
+}
+
+bool FrameArchiveReader::frame(uint32_t index, FrameRecord& record) const
+{
+	if (index >= m_frames)
+		return false;
+
+	uint64_t offset = recordOffset(index);
+
+	if (offset + FRAME_RECORD_HEADER_SIZE > m_map_size)
+		return false;
+
+	const uint8_t* header = m_map + offset;
+
+	if (get32(header) != fourcc("FRAM") ||
+		get32(header + 36) != headerChecksum(header))
+		return false;
+
+	record.size = get32(header + 4);
+
+	if (offset + FRAME_RECORD_HEADER_SIZE + record.size > m_map_size)
+		return false;
+
+	record.sequence = get32(header + 8);
+	record.time = get32(header + 12);
+	record.capture_ns = get64(header + 16);
+	memcpy(record.format, header + 24, 4);
+	record.format[4] = '\0';
+	record.width = get16(header + 28);
+	record.height = get16(header + 30);
+	record.data = header + FRAME_RECORD_HEADER_SIZE;
+
+	return true;
+}
+
+bool FrameArchiveReader::image(uint32_t index, Mat& image) const
+{
+	FrameRecord record;
+
+	if (!frame(index, record))
+		return false;
+
+	/* The raw formats are read in place */
+	int type = -1;
+
+	if (strcmp(record.format, "GREY") == 0)
+		type = CV_8UC1;
+	else if (strcmp(record.format, "YUYV") == 0)
+		type = CV_8UC2;
+
+	if (type >= 0) {
+		if (record.size < (size_t) record.width * record.height *
+			CV_ELEM_SIZE(type))
+			return false;
+
+		image = Mat(record.height, record.width, type,
+			(void*) record.data);
+		return true;
+	}
+
+	if (strcmp(record.format, "JPEG") != 0 &&
+		strcmp(record.format, "MJPG") != 0)
+		return false;
+
+	image = imdecode(Mat(1, record.size, CV_8UC1, (void*) record.data),
+		CV_LOAD_IMAGE_UNCHANGED);
+
+	return !image.empty();
+}
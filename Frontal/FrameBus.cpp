@@ -0,0 +1,308 @@
+#include "FrameBus.h"
+
+#include <iostream>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace cv;
+using namespace std;
+
+static const char* messageHeader = "FrameBus: ";
+
+/* Fields of the header and of the slots, at the offsets documented in
+ * FrameBus.h */
+struct bus_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t slots;
+	uint32_t state;
+	uint64_t slot_size;
+	uint64_t published;
+};
+
+struct bus_slot {
+	uint32_t lock;
+	uint32_t time;
+	uint64_t sequence;
+	uint64_t capture_ns;
+	uint32_t rows;
+	uint32_t cols;
+	uint32_t type;
+	uint32_t unused;
+	uint64_t step;
+};
+
+FrameBus::FrameBus()
+{
+	m_owner = false;
+
+	m_map = NULL;
+	m_map_size = 0;
+
+	m_slots = 0;
+	m_slot_size = 0;
+	m_published = 0;
+}
+
+FrameBus::~FrameBus()
+{
+	close();
+}
+
+bool FrameBus::create(const char* name, uint32_t slots, size_t frame_size)
+{
+	close();
+
+	if (slots < 1)
+		slots = 1;
+
+	/* The readers of a previous bus see it closed, and keep it until
+	 * they let go of it */
+	int fd = shm_open(name, O_RDWR, 0);
+
+	if (fd >= 0) {
+		void* previous = mmap(NULL, FRAME_BUS_HEADER, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+
+		if (previous != MAP_FAILED) {
+			__atomic_store_n(&((bus_header*) previous)->state, 0,
+				__ATOMIC_RELEASE);
+			munmap(previous, FRAME_BUS_HEADER);
+		}
+
+		::close(fd);
+		shm_unlink(name);
+	}
+
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+
+	if (fd < 0) {
+		cerr << messageHeader << "ERROR: Failed to create " << name <<
+			": " << strerror(errno) << endl;
+		return false;
+	}
+
+	/* Every slot on its own cache lines */
+	size_t slot_size = (FRAME_BUS_SLOT_HEADER + frame_size + 63) & ~63UL;
+	size_t map_size = FRAME_BUS_HEADER + (size_t) slots * slot_size;
+
+	void* map = MAP_FAILED;
+
+	if (ftruncate(fd, map_size) == 0)
+		map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			0);
+
+	::close(fd);
+
+	if (map == MAP_FAILED) {
+		cerr << messageHeader << "ERROR: Failed to map " << name << ": " <<
+			strerror(errno) << endl;
+		shm_unlink(name);
+		return false;
+	}
+
+	m_name = name;
+	m_owner = true;
+	m_map = (uint8_t*) map;
+	m_map_size = map_size;
+	m_slots = slots;
+	m_slot_size = slot_size;
+	m_published = 0;
+
+	/* The slots are zero, i.e. empty and unlocked */
+	bus_header* header = (bus_header*) m_map;
+
+	memcpy(header->magic, "TFBS", 4);
+	header->version = FRAME_BUS_VERSION;
+	header->slots = slots;
+	header->slot_size = slot_size;
+	header->published = 0;
+	__atomic_store_n(&header->state, 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+bool FrameBus::open(const char* name)
+{
+	close();
+
+	int fd = shm_open(name, O_RDONLY, 0);
+
+	if (fd < 0)
+		return false;
+
+	struct stat status;
+	void* map = MAP_FAILED;
+
+	if (fstat(fd, &status) == 0 && status.st_size >= FRAME_BUS_HEADER)
+		map = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	::close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	const bus_header* header = (const bus_header*) map;
+
+	if (memcmp(header->magic, "TFBS", 4) != 0 ||
+		header->version != FRAME_BUS_VERSION || header->slots < 1 ||
+		header->slot_size < FRAME_BUS_SLOT_HEADER ||
+		FRAME_BUS_HEADER + header->slots * header->slot_size >
+		(uint64_t) status.st_size) {
+		cerr << messageHeader << "ERROR: Not a frame bus " << name << endl;
+		munmap(map, status.st_size);
+		return false;
+	}
+
+	m_name = name;
+	m_owner = false;
+	m_map = (uint8_t*) map;
+	m_map_size = status.st_size;
+	m_slots = header->slots;
+	m_slot_size = header->slot_size;
+
+	return true;
+}
+
+void FrameBus::close()
+{
+	if (m_map == NULL)
+		return;
+
+	if (m_owner) {
+		__atomic_store_n(&((bus_header*) m_map)->state, 0,
+			__ATOMIC_RELEASE);
+		shm_unlink(m_name.c_str());
+	}
+
+	munmap(m_map, m_map_size);
+
+	m_map = NULL;
+	m_map_size = 0;
+	m_owner = false;
+}
+
+bool FrameBus::isOpen() const
+{
+	return (m_map != NULL);
+}
+
+uint8_t* FrameBus::slot(uint32_t index) const
+{
+	return m_map + FRAME_BUS_HEADER + (size_t) index * m_slot_size;
+}
+
+bool FrameBus::publish(const Mat& image, uint32_t time, uint64_t capture_ns)
+{
+	if (!m_owner || image.empty())
+		return false;
+
+	size_t row_size = image.cols * image.elemSize();
+
+	if (row_size * image.rows > m_slot_size - FRAME_BUS_SLOT_HEADER)
+		return false;
+
+	uint64_t number = m_published + 1;
+	bus_slot* target = (bus_slot*) slot(number % m_slots);
+	uint32_t lock = target->lock;
+
+	/* Odd while written, a reader of this slot gives up the frame */
+	__atomic_store_n(&target->lock, lock + 1, __ATOMIC_RELAXED);
+	__sync_synchronize();
+
+	target->time = time;
+	target->sequence = number;
+	target->capture_ns = capture_ns;
+	target->rows = image.rows;
+	target->cols = image.cols;
+	target->type = image.type();
+	target->step = row_size;
+
+	uint8_t* data = (uint8_t*) target + FRAME_BUS_SLOT_HEADER;
+
+	if (image.isContinuous())
+		memcpy(data, image.data, row_size * image.rows);
+	else {
+		for (int y = 0; y < image.rows; ++y)
+			memcpy(data + y * row_size, image.ptr(y), row_size);
+	}
+
+	__atomic_store_n(&target->lock, lock + 2, __ATOMIC_RELEASE);
+
+	m_published = number;
+	__atomic_store_n(&((bus_header*) m_map)->published, number,
+		__ATOMIC_RELEASE);
+
+	return true;
+}
+
+uint64_t FrameBus::getPublished() const
+{
+	return m_published;
+}
+
+bool FrameBus::latest(FrameBusFrame& frame, uint64_t after) const
+{
+	if (m_map == NULL)
+		return false;
+
+	const bus_header* header = (const bus_header*) m_map;
+	uint64_t number = __atomic_load_n(&header->published, __ATOMIC_ACQUIRE);
+
+	if (number == 0 || number <= after)
+		return false;
+
+	uint32_t index = number % m_slots;
+	const bus_slot* source = (const bus_slot*) slot(index);
+	uint32_t lock = __atomic_load_n(&source->lock, __ATOMIC_ACQUIRE);
+
+	if (lock & 1)
+		return false;
+
+	uint32_t rows = source->rows;
+	uint32_t cols = source->cols;
+	uint32_t type = source->type;
+	uint64_t step = source->step;
+
+	frame.sequence = source->sequence;
+	frame.time = source->time;
+	frame.capture_ns = source->capture_ns;
+	frame.slot = index;
+	frame.lock = lock;
+
+	/* The geometry must be the one written with this lock */
+	if (!valid(frame) || rows * step > m_slot_size - FRAME_BUS_SLOT_HEADER)
+		return false;
+
+	frame.image = Mat(rows, cols, type,
+		(void*) ((const uint8_t*) source + FRAME_BUS_SLOT_HEADER), step);
+
+	return true;
+}
+
+bool FrameBus::valid(const FrameBusFrame& frame) const
+{
+	if (m_map == NULL || frame.slot >= m_slots)
+		return false;
+
+	/* Everything read before is read before the lock */
+	__sync_synchronize();
+
+	const bus_slot* source = (const bus_slot*) slot(frame.slot);
+
+	return (__atomic_load_n(&source->lock, __ATOMIC_RELAXED) == frame.lock);
+}
+
+bool FrameBus::closed() const
+{
+	if (m_map == NULL)
+		return true;
+
+	return (__atomic_load_n(&((const bus_header*) m_map)->state,
+		__ATOMIC_ACQUIRE) == 0);
+}
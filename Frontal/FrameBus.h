@@ -0,0 +1,120 @@
+/*
+ * FrameBus - Publishes the captured frames in POSIX shared memory so
+ * other processes (a viewer, an experimental analysis) can use them
+ * without being built into main.
+ *
+ * The shared memory holds a ring of slots, each with a sequence lock:
+ * odd while the capture writes the slot, even once it is complete. The
+ * capture writes the slots in turn and never waits for a reader, a
+ * reader maps the memory read-only, uses the frame in place and then
+ * checks the lock of its slot did not move, i.e. the frame was not
+ * overwritten meanwhile (the reader was too slow, it tries the newest
+ * frame again).
+ *
+ * Layout, in the byte order of the board (offsets in bytes, the
+ * fields are 32 bits unless said otherwise):
+ *   header  FRAME_BUS_HEADER bytes: 0 "TFBS", 4 version, 8 number of
+ *           slots, 12 open (1) or closed (0), 16 size of a slot (64
+ *           bits), 24 number of the newest frame (64 bits)
+ *   slots   FRAME_BUS_SLOT_HEADER bytes: 0 lock, 4 time (ms), 8 frame
+ *           number (64 bits), 16 capture time (ns, monotonic clock, 64
+ *           bits), 24 rows, 28 columns, 32 type of the image, 40 step
+ *           (64 bits); then the image
+ */
+#ifndef FRAMEBUS_H
+#define FRAMEBUS_H
+
+#include <opencv2/core/core.hpp>
+
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+#define FRAME_BUS_VERSION 1
+#define FRAME_BUS_HEADER 64
+#define FRAME_BUS_SLOT_HEADER 64
+
+/*
+ * A frame read from the bus, the image points into the shared memory.
+ */
+struct FrameBusFrame
+{
+    cv::Mat image;
+    uint64_t sequence;
+    uint32_t time;
+    uint64_t capture_ns;
+
+    /* Slot and lock, to check the frame is still there */
+    uint32_t slot;
+    uint32_t lock;
+};
+
+class FrameBus
+{
+  public:
+    FrameBus();
+    ~FrameBus();
+
+    /*
+     * Create the shared memory 'name' (e.g. "/tartufino_frames"), with
+     * 'slots' slots for images of up to 'frame_size' bytes, replacing
+     * a previous one (its readers see it closed). Returns false if it
+     * cannot be created.
+     */
+    bool create(const char* name, uint32_t slots, size_t frame_size);
+
+    /*
+     * Map the shared memory 'name' read-only, as a reader.
+     */
+    bool open(const char* name);
+
+    /*
+     * Unmap, and remove the shared memory if it was created here.
+     */
+    void close();
+    bool isOpen() const;
+
+    /*
+     * Copy 'image' into the next slot, from the one publishing thread,
+     * as the next frame number (from 1). Returns false if the image is
+     * too large for the slots.
+     */
+    bool publish(const cv::Mat& image, uint32_t time, uint64_t capture_ns);
+    uint64_t getPublished() const;
+
+    /*
+     * The newest frame, if its number is after 'after' (the numbers
+     * missed in between were overwritten). Returns false if there is
+     * none or its slot is being written.
+     */
+    bool latest(FrameBusFrame& frame, uint64_t after = 0) const;
+
+    /*
+     * Whether the frame was not overwritten since 'latest', everything
+     * read from it before this call is consistent.
+     */
+    bool valid(const FrameBusFrame& frame) const;
+
+    /*
+     * Whether the publisher closed the bus (a reader opens it again to
+     * follow a new capture).
+     */
+    bool closed() const;
+
+  private:
+    FrameBus(const FrameBus&);
+    FrameBus& operator=(const FrameBus&);
+
+    uint8_t* slot(uint32_t index) const;
+
+    std::string m_name;
+    bool m_owner;
+
+    uint8_t* m_map;
+    size_t m_map_size;
+
+    uint32_t m_slots;
+    size_t m_slot_size;
+    uint64_t m_published;
+};
+#endif
@@ -0,0 +1,413 @@
+#include "FrameGraph.h"
+#include "EdgeDetector.h"
+#include "FramePool.h"
+#include "workpool.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <iostream>
+
+#include <string.h>
+#include <time.h>
+
+using namespace cv;
+using namespace std;
+
+static const char* messageHeader = "FrameGraph: ";
+
+struct FrameGraph::EdgeNode
+{
+	FrameEdgeParams params;
+	EdgeDetector detector;
+};
+
+FrameGraph::FrameGraph()
+{
+	m_prepared = false;
+	m_invalid = false;
+
+	m_pool = NULL;
+	m_threads = 1;
+
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_node_done, NULL);
+}
+
+FrameGraph::~FrameGraph()
+{
+	work_pool_destroy(m_pool);
+
+	for (size_t i = 0; i < m_edge_nodes.size(); ++i)
+		delete m_edge_nodes[i];
+
+	pthread_mutex_destroy(&m_lock);
+	pthread_cond_destroy(&m_node_done);
+}
+
+int FrameGraph::findImage(const string& name) const
+{
+	for (size_t i = 0; i < m_image_names.size(); ++i) {
+		if (m_image_names[i] == name)
+			return i;
+	}
+
+	return -1;
+}
+
+int FrameGraph::addImage(const string& name)
+{
+	int index = findImage(name);
+
+	if (index >= 0)
+		return index;
+
+	m_image_names.push_back(name);
+	m_images.push_back(Mat());
+	m_sources.push_back(false);
+
+	return m_image_names.size() - 1;
+}
+
+void FrameGraph::addSource(const char* name)
+{
+	m_sources[addImage(name)] = true;
+	m_prepared = false;
+	m_invalid = false;
+}
+
+bool FrameGraph::addNode(const char* name, const char* inputs,
+	const char* output, frame_node_fn fn, void* args)
+{
+	Node node;
+
+	node.name = name;
+	node.fn = fn;
+	node.args = args;
+	node.output = -1;
+	node.done = 0;
+
+	node.runs = 0;
+	node.total_us = 0;
+	node.max_us = 0;
+
+	/* Comma separated names, without blanks */
+	string names = (inputs != NULL ? inputs : "");
+	size_t start = 0;
+
+	while (start < names.size()) {
+		size_t end = names.find(',', start);
+
+		if (end == string::npos)
+			end = names.size();
+
+		if (end > start)
+			node.inputNames.push_back(names.substr(start, end - start));
+
+		start = end + 1;
+	}
+
+	if (output != NULL && output[0] != '\0') {
+		node.outputName = output;
+
+		for (size_t i = 0; i < m_nodes.size(); ++i) {
+			if (m_nodes[i].outputName == node.outputName) {
+				cerr << messageHeader << "ERROR: " << output <<
+					" is already produced by " << m_nodes[i].name << endl;
+				return false;
+			}
+		}
+	}
+
+	m_nodes.push_back(node);
+	m_prepared = false;
+	m_invalid = false;
+
+	return true;
+}
+
+bool FrameGraph::setThreads(uint32_t threads)
+{
+	if (threads < 1)
+		threads = 1;
+
+	if (threads == m_threads)
+		return true;
+
+	work_pool_destroy(m_pool);
+	m_pool = NULL;
+
+	if (threads > 1) {
+		m_pool = work_pool_create(threads);
+
+		if (m_pool == NULL) {
+			cerr << messageHeader << "ERROR: Failed to start the threads"
+				<< endl;
+			m_threads = 1;
+			return false;
+		}
+	}
+
+	m_threads = work_pool_threads(m_pool);
+
+	return true;
+}
+
+uint32_t FrameGraph::threads() const
+{
+	return m_threads;
+}
+
+/*
+ * Resolves the names and sorts the nodes so each one comes after the
+ * nodes producing its inputs.
+ */
+bool FrameGraph::prepare()
+{
+	size_t count = m_nodes.size();
+
+	for (size_t i = 0; i < count; ++i) {
+		Node& node = m_nodes[i];
+
+		node.inputs.clear();
+
+		for (size_t j = 0; j < node.inputNames.size(); ++j)
+			node.inputs.push_back(addImage(node.inputNames[j]));
+
+		node.output = (node.outputName.empty() ? -1 :
+			addImage(node.outputName));
+	}
+
+	/* The node producing every image, -1 for the sources */
+	vector<int> producer(m_images.size(), -1);
+
+	for (size_t i = 0; i < count; ++i) {
+		if (m_nodes[i].output >= 0)
+			producer[m_nodes[i].output] = i;
+	}
+
+	for (size_t i = 0; i < producer.size(); ++i) {
+		if (producer[i] < 0 && !m_sources[i]) {
+			cerr << messageHeader << "ERROR: Nothing produces " <<
+				m_image_names[i] << endl;
+			return false;
+		}
+
+		if (producer[i] >= 0 && m_sources[i]) {
+			cerr << messageHeader << "ERROR: " << m_image_names[i] <<
+				" is a source" << endl;
+			return false;
+		}
+	}
+
+	/* Take the nodes whose inputs are all available, in turn */
+	vector<Node> sorted;
+	vector<int> position(count, -1);
+	vector<bool> available(m_images.size());
+
+	for (size_t i = 0; i < m_images.size(); ++i)
+		available[i] = m_sources[i];
+
+	while (sorted.size() < count) {
+		bool progress = false;
+
+		for (size_t i = 0; i < count; ++i) {
+			Node& node = m_nodes[i];
+			bool ready = (position[i] < 0);
+
+			for (size_t j = 0; ready && j < node.inputs.size(); ++j)
+				ready = available[node.inputs[j]];
+
+			if (!ready)
+				continue;
+
+			node.after.clear();
+
+			for (size_t j = 0; j < node.inputs.size(); ++j) {
+				int from = producer[node.inputs[j]];
+
+				if (from >= 0)
+					node.after.push_back(position[from]);
+			}
+
+			position[i] = sorted.size();
+			sorted.push_back(node);
+
+			if (node.output >= 0)
+				available[node.output] = true;
+
+			progress = true;
+		}
+
+		if (!progress) {
+			cerr << messageHeader << "ERROR: The nodes depend on each other"
+				<< endl;
+			return false;
+		}
+	}
+
+	m_nodes.swap(sorted);
+
+	for (size_t i = 0; i < count; ++i)
+		m_nodes[i].inputImages.resize(m_nodes[i].inputs.size());
+
+	m_prepared = true;
+
+	return true;
+}
+
+void FrameGraph::setSource(const char* name, const Mat& image)
+{
+	int index = findImage(name);
+
+	if (index < 0 || !m_sources[index]) {
+		cerr << messageHeader << "ERROR: " << name << " is not a source"
+			<< endl;
+		return;
+	}
+
+	m_images[index] = image;
+}
+
+/*
+ * Runs one node once the nodes before it are done. The nodes are
+ * handed out in order, so the ones waited for are already running and
+ * the first unfinished node never waits.
+ */
+void FrameGraph::runNode(void* args, int index)
+{
+	FrameGraph* graph = (FrameGraph*) args;
+	Node& node = graph->m_nodes[index];
+
+	pthread_mutex_lock(&graph->m_lock);
+
+	for (size_t i = 0; i < node.after.size(); ++i) {
+		while (!graph->m_nodes[node.after[i]].done)
+			pthread_cond_wait(&graph->m_node_done, &graph->m_lock);
+	}
+
+	pthread_mutex_unlock(&graph->m_lock);
+
+	for (size_t i = 0; i < node.inputs.size(); ++i)
+		node.inputImages[i] = &graph->m_images[node.inputs[i]];
+
+	Mat& output = (node.output >= 0 ? graph->m_images[node.output] :
+		node.sinkOutput);
+
+	/* Kept from one frame to the next, in a buffer of the pool */
+	FramePool::prepare(output);
+
+	struct timespec start;
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	node.fn(node.inputImages, output, node.args);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	uint64_t elapsed = (end.tv_sec - start.tv_sec) * 1000000LL +
+		(end.tv_nsec - start.tv_nsec) / 1000;
+
+	node.runs++;
+	node.total_us += elapsed;
+
+	if (elapsed > node.max_us)
+		node.max_us = elapsed;
+
+	pthread_mutex_lock(&graph->m_lock);
+	node.done = 1;
+	pthread_cond_broadcast(&graph->m_node_done);
+	pthread_mutex_unlock(&graph->m_lock);
+}
+
+bool FrameGraph::run()
+{
+	if (!m_prepared) {
+		if (m_invalid || !prepare()) {
+			m_invalid = true;
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < m_nodes.size(); ++i)
+		m_nodes[i].done = 0;
+
+	work_pool_run(m_pool, runNode, this, m_nodes.size());
+
+	return true;
+}
+
+const Mat* FrameGraph::image(const char* name) const
+{
+	int index = findImage(name);
+
+	return (index >= 0 ? &m_images[index] : NULL);
+}
+
+void FrameGraph::getNodeStats(vector<FrameNodeStats>& stats) const
+{
+	stats.resize(m_nodes.size());
+
+	for (size_t i = 0; i < m_nodes.size(); ++i) {
+		stats[i].name = m_nodes[i].name;
+		stats[i].runs = m_nodes[i].runs;
+		stats[i].total_us = m_nodes[i].total_us;
+		stats[i].max_us = m_nodes[i].max_us;
+	}
+}
+
+void FrameGraph::resetNodeStats()
+{
+	for (size_t i = 0; i < m_nodes.size(); ++i) {
+		m_nodes[i].runs = 0;
+		m_nodes[i].total_us = 0;
+		m_nodes[i].max_us = 0;
+	}
+}
+
+void FrameGraph::halfSize(const vector<const Mat*>& inputs, Mat& output,
+	void* args)
+{
+	const Mat& input = *inputs[0];
+
+	resize(input, output, Size(input.cols / 2, input.rows / 2), 0, 0,
+		INTER_AREA);
+}
+
+void FrameGraph::edges(const vector<const Mat*>& inputs, Mat& output,
+	void* args)
+{
+	FrameEdgeParams* params = (FrameEdgeParams*) args;
+
+	Canny(*inputs[0], output, params->low_threshold,
+		params->high_threshold, params->aperture);
+}
+
+bool FrameGraph::addEdges(const char* name, const char* input,
+	const char* output, const FrameEdgeParams& params)
+{
+	EdgeNode* edgeNode = new EdgeNode;
+
+	edgeNode->params = params;
+	edgeNode->detector.setThresholds(params.low_threshold,
+		params.high_threshold);
+
+	if (!addNode(name, input, output, detectEdges, edgeNode)) {
+		delete edgeNode;
+		return false;
+	}
+
+	m_edge_nodes.push_back(edgeNode);
+
+	return true;
+}
+
+void FrameGraph::detectEdges(const vector<const Mat*>& inputs,
+	Mat& output, void* args)
+{
+	EdgeNode* edgeNode = (EdgeNode*) args;
+
+	if (edgeNode->params.aperture != 3 ||
+		!edgeNode->detector.detect(*inputs[0], output))
+		edges(inputs, output, &edgeNode->params);
+}
@@ -0,0 +1,101 @@
+/*
+ * FramePool - Memory of the frames of the pipeline, taken once at
+ * startup instead of from the heap while capturing.
+ *
+ * A cv::MatAllocator handing out buffers of a fixed size from a single
+ * mapping made when the pool starts: aligned on pages, written once so
+ * no page faults are left for the capture, and optionally locked in
+ * memory (mlock) or backed by huge pages. A Mat given to 'prepare'
+ * takes its buffers from the default pool from then on, and gives
+ * them back when released, so the same buffers go round the pipeline.
+ *
+ * An image larger than the buffers, or asked for when all of them are
+ * taken, comes from the heap as before and is counted: the pool is
+ * sized from those counts.
+ */
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Options of 'start' */
+#define FRAME_POOL_LOCK 1
+#define FRAME_POOL_HUGE 2
+
+struct FramePoolStats
+{
+    uint32_t buffers;
+    size_t buffer_size;
+
+    /* How the memory was had, the options that failed are not set */
+    bool locked;
+    bool huge;
+
+    /* Buffers taken now and at most */
+    uint32_t in_use;
+    uint32_t in_use_max;
+
+    /* Images given buffers of the pool, and from the heap because they
+     * were too large or the pool was empty */
+    uint32_t allocations;
+    uint32_t too_large;
+    uint32_t exhausted;
+};
+
+class FramePool : public cv::MatAllocator
+{
+  public:
+    FramePool();
+    ~FramePool();
+
+    /*
+     * Map 'buffers' buffers of at least 'buffer_size' bytes and fault
+     * them in, locked with FRAME_POOL_LOCK and on huge pages with
+     * FRAME_POOL_HUGE when the system allows it (a warning otherwise).
+     * Returns false if the memory cannot be had.
+     */
+    bool start(uint32_t buffers, size_t buffer_size, int options);
+    bool isRunning() const;
+
+    void allocate(int dims, const int* sizes, int type, int*& refcount,
+      uchar*& datastart, uchar*& data, size_t* step);
+    void deallocate(int* refcount, uchar* datastart, uchar* data);
+
+    void getStats(FramePoolStats& stats) const;
+
+    /*
+     * The pool of 'prepare' (NULL for the heap), the images prepared
+     * before keep the heap.
+     */
+    static void setDefault(FramePool* pool);
+
+    /*
+     * Have 'mat' take its buffers from the default pool, unless it
+     * holds a buffer of the heap (it keeps it until released).
+     */
+    static void prepare(cv::Mat& mat);
+
+  private:
+    FramePool(const FramePool&);
+    FramePool& operator=(const FramePool&);
+
+    uint8_t* m_memory;
+    size_t m_memory_size;
+    size_t m_buffer_size;
+
+    /* Buffers not taken, and the reference count of each buffer on its
+     * own cache line */
+    std::vector<uint32_t> m_free;
+    std::vector<int> m_refcounts;
+
+    FramePoolStats m_stats;
+    mutable pthread_mutex_t m_lock;
+
+    static FramePool* s_default;
+};
+#endif
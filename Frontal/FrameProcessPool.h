@@ -0,0 +1,143 @@
+/*
+ * FrameProcessPool - Processes several frames at once, one per worker,
+ * when the analyses of a frame take longer than a frame period.
+ *
+ * Every worker runs its own FrameGraph, built by the same function, so
+ * the analyses must not keep state from one frame to the next. The
+ * frames are copied into a bounded ring of slots and processed by the
+ * first idle worker; the processed frames are handed out in the order
+ * they were submitted, whichever worker finishes first. The ring holds
+ * at most 'depth' frames in flight: a full ring refuses new frames, so
+ * the caller leaves them to be replaced (and counted) upstream. The
+ * frames are submitted and taken by one thread.
+ */
+#ifndef FRAMEPROCESSPOOL_H
+#define FRAMEPROCESSPOOL_H
+
+#include <opencv2/core/core.hpp>
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "FrameGraph.h"
+
+struct FrameJob
+{
+    /* Number and capture times given to 'submit' */
+    uint32_t sequence;
+    uint32_t time;
+    uint64_t capture_ns;
+
+    /* Time spent processing it */
+    uint64_t process_ns;
+
+    /* The frame, and a copy of the result image once processed */
+    cv::Mat frame;
+    cv::Mat result;
+};
+
+/*
+ * Builds the graph of one worker. 'job' is the frame the worker is
+ * processing while the graph runs, e.g. for a sink naming its files.
+ */
+typedef void (*frame_graph_fn)(FrameGraph& graph, const FrameJob& job,
+  void* args);
+
+class FrameProcessPool
+{
+  public:
+    FrameProcessPool();
+    ~FrameProcessPool();
+
+    /*
+     * Start 'workers' threads, each feeding the frames to the 'source'
+     * image of its graph, with at most 'depth' frames in flight. The
+     * 'result' image (NULL for none) is copied into the processed
+     * frames. Returns false if no worker could be started.
+     */
+    bool start(uint32_t workers, uint32_t depth, const char* source,
+      const char* result, frame_graph_fn setup, void* args);
+
+    /*
+     * Stops the workers, the frames still in flight are discarded.
+     */
+    void stop();
+    bool isRunning() const;
+
+    /*
+     * Whether new frames are refused, every slot being in flight.
+     */
+    bool isFull() const;
+
+    /*
+     * Queue a copy of a frame, 'capture_ns' is its capture time on the
+     * monotonic clock. Returns false when the ring is full (or the pool
+     * is not running).
+     */
+    bool submit(const cv::Mat& frame, uint32_t sequence, uint32_t time,
+      uint64_t capture_ns);
+
+    /*
+     * Take the oldest processed frame. 'next' waits for it and returns
+     * false when there is no frame in flight, 'tryNext' returns false
+     * right away if it is not processed yet. The buffers of the job
+     * passed in are recycled for a later frame.
+     */
+    bool next(FrameJob& job);
+    bool tryNext(FrameJob& job);
+
+    /*
+     * Readable when a frame has been processed, to wait for it with
+     * poll along with other events. Read it before taking the frames.
+     */
+    int doneEvent() const;
+
+    /*
+     * Node times summed over the workers, read once they are stopped.
+     */
+    void getNodeStats(std::vector<FrameNodeStats>& stats) const;
+
+  private:
+    FrameProcessPool(const FrameProcessPool&);
+    FrameProcessPool& operator=(const FrameProcessPool&);
+
+    enum slot_state { kFree, kQueued, kProcessing, kProcessed };
+
+    struct Slot {
+      slot_state state;
+      FrameJob job;
+    };
+
+    struct Worker {
+      FrameProcessPool* pool;
+      pthread_t thread;
+      FrameGraph graph;
+      FrameJob job;
+    };
+
+    static void* worker(void* args);
+    bool take(FrameJob& job, bool wait);
+
+    std::vector<Worker*> m_workers;
+    std::vector<Slot> m_slots;
+
+    std::string m_source;
+    std::string m_result;
+    bool m_running;
+
+    /*
+     * Sequence numbers of the next frame to hand out, to process and to
+     * queue. The slot of a frame is its number modulo the depth.
+     */
+    uint32_t m_head;
+    uint32_t m_next_process;
+    uint32_t m_tail;
+
+    int m_done_fd;
+
+    pthread_mutex_t m_lock;
+    pthread_cond_t m_queued;
+    pthread_cond_t m_processed;
+};
+#endif
@@ -0,0 +1,365 @@
+#include "FrameWriter.h"
+#include "FramePool.h"
+
+#include <opencv2/highgui/highgui.hpp>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+using namespace cv;
+using namespace std;
+
+static uint64_t monotonicNow()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+FrameWriter::FrameWriter()
+{
+	m_block = false;
+	m_quality = 95;
+	m_running = false;
+
+	m_head = 0;
+	m_next_write = 0;
+	m_tail = 0;
+
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_queued, NULL);
+	pthread_cond_init(&m_freed, NULL);
+	pthread_mutex_init(&m_archive_lock, NULL);
+
+	resetStats();
+}
+
+FrameWriter::~FrameWriter()
+{
+	stop();
+
+	pthread_mutex_destroy(&m_lock);
+	pthread_cond_destroy(&m_queued);
+	pthread_cond_destroy(&m_freed);
+	pthread_mutex_destroy(&m_archive_lock);
+}
+
+bool FrameWriter::start(uint32_t workers, uint32_t depth, bool block,
+	int quality, const char* archive, struct storage* storage)
+{
+	if (m_running)
+		stop();
+
+	if (archive != NULL && !m_archive.open(archive, storage))
+		return false;
+
+	if (workers < 1)
+		workers = 1;
+
+	/* Enough slots to keep every worker busy */
+	if (depth < workers)
+		depth = workers;
+
+	m_slots.clear();
+	m_slots.resize(depth);
+
+	for (uint32_t i = 0; i < depth; ++i)
+		m_slots[i].state = kFree;
+
+	m_block = block;
+	m_quality = quality;
+
+	m_head = 0;
+	m_next_write = 0;
+	m_tail = 0;
+
+	m_running = true;
+
+	for (uint32_t i = 0; i < workers; ++i) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, worker, this) != 0)
+			break;
+
+		m_workers.push_back(thread);
+	}
+
+	if (m_workers.empty()) {
+		m_running = false;
+		m_archive.close();
+		return false;
+	}
+
+	return true;
+}
+
+void FrameWriter::stop()
+{
+	/* The workers finish the queued images before leaving */
+	pthread_mutex_lock(&m_lock);
+	m_running = false;
+	pthread_cond_broadcast(&m_queued);
+	pthread_cond_broadcast(&m_freed);
+	pthread_mutex_unlock(&m_lock);
+
+	for (size_t i = 0; i < m_workers.size(); ++i)
+		pthread_join(m_workers[i], NULL);
+
+	m_workers.clear();
+
+	/* With its index, now that nothing else is appended */
+	m_archive.close();
+}
+
+bool FrameWriter::isRunning() const
+{
+	return m_running;
+}
+
+/*
+ * A free slot for a new image, NULL if it is dropped. The slot is the
+ * caller's until it is queued.
+ */
+FrameWriter::Slot* FrameWriter::reserve()
+{
+	pthread_mutex_lock(&m_lock);
+
+	m_stats.submitted++;
+
+	if (m_running && m_block && m_tail - m_head == m_slots.size()) {
+		uint64_t start = monotonicNow();
+
+		while (m_running && m_tail - m_head == m_slots.size())
+			pthread_cond_wait(&m_freed, &m_lock);
+
+		m_stats.blocked++;
+		m_stats.blocked_us += (monotonicNow() - start) / 1000;
+	}
+
+	if (!m_running || m_tail - m_head == m_slots.size()) {
+		m_stats.dropped++;
+		pthread_mutex_unlock(&m_lock);
+		return NULL;
+	}
+
+	uint32_t depth = m_tail - m_head;
+
+	m_stats.depth_total += depth;
+
+	if (depth > m_stats.depth_max)
+		m_stats.depth_max = depth;
+
+	Slot* slot = &m_slots[m_tail % m_slots.size()];
+
+	slot->state = kFilling;
+	m_tail++;
+
+	/* The copy is done without the lock so the other threads can
+	 * queue theirs */
+	pthread_mutex_unlock(&m_lock);
+
+	return slot;
+}
+
+void FrameWriter::queue(Slot* slot)
+{
+	pthread_mutex_lock(&m_lock);
+
+	slot->state = kQueued;
+
+	pthread_cond_broadcast(&m_queued);
+	pthread_mutex_unlock(&m_lock);
+}
+
+bool FrameWriter::submit(const Mat& image, const char* path)
+{
+	Slot* slot = reserve();
+
+	if (slot == NULL)
+		return false;
+
+	FramePool::prepare(slot->image);
+	image.copyTo(slot->image);
+	slot->path = path;
+
+	queue(slot);
+
+	return true;
+}
+
+bool FrameWriter::submit(const Mat& image, uint32_t sequence,
+	uint32_t time, uint64_t capture_ns)
+{
+	Slot* slot = reserve();
+
+	if (slot == NULL)
+		return false;
+
+	FramePool::prepare(slot->image);
+	image.copyTo(slot->image);
+	slot->path.clear();
+	slot->sequence = sequence;
+	slot->time = time;
+	slot->capture_ns = capture_ns;
+
+	queue(slot);
+
+	return true;
+}
+
+bool FrameWriter::writeSlot(const Slot& slot, vector<uchar>& encoded,
+	uint64_t& encode_us, uint64_t& write_us, size_t& bytes)
+{
+	bool toArchive = slot.path.empty();
+
+	encode_us = 0;
+	write_us = 0;
+	bytes = 0;
+
+	uint64_t start = monotonicNow();
+
+	/* The raw images of an archive are not encoded at all */
+	if (!toArchive || m_quality > 0) {
+		vector<int> params;
+		params.push_back(CV_IMWRITE_JPEG_QUALITY);
+		params.push_back(m_quality);
+
+		/* The buffer keeps its capacity from one image to the next */
+		if (!imencode(".jpg", slot.image, encoded, params))
+			return false;
+	}
+
+	uint64_t end = monotonicNow();
+	encode_us = (end - start) / 1000;
+
+	bool written;
+
+	if (toArchive) {
+		pthread_mutex_lock(&m_archive_lock);
+
+		if (m_quality > 0) {
+			FrameRecord record;
+
+			record.sequence = slot.sequence;
+			record.time = slot.time;
+			record.capture_ns = slot.capture_ns;
+			strcpy(record.format, "JPEG");
+			record.width = slot.image.cols;
+			record.height = slot.image.rows;
+
+			written = m_archive.append(record, &encoded[0],
+				encoded.size());
+			bytes = encoded.size();
+		}
+		else {
+			written = m_archive.append(slot.image, slot.sequence,
+				slot.time, slot.capture_ns);
+			bytes = slot.image.total() * slot.image.elemSize();
+		}
+
+		pthread_mutex_unlock(&m_archive_lock);
+	}
+	else {
+		FILE* file = fopen(slot.path.c_str(), "wb");
+
+		if (file == NULL)
+			return false;
+
+		written = (fwrite(&encoded[0], 1, encoded.size(), file) ==
+			encoded.size());
+
+		if (fclose(file) != 0)
+			written = false;
+
+		bytes = encoded.size();
+	}
+
+	write_us = (monotonicNow() - end) / 1000;
+
+	return written;
+}
+
+void* FrameWriter::worker(void* args)
+{
+	FrameWriter* writer = (FrameWriter*) args;
+	vector<uchar> encoded;
+
+	pthread_mutex_lock(&writer->m_lock);
+
+	while (true) {
+		Slot* slot = NULL;
+
+		if (writer->m_next_write != writer->m_tail)
+			slot = &writer->m_slots[writer->m_next_write %
+				writer->m_slots.size()];
+
+		if (slot == NULL && !writer->m_running)
+			break;
+
+		/* Still being copied, or nothing to write */
+		if (slot == NULL || slot->state != kQueued) {
+			pthread_cond_wait(&writer->m_queued, &writer->m_lock);
+			continue;
+		}
+
+		writer->m_next_write++;
+		slot->state = kWriting;
+
+		/* The slot belongs to this worker until it is written */
+		pthread_mutex_unlock(&writer->m_lock);
+
+		uint64_t encode_us;
+		uint64_t write_us;
+		size_t bytes;
+		bool written = writer->writeSlot(*slot, encoded, encode_us,
+			write_us, bytes);
+
+		pthread_mutex_lock(&writer->m_lock);
+
+		FrameWriterStats& stats = writer->m_stats;
+
+		if (written) {
+			stats.written++;
+			stats.bytes += bytes;
+		}
+		else
+			stats.failed++;
+
+		stats.encode_total_us += encode_us;
+		stats.write_total_us += write_us;
+
+		if (encode_us > stats.encode_max_us)
+			stats.encode_max_us = encode_us;
+
+		/* The slots are reused in order, an older one may still be
+		 * written by another worker */
+		slot->state = kFree;
+
+		while (writer->m_head != writer->m_next_write &&
+			writer->m_slots[writer->m_head %
+			writer->m_slots.size()].state == kFree)
+			writer->m_head++;
+
+		pthread_cond_broadcast(&writer->m_freed);
+	}
+
+	pthread_mutex_unlock(&writer->m_lock);
+
+	return NULL;
+}
+
+void FrameWriter::getStats(FrameWriterStats& stats) const
+{
+	pthread_mutex_lock(&m_lock);
+	stats = m_stats;
+	pthread_mutex_unlock(&m_lock);
+}
+
+void FrameWriter::resetStats()
+{
+	pthread_mutex_lock(&m_lock);
+	memset(&m_stats, 0, sizeof(m_stats));
+	pthread_mutex_unlock(&m_lock);
+}
@@ -0,0 +1,141 @@
+/*
+ * FrameWriter - Saves images as JPEG files without holding up the
+ * thread that produced them.
+ *
+ * The images are copied into a bounded ring of slots (the buffers are
+ * reused from one image to the next) and encoded and written by
+ * background workers, each to its own file or all of them with their
+ * sequence and times to a FrameArchive. When every slot is taken a new
+ * image is either dropped, and counted, or waited for, as chosen when
+ * starting. The queue depth, the encoding and writing times and the
+ * bytes written are kept to size the queue and the workers for the
+ * board.
+ */
+#ifndef FRAMEWRITER_H
+#define FRAMEWRITER_H
+
+#include <opencv2/core/core.hpp>
+
+#include "FrameArchive.h"
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+struct FrameWriterStats
+{
+    /* Images submitted, dropped because the queue was full, written
+     * and that could not be encoded or written */
+    uint32_t submitted;
+    uint32_t dropped;
+    uint32_t written;
+    uint32_t failed;
+
+    /* Images in the queue when one is submitted */
+    uint64_t depth_total;
+    uint32_t depth_max;
+
+    /* Time the submissions waited for a free slot */
+    uint32_t blocked;
+    uint64_t blocked_us;
+
+    uint64_t encode_total_us;
+    uint64_t encode_max_us;
+    uint64_t write_total_us;
+    uint64_t bytes;
+};
+
+class FrameWriter
+{
+  public:
+    FrameWriter();
+    ~FrameWriter();
+
+    /*
+     * Start 'workers' threads with at most 'depth' images queued, at
+     * the JPEG 'quality' (0 to 100). When the queue is full 'submit'
+     * waits if 'block' is set, and drops the image otherwise. Returns
+     * false if no worker could be started.
+     *
+     * With 'archive' the images are appended to that file instead (in
+     * the order they are written, with several workers not quite the
+     * order they were submitted), raw when 'quality' is 0, and through
+     * 'storage' if not NULL.
+     */
+    bool start(uint32_t workers, uint32_t depth, bool block,
+      int quality, const char* archive = NULL,
+      struct storage* storage = NULL);
+
+    /*
+     * Writes the images still queued and stops the workers, the archive
+     * is closed.
+     */
+    void stop();
+    bool isRunning() const;
+
+    /*
+     * Queue a copy of 'image' to be written to 'path'. Returns false if
+     * it is dropped (queue full without blocking, or not running).
+     * Can be called from several threads.
+     */
+    bool submit(const cv::Mat& image, const char* path);
+
+    /*
+     * Queue a copy of 'image' for the archive, with its frame number
+     * and times.
+     */
+    bool submit(const cv::Mat& image, uint32_t sequence, uint32_t time,
+      uint64_t capture_ns);
+
+    void getStats(FrameWriterStats& stats) const;
+    void resetStats();
+
+  private:
+    FrameWriter(const FrameWriter&);
+    FrameWriter& operator=(const FrameWriter&);
+
+    enum slot_state { kFree, kFilling, kQueued, kWriting };
+
+    struct Slot {
+      slot_state state;
+      cv::Mat image;
+      std::string path;
+      uint32_t sequence;
+      uint32_t time;
+      uint64_t capture_ns;
+    };
+
+    static void* worker(void* args);
+    Slot* reserve();
+    void queue(Slot* slot);
+    bool writeSlot(const Slot& slot, std::vector<uchar>& encoded,
+      uint64_t& encode_us, uint64_t& write_us, size_t& bytes);
+
+    std::vector<pthread_t> m_workers;
+    std::vector<Slot> m_slots;
+
+    bool m_block;
+    int m_quality;
+    bool m_running;
+
+    /* Appended by one worker at a time */
+    FrameArchive m_archive;
+    pthread_mutex_t m_archive_lock;
+
+    /*
+     * Sequence numbers of the oldest image not written yet, of the
+     * next one to write and of the next one to queue. The slot of an
+     * image is its number modulo the depth.
+     */
+    uint32_t m_head;
+    uint32_t m_next_write;
+    uint32_t m_tail;
+
+    FrameWriterStats m_stats;
+
+    mutable pthread_mutex_t m_lock;
+    pthread_cond_t m_queued;
+    pthread_cond_t m_freed;
+};
+#endif
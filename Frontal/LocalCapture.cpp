@@ -1,4 +1,9 @@
-#include "OCVCapture.h"
+#include "FrameSource.h"
+#include "MJPEGDecodePool.h"
+#include "MJPEGDecoder.h"
+#include "EventRecorder.h"
+#include "FrameBus.h"
+#include "FramePool.h"
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -6,169 +11,883 @@
 #include <iostream>
 #include <iomanip>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/time.h>
+#include <time.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
 #include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/eventfd.h>
 
 #include "periodic.h"
+#include "triplebuf.h"
+#include "FrameGraph.h"
+#include "FrameProcessPool.h"
+#include "FrameAdmission.h"
+#include "FrameWriter.h"
 #include "LocalCapture.h"
+#include "telemetry.h"
 
 #include <linux/can.h>
 #include <linux/can/raw.h>
 
+/* Threads converting the frames, compare the conversion times printed
+ * when the capture stops to find the best count for the board */
+#define CONVERSION_THREADS 1
+
+/* Pixel format of the camera, MJPEG frames are decoded in parallel by
+ * DECODE_WORKERS threads with up to DECODE_DEPTH frames in flight */
+#define CAPTURE_FORMAT "YUYV"
+#define DECODE_WORKERS 2
+#define DECODE_DEPTH 4
+
+/* Buffers queued to the driver and whether only the newest ready frame
+ * is used (lower latency, but the older frames are neither processed
+ * nor recorded) */
+#define CAPTURE_BUFFERS 4
+#define LATEST_FRAME 0
+
+/* Count the frames left waiting behind every one (printed when the
+ * capture stops), an ioctl per buffer at each frame */
+#define QUEUE_STATS 0
+
+/* Record the raw frames of the camera while processing them, without
+ * decoding them (frames/record%u.avi and frames/record%u.csv). They are
+ * written by a thread of their own, up to RECORD_QUEUE bytes of them
+ * waiting for the card before the new ones are dropped */
+#define RECORD_FRAMES 0
+#define RECORD_QUEUE (16 << 20)
+
+/* Record the raw frames only around events (triggerRecording): the last
+ * RECORD_PRE_MS of frames are kept in RECORD_MEMORY bytes and written
+ * with the next RECORD_POST_MS once an event is triggered
+ * (frames/event%u_%u.avi and .csv), with the telemetry records of the
+ * same time out of the last RECORD_RECORDS (.tlm). TRIGGER_EDGES
+ * triggers one when more than that share of the pixels of a frame are
+ * edges (0 for none, needs DETECT_EDGES) */
+#define RECORD_EVENTS 0
+#define RECORD_MEMORY (48 << 20)
+#define RECORD_RECORDS 16384
+#define RECORD_PRE_MS 5000
+#define RECORD_POST_MS 5000
+#define TRIGGER_EDGES 0
+
+/* Analyses of the processed frames, run as a graph of nodes on
+ * PROCESS_THREADS threads (the time of every node is printed when the
+ * processing pauses). SAVE_EDGES writes the edges of every frame
+ * (frames/frame%u.jpg) */
+#define PROCESS_THREADS 1
+#define DETECT_EDGES 0
+#define SAVE_EDGES 0
+
+/* The saved frames are encoded and written by SAVE_WORKERS threads in
+ * the background, with at most SAVE_DEPTH frames waiting. When they
+ * cannot keep up the new frames are dropped, or waited for with
+ * SAVE_BLOCK (slowing the processing down) */
+#define SAVE_WORKERS 1
+#define SAVE_DEPTH 8
+#define SAVE_BLOCK 0
+#define SAVE_QUALITY 95
+
+/* The saved frames go to a single archive per processing run with
+ * their number and times (frames/frames%u.tfa, see FrameArchive.h)
+ * rather than a file each, as JPEG or raw when SAVE_QUALITY is 0 */
+#define SAVE_ARCHIVE 1
+
+/* The edges are found by an EdgeDetector, the edges of cv::Canny in
+ * less time. CHECK_EDGES runs cv::Canny too ("canny" in the node
+ * times) and counts the pixels where they differ */
+#define CHECK_EDGES 0
+
+/* Frames processed at once, each by its own worker when the analyses
+ * take longer than a frame period, with at most PROCESS_DEPTH frames in
+ * flight. They are logged in capture order whatever the worker */
+#define PROCESS_WORKERS 1
+#define PROCESS_DEPTH 2
+
+/* Which frames are processed when the processing is slower than the
+ * capture: "newest", "every:N" or "budget:MS" (see FrameAdmission.h).
+ * The frames processed and skipped and their age are printed when the
+ * processing pauses */
+#define PROCESS_ADMISSION "newest"
+
+/* Records of the binary logs (.tlm, telemetry_csv prints them as the
+ * .csv files) kept until the drainer of main writes them, and space
+ * reserved when each log is created */
+#define CAPTURE_LOG_RECORDS 256
+#define PROCESS_LOG_RECORDS 256
+#define CAPTURE_LOG_PREALLOC (1 << 20)
+#define PROCESS_LOG_PREALLOC (256 << 10)
+
+/* Publish the gray frames in shared memory for other processes, in a
+ * ring of FRAME_BUS_SLOTS frames (see FrameBus.h and framebus_view) */
+#define PUBLISH_FRAMES 1
+#define FRAME_BUS_NAME "/tartufino_frames"
+#define FRAME_BUS_SLOTS 4
+
+/* The images of the pipeline take FRAME_POOL_BUFFERS buffers of a gray
+ * frame, mapped and faulted in when the camera opens (locked in memory
+ * with FRAME_POOL_LOCK, on huge pages with FRAME_POOL_HUGE), instead of
+ * the heap. Their use is printed when the capture stops */
+#define FRAME_POOL_BUFFERS 32
+#define FRAME_POOL_OPTIONS FRAME_POOL_LOCK
+
 using namespace cv;
 using namespace std;
 
+/* Memory of the images, before them so it goes after them at exit */
+static FramePool frame_pool;
+
 /* Variables for the names of the saved frames */
 static int num_frames = 0;
 
-/* Variables for the log file */
-static FILE *proc_file;
-static FILE *capt_file;
-uint32_t timestamp_ms;
-
-/* Mutex and condition variable to control the access to the new frame */
-pthread_mutex_t lock_new_frame;
-pthread_cond_t cond_new_frame;
-int new_frame = 0;
+/* Capture and processing threads, each stopped by writing its eventfd
+ * (it wakes the thread wherever it waits) */
+static pthread_t capture_th, process_th;
+static int capture_stop = -1;
+static int process_stop = -1;
+static int process_file_index;
+
+/* Variables for the log files and the saved frames */
+static struct storage *storage;
+static struct telemetry *telemetry;
+static struct telemetry_log *proc_file;
+static struct telemetry_log *capt_file;
 int grabbed_frames = 0;
 
-/* Variables to identify the camera */
-OCVCapture camera;
+/* Variables to identify the camera, created when the capture starts */
+FrameSource* camera = NULL;
+static MJPEGDecodePool decode_pool;
+
+/* Recording of the raw frames, started and stopped from the main thread,
+ * the frames are pushed while recording */
+static EventRecorder recorder;
+static bool recording = false;
+static pthread_mutex_t lock_recorder = PTHREAD_MUTEX_INITIALIZER;
+
+/* Recording around the events, the frames are pushed while armed */
+static EventRecorder events;
+static bool events_armed = false;
+
+/* Frames for the other processes, only used by the capture thread */
+static FrameBus frame_bus;
+
+/* The captured frames, handed to the processing thread without a lock:
+ * the capture fills one slot while the processing reads another */
+struct captured_frame {
+	Mat gray;
+	uint32_t timestamp_ms;
+
+	/* Number among the frames handed over, and capture time on the
+	 * monotonic clock */
+	uint32_t sequence;
+	uint64_t capture_ns;
+};
+
+static captured_frame captured[3];
+static struct triple_buf handoff;
+
+/* Parameters of the analyses */
+static FrameEdgeParams edge_params = { 0, 30, 3 };
+
+/* Writer of the saved frames, running while the frames are processed */
+static FrameWriter frame_writer;
+
+/* Pixels of the edges that differ from cv::Canny, with CHECK_EDGES */
+static volatile uint32_t edge_mismatches = 0;
+
+static void signalStop(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+		perror("eventfd");
+}
+
+static uint64_t monotonicNow()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static bool stopRequested(int fd)
+{
+	struct pollfd stop;
+
+	stop.fd = fd;
+	stop.events = POLLIN;
+
+	return (poll(&stop, 1, 0) > 0);
+}
+
+static void *capture_frames(void *args);
+static void *process_frames(void *args);
 
-/* Structures for the captured frames */
-Mat gray = Mat::zeros(480, 640, CV_8U);
-Mat edge = Mat::zeros(480, 640, CV_8U);
+void startCapture(struct storage *files, struct telemetry *logs)
+{
+	if (capture_stop >= 0)
+		return;
+
+	storage = files;
+	telemetry = logs;
+
+	capture_stop = eventfd(0, 0);
+
+	/* Nothing to process until the first frame is published */
+	if (capture_stop < 0 || triple_buf_init(&handoff) < 0) {
+		perror("Local Camera");
+		return;
+	}
+
+	pthread_create(&capture_th, NULL, capture_frames, NULL);
+}
 
 void stopCapture()
 {
-	fclose(capt_file);
+	if (capture_stop < 0)
+		return;
 
-	pthread_mutex_destroy(&lock_new_frame);
-	pthread_cond_destroy(&cond_new_frame);
-	
-	camera.closeCamera();
+	pauseProcessing();
+
+	/* The capture thread leaves as soon as it sees the event */
+	signalStop(capture_stop);
+	pthread_join(capture_th, NULL);
+
+	close(capture_stop);
+	capture_stop = -1;
+
+	triple_buf_destroy(&handoff);
+
+	/* The capture never started */
+	if (camera == NULL)
+		return;
+
+	if (frame_bus.isOpen()) {
+		printf("Local Camera:  %llu frames published on %s\n", 
+			(unsigned long long) frame_bus.getPublished(), FRAME_BUS_NAME);
+		frame_bus.close();
+	}
+
+	if (frame_pool.isRunning()) {
+		FramePoolStats pool;
+		frame_pool.getStats(pool);
+
+		printf("Local Camera:  %u of %u frame buffers used at most (%zu "
+			"bytes%s%s), %u images from the heap (%u too large)\n", 
+			pool.in_use_max, pool.buffers, pool.buffer_size, 
+			(pool.locked ? ", locked" : ""), (pool.huge ? ", huge pages" : ""),
+			pool.too_large + pool.exhausted, pool.too_large);
+	}
+
+	OCVConversionStats stats;
+
+	OCVCaptureStats counters;
+
+	telemetry_close(capt_file);
+
+	camera->getCaptureStats(counters);
+
+	printf("Local Camera:  %u frames grabbed, %u dropped by the driver, "
+		"%u dropped by the application, %u with errors\n", 
+		counters.grabbed, counters.driver_dropped, counters.app_dropped, 
+		counters.error_frames);
+
+	if (counters.grabbed > 0) {
+		printf("Local Camera:  %u frames skipped, %.2f frames behind on "
+			"average (max %u, %llu ms)\n", counters.skipped, 
+			(double) counters.behind_total / counters.grabbed, 
+			counters.behind_max, 
+			(unsigned long long) counters.behind_max_ns / 1000000);
+	}
+
+	if (decode_pool.isRunning()) {
+		decode_pool.stop();
+
+		printf("Local Camera:  %u frames dropped, %u corrupt\n", 
+			decode_pool.droppedFrames(), decode_pool.corruptFrames());
+	}
+
+	camera->getConversionStats(stats);
+
+	if (stats.frames > 0) {
+		printf("Local Camera:  %u frames converted in %.0f us on average "
+			"(max %llu us, %u threads)\n", stats.frames, 
+			(double) stats.total_us / stats.frames, 
+			(unsigned long long) stats.max_us, camera->conversionThreads());
+	}
+
+	camera->closeCamera();
+
+	delete camera;
+	camera = NULL;
 
 	printf("Local Camera:  Disabled\n");
 }
 
+/* On the drainer of the telemetry */
+static void keepRecords(const struct telemetry_record* records, 
+	unsigned int count, void* context)
+{
+	((EventRecorder*) context)->pushRecords(records, count);
+}
+
+/* The raw frames go in the AVI files as they are, which only works for
+ * compressed frames or rows packed one after the other */
+static bool recordable()
+{
+	return (strcmp(CAPTURE_FORMAT, "MJPEG") == 0 || 
+		camera->getBytesPerLine() == camera->getWidth() * 2);
+}
+
+void startRecording(int file_index)
+{
+	if (!(RECORD_FRAMES || RECORD_EVENTS) || camera == NULL)
+		return;
+
+	if (!recordable()) {
+		cerr << "ERROR: The frames of this source cannot be recorded" << 
+			endl;
+		return;
+	}
+
+	char file_name[50];
+
+	/* The frames are stored as delivered by the camera */
+	const char* format = (strcmp(CAPTURE_FORMAT, "MJPEG") == 0 ? 
+		"MJPG" : "YUY2");
+
+	/* Armed once its memory is there, out of the way of the capture */
+	if (RECORD_EVENTS && !events.isRunning()) {
+		sprintf(file_name, "frames/event%u_", file_index);
+
+		if (events.start(RECORD_MEMORY, (telemetry != NULL ? 
+			RECORD_RECORDS : 0), RECORD_PRE_MS, RECORD_POST_MS, file_name, 
+			format, camera->getWidth(), camera->getHeight(), 
+			camera->getFrameRate())) {
+			pthread_mutex_lock(&lock_recorder);
+			events_armed = true;
+			pthread_mutex_unlock(&lock_recorder);
+
+			/* Every record drained is kept with the frames */
+			telemetry_set_tap(telemetry, keepRecords, &events);
+		}
+	}
+
+	if (!RECORD_FRAMES || recorder.isRunning())
+		return;
+
+	sprintf(file_name, "frames/record%u", file_index);
+
+	/* Every frame, written in the background like the events */
+	if (!recorder.start(RECORD_QUEUE, 0, 0, 0, file_name, format, 
+		camera->getWidth(), camera->getHeight(), camera->getFrameRate()) ||
+		!recorder.record()) {
+		cerr << "ERROR: Failed to start the recording" << endl;
+		return;
+	}
+
+	pthread_mutex_lock(&lock_recorder);
+	recording = true;
+	pthread_mutex_unlock(&lock_recorder);
+}
+
+void stopRecording()
+{
+	pthread_mutex_lock(&lock_recorder);
+
+	bool recorded = recording;
+	recording = false;
+
+	bool armed = events_armed;
+	events_armed = false;
+
+	pthread_mutex_unlock(&lock_recorder);
+
+	/* The frames still queued are written first */
+	if (recorded) {
+		recorder.stop();
+
+		EventRecorderStats stats;
+		recorder.getStats(stats);
+
+		printf("Local Camera:  %u frames recorded, %u dropped\n", 
+			stats.recorded, stats.dropped);
+	}
+
+	if (!armed)
+		return;
+
+	telemetry_set_tap(telemetry, NULL, NULL);
+
+	/* The recording in progress is finished, the capture goes on */
+	events.stop();
+
+	EventRecorderStats stats;
+	events.getStats(stats);
+
+	printf("Local Camera:  %u events recorded (%u frames, %u triggers), "
+		"%u frames dropped, %zu KB of the ring used\n", stats.events, 
+		stats.recorded, stats.triggers, stats.dropped, 
+		stats.memory_max / 1024);
+
+	if (telemetry != NULL)
+		printf("Local Camera:  %u records with the events, %u lost\n", 
+			stats.records, stats.records_lost);
+}
+
+void triggerRecording(const char* reason)
+{
+	pthread_mutex_lock(&lock_recorder);
+
+	bool started = (events_armed && events.trigger());
+
+	pthread_mutex_unlock(&lock_recorder);
+
+	if (started)
+		printf("Local Camera:  Recording an event (%s)\n", reason);
+}
+
+static void recordFrame(const OCVFrameLease& frame, uint32_t time)
+{
+	pthread_mutex_lock(&lock_recorder);
+
+	if ((recording || events_armed) && frame.isValid() && recordable()) {
+		size_t size = frame.size();
+
+		/* Only complete JPEG frames, without the padding of the driver */
+		if (strcmp(CAPTURE_FORMAT, "MJPEG") == 0)
+			size = MJPEGDecoder::frameSize(frame.data(), size);
+
+		/* Copied, the card is written by the recorders */
+		if (size > 0 && recording)
+			recorder.push(frame.data(), size, time);
+
+		if (size > 0 && events_armed)
+			events.push(frame.data(), size, time);
+	}
+
+	pthread_mutex_unlock(&lock_recorder);
+}
+
+void startProcessing(int file_index)
+{
+	if (process_stop >= 0)
+		return;
+
+	/* The frames come from the capture */
+	if (capture_stop < 0) {
+		cerr << "ERROR: The local camera is not capturing" << endl;
+		return;
+	}
+
+	process_stop = eventfd(0, 0);
+
+	if (process_stop < 0) {
+		perror("Local Camera");
+		return;
+	}
+
+	process_file_index = file_index;
+	pthread_create(&process_th, NULL, process_frames, NULL);
+}
+
 void pauseProcessing()
 {
-	pthread_mutex_unlock(&lock_new_frame);
-	
-	fclose(proc_file);
+	if (process_stop < 0)
+		return;
+
+	/* The frame being processed is finished first */
+	signalStop(process_stop);
+	pthread_join(process_th, NULL);
+
+	close(process_stop);
+	process_stop = -1;
+
+	telemetry_close(proc_file);
 }
 
-void *capture_frames(void *args)
+static void *capture_frames(void *args)
 {
-	/* Avoid to cancel the thread during this period */
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	
+	/* The frames come from the camera unless FRAME_SOURCE says
+	 * otherwise ("synthetic" or "replay:<file>[,fast][,loop]") */
+	camera = FrameSource::create(getenv("FRAME_SOURCE"));
+
+	if (camera == NULL)
+		return NULL;
+
 	/* Set up the capture device */
-	camera.configureCapture((char*)"/dev/video0", 640, 480, 5, (char*)"YUYV");
+	camera->configureCapture((char*)"/dev/video0", 640, 480, 5, 
+		(char*)CAPTURE_FORMAT);
+	camera->setConversionThreads(CONVERSION_THREADS);
+	camera->setBufferCount(CAPTURE_BUFFERS);
+	camera->setLatestFrame(LATEST_FRAME);
+	camera->setQueueStats(QUEUE_STATS);
+
+	/* Waiting for a frame ends when the capture is stopped */
+	camera->setStopEvent(capture_stop);
 
 	/* Open the capture device */
-	camera.openCamera();
+	camera->openCamera();
+
+	/* Decode the compressed frames out of the capture thread */
+	if (strcmp(CAPTURE_FORMAT, "MJPEG") == 0 && DECODE_WORKERS > 0)
+		decode_pool.start(DECODE_WORKERS, DECODE_DEPTH, false, 1);
 
 	/* Open file descriptor */
-	capt_file = fopen("frames/capture.csv", "w");
+	capt_file = telemetry_open(telemetry, "frames/capture.tlm", 
+		CAPTURE_LOG_RECORDS, CAPTURE_LOG_PREALLOC);
 
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-	
 	/* Verify if the device is active */
-	if (!camera.isOpen()) {
+	if (!camera->isOpen()) {
 		cerr << "ERROR: Failed to open the local camera" << endl;
-		pthread_exit(NULL);
+		return NULL;
 	}
 
+	OCVFrameLease frame;
+	uint32_t grab_ms;
+	uint32_t handed_over = 0;
+
 	/* The first several frames tend to come out black */
-	for (int i = 0; i < 20; ++i) {
-		camera.grabFrame(timestamp_ms);
+	for (int i = 0; i < 20 && !stopRequested(capture_stop); ++i) {
+		camera->grabFrame(frame, grab_ms);
 		usleep(1000);
 	}
 
+	frame.release();
+
 	/* Information about the local capture parameters */
-	cout << "Local Camera:  Enabled (" << camera.getWidth() << "x" << 
-		camera.getHeight() << " - " << camera.getFrameRate() << " fps)" << endl;
-
-	/* Initialize the mutex for the new captured frame */
-	pthread_mutex_init(&lock_new_frame, NULL);
-	pthread_cond_init(&cond_new_frame, NULL);
-		
-	/* Capture the frames in a gray-scale format */
-	while (1) {
-		
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-		pthread_mutex_lock(&lock_new_frame);
+	cout << "Local Camera:  Enabled (" << camera->getWidth() << "x" << 
+		camera->getHeight() << " - " << camera->getFrameRate() << " fps)" << endl;
+
+	/* Once for the whole run, the images keep their buffers */
+	if (!frame_pool.isRunning() && frame_pool.start(FRAME_POOL_BUFFERS, 
+		camera->getWidth() * camera->getHeight(), FRAME_POOL_OPTIONS))
+		FramePool::setDefault(&frame_pool);
+
+	/* Room for the gray frames, one byte per pixel */
+	if (PUBLISH_FRAMES && frame_bus.create(FRAME_BUS_NAME, FRAME_BUS_SLOTS, 
+		camera->getWidth() * camera->getHeight()))
+		cout << "Local Camera:  Publishing on " << FRAME_BUS_NAME << endl;
+
+	/* Capture the frames in a gray-scale format, each one as soon as
+	 * the driver has it */
+	while (!stopRequested(capture_stop)) {
+
+		/* The slot is not seen by the processing until it is published */
+		captured_frame& slot = captured[triple_buf_back(&handoff)];
+		bool ready = false;
+
+		/* Grab the frame from the device, fails when stopped */
+		if (!camera->grabFrame(frame, grab_ms))
+			continue;
 
-		/* Grab the frame from the device */
-		camera.grabFrame(timestamp_ms);
 		grabbed_frames++;
-		
-		fprintf(capt_file, "%d %d\n", grabbed_frames, timestamp_ms);
 
-		/* Convert the frame to gray-scale */
-		camera.gray(gray);
+		telemetry_write(capt_file, TELEMETRY_CAPTURE, grabbed_frames, 
+			grab_ms, frame.info().sequence, frame.info().dropped);
+
+		if (decode_pool.isRunning()) {
+			/* Hand the frame to the decoders, the decoded frames come
+			 * out in capture order a few frames later */
+			if (!decode_pool.submit(frame, grab_ms))
+				camera->countDroppedFrame();
+
+			recordFrame(frame, grab_ms);
+			frame.release();
+
+			ready = decode_pool.tryNext(slot.gray, slot.timestamp_ms);
+			slot.capture_ns = decode_pool.lastCaptureTime();
+		}
+		else {
+			/* Convert the frame to gray-scale */
+			camera->gray(frame, slot.gray);
+			slot.timestamp_ms = grab_ms;
+			slot.capture_ns = (frame.info().monotonic ? 
+				frame.info().timestamp_ns : 0);
+			ready = true;
+
+			recordFrame(frame, grab_ms);
+			frame.release();
+		}
+
+		if (!ready)
+			continue;
+
+		/* Without a capture time from the driver, the frame is as old
+		 * as it is now */
+		if (slot.capture_ns == 0)
+			slot.capture_ns = monotonicNow();
+
+		slot.sequence = ++handed_over;
+
+		/* Copied out before the processing can see the slot */
+		if (frame_bus.isOpen())
+			frame_bus.publish(slot.gray, slot.timestamp_ms, slot.capture_ns);
+
+		/* Hand the new frame over, the previous one was never processed
+		 * if it is still there */
+		if (triple_buf_publish(&handoff))
+			camera->countDroppedFrame();
+	}
+
+	return NULL;
+}
+
+/* Sink node queuing its input to be saved with the frame of the
+ * FrameJob in 'args', in the archive or to frames/frame%u.jpg */
+static void saveImage(const vector<const Mat*>& inputs, Mat& output, 
+	void* args)
+{
+	const FrameJob* job = (const FrameJob*) args;
+
+	if (SAVE_ARCHIVE) {
+		frame_writer.submit(*inputs[0], job->sequence, job->time, 
+			job->capture_ns);
+		return;
+	}
+
+	char file_name[50];
+	sprintf(file_name, "frames/frame%u.jpg", job->sequence);
+
+	frame_writer.submit(*inputs[0], file_name);
+}
+
+/* Sink node counting the pixels where its two inputs differ, the
+ * output is only a scratch buffer */
+static void compareEdges(const vector<const Mat*>& inputs, Mat& output, 
+	void* args)
+{
+	compare(*inputs[0], *inputs[1], output, CMP_NE);
+
+	uint32_t differing = countNonZero(output);
+
+	if (differing > 0)
+		__sync_fetch_and_add(&edge_mismatches, differing);
+}
+
+/* Sink node triggering a recording when more than TRIGGER_EDGES of
+ * the pixels are edges, something close in front of the camera */
+static void triggerOnEdges(const vector<const Mat*>& inputs, Mat& output, 
+	void* args)
+{
+	const Mat& edges = *inputs[0];
+
+	if (countNonZero(edges) > TRIGGER_EDGES * (double) edges.total())
+		triggerRecording("edges");
+}
+
+/* The analyses of every worker, the intermediate images are shared */
+static void buildGraph(FrameGraph& graph, const FrameJob& job, void* args)
+{
+	graph.addSource("gray");
+	graph.setThreads(PROCESS_THREADS);
+
+	if (DETECT_EDGES || SAVE_EDGES || CHECK_EDGES)
+		graph.addEdges("edges", "gray", "edges", edge_params);
+
+	if (CHECK_EDGES) {
+		graph.addNode("canny", "gray", "canny", FrameGraph::edges, 
+			&edge_params);
+		graph.addNode("check", "edges,canny", NULL, compareEdges);
+	}
+
+	if (SAVE_EDGES)
+		graph.addNode("save", "edges", NULL, saveImage, (void*) &job);
+
+	if (DETECT_EDGES && RECORD_EVENTS && TRIGGER_EDGES > 0)
+		graph.addNode("trigger", "edges", NULL, triggerOnEdges);
+}
+
+static void logFrame(const FrameJob& job)
+{
+	telemetry_write(proc_file, TELEMETRY_PROCESS, job.sequence, job.time, 0, 
+		0);
+}
+
+static void printNodeStats(const FrameProcessPool& pool)
+{
+	vector<FrameNodeStats> stats;
+	pool.getNodeStats(stats);
+
+	for (size_t i = 0; i < stats.size(); ++i) {
+		if (stats[i].runs == 0)
+			continue;
 
-		/* Notify to other threads that the new frame is ready */
-		new_frame = 1;
-		pthread_cond_signal(&cond_new_frame);
-		pthread_mutex_unlock(&lock_new_frame);
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-		
-		/* TODO: Define the priority to the keyboard and the capture*/
-		usleep(5000);
+		printf("Local Camera:  %s: %u frames in %.0f us on average "
+			"(max %llu us)\n", stats[i].name.c_str(), stats[i].runs, 
+			(double) stats[i].total_us / stats[i].runs, 
+			(unsigned long long) stats[i].max_us);
 	}
+}
 
-	pthread_exit(NULL);
+static void printAdmissionStats(const FrameAdmission& admission)
+{
+	FrameAdmissionStats stats;
+	admission.getStats(stats);
+
+	printf("Local Camera:  %s: %u frames processed, %u skipped, "
+		"%u superseded\n", admission.policy(), stats.admitted, 
+		stats.skipped, stats.superseded);
+
+	if (stats.processed > 0) {
+		printf("Local Camera:  %.0f ms old on average when processed "
+			"(max %llu ms), %llu us of processing expected\n", 
+			(double) stats.age_total_us / stats.processed / 1000, 
+			(unsigned long long) stats.age_max_us / 1000, 
+			(unsigned long long) stats.cost_us);
+	}
 }
 
-void *process_frames(void *args)
+static void printWriterStats(const FrameWriter& writer)
 {
-	/* Get index of the file */
-	struct video_th_params *params = (struct video_th_params *) args;
-	int file_index = params->file_index;
+	FrameWriterStats stats;
+	writer.getStats(stats);
+
+	if (stats.submitted == 0)
+		return;
+
+	uint32_t queued = stats.submitted - stats.dropped;
+
+	printf("Local Camera:  %u frames saved, %u dropped, %u failed, "
+		"%.1f waiting on average (max %u)\n", stats.written, 
+		stats.dropped, stats.failed, 
+		(queued > 0 ? (double) stats.depth_total / queued : 0.0), 
+		stats.depth_max);
+
+	uint32_t done = stats.written + stats.failed;
+
+	if (done > 0) {
+		printf("Local Camera:  %.0f us to encode a frame on average "
+			"(max %llu us), %.0f us to write it, %llu kB written\n", 
+			(double) stats.encode_total_us / done, 
+			(unsigned long long) stats.encode_max_us, 
+			(double) stats.write_total_us / done, 
+			(unsigned long long) stats.bytes / 1024);
+	}
+
+	if (stats.blocked > 0) {
+		printf("Local Camera:  %u frames waited %llu ms for the writer\n", 
+			stats.blocked, (unsigned long long) stats.blocked_us / 1000);
+	}
+}
 
+static void *process_frames(void *args)
+{
 	/* Open file descriptor */
 	char file_name[50];
-	sprintf(file_name, "frames/file%u.csv", file_index);
+	sprintf(file_name, "frames/file%u.tlm", process_file_index);
 	
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	proc_file = fopen(file_name, "w");
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-		
-	char name_edge[50];
-	char full_name_edge[50];
+	proc_file = telemetry_open(telemetry, file_name, PROCESS_LOG_RECORDS, 
+		PROCESS_LOG_PREALLOC);
+
+	/* Every worker processes its own frame */
+	FrameProcessPool pool;
+	FrameJob done;
+
+	/* Which of the frames are worth processing */
+	FrameAdmission admission;
+	admission.setPolicy(PROCESS_ADMISSION);
+
+	edge_mismatches = 0;
+
+	/* The edges are saved in the background */
+	if (SAVE_EDGES) {
+		sprintf(file_name, "frames/frames%u.tfa", process_file_index);
+
+		frame_writer.resetStats();
+		frame_writer.start(SAVE_WORKERS, SAVE_DEPTH, SAVE_BLOCK, 
+			SAVE_QUALITY, (SAVE_ARCHIVE ? file_name : NULL), storage);
+	}
+
+	if (!pool.start(PROCESS_WORKERS, PROCESS_DEPTH, "gray", NULL, 
+		buildGraph, NULL)) {
+		/* Nothing is saved, the archive is closed */
+		frame_writer.stop();
+		return NULL;
+	}
+
+	/* Wait for a new frame, for a processed one or for the pause */
+	struct pollfd events[3];
+
+	events[0].fd = triple_buf_fd(&handoff);
+
+	events[1].fd = pool.doneEvent();
+	events[1].events = POLLIN;
+
+	events[2].fd = process_stop;
+	events[2].events = POLLIN;
 	
 	/* Process the gray-scale frames */
 	while (1) {
+		/* With every worker busy and the ring full, the new frames are
+		 * left to be replaced (and counted as dropped) by the capture */
+		events[0].events = (pool.isFull() ? 0 : POLLIN);
 
-		/* Define the name of the new frame */
+		if (poll(events, 3, -1) == -1 && errno != EINTR) {
+			perror("Local Camera");
+			break;
+		}
+
+		if (events[2].revents & POLLIN)
+			break;
+
+		/* Log the processed frames in capture order */
+		if (events[1].revents & POLLIN) {
+			uint64_t count;
+
+			if (read(events[1].fd, &count, sizeof(count)) == -1 && 
+				errno != EAGAIN)
+				perror("Local Camera");
+		}
+
+		while (pool.tryNext(done)) {
+			admission.processed(done.capture_ns, done.process_ns);
+			logFrame(done);
+		}
+
+		if (pool.isFull())
+			continue;
+
+		/* The latest frame, it stays put until the next take */
+		int index = triple_buf_try_take(&handoff);
+
+		if (index < 0)
+			continue;
+
+		const captured_frame& slot = captured[index];
+
+		if (!admission.admit(slot.sequence, slot.capture_ns))
+			continue;
+
+		/* Number the new frame, the pool keeps a copy of it */
 		num_frames++;
-		sprintf(name_edge, "frame%u.jpg", num_frames);
-		sprintf(full_name_edge, "frames/frame%u.jpg", num_frames);
+		pool.submit(slot.gray, num_frames, slot.timestamp_ms, 
+			slot.capture_ns);
+	}
 
-		pthread_mutex_lock(&lock_new_frame);
+	/* The frames in flight are finished first */
+	while (pool.next(done)) {
+		admission.processed(done.capture_ns, done.process_ns);
+		logFrame(done);
+	}
 
-		/* Block until a new frame is available */
-		while (!new_frame)
-			pthread_cond_wait(&cond_new_frame, &lock_new_frame);
-				
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-		
-		/* Apply the edge filter and save the resulting frame */
-		//Canny(gray, edge, 0, 30, 3);
-		//imwrite(full_name_edge, edge);
-		fprintf(proc_file, "%s %d\n", name_edge, timestamp_ms);
+	pool.stop();
 
-		new_frame = 0;
-		pthread_mutex_unlock(&lock_new_frame);
+	/* The frames still waiting are written before the pause */
+	frame_writer.stop();
 
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	printNodeStats(pool);
+	printAdmissionStats(admission);
+	printWriterStats(frame_writer);
 
-		usleep(5000);
+	if (CHECK_EDGES) {
+		printf("Local Camera:  %u edge pixels differ from cv::Canny\n", 
+			edge_mismatches);
 	}
 
-	pthread_exit(NULL);
-}	
+	return NULL;
+}
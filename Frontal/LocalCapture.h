@@ -1,9 +1,25 @@
-void *capture_frames(void *args);
-void *process_frames(void *args);
+/*
+ * The capture runs in its own thread from 'startCapture' to
+ * 'stopCapture', the processing of the captured frames from
+ * 'startProcessing' to 'pauseProcessing' (or 'stopCapture'). Both
+ * return within a frame period. The logs of the frames are written
+ * through 'telemetry' (none if it is NULL), the saved frames through
+ * 'storage' (with stdio if it is NULL).
+ */
+struct storage;
+struct telemetry;
 
-void pauseProcessing();
+void startCapture(struct storage *storage, struct telemetry *telemetry);
 void stopCapture();
 
-struct video_th_params {
-	int file_index;
-};
+void startProcessing(int file_index);
+void pauseProcessing();
+
+void startRecording(int file_index);
+void stopRecording();
+
+/*
+ * Record the frames around now when recording events, from any thread
+ * ('reason' is printed when it starts a recording).
+ */
+void triggerRecording(const char* reason);
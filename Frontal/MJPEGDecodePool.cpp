@@ -0,0 +1,259 @@
+#include "MJPEGDecodePool.h"
+#include "MJPEGDecoder.h"
+
+#include <string.h>
+
+using namespace cv;
+using namespace std;
+
+MJPEGDecodePool::MJPEGDecodePool()
+{
+	m_color = false;
+	m_scale = 1;
+	m_running = false;
+
+	m_head = 0;
+	m_next_decode = 0;
+	m_tail = 0;
+
+	m_dropped_frames = 0;
+	m_corrupt_frames = 0;
+
+	m_last_capture_ns = 0;
+
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_queued, NULL);
+	pthread_cond_init(&m_decoded, NULL);
+}
+
+MJPEGDecodePool::~MJPEGDecodePool()
+{
+	stop();
+
+	pthread_mutex_destroy(&m_lock);
+	pthread_cond_destroy(&m_queued);
+	pthread_cond_destroy(&m_decoded);
+}
+
+bool MJPEGDecodePool::start(uint32_t workers, uint32_t depth, bool color,
+	uint32_t scale)
+{
+	if (m_running)
+		stop();
+
+	if (workers < 1)
+		workers = 1;
+
+	/* Enough slots to keep every worker busy */
+	if (depth < workers)
+		depth = workers;
+
+	m_slots.clear();
+	m_slots.resize(depth);
+
+	for (uint32_t i = 0; i < depth; ++i)
+		m_slots[i].state = kFree;
+
+	m_color = color;
+	m_scale = scale;
+
+	m_head = 0;
+	m_next_decode = 0;
+	m_tail = 0;
+
+	m_dropped_frames = 0;
+	m_corrupt_frames = 0;
+
+	m_running = true;
+
+	for (uint32_t i = 0; i < workers; ++i) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, worker, this) != 0)
+			break;
+
+		m_workers.push_back(thread);
+	}
+
+	if (m_workers.empty()) {
+		m_running = false;
+		return false;
+	}
+
+	return true;
+}
+
+void MJPEGDecodePool::stop()
+{
+	pthread_mutex_lock(&m_lock);
+	m_running = false;
+	pthread_cond_broadcast(&m_queued);
+	pthread_cond_broadcast(&m_decoded);
+	pthread_mutex_unlock(&m_lock);
+
+	for (size_t i = 0; i < m_workers.size(); ++i)
+		pthread_join(m_workers[i], NULL);
+
+	m_workers.clear();
+}
+
+bool MJPEGDecodePool::isRunning() const
+{
+	return m_running;
+}
+
+bool MJPEGDecodePool::submit(const OCVFrameLease& frame, uint32_t time)
+{
+	const OCVFrameInfo& info = frame.info();
+
+	return queue(frame.data(), frame.size(), time,
+		(info.monotonic ? info.timestamp_ns : 0));
+}
+
+bool MJPEGDecodePool::submit(const uint8_t* data, size_t size,
+	uint32_t time)
+{
+	return queue(data, size, time, 0);
+}
+
+bool MJPEGDecodePool::queue(const uint8_t* data, size_t size,
+	uint32_t time, uint64_t capture_ns)
+{
+	pthread_mutex_lock(&m_lock);
+
+	if (!m_running || data == NULL || m_tail - m_head == m_slots.size()) {
+		m_dropped_frames++;
+		pthread_mutex_unlock(&m_lock);
+		return false;
+	}
+
+	Slot& slot = m_slots[m_tail % m_slots.size()];
+
+	/* Copying keeps the driver buffer out of the queue only briefly,
+	 * and takes little time next to a decode */
+	if (slot.compressed.size() < size)
+		slot.compressed.resize(size);
+
+	memcpy(&slot.compressed[0], data, size);
+	slot.size = size;
+	slot.time = time;
+	slot.capture_ns = capture_ns;
+	slot.state = kQueued;
+
+	m_tail++;
+
+	pthread_cond_signal(&m_queued);
+	pthread_mutex_unlock(&m_lock);
+
+	return true;
+}
+
+void* MJPEGDecodePool::worker(void* args)
+{
+	MJPEGDecodePool* pool = (MJPEGDecodePool*) args;
+	MJPEGDecoder decoder;
+
+	decoder.setScale(pool->m_scale);
+
+	pthread_mutex_lock(&pool->m_lock);
+
+	while (true) {
+		while (pool->m_running && pool->m_next_decode == pool->m_tail)
+			pthread_cond_wait(&pool->m_queued, &pool->m_lock);
+
+		if (!pool->m_running)
+			break;
+
+		Slot& slot = pool->m_slots[pool->m_next_decode %
+			pool->m_slots.size()];
+
+		pool->m_next_decode++;
+		slot.state = kDecoding;
+
+		/* The slot belongs to this worker until it is decoded */
+		pthread_mutex_unlock(&pool->m_lock);
+
+		bool decoded;
+
+		if (pool->m_color)
+			decoded = decoder.rgb(&slot.compressed[0], slot.size,
+				slot.decoded);
+		else
+			decoded = decoder.gray(&slot.compressed[0], slot.size,
+				slot.decoded);
+
+		pthread_mutex_lock(&pool->m_lock);
+
+		slot.state = (decoded ? kDecoded : kCorrupt);
+
+		pthread_cond_broadcast(&pool->m_decoded);
+	}
+
+	pthread_mutex_unlock(&pool->m_lock);
+
+	return NULL;
+}
+
+bool MJPEGDecodePool::next(Mat& frame, uint32_t& time)
+{
+	return take(frame, time, true);
+}
+
+bool MJPEGDecodePool::tryNext(Mat& frame, uint32_t& time)
+{
+	return take(frame, time, false);
+}
+
+bool MJPEGDecodePool::take(Mat& frame, uint32_t& time, bool wait)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&m_lock);
+
+	while (m_running && !found) {
+		/* Frames are handed out in the order they were queued, even
+		 * if a later one is decoded first */
+		Slot* slot = NULL;
+
+		if (m_head != m_tail)
+			slot = &m_slots[m_head % m_slots.size()];
+
+		if (slot != NULL && slot->state == kCorrupt) {
+			slot->state = kFree;
+			m_corrupt_frames++;
+			m_head++;
+		}
+		else if (slot != NULL && slot->state == kDecoded) {
+			/* Swap so the caller's buffer is reused by a later frame */
+			cv::swap(frame, slot->decoded);
+			time = slot->time;
+			m_last_capture_ns = slot->capture_ns;
+			slot->state = kFree;
+			m_head++;
+			found = true;
+		}
+		else if (wait)
+			pthread_cond_wait(&m_decoded, &m_lock);
+		else
+			break;
+	}
+
+	pthread_mutex_unlock(&m_lock);
+
+	return found;
+}
+
+uint64_t MJPEGDecodePool::lastCaptureTime() const
+{
+	return m_last_capture_ns;
+}
+
+uint32_t MJPEGDecodePool::droppedFrames() const
+{
+	return m_dropped_frames;
+}
+
+uint32_t MJPEGDecodePool::corruptFrames() const
+{
+	return m_corrupt_frames;
+}
@@ -0,0 +1,115 @@
+/*
+ * MJPEGDecodePool - Decodes MJPEG frames on several threads while the
+ * capture thread keeps grabbing.
+ *
+ * The compressed frames are copied into a bounded ring of slots, so
+ * the driver buffers go back to the queue right away, and decoded by
+ * the first idle worker (each one with its own decoder). The decoded
+ * frames are handed out in capture order with their timestamps. When
+ * all the slots are in flight new frames are dropped, and counted,
+ * instead of blocking the capture.
+ */
+#ifndef MJPEGDECODEPOOL_H
+#define MJPEGDECODEPOOL_H
+
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+#include <pthread.h>
+
+#include "FrameSource.h"
+
+class MJPEGDecodePool
+{
+  public:
+    MJPEGDecodePool();
+    ~MJPEGDecodePool();
+
+    /*
+     * Start 'workers' threads decoding to gray (or BGR when 'color' is
+     * set) at 1/scale of the captured size, with at most 'depth'
+     * frames in flight. Returns false if no worker could be started.
+     */
+    bool start(uint32_t workers, uint32_t depth, bool color,
+      uint32_t scale);
+
+    /*
+     * Stops the workers, the frames still in flight are discarded.
+     */
+    void stop();
+    bool isRunning() const;
+
+    /*
+     * Queue a compressed frame. Returns false when the frame is dropped
+     * because the ring is full (or the pool is not running).
+     */
+    bool submit(const OCVFrameLease& frame, uint32_t time);
+    bool submit(const uint8_t* data, size_t size, uint32_t time);
+
+    /*
+     * Take the oldest decoded frame. 'next' waits for it and returns
+     * false only when the pool is stopped, 'tryNext' returns false
+     * right away if it is not decoded yet. Corrupt frames are skipped.
+     * The Mat buffer passed in is recycled for a later frame.
+     */
+    bool next(cv::Mat& frame, uint32_t& time);
+    bool tryNext(cv::Mat& frame, uint32_t& time);
+
+    /*
+     * Capture time on the monotonic clock of the last frame taken, 0
+     * if the driver did not tell it.
+     */
+    uint64_t lastCaptureTime() const;
+
+    /*
+     * Frames dropped because the ring was full and frames that could
+     * not be decoded.
+     */
+    uint32_t droppedFrames() const;
+    uint32_t corruptFrames() const;
+
+  private:
+    MJPEGDecodePool(const MJPEGDecodePool&);
+    MJPEGDecodePool& operator=(const MJPEGDecodePool&);
+
+    enum slot_state { kFree, kQueued, kDecoding, kDecoded, kCorrupt };
+
+    struct Slot {
+      slot_state state;
+      std::vector<uint8_t> compressed;
+      size_t size;
+      uint32_t time;
+      uint64_t capture_ns;
+      cv::Mat decoded;
+    };
+
+    static void* worker(void* args);
+    bool queue(const uint8_t* data, size_t size, uint32_t time,
+      uint64_t capture_ns);
+    bool take(cv::Mat& frame, uint32_t& time, bool wait);
+
+    std::vector<pthread_t> m_workers;
+    std::vector<Slot> m_slots;
+
+    bool m_color;
+    uint32_t m_scale;
+    bool m_running;
+
+    /*
+     * Sequence numbers of the next frame to hand out, to decode and to
+     * queue. The slot of a frame is its number modulo the depth.
+     */
+    uint32_t m_head;
+    uint32_t m_next_decode;
+    uint32_t m_tail;
+
+    uint32_t m_dropped_frames;
+    uint32_t m_corrupt_frames;
+
+    uint64_t m_last_capture_ns;
+
+    pthread_mutex_t m_lock;
+    pthread_cond_t m_queued;
+    pthread_cond_t m_decoded;
+};
+#endif
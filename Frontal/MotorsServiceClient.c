@@ -1,11 +1,9 @@
-#include <net/if.h>
-#include <sys/ioctl.h>
 #include <string.h>
 
 #include <linux/can.h>
-#include <linux/can/raw.h>
 
 #include "MotorsServiceClient.h"
+#include "canbus.h"
 //#include "canopen.h"
 #include "socket_ids.h"
 #include "canbus_ids.h"
@@ -13,9 +11,8 @@
 #define CPR 64000 /* counts per revolution of the encoder */
 #define C_WHEEL 0.298 /* meters - Diameter 0.095 meters */
 
-/* Variables to identify the socket */
-static int sock_can;
-static const char* can_interface = "can0";
+/* The CAN socket of the board */
+static struct canbus *canbus;
 
 /**Status varibales**/
 static struct Motors* _motorsClient;
@@ -33,38 +30,9 @@ int from_rpm_to_encoder(float rpm);
 
 /**Public methods**/
 
-static void enableCommunication()
-{
-	/* Open CAN socket */
-	struct sockaddr_can addr;
-	struct ifreq ifr;
-	
-	if ((sock_can = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
-		perror("socket");
-		return;
-	}
-	
-	strcpy(ifr.ifr_name, can_interface);
-	ioctl(sock_can, SIOCGIFINDEX, &ifr);
-	addr.can_family = AF_CAN;
-	addr.can_ifindex = ifr.ifr_ifindex;
-	
-	if (bind(sock_can, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-		perror("bind");
-		return;
-	}
-
-	/* Filter the can messages */
-	struct can_filter rfilter;
-	rfilter.can_id   = 0x583;
-	rfilter.can_mask = CAN_SFF_MASK;
+int MotorsServiceClient(struct canbus *bus){
+	canbus = bus;
 
-	setsockopt(sock_can, SOL_CAN_RAW, CAN_RAW_FILTER, &rfilter, sizeof(rfilter));
-	
-	return;
-}
-
-int MotorsServiceClient(){
 	_motorsClient = (struct Motors*) malloc( sizeof(struct Motors) );
 	_motorsClient->statusLeft = 0;
 	_motorsClient->statusRight = 0;
@@ -78,8 +46,10 @@ int MotorsServiceClient(){
 	_lastReq=&noRequest;
   
 	//activateMotorsServiceClient();
-	
-	enableCommunication();
+
+	/* Only the requests go out, the replies are not read: the drivers
+	 * answer the encoder queries on the same IDs, which would be taken
+	 * for the replies of a pending request */
 
 	printf("Motors:        Enabled\n");
   
@@ -95,7 +65,6 @@ void sendMsg(__u32 ID, __u8 DATA[], int len)
 {
   /* Procedure to send a CAN message */
   struct can_frame Tmsg;
-  int nbytes;
   int i, errno;
 
   Tmsg.can_id = ID;
@@ -109,7 +78,7 @@ void sendMsg(__u32 ID, __u8 DATA[], int len)
     printf("\n");    
 #endif
 
-    if ((nbytes = write(sock_can, &Tmsg, sizeof(Tmsg))) != sizeof(Tmsg)) {
+    if (canbus_send(canbus, Tmsg.can_id, Tmsg.data, Tmsg.can_dlc) < 0) {
       errno = -1;
       printf("Error sending message through CANbus!!!\n");
     }
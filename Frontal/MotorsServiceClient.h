@@ -26,7 +26,9 @@ struct MotorsAck{
   int ack;
 };
 
-int MotorsServiceClient();
+struct canbus;
+
+int MotorsServiceClient(struct canbus *bus);
 struct Motors readMotors();
 
 int setMotorLeftSpeed(float speed_mps, struct MotorsAck* ack);
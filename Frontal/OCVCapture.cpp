@@ -17,9 +17,6 @@
  */ 
 #include "OCVCapture.h"
 
-#include "opencv2/imgproc/imgproc.hpp"
-#include "opencv2/highgui/highgui.hpp"
-
 #include <iostream>
 #include <iomanip>
 
@@ -27,30 +24,26 @@
 #include <linux/videodev2.h>
 #include <libv4l2.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <poll.h>
 
 using namespace cv;
 using namespace std;
 
+/* Older headers lack the timestamp flags */
+#ifndef V4L2_BUF_FLAG_TIMESTAMP_MASK
+#define V4L2_BUF_FLAG_TIMESTAMP_MASK 0x0000e000
+#define V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC 0x00002000
+#endif
+
 OCVCapture::OCVCapture()
 {
-	m_device_id = "/dev/video0";
-	m_desired_width = 640;
-	m_desired_height = 480;
-	m_desired_frame_rate = 5;
-
-	m_verbose = false;
-
 	m_camera_handle = -1;
 	m_first_grab = true;
 
-	m_final_width = 0;
-	m_final_height = 0;
-	m_final_frame_rate = 0;
-
-	m_raw_image_size = 0;
-	m_raw_image_data = NULL;
-	m_raw_bytes_per_line = 0;
+	m_have_sequence = false;
+	m_last_sequence = 0;
 }
 
 OCVCapture::~OCVCapture()
@@ -60,64 +53,6 @@ OCVCapture::~OCVCapture()
 
 static const char* messageHeader = "Capture: ";
 
-void OCVCapture::configureCapture(char* id, uint32_t width, 
-  uint32_t height, uint32_t fps, char* pixfmt)
-{
-	/* Check if device is open */
-	if (isOpen()) {
-		reportError("ERROR: Can't configure device while open");
-		return;
-	}
-
-	/* Set the id of the device */
-	if (id != m_device_id)
-		m_device_id = id;
-
-	/* Set the width of the capture */
-	if (width != m_desired_width)
-		m_desired_width = width;
-		
-	/* Set the height of the capture */
-	if (height != m_desired_height)
-		m_desired_height = height;
-
-	/* Set the frame rate of the capture */
-	if (fps != m_desired_frame_rate)
-		m_desired_frame_rate = fps;
-
-	// Set the pixel format of the capture
-	if (strcmp(pixfmt,"YUYV") == 0) {
-		m_desired_pix_fmt = V4L2_PIX_FMT_YUYV;
-	} 
-	else if (strcmp(pixfmt,"MJPEG") == 0) {
-		m_desired_pix_fmt = V4L2_PIX_FMT_MJPEG;
-	} 
-	else {
-		reportError("ERROR: The pixel format is not handled");
-		return;
-	}
-}
-
-void OCVCapture::reportError(const char *error)
-{
-	cerr << messageHeader << error << endl;
-}
-
-void OCVCapture::reportError(const char* error, int64_t value)
-{
-	cerr << messageHeader << error << " " << value << endl;
-}
-
-void OCVCapture::setVerbose(bool verboseOn)
-{
-	m_verbose = verboseOn;
-}
-
-bool OCVCapture::verbose() const
-{
-	return m_verbose;
-}
-
 int OCVCapture::retry_ioctl(int request, void* argument)
 {
 	int result;
@@ -134,27 +69,15 @@ bool OCVCapture::isOpen() const
 	return (m_camera_handle > 0);
 }
 
-uint32_t OCVCapture::getWidth() const
-{
-	return m_final_width;
-}
-
-uint32_t OCVCapture::getHeight() const
-{
-	return m_final_height;
-}
-
-uint32_t OCVCapture::getFrameRate() const
-{
-	return m_final_frame_rate;
-}
-
 bool OCVCapture::openCamera()
 {
 	if (isOpen())
 		return true;
 
 	m_first_grab = true;
+	m_have_sequence = false;
+
+	openSource();
 
 	/* Open the device for the capture */
 	m_camera_handle = v4l2_open(m_device_id, O_RDWR | O_NONBLOCK, 0);
@@ -233,7 +156,6 @@ bool OCVCapture::openCamera()
 		}
 	}
 
-	static const uint32_t desiredBuffers = 4;
 	static const uint32_t desiredFormat = m_desired_pix_fmt;
 	int matrixType = CV_8UC2;
 
@@ -305,7 +227,7 @@ bool OCVCapture::openCamera()
 	struct v4l2_requestbuffers request;
 	bzero(&request, sizeof(request));
 
-	uint32_t bufferCount = desiredBuffers;
+	uint32_t bufferCount = m_desired_buffers;
 
 	request.count = bufferCount;
 	request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -377,17 +299,6 @@ bool OCVCapture::openCamera()
 		m_mapped_buffer_ptrs.push_back(mapped);
 		m_mapped_buffer_lens.push_back(buffer.length);
 	}
-
-	/* Now allocate the image data */
-	m_raw_image_size = m_mapped_buffer_lens[0];
-	dataBuffer.resize(m_raw_image_size);
-	m_raw_image_data = &dataBuffer[0];
-
-	if (m_raw_image_data == NULL) {
-		reportError("Could not allocate RAW image data");
-		closeCamera();
-		return false;
-	}
 	
 	return true;
 }
@@ -425,8 +336,28 @@ bool OCVCapture::firstGrabSetup()
 	return true;
 }
 
-bool OCVCapture::grabFrame(uint32_t& time)
+void OCVCapture::releaseBuffer(uint32_t index, uint32_t generation)
+{
+	/* The buffers leased before the camera was closed are gone */
+	if (!isOpen() || generation != m_generation)
+		return;
+
+	struct v4l2_buffer buffer;
+	bzero(&buffer, sizeof(buffer));
+
+	buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buffer.memory = V4L2_MEMORY_MMAP;
+	buffer.index = index;
+
+	/* Put this buffer back on the queue */
+	if (retry_ioctl(VIDIOC_QBUF, &buffer) == -1)
+		reportError("failed putting buffer back in queue", index);
+}
+
+bool OCVCapture::grabFrame(OCVFrameLease& lease, uint32_t& time)
 {	
+	lease.release();
+
 	if (!isOpen())
 		return false;
 
@@ -436,31 +367,34 @@ bool OCVCapture::grabFrame(uint32_t& time)
 	enum status_type { kTrying, kFailure, kSuccess };
 
 	status_type status = kTrying;
-	void* dataPtr = NULL;
-	size_t dataLen = 0;
 
 	while (status == kTrying) {
-		fd_set readset;
-		struct timeval timeout;
+		/* Wait for a frame or for the stop event, whichever is first */
+		struct pollfd ready[2];
 
-		FD_ZERO(&readset);
-		FD_SET(m_camera_handle, &readset);
+		ready[0].fd = m_camera_handle;
+		ready[0].events = POLLIN;
+		ready[0].revents = 0;
 
-		timeout.tv_sec = 2;
-		timeout.tv_usec = 0;
+		ready[1].fd = m_stop_fd;
+		ready[1].events = POLLIN;
+		ready[1].revents = 0;
 
-		int numReady = select(m_camera_handle + 1, &readset, NULL, 
-			NULL, &timeout);
+		int numReady = poll(ready, (m_stop_fd >= 0 ? 2 : 1), 2000);
 
 		if (numReady == -1) {
 			/* Wait for it... */
 			if (errno != EINTR) {
-				reportError("error on select", errno);
+				reportError("error on poll", errno);
 				status = kFailure;
 			}
 		}
 		else if (numReady == 0) {
-			//reportError("select timeout");
+			//reportError("poll timeout");
+			status = kFailure;
+		}
+		else if (ready[1].revents & POLLIN) {
+			/* Stopped, the frame (if any) stays queued */
 			status = kFailure;
 		}
 		else {
@@ -484,238 +418,164 @@ bool OCVCapture::grabFrame(uint32_t& time)
 				}
 				else {
 					status = kSuccess;
-					
-					/* Grab the data */
-					dataPtr = m_mapped_buffer_ptrs[bufferIndex];
-					memcpy(m_raw_image_data, dataPtr, m_raw_image_size);
-					time = buffer.timestamp.tv_sec * 1000 + buffer.timestamp.tv_usec / 1000;
 
-					/* Put this buffer back on the queue */
-					if (retry_ioctl(VIDIOC_QBUF, &buffer) == -1) {
-						reportError("utting buffer back in queue");
-						status = kFailure;
-					}
-				}
-			}
-		}
-	}
+					uint32_t dropped = sequenceGap(buffer);
+					uint32_t skipped = 0;
 
-	return (status == kSuccess);
-}
+					/* Keep only the newest ready frame, the older ones
+					 * go back to the queue (the device is non-blocking
+					 * so this stops when the queue is empty) */
+					while (m_latest_frame) {
+						struct v4l2_buffer newer;
+						bzero(&newer, sizeof(newer));
 
-void OCVCapture::resizeMat(Mat& mat, int matType)
-{
-	if (mat.empty() || mat.rows != m_final_height || 
-		mat.cols != m_final_width || mat.type() != matType) {
-		mat = Mat(m_final_height, m_final_width, matType);
-	}
-}
-
-bool OCVCapture::yuv2gray(Mat& grayMat)
-{
-	if (!isOpen())
-		return false;
+						newer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+						newer.memory = V4L2_MEMORY_MMAP;
 
-	if (m_raw_image_data == NULL)
-		return false;
+						if (retry_ioctl(VIDIOC_DQBUF, &newer) == -1)
+							break;
 
-	resizeMat(grayMat, CV_8UC1);
+						if (newer.index >= m_mapped_buffer_ptrs.size()) {
+							reportError("dequeued buffer index out of range");
+							break;
+						}
 
-	for (size_t rowIndex = 0; rowIndex < m_final_height; ++rowIndex) {
-		const uint8_t *getIt = m_raw_image_data + 
-			rowIndex * m_raw_bytes_per_line;
-		uint8_t *putIt = grayMat.ptr(rowIndex);
+						releaseBuffer(buffer.index, m_generation);
+						dropped += sequenceGap(newer);
+						skipped++;
 
-		for (size_t colIndex = 0; colIndex < m_final_width; 
-			++colIndex) {
-			*putIt++ = *getIt;
-			getIt += 2;
-		}
-	}
+						buffer = newer;
+						bufferIndex = buffer.index;
+					}
+					
+					size_t size = buffer.bytesused;
 
-	return true;
-}
+					if (size == 0 || 
+						size > m_mapped_buffer_lens[bufferIndex])
+						size = m_mapped_buffer_lens[bufferIndex];
 
-#define Fixed(n) ((int)((n) * 255.0 + 0.5))
-#define clamp(v) ((v) < 0 ? 0 : ((v) > 255 ? 255 : (v)))
-#define prepare(comp) clamp((comp + 128) >> 8)
+					/* Lease the data, the buffer goes back on the 
+					 * queue when the lease is released */
+					OCVFrameInfo& info = leaseFrame(lease, bufferIndex, 
+						(const uint8_t*) m_mapped_buffer_ptrs[bufferIndex], 
+						size);
 
-bool OCVCapture::yuv2rgb(Mat& rgbMat)
-{
-	if (!isOpen())
-		return false;
+					fillFrameInfo(buffer, info);
+					info.dropped = dropped;
+					info.skipped = skipped;
+					m_capture_stats.skipped += skipped;
 
-	if (m_raw_image_data == NULL)
-		return false;
+					/* Draining leaves nothing newer behind */
+					if (m_queue_stats && !m_latest_frame)
+						queueAge(buffer, info);
 
-	resizeMat(rgbMat, CV_8UC3);
-
-	for (size_t rowIndex = 0; rowIndex < m_final_height; ++rowIndex) {
-		const uint8_t *getIt = m_raw_image_data + 
-			rowIndex * m_raw_bytes_per_line;
-		uint8_t *putIt = rgbMat.ptr(rowIndex);
-
-		for (size_t colIndex = 0; colIndex < m_final_width; 
-			colIndex += 2) {
-			int y1 = *getIt++;
-			int cb = *getIt++;
-			int y2 = *getIt++;
-			int cr = *getIt++;
-
-			/* There seems to be multiple way so of doing YCbCr to
-			 * RGB conversions due to variations in the standards.
-			 */
-
-			#if 1
-			/* This conversion uses the standards defined for JFIF
-			 * which allow all components to span the entire range
-			 * of 0 to 255. I'm not sure that is what my webcam is
-			 * doing or whether it conforms to a spec where Y ranges
-			 * from 16 to 235 and Cb and Cr range from 16 to 239.
-			 * 
-			 * For details see http://www.fourcc.org/fccyvrgb.php
-			 */
-
-			/* First we adjust Cb and Cr so they lie in the range
-			 * -0.5 to 0.5
-			 */
-			cb -= 128;
-			cr -= 128;
-
-			/* For speed we use fixed point with 8 bits of fractional
-			 * precision.
-			 */
-			int rAdd = Fixed(1.403) * cr;
-			int gAdd = Fixed(-0.344) * cb + Fixed(-.714) * cr;
-			int bAdd = Fixed(1.770) * cb;
-
-			y1 *= 256;
-			y2 *= 256;
-			#else
-			/* This is the solution provided by Microsoft, which
-			 * seems to assume a standard where the component range
-			 * is restricted so the components require some scaling
-			 * to bring them into range before the coefficients are
-			 * applied.
-			 */
-			y1 -= 16;
-			y2 -= 16;
-			y1 *= 298;
-			y2 *= 298;
-
-			cb -= 128;
-			cr -= 128;
-
-			int rAdd = 409 * cr;
-			int gAdd = -100 * cb - 208 * cr;
-			int bAdd = 516 * cb;
-			#endif
-
-			*putIt++ = prepare(y1 + bAdd);
-			*putIt++ = prepare(y1 + gAdd);
-			*putIt++ = prepare(y1 + rAdd);
-
-			*putIt++ = prepare(y2 + bAdd);
-			*putIt++ = prepare(y2 + gAdd);
-			*putIt++ = prepare(y2 + rAdd);
+					time = buffer.timestamp.tv_sec * 1000 + buffer.timestamp.tv_usec / 1000;
+				}
+			}
 		}
 	}
 
-	return true;
+	return (status == kSuccess);
 }
 
-bool OCVCapture::yuv2yuv(Mat& yuvMat)
+/*
+ * Frames dropped by the driver since the previous dequeued buffer.
+ */
+uint32_t OCVCapture::sequenceGap(const struct v4l2_buffer& buffer)
 {
-	if (!isOpen())
-		return false;
+	uint32_t gap = 0;
 
-	if (m_raw_image_data == NULL)
-		return false;
+	/* Some drivers do not count the frames, the sequence stays put */
+	if (m_have_sequence && buffer.sequence > m_last_sequence)
+		gap = buffer.sequence - m_last_sequence - 1;
 
-	resizeMat(yuvMat, CV_8UC3);
-
-	for (size_t rowIndex = 0; rowIndex < m_final_height; ++rowIndex) {
-		const uint8_t *getIt = m_raw_image_data + 
-			rowIndex * m_raw_bytes_per_line;
-		uint8_t *putIt = yuvMat.ptr(rowIndex);
-
-		for (size_t colIndex = 0; colIndex < m_final_width; 
-			colIndex += 2) {
-			int y1 = *getIt++;
-			int cb = *getIt++;
-			int y2 = *getIt++;
-			int cr = *getIt++;
-
-			*putIt++ = y1;
-			*putIt++ = cb;
-			*putIt++ = cr;
-			*putIt++ = y2;
-			*putIt++ = cb;
-			*putIt++ = cr;
-		}
+	m_have_sequence = true;
+	m_last_sequence = buffer.sequence;
+
+	m_capture_stats.driver_dropped += gap;
+
+	return gap;
+}
+
+/*
+ * Fills the information of a dequeued buffer and keeps the counters.
+ */
+void OCVCapture::fillFrameInfo(const struct v4l2_buffer& buffer, 
+	OCVFrameInfo& info)
+{
+	info.sequence = buffer.sequence;
+	info.timestamp_ns = buffer.timestamp.tv_sec * 1000000000ULL + 
+		buffer.timestamp.tv_usec * 1000ULL;
+	info.monotonic = ((buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == 
+		V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC);
+	info.latency_ns = -1;
+	info.bytesused = buffer.bytesused;
+	info.error = ((buffer.flags & V4L2_BUF_FLAG_ERROR) != 0);
+
+	if (info.monotonic) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		info.latency_ns = (int64_t) (now.tv_sec * 1000000000ULL + 
+			now.tv_nsec) - (int64_t) info.timestamp_ns;
 	}
 
-	return true;
+	if (info.error)
+		m_capture_stats.error_frames++;
 }
 
-bool OCVCapture::mjpeg2gray(Mat& grayMat)
+/*
+ * Counts the frames that are ready in the queue, newer than the one
+ * being delivered.
+ */
+void OCVCapture::queueAge(const struct v4l2_buffer& delivered, 
+	OCVFrameInfo& info)
 {
-	if (!isOpen())
-		return false;
+	uint64_t newest_ns = info.timestamp_ns;
 
-	if (m_raw_image_data == NULL)
-		return false;
+	for (size_t i = 0; i < m_mapped_buffer_ptrs.size(); ++i) {
+		if (i == delivered.index)
+			continue;
 
-	resizeMat(grayMat, CV_8UC1);
+		struct v4l2_buffer buffer;
+		bzero(&buffer, sizeof(buffer));
 
-	grayMat = imdecode(Mat(dataBuffer), CV_LOAD_IMAGE_GRAYSCALE);
-}
+		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buffer.memory = V4L2_MEMORY_MMAP;
+		buffer.index = i;
 
-bool OCVCapture::mjpeg2rgb(Mat& rgbMat)
-{
-	if (!isOpen())
-		return false;
+		if (retry_ioctl(VIDIOC_QUERYBUF, &buffer) == -1)
+			continue;
 
-	if (m_raw_image_data == NULL)
-		return false;
+		/* Filled by the driver, waiting to be dequeued */
+		if ((buffer.flags & V4L2_BUF_FLAG_DONE) == 0)
+			continue;
 
-	resizeMat(rgbMat, CV_8UC3);
+		uint64_t timestamp_ns = buffer.timestamp.tv_sec * 1000000000ULL + 
+			buffer.timestamp.tv_usec * 1000ULL;
 
-	rgbMat = imdecode(Mat(dataBuffer),CV_LOAD_IMAGE_COLOR);
-}
+		info.behind++;
 
-bool OCVCapture::gray(Mat& grayMat)
-{
-	switch (m_desired_pix_fmt) {
-		case V4L2_PIX_FMT_YUYV:
-			return OCVCapture::yuv2gray(grayMat);
-			break;
-		case V4L2_PIX_FMT_MJPEG:
-			return OCVCapture::mjpeg2gray(grayMat);
-			break;
-		default:
-			reportError("ERROR: Can't parse that pixel format");
-			return -1;
+		if (timestamp_ns > newest_ns)
+			newest_ns = timestamp_ns;
 	}
-}
 
-bool OCVCapture::rgb(Mat& rgbMat)
-{
-	switch (m_desired_pix_fmt){
-		case V4L2_PIX_FMT_YUYV:
-			return OCVCapture::yuv2rgb(rgbMat);
-			break;
-		case V4L2_PIX_FMT_MJPEG:
-			return OCVCapture::mjpeg2rgb(rgbMat);
-			break;
-		default:
-			reportError("Cannot parse that pixel format");
-			return -1;
-	}
+	info.behind_ns = newest_ns - info.timestamp_ns;
+
+	m_capture_stats.behind_total += info.behind;
+
+	if (info.behind > m_capture_stats.behind_max)
+		m_capture_stats.behind_max = info.behind;
+
+	if (info.behind_ns > m_capture_stats.behind_max_ns)
+		m_capture_stats.behind_max_ns = info.behind_ns;
 }
 
 void OCVCapture::closeCamera()
 {
+	/* Give the current frame back before the buffers go away */
+	closeSource();
+
 	if (m_camera_handle >= 0) {
 		/* Turn off the stream */
 		int captureType = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -724,22 +584,12 @@ void OCVCapture::closeCamera()
 			reportError("unable to stop stream");
 	}
 
-	dataBuffer.clear();
-
-	m_raw_image_size = 0;
-	m_raw_image_data = NULL;
-	m_raw_bytes_per_line = 0;
-
 	for (size_t i = 0; i < m_mapped_buffer_ptrs.size(); ++i) {
 		if (v4l2_munmap(m_mapped_buffer_ptrs[i], 
 			m_mapped_buffer_lens[i]) == -1)
 			reportError("could not unmap buffer", i);
 	}
 
-	m_final_height = 0;
-	m_final_width = 0;
-	m_final_frame_rate = 0;
-
 	m_mapped_buffer_ptrs.resize(0);
 	m_mapped_buffer_lens.resize(0);
 
@@ -0,0 +1,95 @@
+/*
+ * ReplaySource - Plays back a recording made with AVIRecorder as if it
+ * came from the camera.
+ *
+ * The file is mapped in memory and the frames are leased straight from
+ * the mapping, so replaying costs nothing but the conversions. The
+ * frames come out with the times of the .csv file next to the
+ * recording (or spaced at the frame rate of the file when there is
+ * none), paced in real time or as fast as they are grabbed. Recordings
+ * that were not closed properly (no index, headers of an empty file)
+ * are replayed up to the last complete frame.
+ */
+#ifndef REPLAYSOURCE_H
+#define REPLAYSOURCE_H
+
+#include "FrameSource.h"
+
+#include <string>
+#include <vector>
+#include <time.h>
+
+class ReplaySource : public FrameSource
+{
+  public:
+    ReplaySource(const char* path);
+    virtual ~ReplaySource();
+
+    /*
+     * Deliver the frames at the pace they were recorded (the default)
+     * or as fast as they are grabbed.
+     */
+    void setRealTime(bool realTime);
+    bool realTime() const;
+
+    /*
+     * Start again from the first frame at the end of the file, the
+     * times keep increasing. Otherwise 'grabFrame' fails at the end.
+     */
+    void setLoop(bool loop);
+    bool loop() const;
+
+    /*
+     * The size, the frame rate and the pixel format are those of the
+     * file, whatever 'configureCapture' asked for.
+     */
+    bool openCamera();
+    bool isOpen() const;
+    void closeCamera();
+
+    using FrameSource::grabFrame;
+    bool grabFrame(OCVFrameLease& lease, uint32_t& time);
+
+    uint32_t frames() const;
+
+  protected:
+    void releaseBuffer(uint32_t index, uint32_t generation);
+
+  private:
+    bool parseHeaders();
+    void parseFrames(uint32_t offset, uint32_t end);
+    void readTimes();
+
+    uint64_t dueTime(uint32_t index) const;
+
+    std::string m_path;
+    int m_file_handle;
+    const uint8_t* m_map;
+    size_t m_map_size;
+
+    bool m_real_time;
+    bool m_loop;
+
+    /*
+     * Offset and size of every frame in the file, and its time.
+     */
+    std::vector<uint32_t> m_offsets;
+    std::vector<uint32_t> m_sizes;
+    std::vector<uint32_t> m_times;
+
+    /*
+     * Next frame to deliver and times added to the recorded ones, to
+     * keep them increasing when looping.
+     */
+    uint32_t m_next;
+    uint32_t m_loops;
+    uint32_t m_loop_offset;
+
+    /*
+     * Monotonic time the first frame was delivered at, the others are
+     * due at the same distance from it as in the recording.
+     */
+    bool m_started;
+    uint64_t m_start_ns;
+};
+#endif
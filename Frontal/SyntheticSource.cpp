@@ -0,0 +1,199 @@
+#include "SyntheticSource.h"
+
+#include <iostream>
+
+#include <time.h>
+#include <linux/videodev2.h>
+
+using namespace std;
+
+static const char* messageHeader = "Synthetic: ";
+
+/* Pixels the pattern moves by from one frame to the next */
+static const uint32_t frameShift = 2;
+
+/* Y, U and V of 75% colour bars */
+static const uint8_t colourBars[8][3] = {
+	{ 180, 128, 128 }, { 162, 44, 142 }, { 131, 156, 44 },
+	{ 112, 72, 58 }, { 84, 184, 198 }, { 65, 100, 212 },
+	{ 35, 212, 114 }, { 16, 128, 128 }
+};
+
+static uint64_t monotonicNow()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+SyntheticSource::SyntheticSource()
+{
+	m_open = false;
+	m_rate_set = false;
+	m_rate = 0;
+	m_next = 0;
+	m_started = false;
+	m_start_ns = 0;
+}
+
+SyntheticSource::~SyntheticSource()
+{
+	closeCamera();
+}
+
+void SyntheticSource::setRate(uint32_t fps)
+{
+	m_rate_set = true;
+	m_rate = fps;
+}
+
+bool SyntheticSource::isOpen() const
+{
+	return m_open;
+}
+
+bool SyntheticSource::openCamera()
+{
+	if (isOpen())
+		return true;
+
+	openSource();
+
+	/* YUYV pixels go in pairs */
+	m_final_width = m_desired_width & ~1;
+	m_final_height = m_desired_height;
+	m_final_frame_rate = (m_rate_set ? m_rate : m_desired_frame_rate);
+	m_desired_pix_fmt = V4L2_PIX_FMT_YUYV;
+
+	if (m_final_width < frameShift || m_final_height == 0) {
+		reportError("ERROR: Invalid frame size");
+		closeCamera();
+		return false;
+	}
+
+	/* Each frame is a window of a pattern twice as wide */
+	m_raw_bytes_per_line = m_final_width * 4;
+
+	drawPattern();
+
+	m_next = 0;
+	m_started = false;
+	m_open = true;
+
+	if (m_verbose) {
+		cout << messageHeader << m_final_width << " x " <<
+			m_final_height << " at " << m_final_frame_rate << " fps" <<
+			endl;
+	}
+
+	return true;
+}
+
+void SyntheticSource::drawPattern()
+{
+	uint32_t width = m_final_width;
+	uint32_t barRows = m_final_height * 2 / 3;
+
+	m_pattern.resize((size_t) m_raw_bytes_per_line * m_final_height);
+
+	for (uint32_t rowIndex = 0; rowIndex < m_final_height; ++rowIndex) {
+		uint8_t* row = &m_pattern[(size_t) rowIndex * m_raw_bytes_per_line];
+
+		/* Repeats every 'width' pixels so any window is seamless */
+		for (uint32_t colIndex = 0; colIndex < 2 * width; colIndex += 2) {
+			uint32_t x = colIndex % width;
+			uint8_t* pixels = row + colIndex * 2;
+
+			if (rowIndex < barRows) {
+				const uint8_t* bar = colourBars[x * 8 / width];
+
+				pixels[0] = bar[0];
+				pixels[1] = bar[1];
+				pixels[2] = bar[0];
+				pixels[3] = bar[2];
+			}
+			else {
+				/* Luma ramp */
+				pixels[0] = 16 + x * 219 / width;
+				pixels[1] = 128;
+				pixels[2] = 16 + (x + 1) * 219 / width;
+				pixels[3] = 128;
+			}
+		}
+	}
+}
+
+/*
+ * When a frame is due, on the monotonic clock.
+ */
+uint64_t SyntheticSource::dueTime(uint32_t frame) const
+{
+	return m_start_ns + (uint64_t) frame * 1000000000ULL /
+		m_final_frame_rate;
+}
+
+bool SyntheticSource::grabFrame(OCVFrameLease& lease, uint32_t& time)
+{
+	lease.release();
+
+	if (!isOpen())
+		return false;
+
+	uint64_t now = monotonicNow();
+	uint32_t skipped = 0;
+	uint64_t timestamp_ns = now;
+
+	if (!m_started) {
+		m_started = true;
+		m_start_ns = now;
+	}
+
+	if (m_final_frame_rate > 0) {
+		/* Skip the frames a camera would have replaced already */
+		while (m_latest_frame && dueTime(m_next + 1) <= now) {
+			m_next++;
+			skipped++;
+		}
+
+		timestamp_ns = dueTime(m_next);
+
+		if (!waitUntil(timestamp_ns))
+			return false;
+	}
+
+	uint32_t frame = m_next++;
+	uint32_t shift = (uint32_t) (((uint64_t) frame * frameShift) %
+		m_final_width);
+
+	/* The window starts 'shift' pixels into the pattern */
+	const uint8_t* data = &m_pattern[shift * 2];
+	size_t size = (size_t) m_raw_bytes_per_line * (m_final_height - 1) +
+		m_final_width * 2;
+
+	OCVFrameInfo& info = leaseFrame(lease, 0, data, size);
+
+	info.sequence = frame;
+	info.timestamp_ns = timestamp_ns;
+	info.monotonic = true;
+	info.latency_ns = (int64_t) (monotonicNow() - timestamp_ns);
+	info.bytesused = size;
+	info.skipped = skipped;
+	m_capture_stats.skipped += skipped;
+
+	time = timestamp_ns / 1000000ULL;
+
+	return true;
+}
+
+void SyntheticSource::releaseBuffer(uint32_t index, uint32_t generation)
+{
+}
+
+void SyntheticSource::closeCamera()
+{
+	closeSource();
+
+	m_open = false;
+	m_pattern.clear();
+}
@@ -0,0 +1,65 @@
+/*
+ * SyntheticSource - Generates YUYV frames of a known pattern, for
+ * running and timing the processing without a camera.
+ *
+ * The pattern (colour bars over a luma ramp) is drawn once, twice as
+ * wide as the frame and repeating, and every frame is a window of it
+ * moved 2 pixels to the left of the previous one. The frames are
+ * leased from the pattern without a copy, so the generator costs
+ * nothing next to the conversions, but their rows are as far apart as
+ * in the pattern so they cannot be recorded (see getBytesPerLine). They
+ * come at the configured frame rate, or as fast as they are grabbed
+ * when the frame rate is 0.
+ */
+#ifndef SYNTHETICSOURCE_H
+#define SYNTHETICSOURCE_H
+
+#include "FrameSource.h"
+
+#include <vector>
+
+class SyntheticSource : public FrameSource
+{
+  public:
+    SyntheticSource();
+    virtual ~SyntheticSource();
+
+    /*
+     * The frame rate whatever 'configureCapture' asks for, 0 for as
+     * fast as the frames are grabbed.
+     */
+    void setRate(uint32_t fps);
+
+    /*
+     * The frames have the size and the frame rate asked for with
+     * 'configureCapture', always in YUYV.
+     */
+    bool openCamera();
+    bool isOpen() const;
+    void closeCamera();
+
+    using FrameSource::grabFrame;
+    bool grabFrame(OCVFrameLease& lease, uint32_t& time);
+
+  protected:
+    void releaseBuffer(uint32_t index, uint32_t generation);
+
+  private:
+    void drawPattern();
+
+    uint64_t dueTime(uint32_t frame) const;
+
+    std::vector<uint8_t> m_pattern;
+    bool m_open;
+
+    bool m_rate_set;
+    uint32_t m_rate;
+
+    /*
+     * Number of the next frame and monotonic time of the first one.
+     */
+    uint32_t m_next;
+    bool m_started;
+    uint64_t m_start_ns;
+};
+#endif
@@ -0,0 +1,68 @@
+/*
+ * YUYVKernels - Conversion kernels from packed YUYV (YCbCr 4:2:2)
+ * frames to gray, BGR and YCbCr images.
+ *
+ * Every kernel exists in a scalar version and, where the CPU allows,
+ * in vectorized versions (SSE2 and AVX2 on x86, NEON on ARM). All the
+ * versions use the same fixed point arithmetic so they produce exactly
+ * the same output. The best version for the running CPU is chosen at
+ * run time by 'yuyvSelectKernels'.
+ */
+#ifndef YUYVKERNELS_H
+#define YUYVKERNELS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * There seems to be multiple ways of doing YCbCr to RGB conversions
+ * due to variations in the standards. The one used is chosen at
+ * compile time, e.g. with -DYCBCR_STANDARD=YCBCR_BT601.
+ *
+ * YCBCR_JFIF allows all components to span the entire range of 0 to
+ * 255. YCBCR_BT601 and YCBCR_BT709 restrict Y to 16..235 and Cb, Cr
+ * to 16..240, so the components are scaled to bring them into range
+ * before the coefficients are applied.
+ *
+ * For details see http://www.fourcc.org/fccyvrgb.php
+ */
+#define YCBCR_JFIF 0
+#define YCBCR_BT601 1
+#define YCBCR_BT709 2
+
+#ifndef YCBCR_STANDARD
+#define YCBCR_STANDARD YCBCR_JFIF
+#endif
+
+/*
+ * Converts 'height' rows of 'width' pixels (width must be even). The
+ * strides are the number of bytes between the start of two rows.
+ */
+typedef void (*yuyv_kernel)(const uint8_t* src, size_t srcStride,
+	uint8_t* dst, size_t dstStride, uint32_t width, uint32_t height);
+
+struct YUYVKernels {
+	const char* name;
+
+	/* One byte of luma per pixel */
+	yuyv_kernel gray;
+
+	/* Three bytes per pixel in OpenCV order (blue, green, red) */
+	yuyv_kernel rgb;
+
+	/* Three bytes per pixel (Y, Cb, Cr) */
+	yuyv_kernel yuv;
+};
+
+/*
+ * Returns the fastest set of kernels supported by the running CPU.
+ */
+const YUYVKernels* yuyvSelectKernels();
+
+/*
+ * Returns the kernels with the given name ("scalar", "sse2", "avx2",
+ * "neon") or NULL if they are not supported by the running CPU.
+ */
+const YUYVKernels* yuyvKernels(const char* name);
+
+#endif
@@ -0,0 +1,510 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <linux/can/raw.h>
+
+#include "canbus.h"
+
+struct canbus_subscription {
+	canid_t id;
+	canid_t mask;
+
+	/* NULL when the entry is free */
+	canbus_handler handler;
+	void *context;
+};
+
+/* The handlers of an ID, never changed once published: a change
+ * publishes a new one and frees the old one once no batch uses it */
+struct canbus_route {
+	struct canbus_route *retired;
+	int count;
+	struct canbus_subscription entries[1];
+};
+
+struct canbus {
+	int sock;
+	int wake;
+	pthread_t thread;
+
+	/* The subscriptions, changed one at a time under the lock (never
+	 * taken by the CAN thread) */
+	pthread_mutex_t lock;
+	struct canbus_subscription subscriptions[CANBUS_SUBSCRIBERS];
+
+	/* What the CAN thread reads: the handlers of every standard ID,
+	 * and of the extended frames (all the subscriptions, to match) */
+	struct canbus_route *routes[CANBUS_IDS];
+	struct canbus_route *extended;
+
+	/* Odd while the CAN thread dispatches a batch */
+	uint32_t epoch;
+
+	/* Frames received by standard ID */
+	uint32_t hits[CANBUS_IDS];
+
+	/* Filled by the CAN thread only, with the batch read at once */
+	struct can_frame frames[CANBUS_BATCH];
+	struct iovec iov[CANBUS_BATCH];
+	struct mmsghdr messages[CANBUS_BATCH];
+	char control[CANBUS_BATCH][CMSG_SPACE(sizeof(struct timeval))];
+
+	/* Moved by the CAN thread only, but for the counters of the
+	 * senders */
+	struct canbus_stats stats;
+	uint64_t sent;
+	uint32_t send_failed;
+};
+
+/* The kernel delivers the union of the subscriptions, with the lock */
+static void update_filter(struct canbus *bus)
+{
+	struct can_filter filters[CANBUS_SUBSCRIBERS];
+	int count = 0;
+	int i, j;
+
+	for (i = 0; i < CANBUS_SUBSCRIBERS; ++i) {
+		struct canbus_subscription *sub = &bus->subscriptions[i];
+
+		if (sub->handler == NULL)
+			continue;
+
+		/* Once for the services interested in the same frames */
+		for (j = 0; j < count; ++j) {
+			if (filters[j].can_mask == sub->mask &&
+				filters[j].can_id == (sub->id & sub->mask))
+				break;
+		}
+
+		if (j < count)
+			continue;
+
+		filters[count].can_id = sub->id & sub->mask;
+		filters[count].can_mask = sub->mask;
+		count++;
+	}
+
+	/* No filter at all means no frame at all */
+	if (setsockopt(bus->sock, SOL_CAN_RAW, CAN_RAW_FILTER,
+		(count > 0 ? filters : NULL), count * sizeof(struct can_filter)) < 0)
+		perror("CAN bus");
+}
+
+static uint32_t receive_time(struct mmsghdr *message)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(&message->msg_hdr); cmsg != NULL;
+		cmsg = CMSG_NXTHDR(&message->msg_hdr, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_TIMESTAMP) {
+			struct timeval tv;
+			memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+
+			return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+		}
+	}
+
+	/* Without one, the frame is as old as it is now */
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	return now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+static int matches(const struct canbus_subscription *sub, canid_t id)
+{
+	return (sub->handler != NULL && (id & sub->mask) == (sub->id & sub->mask));
+}
+
+/* The handlers matching 'id' now, NULL if none (or out of memory) */
+static struct canbus_route *make_route(struct canbus *bus, canid_t id,
+	int all)
+{
+	struct canbus_route *route;
+	int count = 0;
+	int i;
+
+	for (i = 0; i < CANBUS_SUBSCRIBERS; ++i) {
+		if (all ? bus->subscriptions[i].handler != NULL :
+			matches(&bus->subscriptions[i], id))
+			count++;
+	}
+
+	if (count == 0)
+		return NULL;
+
+	route = (struct canbus_route *) malloc(sizeof(struct canbus_route) +
+		(count - 1) * sizeof(struct canbus_subscription));
+	if (route == NULL) {
+		perror("CAN bus");
+		return NULL;
+	}
+
+	route->retired = NULL;
+	route->count = 0;
+
+	for (i = 0; i < CANBUS_SUBSCRIBERS; ++i) {
+		if (all ? bus->subscriptions[i].handler != NULL :
+			matches(&bus->subscriptions[i], id))
+			route->entries[route->count++] = bus->subscriptions[i];
+	}
+
+	return route;
+}
+
+static void publish(struct canbus_route **slot, struct canbus_route *route,
+	struct canbus_route **retired)
+{
+	struct canbus_route *old = __atomic_exchange_n(slot, route,
+		__ATOMIC_SEQ_CST);
+
+	if (old != NULL) {
+		old->retired = *retired;
+		*retired = old;
+	}
+}
+
+/*
+ * Publish the handlers of the standard IDs 'sub' matches, with the
+ * lock. Once the batch in progress is over, the CAN thread only sees
+ * the new ones, and the old ones are freed.
+ */
+static void update_routes(struct canbus *bus,
+	const struct canbus_subscription *sub)
+{
+	struct canbus_route *retired = NULL;
+	canid_t id;
+
+	for (id = 0; id < CANBUS_IDS; ++id) {
+		if ((id & sub->mask) == (sub->id & sub->mask))
+			publish(&bus->routes[id], make_route(bus, id, 0), &retired);
+	}
+
+	publish(&bus->extended, make_route(bus, 0, 1), &retired);
+
+	/* The CAN thread reads the routes only within a batch */
+	uint32_t epoch = __atomic_load_n(&bus->epoch, __ATOMIC_SEQ_CST);
+
+	if (epoch & 1) {
+		while (__atomic_load_n(&bus->epoch, __ATOMIC_SEQ_CST) == epoch)
+			sched_yield();
+	}
+
+	while (retired != NULL) {
+		struct canbus_route *route = retired;
+
+		retired = route->retired;
+		free(route);
+	}
+}
+
+static void dispatch(struct canbus *bus, int count)
+{
+	struct canbus_stats *stats = &bus->stats;
+	uint32_t epoch = bus->epoch;
+	int i, j;
+
+	/* The routes read from now on are not freed under the handlers */
+	__atomic_store_n(&bus->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+
+	for (i = 0; i < count; ++i) {
+		struct can_frame *frame = &bus->frames[i];
+		uint32_t time_ms = receive_time(&bus->messages[i]);
+		struct canbus_route *route;
+		int matched = 0;
+
+		/* One lookup for a standard frame, whatever the subscriptions */
+		if (frame->can_id & CAN_EFF_FLAG) {
+			route = __atomic_load_n(&bus->extended, __ATOMIC_SEQ_CST);
+		}
+		else {
+			canid_t id = frame->can_id & CAN_SFF_MASK;
+
+			__atomic_store_n(&bus->hits[id], bus->hits[id] + 1,
+				__ATOMIC_RELAXED);
+			route = __atomic_load_n(&bus->routes[id], __ATOMIC_SEQ_CST);
+		}
+
+		for (j = 0; route != NULL && j < route->count; ++j) {
+			struct canbus_subscription *sub = &route->entries[j];
+
+			if (!matches(sub, frame->can_id))
+				continue;
+
+			sub->handler(frame, time_ms, sub->context);
+			matched = 1;
+		}
+
+		/* Let in by a wider filter of the kernel, or just
+		 * unsubscribed */
+		if (!matched)
+			__atomic_store_n(&stats->unmatched, stats->unmatched + 1,
+				__ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&bus->epoch, epoch + 2, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&stats->frames, stats->frames + count,
+		__ATOMIC_RELAXED);
+	__atomic_store_n(&stats->reads, stats->reads + 1, __ATOMIC_RELAXED);
+
+	if ((uint32_t) count > stats->batch_max)
+		__atomic_store_n(&stats->batch_max, count, __ATOMIC_RELAXED);
+}
+
+static void *canbus_thread(void *args)
+{
+	struct canbus *bus = (struct canbus *) args;
+	struct pollfd events[2];
+	int i;
+
+	events[0].fd = bus->sock;
+	events[0].events = POLLIN;
+	events[1].fd = bus->wake;
+	events[1].events = POLLIN;
+
+	while (1) {
+		if (poll(events, 2, -1) == -1 && errno != EINTR)
+			perror("CAN bus");
+
+		if (events[1].revents & POLLIN)
+			break;
+
+		if (!(events[0].revents & POLLIN))
+			continue;
+
+		/* The lengths are set back by every read */
+		for (i = 0; i < CANBUS_BATCH; ++i)
+			bus->messages[i].msg_hdr.msg_controllen =
+				sizeof(bus->control[i]);
+
+		/* Every frame already there in one call */
+		int count = recvmmsg(bus->sock, bus->messages, CANBUS_BATCH,
+			MSG_DONTWAIT, NULL);
+
+		if (count < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				perror("CAN bus");
+			continue;
+		}
+
+		dispatch(bus, count);
+	}
+
+	pthread_exit(NULL);
+}
+
+struct canbus *canbus_open(const char *interface)
+{
+	struct canbus *bus;
+	struct sockaddr_can addr;
+	struct ifreq ifr;
+	int on = 1;
+	int i;
+
+	bus = (struct canbus *) calloc(1, sizeof(struct canbus));
+	if (bus == NULL)
+		return NULL;
+
+	bus->sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	bus->wake = eventfd(0, EFD_NONBLOCK);
+
+	if (bus->sock < 0 || bus->wake < 0) {
+		perror("CAN bus");
+		goto failed;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, interface, IFNAMSIZ - 1);
+
+	if (ioctl(bus->sock, SIOCGIFINDEX, &ifr) < 0) {
+		fprintf(stderr, "CAN bus: ERROR: No interface %s: %s\n",
+			interface, strerror(errno));
+		goto failed;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+
+	/* Nothing comes in before a service subscribes */
+	if (setsockopt(bus->sock, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0) < 0 ||
+		bind(bus->sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("CAN bus");
+		goto failed;
+	}
+
+	/* The receive time of every frame comes with it, rather than from
+	 * an ioctl per frame */
+	if (setsockopt(bus->sock, SOL_SOCKET, SO_TIMESTAMP, &on,
+		sizeof(on)) < 0)
+		perror("CAN bus");
+
+	for (i = 0; i < CANBUS_BATCH; ++i) {
+		bus->iov[i].iov_base = &bus->frames[i];
+		bus->iov[i].iov_len = sizeof(struct can_frame);
+		bus->messages[i].msg_hdr.msg_iov = &bus->iov[i];
+		bus->messages[i].msg_hdr.msg_iovlen = 1;
+		bus->messages[i].msg_hdr.msg_control = bus->control[i];
+	}
+
+	pthread_mutex_init(&bus->lock, NULL);
+
+	if (pthread_create(&bus->thread, NULL, canbus_thread, bus) != 0) {
+		pthread_mutex_destroy(&bus->lock);
+		goto failed;
+	}
+
+	return bus;
+
+failed:
+	if (bus->sock >= 0)
+		close(bus->sock);
+
+	if (bus->wake >= 0)
+		close(bus->wake);
+
+	free(bus);
+	return NULL;
+}
+
+void canbus_close(struct canbus *bus, struct canbus_stats *stats)
+{
+	uint64_t one = 1;
+	int i;
+
+	if (bus == NULL)
+		return;
+
+	if (write(bus->wake, &one, sizeof(one)) != sizeof(one))
+		perror("CAN bus");
+
+	pthread_join(bus->thread, NULL);
+
+	if (stats != NULL)
+		canbus_get_stats(bus, stats);
+
+	/* Nothing dispatches anymore */
+	for (i = 0; i < CANBUS_IDS; ++i)
+		free(bus->routes[i]);
+
+	free(bus->extended);
+
+	pthread_mutex_destroy(&bus->lock);
+	close(bus->sock);
+	close(bus->wake);
+	free(bus);
+}
+
+int canbus_subscribe(struct canbus *bus, canid_t id, canid_t mask,
+	canbus_handler handler, void *context)
+{
+	int i;
+
+	if (bus == NULL || handler == NULL)
+		return -1;
+
+	pthread_mutex_lock(&bus->lock);
+
+	for (i = 0; i < CANBUS_SUBSCRIBERS; ++i) {
+		struct canbus_subscription *sub = &bus->subscriptions[i];
+
+		if (sub->handler != NULL)
+			continue;
+
+		sub->id = id;
+		sub->mask = mask;
+		sub->handler = handler;
+		sub->context = context;
+
+		update_filter(bus);
+		update_routes(bus, sub);
+		pthread_mutex_unlock(&bus->lock);
+
+		return i;
+	}
+
+	pthread_mutex_unlock(&bus->lock);
+
+	fprintf(stderr, "CAN bus: ERROR: No room to subscribe to 0x%03x\n",
+		id);
+
+	return -1;
+}
+
+void canbus_unsubscribe(struct canbus *bus, int subscription)
+{
+	if (bus == NULL || subscription < 0 ||
+		subscription >= CANBUS_SUBSCRIBERS)
+		return;
+
+	pthread_mutex_lock(&bus->lock);
+
+	struct canbus_subscription *sub = &bus->subscriptions[subscription];
+
+	sub->handler = NULL;
+	update_filter(bus);
+
+	/* Not called anymore once the batch in progress is over */
+	update_routes(bus, sub);
+
+	pthread_mutex_unlock(&bus->lock);
+}
+
+int canbus_send(struct canbus *bus, canid_t id, const uint8_t *data,
+	int length)
+{
+	struct can_frame frame;
+
+	if (bus == NULL || length < 0 || length > 8)
+		return -1;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.can_id = id;
+	frame.can_dlc = length;
+
+	if (length > 0)
+		memcpy(frame.data, data, length);
+
+	/* A frame is written whole, whatever the other senders do */
+	if (write(bus->sock, &frame, sizeof(frame)) != sizeof(frame)) {
+		__sync_fetch_and_add(&bus->send_failed, 1);
+		return -1;
+	}
+
+	__sync_fetch_and_add(&bus->sent, 1);
+
+	return 0;
+}
+
+void canbus_get_stats(struct canbus *bus, struct canbus_stats *stats)
+{
+	stats->frames = __atomic_load_n(&bus->stats.frames, __ATOMIC_RELAXED);
+	stats->reads = __atomic_load_n(&bus->stats.reads, __ATOMIC_RELAXED);
+	stats->batch_max = __atomic_load_n(&bus->stats.batch_max,
+		__ATOMIC_RELAXED);
+	stats->unmatched = __atomic_load_n(&bus->stats.unmatched,
+		__ATOMIC_RELAXED);
+
+	stats->sent = __sync_fetch_and_add(&bus->sent, 0);
+	stats->send_failed = __sync_fetch_and_add(&bus->send_failed, 0);
+}
+
+uint32_t canbus_get_hits(struct canbus *bus, canid_t id)
+{
+	if (id >= CANBUS_IDS)
+		return 0;
+
+	return __atomic_load_n(&bus->hits[id], __ATOMIC_RELAXED);
+}
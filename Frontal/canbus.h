@@ -0,0 +1,75 @@
+#ifndef CANBUS_H
+#define CANBUS_H
+
+#include <stdint.h>
+#include <linux/can.h>
+
+/*
+ * The one CAN socket of the board, shared by every service. A single
+ * thread waits on it, reads the frames in batches (recvmmsg, with the
+ * kernel receive time of each) and hands each frame to the services
+ * that subscribed to its ID. The kernel filter of the socket is the
+ * union of the subscriptions, so the frames nobody wants never wake the
+ * thread up. The services send through the same socket.
+ *
+ * The thread finds the handlers of a frame in a table indexed by its
+ * standard ID, without a lock and whatever the number of subscriptions;
+ * subscribing or unsubscribing rebuilds the entries of the IDs it
+ * matches and waits for the batch in progress.
+ *
+ * The handlers run on the CAN thread one after the other and must not
+ * block; they must not subscribe or unsubscribe either. Once
+ * canbus_unsubscribe returns the handler is not running and is not
+ * called again.
+ */
+struct canbus;
+
+#define CANBUS_SUBSCRIBERS 16
+#define CANBUS_BATCH 16
+
+/* Standard (11 bit) IDs */
+#define CANBUS_IDS 2048
+
+/* A frame received, 'time_ms' from the kernel receive time */
+typedef void (*canbus_handler)(const struct can_frame *frame,
+	uint32_t time_ms, void *context);
+
+struct canbus_stats {
+	/* Frames received, reads that returned them and most frames in a
+	 * read, frames that matched no subscription */
+	uint64_t frames;
+	uint64_t reads;
+	uint32_t batch_max;
+	uint64_t unmatched;
+
+	/* Frames sent, and that could not be */
+	uint64_t sent;
+	uint32_t send_failed;
+};
+
+/* Bind a socket to 'interface' (e.g. "can0") receiving nothing until a
+ * service subscribes, NULL if it cannot be opened */
+struct canbus *canbus_open(const char *interface);
+
+/* Stops the CAN thread and closes the socket, the final counters go to
+ * 'stats' if not NULL */
+void canbus_close(struct canbus *bus, struct canbus_stats *stats);
+
+/* Call 'handler' for the frames whose ID matches 'id' on the bits of
+ * 'mask' (CAN_SFF_MASK for just that ID). Returns the subscription, or
+ * -1 if there is no room or 'bus' is NULL */
+int canbus_subscribe(struct canbus *bus, canid_t id, canid_t mask,
+	canbus_handler handler, void *context);
+void canbus_unsubscribe(struct canbus *bus, int subscription);
+
+/* Send a frame of 'length' bytes (up to 8), from any thread. Returns
+ * -1 if it is not sent */
+int canbus_send(struct canbus *bus, canid_t id, const uint8_t *data,
+	int length);
+
+void canbus_get_stats(struct canbus *bus, struct canbus_stats *stats);
+
+/* Frames received with the standard ID 'id', subscribed or not */
+uint32_t canbus_get_hits(struct canbus *bus, canid_t id);
+
+#endif
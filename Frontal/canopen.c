@@ -4,19 +4,15 @@
 #include <unistd.h>
 #include <stdio.h>
 
-#include <net/if.h>
-#include <sys/ioctl.h>
-
-#include "can.h" 
+#include <linux/can.h>
+#include "canbus.h"
 #include "canbus_ids.h" 
-#include <sys/mman.h>
+#include "canopen.h"
 
 #include "MotorsServiceClient.h"
 
 //#define VERB
 
-#define PRIO 98              /* Priority of the receiving thread  */
-
 __u8 * PDO0[128] = {NULL};   /* Memory reserved for TX PDO1 */
 __u8 * PDO1[128] = {NULL};   /* Memory reserved for TX PDO2 */
 __u8 * PDO2[128] = {NULL};   /* Memory reserved for TX PDO3 */
@@ -25,15 +21,92 @@ __u8 lastSDOack[8];          /* When init_flag is set this array */
                              /* contains the las received message */
 static int init_flag = 0;
 static int dev_cnt = 0;      /* CAN devices counter */
-static volatile int endrcv = 0;
-static pthread_t  rt_rcv;
-static int s;                 /* can raw socket  */
+static struct canbus *bus;   /* shared can socket */
+static int subscriptions[4];  /* frames handed to rcv */
+
+/* What to do with a frame, by its standard ID. The receiving handler
+ * only loads the pointer of the ID (the same cost whatever the number
+ * of services), a route is never changed once published: registering
+ * publishes a new one and retires the old one, which is freed once no
+ * frame can be received anymore (canClose). The routes are changed
+ * under routes_lock, never taken by the receiving handler. */
+struct canopen_route {
+  canopen_handler handler;
+  void *context;
+  struct canopen_route *retired;
+};
+
+static struct canopen_route *routes[CANOPEN_IDS];
+static unsigned int hits[CANOPEN_IDS];  /* frames received by ID */
+static struct canopen_route *retired;
+static pthread_mutex_t routes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void replace_route(int id, struct canopen_route *route)
+{
+  struct canopen_route *old;
+
+  pthread_mutex_lock(&routes_lock);
+
+  old = __atomic_exchange_n(&routes[id], route, __ATOMIC_ACQ_REL);
+
+  /* The receiving handler may still be using it */
+  if (old != NULL) {
+    old->retired = retired;
+    retired = old;
+  }
+
+  pthread_mutex_unlock(&routes_lock);
+}
+
+int canopen_register(int id, canopen_handler handler, void *context)
+{
+  struct canopen_route *route;
+
+  if ((id < 0) || (id >= CANOPEN_IDS) || (handler == NULL))
+    return -1;
+
+  route = (struct canopen_route*) malloc(sizeof(struct canopen_route));
+  if (route == NULL)
+    return -1;
+
+  route->handler = handler;
+  route->context = context;
+  route->retired = NULL;
+
+  replace_route(id, route);
+  return 0;
+}
+
+void canopen_unregister(int id)
+{
+  if ((id >= 0) && (id < CANOPEN_IDS))
+    replace_route(id, NULL);
+}
+
+unsigned int canopen_hits(int id)
+{
+  if ((id < 0) || (id >= CANOPEN_IDS))
+    return 0;
+
+  return __atomic_load_n(&hits[id], __ATOMIC_RELAXED);
+}
+
+static void motors_reply(const struct can_frame *m, void *context)
+{
+#ifdef DEBUG_L3
+    printf("CANbus message received for MotorsServiceClient");
+#endif
+    MotorsServiceClienthandle((__u8*) m->data, m->can_dlc, 
+      m->can_id - CAN_SENDFROM);
+}
 
 //static int sonar_service_client = 0;
-static int motors_service_client = 0;
 
 int activateMotorsServiceClient(){
-  motors_service_client = 1;
+  /* The replies of the Motors service and of the two drivers */
+  canopen_register(CAN_SENDFROM + CAN_ID_Motors, motors_reply, NULL);
+  canopen_register(CAN_SENDFROM + CAN_ID_MotorLeft, motors_reply, NULL);
+  canopen_register(CAN_SENDFROM + CAN_ID_MotorRight, motors_reply, NULL);
   
   return 0;
 }
@@ -63,117 +136,72 @@ __u8 * get_PDO(int PDOn,int id)
 void sendMsg(__u32 ID, __u8 DATA[], int len)
 {
   /* Procedure to send a CAN message */
-  struct can_frame Tmsg;
-  int nbytes;
   int i, errno;
 
-  Tmsg.can_id = ID;
-  Tmsg.can_dlc = len;
-
-  for(i=0;i<len;i++) Tmsg.data[i] = DATA[i];
-
 #ifdef VERB
-    printf("--> 0x%03x  %d   ",Tmsg.can_id,Tmsg.can_dlc);
-    for(i=0;i<Tmsg.can_dlc;i++) printf("0x%02x  ",Tmsg.data[i]);
+    printf("--> 0x%03x  %d   ",ID,len);
+    for(i=0;i<len;i++) printf("0x%02x  ",DATA[i]);
     printf("\n");    
 #endif
 
-    if ((nbytes = write(s, &Tmsg, sizeof(Tmsg))) != sizeof(Tmsg)) {
+    if (canbus_send(bus, ID, DATA, len) < 0) {
       errno = -1;
       printf("Error sending message through CANbus!!!\n");
     }
 }
 
-void *rcv(void *args)
+static void store_pdo(const struct can_frame *m, void *context)
 {
-  /* Receiving thread */
-
-  struct can_frame m;
-  int nbytes;
-  int i, errno;
-
-  int id, PDOn;
-  __u8 * data;
-  struct sched_param param;
-
-  param.sched_priority = PRIO;
-  if(sched_setscheduler(0, SCHED_FIFO, &param)==-1){
-    perror("sched_setscheduler failed");
-    exit(-1);
-  }
-
-  mlockall(MCL_CURRENT | MCL_FUTURE);
+  /* Store PDO messages  */
+  memcpy((__u8*) context,m->data,m->can_dlc);
+}
 
-  while (!endrcv) {       /* receiving loop */
-    if ((nbytes = read(s, &m, sizeof(m))) < 0) {
-      errno = -1;
-    }
+static void rcv(const struct can_frame *m, uint32_t time_ms, void *args)
+{
+  /* Receiving handler, on the CAN thread */
 
+  struct canopen_route *route;
+  int id;
 #ifdef VERB
-    printf("<-- 0x%03x  %d   ",m.can_id,m.can_dlc);
-    for(i=0;i<m.can_dlc;i++) printf("0x%02x  ",m.data[i]);
-    printf("\n");    
+  int i;
 #endif
 
-int id_message_sendfrom = m.can_id - CAN_SENDFROM;
-//int id_message_sendto = m.can_id - CAN_SENDTO;
-
-if( ( (id_message_sendfrom == CAN_ID_Motors) || 
-	(id_message_sendfrom == CAN_ID_MotorLeft) || 
-	(id_message_sendfrom == CAN_ID_MotorRight) ) && 
-	(motors_service_client)) {
-#ifdef DEBUG_L3
-    printf("CANbus message received for MotorsServiceClient");
+#ifdef VERB
+    printf("<-- 0x%03x  %d   ",m->can_id,m->can_dlc);
+    for(i=0;i<m->can_dlc;i++) printf("0x%02x  ",m->data[i]);
+    printf("\n");    
 #endif
-    MotorsServiceClienthandle(m.data, m.can_dlc, id_message_sendfrom);
-}
 
-    /* Store PDO messages  */
-    if(m.can_id==0x7FF) m.can_id=0x3FF;
+    /* One lookup by ID, only this thread counts the frames */
+    if(!(m->can_id & CAN_EFF_FLAG)){
+      id = m->can_id & CAN_SFF_MASK;
+      __atomic_store_n(&hits[id], hits[id] + 1, __ATOMIC_RELAXED);
 
-    if((m.can_id>=0x180) && (m.can_id<=0x3FF)){    
-      PDOn = (m.can_id >> 8) & 0x0F;
-      id   = (m.can_id & 0xFF) - 0x80;
-
-      data = get_PDO(PDOn,id);
-      if (data!=NULL) memcpy(data,m.data,m.can_dlc);
+      route = __atomic_load_n(&routes[id], __ATOMIC_ACQUIRE);
+      if (route!=NULL) route->handler(m, route->context);
     }
+
     if(init_flag){
-      memcpy(lastSDOack,m.data,m.can_dlc);
+      memcpy(lastSDOack,m->data,m->can_dlc);
     }
-  }
-  return 0;
 }
 
-int canOpen()
+int canOpen(struct canbus *canbus)
 {
   /* CAN initialization */
-  struct sockaddr_can addr;
-  struct ifreq ifr;
-
-#ifdef VERB
-#endif
 
   if(!dev_cnt){  /* This task is performed only one time */
 
-    /* open socket */
-    if ((s = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+    if (canbus == NULL)
       return -1;
-    }
 
-    strcpy(ifr.ifr_name, "can0");
-    ioctl(s, SIOCGIFINDEX, &ifr);
+    bus = canbus;
 
-    addr.can_family = AF_CAN;
-    addr.can_ifindex = ifr.ifr_ifindex;
-
-    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-      perror("bind");
-      return 1;
-    }
-
-	/* Start receiving task */
-    pthread_create(&rt_rcv, NULL, rcv, NULL);  
+    /* The PDOs (0x180 to 0x3FF, and 0x7FF) and the SDO replies */
+    subscriptions[0] = canbus_subscribe(bus, 0x180, 0x780, rcv, NULL);
+    subscriptions[1] = canbus_subscribe(bus, 0x200, 0x600, rcv, NULL);
+    subscriptions[2] = canbus_subscribe(bus, 0x7FF, CAN_SFF_MASK, rcv, NULL);
+    subscriptions[3] = canbus_subscribe(bus, CAN_SENDFROM, 0x780, rcv, NULL);
   }
   dev_cnt++;
   printf("Init CAN end\n");
@@ -198,7 +226,15 @@ int register_pdo(int id, int PDOn)
   case 3:
     PDO2[id] = data;
     break;
+  default:
+    return(0);
   }
+
+  /* TX PDOn of node id is received on 0x80 + (PDOn << 8) + id, and
+   * the last one of PDO3 on 0x7FF too */
+  canopen_register(0x80 + (PDOn << 8) + id, store_pdo, data);
+  if((PDOn==3) && (id==0x7F)) canopen_register(0x7FF, store_pdo, data);
+
   return(0);
 }
 
@@ -209,9 +245,20 @@ void canopen_synch()
 
 void canClose()
 {
+  struct canopen_route *route;
+  int i;
+
   if(--dev_cnt == 0) {
-    endrcv = 1;
-    close(s);
+    for(i=0;i<4;i++) canbus_unsubscribe(bus, subscriptions[i]);
+
+    /* No frame is received anymore, nobody uses the retired routes */
+    pthread_mutex_lock(&routes_lock);
+    while(retired!=NULL){
+      route = retired;
+      retired = route->retired;
+      free(route);
+    }
+    pthread_mutex_unlock(&routes_lock);
 #ifdef VERB
 #endif
 
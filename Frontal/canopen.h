@@ -1,8 +1,18 @@
 #include <linux/types.h>
 
+struct canbus;
+struct can_frame;
+
+/* Standard CAN IDs, the size of the dispatch table */
+#define CANOPEN_IDS 2048
+
+/* Called on the CAN thread for every frame of the ID it is registered
+ * for, it must not block */
+typedef void (*canopen_handler)(const struct can_frame *m, void *context);
+
 void set_init_flag(int v);
 void sendMsg(__u32 ID, __u8 DATA[], int len);
-int canOpen(void);
+int canOpen(struct canbus *canbus);
 int register_pdo(int id, int PDOn);
 
 int get_1b_signed_val(int id, int PDOn, int pos);
@@ -14,5 +24,14 @@ unsigned int get_4b_unsigned_val(int id, int PDOn, int pos);
 void canopen_synch(void);
 void canClose();
 
+/* Route the frames of 'id' (standard) to 'handler' instead of its
+ * previous one, at any time and from any thread. Returns -1 if 'id' is
+ * not a standard ID */
+int canopen_register(int id, canopen_handler handler, void *context);
+void canopen_unregister(int id);
+
+/* Frames received with 'id' so far, routed or not */
+unsigned int canopen_hits(int id);
+
 int activateSonarServiceClient();
 int activateMotorsServiceClient();
\ No newline at end of file
@@ -1,7 +1,11 @@
 void *encoder(void *args);
 
+struct telemetry;
+struct canbus;
+
 struct encoder_th_params {
 	int file_index;
+	struct telemetry *telemetry;
 	int period_ms;
-	const char* can_interface;
+	struct canbus *canbus;
 };
@@ -0,0 +1,121 @@
+/*
+ * framearchive - Lists the frames of a frame archive (.tfa) as a .csv
+ * file, or extracts them as images, e.g.
+ *   framearchive frames/frames1.tfa > frames1.csv
+ *   framearchive frames/frames1.tfa frames/extracted [first [last]]
+ * The JPEG frames are written as they are (.jpg), the raw ones are
+ * converted (.png).
+ */
+#include "FrameArchive.h"
+
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace cv;
+
+static bool extract(const FrameArchiveReader& archive, uint32_t index,
+	const char* directory)
+{
+	FrameRecord record;
+	char path[256];
+
+	if (!archive.frame(index, record))
+		return false;
+
+	/* Compressed frames are kept as they were captured */
+	if (strcmp(record.format, "JPEG") == 0 ||
+		strcmp(record.format, "MJPG") == 0) {
+		snprintf(path, sizeof(path), "%s/frame%06u.jpg", directory,
+			record.sequence);
+
+		FILE* file = fopen(path, "wb");
+
+		if (file == NULL) {
+			perror(path);
+			return false;
+		}
+
+		bool written = (fwrite(record.data, 1, record.size, file) ==
+			record.size);
+
+		if (fclose(file) != 0 || !written) {
+			perror(path);
+			return false;
+		}
+
+		return true;
+	}
+
+	Mat image, converted;
+
+	if (!archive.image(index, image))
+		return false;
+
+	if (strcmp(record.format, "YUYV") == 0) {
+		cvtColor(image, converted, CV_YUV2BGR_YUYV);
+		image = converted;
+	}
+
+	snprintf(path, sizeof(path), "%s/frame%06u.png", directory,
+		record.sequence);
+
+	return imwrite(path, image);
+}
+
+int main(int argc, char** argv)
+{
+	FrameArchiveReader archive;
+	FrameRecord record;
+	unsigned int damaged = 0;
+
+	if (argc < 2 || argc > 5) {
+		fprintf(stderr, "Usage: %s <file.tfa> [<directory> [first "
+			"[last]]]\n", argv[0]);
+		return 2;
+	}
+
+	if (!archive.open(argv[1])) {
+		fprintf(stderr, "%s: not a frame archive\n", argv[1]);
+		return 1;
+	}
+
+	uint32_t frames = archive.frames();
+	uint32_t first = (argc > 3 ? strtoul(argv[3], NULL, 10) : 0);
+	uint32_t last = (argc > 4 ? strtoul(argv[4], NULL, 10) :
+		(frames > 0 ? frames - 1 : 0));
+
+	if (argc == 2)
+		printf("index,sequence,time,capture_ns,format,width,height,size\n");
+
+	for (uint32_t index = first; index <= last && index < frames; ++index) {
+		if (argc > 2) {
+			if (!extract(archive, index, argv[2]))
+				damaged++;
+			continue;
+		}
+
+		if (!archive.frame(index, record)) {
+			damaged++;
+			continue;
+		}
+
+		printf("%u,%u,%u,%llu,%s,%u,%u,%lu\n", index, record.sequence,
+			record.time, (unsigned long long) record.capture_ns,
+			record.format, record.width, record.height,
+			(unsigned long) record.size);
+	}
+
+	/* Recovered: never closed, read up to the last complete frame */
+	fprintf(stderr, "%s: %u frames%s\n", argv[1], frames,
+		(archive.complete() ? "" : ", recovered without the index"));
+
+	if (damaged > 0)
+		fprintf(stderr, "%s: %u frames damaged or not extracted\n",
+			argv[1], damaged);
+
+	return (damaged > 0 ? 1 : 0);
+}
@@ -0,0 +1,107 @@
+/*
+ * framebus_view - Follows the frames published on the frame bus by the
+ * capture, from another process: prints every second the frames seen
+ * and missed, their age and the mean level of the newest one, and
+ * saves it if asked, e.g.
+ *   framebus_view /tartufino_frames frames/latest.png
+ */
+#include "FrameBus.h"
+
+#include <opencv2/highgui/highgui.hpp>
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace cv;
+
+static uint64_t monotonicNow()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int main(int argc, char** argv)
+{
+	const char* name = (argc > 1 ? argv[1] : "/tartufino_frames");
+	const char* image_path = (argc > 2 ? argv[2] : NULL);
+
+	FrameBus bus;
+	FrameBusFrame frame;
+	uint64_t last = 0;
+
+	uint32_t seen = 0, missed = 0, torn = 0;
+	uint64_t age_total_us = 0, age_max_us = 0;
+	double brightness = 0;
+	bool save = (image_path != NULL);
+	uint64_t report_ns = monotonicNow() + 1000000000ULL;
+
+	while (true) {
+		/* Wait for the capture, or follow it when it starts again */
+		if (bus.closed()) {
+			if (!bus.open(name)) {
+				sleep(1);
+				continue;
+			}
+
+			printf("%s: following the frames\n", name);
+			last = 0;
+		}
+
+		if (bus.latest(frame, last)) {
+			/* Used in place, the shared memory is read-only */
+			Scalar level = mean(frame.image);
+			Mat saved;
+
+			if (save)
+				saved = frame.image.clone();
+
+			if (!bus.valid(frame)) {
+				/* Overwritten while read, too slow for the capture */
+				torn++;
+				continue;
+			}
+
+			if (last > 0)
+				missed += frame.sequence - last - 1;
+
+			last = frame.sequence;
+			seen++;
+
+			uint64_t age_us = (frame.capture_ns > 0 ?
+				(monotonicNow() - frame.capture_ns) / 1000 : 0);
+			age_total_us += age_us;
+
+			if (age_us > age_max_us)
+				age_max_us = age_us;
+
+			brightness = level[0];
+
+			/* The newest frame once a second */
+			if (!saved.empty()) {
+				imwrite(image_path, saved);
+				save = false;
+			}
+		}
+		else
+			usleep(1000);
+
+		if (monotonicNow() < report_ns)
+			continue;
+
+		printf("%s: %u frames, %u missed, %u overwritten while read, "
+			"%.1f ms old on average (max %.1f ms), level %.0f\n", name,
+			seen, missed, torn,
+			(seen > 0 ? age_total_us / 1000.0 / seen : 0.0),
+			age_max_us / 1000.0, brightness);
+
+		seen = missed = torn = 0;
+		save = (image_path != NULL);
+		age_total_us = age_max_us = 0;
+		report_ns = monotonicNow() + 1000000000ULL;
+	}
+
+	return 0;
+}
@@ -1,13 +1,16 @@
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
 #include <time.h>
 #include <stdint.h>
 #include <linux/can.h>
-#include <linux/can/raw.h>
 #include <pthread.h>
 
 #include "periodic.h"
@@ -16,48 +19,79 @@
 #include "encoder.h"
 #include "LocalCapture.h"
 #include "MotorsServiceClient.h"
+#include "canbus.h"
+#include "canbus_ids.h"
+#include "storage.h"
+#include "telemetry.h"
 
 #define V 0.3 /* Initial speed for the robot (m/s) */
 #define step_speed 0.02 /* Step to increase/decrease the speed */
 #define r 0.0475 /* Radius of the wheels */
 #define L 0.275 /* Base wheel of the robot*/
 
-/* Variables to identify the socket */
-static int sock_can;
+/* Buffers shared by the log files and the frame archive, written in the
+ * background so the capture, the processing and the encoder never wait
+ * for the SD card */
+#define STORAGE_BUFFERS 64
+#define STORAGE_BUFFER_SIZE 65536
+
+/* The CAN socket, shared by all the services */
+static struct canbus *canbus;
 static const char* can_interface = "can0";
 
-/* Variables to identify the threads */
-pthread_t capture_th, process_th, receive_th;
+/* The recordings asked on the CAN bus, started by the commands thread
+ * as the CAN thread must not wait for the recorder */
+static pthread_t commands_th;
+static int commands_fd = -1;
+static int commands_stop = 0;
+
+static void *commands(void *args)
+{
+	struct pollfd event;
+	uint64_t count;
+
+	event.fd = commands_fd;
+	event.events = POLLIN;
+
+	while (1) {
+		if (poll(&event, 1, -1) == -1 && errno != EINTR)
+			perror("Commands");
+
+		/* Asked once or more since the last time */
+		if (read(commands_fd, &count, sizeof(count)) != sizeof(count))
+			continue;
+
+		if (__sync_fetch_and_add(&commands_stop, 0))
+			break;
+
+		triggerRecording("CAN command");
+	}
+
+	pthread_exit(NULL);
+}
 
 static void enableCommunication()
 {
 	/* Open CAN socket */
-	struct sockaddr_can addr;
-	struct ifreq ifr;
-	
-	if ((sock_can = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
-		perror("socket");
-		return;
-	}
-	
-	strcpy(ifr.ifr_name, can_interface);
-	ioctl(sock_can, SIOCGIFINDEX, &ifr);
-	addr.can_family = AF_CAN;
-	addr.can_ifindex = ifr.ifr_ifindex;
-	
-	if (bind(sock_can, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-		perror("bind");
+	canbus = canbus_open(can_interface);
+
+	if (canbus == NULL)
 		return;
-	}
 
-	/* Filter the can messages */
-	//struct can_filter rfilter;
-	//rfilter.can_id   = 0x584;
-	//rfilter.can_mask = CAN_SFF_MASK;
+	commands_fd = eventfd(0, EFD_NONBLOCK);
 
-	//setsockopt(sock_can, SOL_CAN_RAW, CAN_RAW_FILTER, &rfilter, sizeof(rfilter));
-	
-	pthread_create(&receive_th, NULL, receive_info, NULL);  
+	if (commands_fd < 0 || 
+		pthread_create(&commands_th, NULL, commands, NULL) != 0) {
+		perror("Commands");
+
+		if (commands_fd >= 0)
+			close(commands_fd);
+		commands_fd = -1;
+	}
+
+	/* The messages of the other boards for this one */
+	canbus_subscribe(canbus, CAN_SENDTO + CAN_ID_HighController, 
+		CAN_SFF_MASK, receive_info, NULL);
 	
 	return;
 }
@@ -82,44 +116,34 @@ void sendCommand(char cmd)
 	else if (cmd == 'e')
 		frame[2] = 0x33;
 
-	struct can_frame Tmsg;
-	Tmsg.can_id = 0x604;
-	Tmsg.can_dlc = 8;
-	int nbytes, i;
-	for (i = 0; i < Tmsg.can_dlc; i++) Tmsg.data[i] = frame[i];
-	
-	if ((nbytes = write(sock_can, &Tmsg, sizeof(Tmsg))) != sizeof(Tmsg)) {
+	if (canbus_send(canbus, 0x604, frame, 8) < 0) {
 		printf("Error sending message through CANbus!!!\n");
 	}
 }
 
-void *receive_info(void *args)
+/* On the CAN thread, for every message to this board */
+void receive_info(const struct can_frame *m, uint32_t time_ms, void *context)
 {
-	struct can_frame m;
-	int nbytes;
-
-	while (1) {
+	if (m->data[0] == 0x93) {
+		int width = m->data[1] + (m->data[2] << 8) + (m->data[3] << 16);
+		int height = m->data[4] + (m->data[5] << 8) + (m->data[6] << 16);
+		int fps = m->data[7];
 
-		/* Read next message */
-		if ((nbytes = read(sock_can, &m, sizeof(m))) < 0) {
-			printf("Error sending message through CANbus!!!\n");
-		}
+		/* Information about the remote capture parameters */
+		printf("Remote Camera: Enabled (%dx%d - %d fps)\n", width, 
+			height, fps);
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-		if (m.data[0] == 0x93) {
-			int width = m.data[1] + (m.data[2] << 8) + (m.data[3] << 16);
-			int height = m.data[4] + (m.data[5] << 8) + (m.data[6] << 16);
-			int fps = m.data[7];
+	}
 
-			/* Information about the remote capture parameters */
-			printf("Remote Camera: Enabled (%dx%d - %d fps)\n", width, 
-				height, fps);
+	/* Another board asks to record what the local camera sees, the
+	 * commands thread starts the recording */
+	if ((m->data[0] == 0x91) && (m->data[1] == 0x92) && 
+		(m->data[2] == 0x77) && (commands_fd >= 0)) {
+		uint64_t one = 1;
 
-		}
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		if (write(commands_fd, &one, sizeof(one)) != sizeof(one))
+			perror("Commands");
 	}
-
-	pthread_exit(NULL);
 }
 
 int main()
@@ -138,25 +162,36 @@ int main()
 	/* Start capturing the frames from the remote camera */
 	sendCommand('c');
 
+	/* The log files of the capture and of the encoder, binary records
+	 * drained to the storage, and the saved frames */
+	struct storage *storage = storage_create(STORAGE_BUFFERS, 
+		STORAGE_BUFFER_SIZE, STORAGE_AUTO);
+	struct telemetry *telemetry = telemetry_create(storage);
+
+	if (telemetry == NULL)
+		printf("Storage:       ERROR: No log files\n");
+	else
+		printf("Storage:       Enabled (%s)\n", storage_backend(storage));
+
 	/* Start capturing the frames from the local camera */
-	pthread_create(&capture_th, NULL, capture_frames, NULL);
+	startCapture(storage, telemetry);
 	
 	/* Encoder service settings */
 	pthread_t encoder_th;
 	int encoder_active = 0;
 	int index_encoder_file = 0;
 	struct encoder_th_params enc_params;
+	enc_params.telemetry = telemetry;
 
 	/* Image processing service settings */
 	int processing_active = 0;
 	int index_video_file = 0;
-	struct video_th_params proc_params;
 
 	sleep(8);
 	
 	/* Enable the Motors */
 	/* TODO: rethink the interface */
-	MotorsServiceClient();
+	MotorsServiceClient(canbus);
 
 	/* Enable the Telecommand Piloting */
 	enterInputMode();
@@ -176,8 +211,8 @@ int main()
 			if (!processing_active) {
 				processing_active = 1;
 				index_video_file++;
-				proc_params.file_index = index_video_file;
-				pthread_create(&process_th, NULL, process_frames, &proc_params);
+				startProcessing(index_video_file);
+				startRecording(index_video_file);
 			}
 			
 			/* Start obtaining the readings from the encoder */
@@ -186,7 +221,7 @@ int main()
 				index_encoder_file++;
 				enc_params.file_index = index_encoder_file;
 				enc_params.period_ms = 10;
-				enc_params.can_interface = can_interface;			
+				enc_params.canbus = canbus;
 				pthread_create(&encoder_th, NULL, encoder, &enc_params);
 			}
 			
@@ -199,6 +234,10 @@ int main()
 			//printf("Start\n");
 		}
 
+		/* Record what the local camera sees around now (r) */
+		if (c == 114)
+			triggerRecording("operator");
+
 		/* Finish piloting the robot */
 		if (c == 101) {
 			
@@ -207,19 +246,9 @@ int main()
 			printf("Remote Camera: Disabled\n");
 
 			/* Stop capturing & processing the frames from the local camera */
-			if (processing_active) //{
-				//processing_active = 0;
-				pthread_cancel(process_th);
-			pthread_cancel(capture_th);
-				
-			if (processing_active)
-				pthread_join(process_th, NULL);
-			pthread_join(capture_th, NULL);
-
-			if (processing_active)
-				pauseProcessing();
+			pauseProcessing();
+			stopRecording();
 			stopCapture();
-			//}
 			
 			processing_active = 0;
 
@@ -284,9 +313,8 @@ int main()
 			/* Stop processing the frames from the local camera */ 
 			if (processing_active) {
 				processing_active = 0;
-				pthread_cancel(process_th);
-				pthread_join(process_th, NULL);
 				pauseProcessing();
+				stopRecording();
 			}
 			
 			/* Stop obtaining the readings from the encoder */
@@ -304,13 +332,56 @@ int main()
 		}
 	}
 	
-	pthread_cancel(receive_th);
-	pthread_join(receive_th, NULL);
-	
 	/* Disable the Telecommand Piloting */
 	leaveInputMode();
 	
-	close(sock_can);
+	/* No service receives anything past this point */
+	if (canbus != NULL) {
+		struct canbus_stats bus;
+		canbus_close(canbus, &bus);
+
+		printf("CAN bus:       %llu frames received in %llu reads (max %u "
+			"at once), %llu sent, %u failed\n", 
+			(unsigned long long) bus.frames, (unsigned long long) bus.reads, 
+			bus.batch_max, (unsigned long long) bus.sent, bus.send_failed);
+	}
+
+	/* Nothing asks for a recording anymore */
+	if (commands_fd >= 0) {
+		uint64_t one = 1;
+
+		__sync_fetch_and_add(&commands_stop, 1);
+
+		if (write(commands_fd, &one, sizeof(one)) != sizeof(one))
+			perror("Commands");
+
+		pthread_join(commands_th, NULL);
+		close(commands_fd);
+		commands_fd = -1;
+	}
+
+	/* Everything logged is on the card once the storage is destroyed */
+	if (telemetry != NULL) {
+		struct telemetry_stats records;
+		telemetry_destroy(telemetry, &records);
+
+		printf("Storage:       %llu records logged, %llu dropped\n", 
+			(unsigned long long) records.records, 
+			(unsigned long long) records.dropped);
+	}
+
+	if (storage != NULL) {
+		struct storage_stats stats;
+		storage_destroy(storage, &stats);
+
+		printf("Storage:       %llu writes (%llu KB), %u failed, "
+			"%llu KB dropped, %llu ms max latency, %u in flight max\n",
+			(unsigned long long) stats.writes, 
+			(unsigned long long) stats.bytes / 1024, stats.failed, 
+			(unsigned long long) stats.dropped_bytes / 1024, 
+			(unsigned long long) stats.latency_max_us / 1000, 
+			stats.inflight_max);
+	}
 	
 	sleep(2);
 
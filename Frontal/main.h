@@ -1 +1,5 @@
-void *receive_info(void *args);
+#include <stdint.h>
+
+struct can_frame;
+
+void receive_info(const struct can_frame *m, uint32_t time_ms, void *context);
@@ -0,0 +1,81 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * Writes the log and recording files without ever making the calling
+ * thread wait for the SD card. The data is copied into buffers shared
+ * by every file and written by a storage thread, through io_uring when
+ * the kernel has it (many writes in flight, the thread does not block
+ * on any) or with plain writes otherwise. The storage thread also
+ * opens the files, preallocates them (fallocate) and truncates the
+ * space left when they are closed, so starting a new file at a session
+ * boundary costs the caller nothing. Partly filled buffers are written
+ * every STORAGE_FLUSH_MS.
+ *
+ * When every buffer is waiting for the card the new data is dropped,
+ * and counted, rather than stalling the capture.
+ */
+struct storage;
+struct storage_file;
+
+#define STORAGE_FLUSH_MS 500
+
+/* Backends of storage_create */
+#define STORAGE_AUTO 0
+#define STORAGE_THREAD 1
+
+struct storage_stats {
+	/* Writes completed and failed, bytes written and dropped because
+	 * no buffer was free */
+	uint64_t writes;
+	uint32_t failed;
+	uint64_t bytes;
+	uint64_t dropped_bytes;
+
+	/* From a buffer being ready to its data being written */
+	uint64_t latency_total_us;
+	uint64_t latency_max_us;
+
+	/* Buffers in flight at once, and time since the creation */
+	uint32_t inflight_max;
+	uint64_t elapsed_us;
+};
+
+/* 'buffers' of 'buffer_size' bytes for every file, NULL if the storage
+ * thread cannot be started. STORAGE_AUTO uses io_uring if available */
+struct storage *storage_create(unsigned int buffers, size_t buffer_size,
+	int backend);
+
+/* Writes everything still buffered and closes the files left open,
+ * the final counters go to 'stats' if not NULL */
+void storage_destroy(struct storage *st, struct storage_stats *stats);
+
+/* "io_uring" or "thread" */
+const char *storage_backend(struct storage *st);
+
+/* Create (or truncate) the file 'path' with 'prealloc' bytes reserved,
+ * it is opened by the storage thread. NULL if out of memory or 'st' is
+ * NULL, the functions below ignore a NULL file */
+struct storage_file *storage_open(struct storage *st, const char *path,
+	uint64_t prealloc);
+
+/* Append data to the file, returns -1 if it is dropped. The pieces of
+ * storage_writev are appended or dropped together */
+int storage_write(struct storage_file *file, const void *data,
+	size_t size);
+int storage_writev(struct storage_file *file, const struct iovec *iov,
+	int count);
+int storage_printf(struct storage_file *file, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/* The file is written and closed in the background, the handle must
+ * not be used anymore */
+void storage_close(struct storage_file *file);
+
+void storage_get_stats(struct storage *st, struct storage_stats *stats);
+
+#endif
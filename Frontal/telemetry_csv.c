@@ -0,0 +1,69 @@
+/*
+ * telemetry_csv - Print a telemetry file (.tlm) as the .csv file it
+ * replaces, e.g. telemetry_csv frames/capture.tlm > capture.csv
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "telemetry.h"
+
+static uint32_t get32(const uint8_t *get)
+{
+	return (uint32_t) get[0] | ((uint32_t) get[1] << 8) |
+		((uint32_t) get[2] << 16) | ((uint32_t) get[3] << 24);
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t header[TELEMETRY_HEADER_SIZE];
+	uint8_t data[TELEMETRY_RECORD_SIZE];
+	char line[128];
+	unsigned int unknown = 0;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <file.tlm>\n", argv[0]);
+		return 2;
+	}
+
+	FILE *file = fopen(argv[1], "rb");
+
+	if (file == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+		memcmp(header, "TTLM", 4) != 0 ||
+		get32(header + 4) != TELEMETRY_VERSION ||
+		get32(header + 8) != TELEMETRY_RECORD_SIZE) {
+		fprintf(stderr, "%s: not a telemetry file\n", argv[1]);
+		fclose(file);
+		return 1;
+	}
+
+	/* A record cut short at the end (power cut) is left out */
+	while (fread(data, 1, sizeof(data), file) == sizeof(data)) {
+		struct telemetry_record record;
+		int i;
+
+		record.type = get32(data);
+
+		for (i = 0; i < 4; ++i)
+			record.values[i] = get32(data + 4 + 4 * i);
+
+		int length = telemetry_format(&record, line, sizeof(line));
+
+		if (length < 0)
+			unknown++;
+		else
+			fwrite(line, 1, length, stdout);
+	}
+
+	fclose(file);
+
+	if (unknown > 0)
+		fprintf(stderr, "%s: %u records of an unknown type\n", argv[1],
+			unknown);
+
+	return 0;
+}
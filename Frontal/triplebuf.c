@@ -0,0 +1,105 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "triplebuf.h"
+
+int triple_buf_init(struct triple_buf *buf)
+{
+	buf->front = 0;
+	buf->middle = 1;
+	buf->back = 2;
+
+	/* Counts the frames to take, each read takes one */
+	buf->ready = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+
+	return (buf->ready < 0 ? -1 : 0);
+}
+
+void triple_buf_destroy(struct triple_buf *buf)
+{
+	if (buf->ready >= 0)
+		close(buf->ready);
+
+	buf->ready = -1;
+}
+
+unsigned int triple_buf_back(struct triple_buf *buf)
+{
+	return buf->back;
+}
+
+/* Swap 'slot' with the middle one, a full barrier on both sides */
+static unsigned int exchange_middle(struct triple_buf *buf,
+	unsigned int slot)
+{
+	unsigned int expected = 0;
+	unsigned int middle;
+
+	/* A failed swap returns the current value, retry with it */
+	while ((middle = __sync_val_compare_and_swap(&buf->middle, expected,
+		slot)) != expected)
+		expected = middle;
+
+	return middle;
+}
+
+int triple_buf_publish(struct triple_buf *buf)
+{
+	unsigned int middle;
+
+	middle = exchange_middle(buf, buf->back | TRIPLE_BUF_FRESH);
+
+	buf->back = middle & ~TRIPLE_BUF_FRESH;
+
+	/* The consumer was already told about the frame replaced */
+	if (middle & TRIPLE_BUF_FRESH)
+		return 1;
+
+	uint64_t one = 1;
+	write(buf->ready, &one, sizeof(one));
+
+	return 0;
+}
+
+int triple_buf_fd(struct triple_buf *buf)
+{
+	return buf->ready;
+}
+
+/* Only called once 'ready' was read, the middle slot is fresh */
+static int take_middle(struct triple_buf *buf)
+{
+	buf->front = exchange_middle(buf, buf->front) & ~TRIPLE_BUF_FRESH;
+
+	return buf->front;
+}
+
+int triple_buf_take(struct triple_buf *buf)
+{
+	int index;
+
+	while ((index = triple_buf_try_take(buf)) < 0) {
+		struct pollfd ready;
+
+		ready.fd = buf->ready;
+		ready.events = POLLIN;
+
+		if (poll(&ready, 1, -1) == -1 && errno != EINTR)
+			return -1;
+	}
+
+	return index;
+}
+
+int triple_buf_try_take(struct triple_buf *buf)
+{
+	uint64_t count;
+
+	if (read(buf->ready, &count, sizeof(count)) != sizeof(count))
+		return -1;
+
+	return take_middle(buf);
+}
@@ -0,0 +1,45 @@
+#ifndef TRIPLEBUF_H
+#define TRIPLEBUF_H
+
+/*
+ * Hands the latest frame from one producer thread to one consumer
+ * thread without a lock. There are three slots, owned by the caller
+ * (e.g. an array of 3 frames): the producer fills the 'back' one and
+ * publishes it, the consumer takes the latest published one and reads
+ * it until its next take. Publishing never waits, a frame that was
+ * not taken yet is replaced by the new one (and reported as dropped).
+ */
+struct triple_buf {
+	/* Slot of the latest published frame, TRIPLE_BUF_FRESH is set
+	 * until the consumer takes it */
+	volatile unsigned int middle;
+
+	unsigned int back;
+	unsigned int front;
+
+	/* eventfd signalled when a frame is published over a taken one */
+	int ready;
+};
+
+#define TRIPLE_BUF_FRESH 0x4
+
+/* Returns -1 if the eventfd cannot be created */
+int triple_buf_init(struct triple_buf *buf);
+void triple_buf_destroy(struct triple_buf *buf);
+
+/* Slot the producer writes the next frame into */
+unsigned int triple_buf_back(struct triple_buf *buf);
+
+/* Publish the back slot, returns 1 if an untaken frame was dropped */
+int triple_buf_publish(struct triple_buf *buf);
+
+/* Readable when there is a frame to take, to wait for it with poll
+ * along with other events */
+int triple_buf_fd(struct triple_buf *buf);
+
+/* Slot of the latest frame, waits until there is one or returns -1
+ * right away if there is none for 'try' */
+int triple_buf_take(struct triple_buf *buf);
+int triple_buf_try_take(struct triple_buf *buf);
+
+#endif
@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "workpool.h"
+
+struct work_pool {
+	int threads;
+	pthread_t *workers;
+
+	/* Serializes the jobs */
+	pthread_mutex_t run_lock;
+
+	/* Current job, 'generation' changes when a new one starts and
+	 * 'busy' counts the workers still inside a job */
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	uint32_t generation;
+	int busy;
+	int stop;
+
+	/* Read under the lock when joining a job */
+	work_fn fn;
+	void *args;
+	int count;
+
+	/* The generation of the job (high 32 bits) and its next index, so
+	 * a worker late for a job never takes an index of the next one */
+	uint64_t claim;
+};
+
+/* Run indices of the job 'generation' until there are none left */
+static void run_indices(struct work_pool *pool, uint32_t generation,
+	work_fn fn, void *args, int count)
+{
+	uint64_t claim;
+
+	while (1) {
+		claim = __atomic_load_n(&pool->claim, __ATOMIC_ACQUIRE);
+
+		if ((uint32_t) (claim >> 32) != generation ||
+			(int) (uint32_t) claim >= count)
+			break;
+
+		if (__atomic_compare_exchange_n(&pool->claim, &claim, claim + 1,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			fn(args, (int) (uint32_t) claim);
+	}
+}
+
+static void *worker(void *args)
+{
+	struct work_pool *pool = (struct work_pool *) args;
+	uint32_t seen = 0;
+	work_fn fn;
+	void *job_args;
+	int count;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->stop && pool->generation == seen)
+			pthread_cond_wait(&pool->start, &pool->lock);
+
+		if (pool->stop) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+
+		/* The job as it is now, the next one may start once the
+		 * indices of this one are taken */
+		seen = pool->generation;
+		fn = pool->fn;
+		job_args = pool->args;
+		count = pool->count;
+		pool->busy++;
+		pthread_mutex_unlock(&pool->lock);
+
+		run_indices(pool, seen, fn, job_args, count);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0)
+			pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	pthread_exit(NULL);
+}
+
+struct work_pool *work_pool_create(int threads)
+{
+	struct work_pool *pool;
+	int i;
+
+	pool = (struct work_pool *) calloc(1, sizeof(struct work_pool));
+	if (pool == NULL)
+		return NULL;
+
+	pthread_mutex_init(&pool->run_lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	/* The caller of work_pool_run is one of the threads */
+	if (threads < 1)
+		threads = 1;
+
+	pool->workers = (pthread_t *) calloc(threads, sizeof(pthread_t));
+	pool->threads = 1;
+
+	for (i = 0; i < threads - 1; i++) {
+		if (pthread_create(&pool->workers[i], NULL, worker, pool) != 0)
+			break;
+		pool->threads++;
+	}
+
+	return pool;
+}
+
+void work_pool_run(struct work_pool *pool, work_fn fn, void *args,
+	int count)
+{
+	int i;
+
+	if (count <= 0)
+		return;
+
+	/* Not worth waking up anybody */
+	if (pool == NULL || pool->threads == 1 || count == 1) {
+		for (i = 0; i < count; i++)
+			fn(args, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->run_lock);
+
+	pthread_mutex_lock(&pool->lock);
+	uint32_t generation = ++pool->generation;
+
+	pool->fn = fn;
+	pool->args = args;
+	pool->count = count;
+	__atomic_store_n(&pool->claim, (uint64_t) generation << 32,
+		__ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	run_indices(pool, generation, fn, args, count);
+
+	/* Every index is taken now, wait for the workers running them (a
+	 * worker joining later finds none left) */
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_mutex_unlock(&pool->run_lock);
+}
+
+int work_pool_threads(struct work_pool *pool)
+{
+	return (pool != NULL ? pool->threads : 1);
+}
+
+void work_pool_destroy(struct work_pool *pool)
+{
+	int i;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->threads - 1; i++)
+		pthread_join(pool->workers[i], NULL);
+
+	pthread_mutex_destroy(&pool->run_lock);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+
+	free(pool->workers);
+	free(pool);
+}
@@ -0,0 +1,20 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+/*
+ * A small pool of persistent threads that run the same function over
+ * a range of indices (e.g. the stripes of a frame). The thread calling
+ * work_pool_run takes part in the work and returns when every index
+ * has been processed. One job runs at a time.
+ */
+struct work_pool;
+
+typedef void (*work_fn)(void *args, int index);
+
+struct work_pool *work_pool_create(int threads);
+void work_pool_run(struct work_pool *pool, work_fn fn, void *args,
+	int count);
+int work_pool_threads(struct work_pool *pool);
+void work_pool_destroy(struct work_pool *pool);
+
+#endif
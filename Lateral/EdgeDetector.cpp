@@ -0,0 +1,721 @@
+/*
+ * EdgeDetector - Canny edge detection fast enough for every frame.
+ *
+ * The suppression of the non-maximum gradients and the hysteresis are
+ * the ones of cv::Canny (OpenCV 2.4) step by step, including the fixed
+ * point tangents, so the edges are the same pixel for pixel. Only the
+ * way there differs: the rows are streamed through three row buffers
+ * instead of whole frames of gradients, and the kernels below do the
+ * per pixel work 8 or 16 pixels at a time.
+ */
+#include "EdgeDetector.h"
+
+#include <iostream>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define EDGE_X86
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON) || defined(__aarch64__)
+#define EDGE_NEON
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_ARM_NEON
+#define HWCAP_ARM_NEON 4096
+#endif
+#endif
+
+using namespace cv;
+using namespace std;
+
+static const char* messageHeader = "EdgeDetector: ";
+
+/* tan(22.5 degrees) with 15 bits of fractional precision */
+#define CANNY_SHIFT 15
+static const int kTan22 = (int) (0.4142135623730950488016887242097 *
+	(1 << CANNY_SHIFT) + 0.5);
+
+/*
+ * Gradients of 'width' pixels from the row above, the row and the row
+ * below, each starting one pixel to the left of the first pixel:
+ * dx, dy and the L1 magnitude |dx| + |dy|. They fit in 16 bits.
+ */
+typedef void (*sobel_kernel)(const uint8_t* above, const uint8_t* row,
+	const uint8_t* below, int16_t* dx, int16_t* dy, int16_t* mag,
+	uint32_t width);
+
+/*
+ * First step of the non-maximum suppression of 'width' pixels, from
+ * their gradients and the magnitudes of the rows around them: in 'map'
+ * 1 (no edge) unless the magnitude is above 'low' and a maximum along
+ * the direction of the gradient, then 3 if it is above 'high' too and
+ * 0 otherwise. The magnitudes have a 0 on each side.
+ */
+typedef void (*classify_kernel)(const int16_t* dx, const int16_t* dy,
+	const int16_t* above, const int16_t* mag, const int16_t* below,
+	uint8_t* map, uint32_t width, int16_t low, int16_t high);
+
+/* Values of the classified pixels that are not no edge */
+#define EDGE_POSSIBLE 0
+#define EDGE_STRONG 3
+
+struct EdgeKernels {
+	const char* name;
+	sobel_kernel sobel;
+	classify_kernel classify;
+};
+
+static void scalar_sobel(const uint8_t* above, const uint8_t* row,
+	const uint8_t* below, int16_t* dx, int16_t* dy, int16_t* mag,
+	uint32_t width)
+{
+	for (uint32_t colIndex = 0; colIndex < width; ++colIndex) {
+		const uint8_t* a = above + colIndex;
+		const uint8_t* b = row + colIndex;
+		const uint8_t* c = below + colIndex;
+
+		int x = (a[2] - a[0]) + 2 * (b[2] - b[0]) + (c[2] - c[0]);
+		int y = (c[0] + 2 * c[1] + c[2]) - (a[0] + 2 * a[1] + a[2]);
+
+		dx[colIndex] = x;
+		dy[colIndex] = y;
+		mag[colIndex] = abs(x) + abs(y);
+	}
+}
+
+static void scalar_classify(const int16_t* dx, const int16_t* dy,
+	const int16_t* above, const int16_t* mag, const int16_t* below,
+	uint8_t* map, uint32_t width, int16_t low, int16_t high)
+{
+	/* Signed, the neighbours are on both sides */
+	for (int colIndex = 0; colIndex < (int) width; ++colIndex) {
+		int m = mag[colIndex];
+
+		if (m <= low) {
+			map[colIndex] = 1;
+			continue;
+		}
+
+		int xs = dx[colIndex];
+		int ys = dy[colIndex];
+		int x = abs(xs);
+		int y = abs(ys) << CANNY_SHIFT;
+		int tg22x = x * kTan22;
+		bool peak;
+
+		if (y < tg22x) {
+			/* Horizontal gradient, compared left and right */
+			peak = (m > mag[colIndex - 1] && m >= mag[colIndex + 1]);
+		}
+		else {
+			int tg67x = tg22x + (x << (CANNY_SHIFT + 1));
+
+			if (y > tg67x) {
+				/* Vertical gradient, compared above and below */
+				peak = (m > above[colIndex] && m >= below[colIndex]);
+			}
+			else {
+				/* Diagonal, the side depends on the signs */
+				int s = ((xs ^ ys) < 0 ? -1 : 1);
+
+				peak = (m > above[colIndex - s] &&
+					m > below[colIndex + s]);
+			}
+		}
+
+		if (!peak)
+			map[colIndex] = 1;
+		else
+			map[colIndex] = (m > high ? EDGE_STRONG : EDGE_POSSIBLE);
+	}
+}
+
+#ifdef EDGE_X86
+
+#ifdef __x86_64__
+#define SSE2_TARGET
+#else
+#define SSE2_TARGET __attribute__((target("sse2")))
+#endif
+
+/*
+ * Gradients of 8 pixels, the bytes of the three rows widened to 16 bits
+ * at the offsets 0, 1 and 2.
+ */
+SSE2_TARGET static inline void sse2_sobel8(__m128i a0, __m128i a1,
+	__m128i a2, __m128i b0, __m128i b2, __m128i c0, __m128i c1,
+	__m128i c2, int16_t* dx, int16_t* dy, int16_t* mag)
+{
+	__m128i x = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(a2, a0),
+		_mm_slli_epi16(_mm_sub_epi16(b2, b0), 1)),
+		_mm_sub_epi16(c2, c0));
+	__m128i y = _mm_sub_epi16(
+		_mm_add_epi16(_mm_add_epi16(c0, _mm_slli_epi16(c1, 1)), c2),
+		_mm_add_epi16(_mm_add_epi16(a0, _mm_slli_epi16(a1, 1)), a2));
+
+	/* No abs in SSE2, the largest of the value and its opposite */
+	__m128i zero = _mm_setzero_si128();
+	__m128i m = _mm_add_epi16(_mm_max_epi16(x, _mm_sub_epi16(zero, x)),
+		_mm_max_epi16(y, _mm_sub_epi16(zero, y)));
+
+	_mm_storeu_si128((__m128i*) dx, x);
+	_mm_storeu_si128((__m128i*) dy, y);
+	_mm_storeu_si128((__m128i*) mag, m);
+}
+
+SSE2_TARGET static void sse2_sobel(const uint8_t* above,
+	const uint8_t* row, const uint8_t* below, int16_t* dx, int16_t* dy,
+	int16_t* mag, uint32_t width)
+{
+	uint32_t vectorWidth = width & ~15u;
+	__m128i zero = _mm_setzero_si128();
+
+	for (uint32_t colIndex = 0; colIndex < vectorWidth; colIndex += 16) {
+		const uint8_t* a = above + colIndex;
+		const uint8_t* b = row + colIndex;
+		const uint8_t* c = below + colIndex;
+
+		__m128i a0 = _mm_loadu_si128((const __m128i*) a);
+		__m128i a1 = _mm_loadu_si128((const __m128i*) (a + 1));
+		__m128i a2 = _mm_loadu_si128((const __m128i*) (a + 2));
+		__m128i b0 = _mm_loadu_si128((const __m128i*) b);
+		__m128i b2 = _mm_loadu_si128((const __m128i*) (b + 2));
+		__m128i c0 = _mm_loadu_si128((const __m128i*) c);
+		__m128i c1 = _mm_loadu_si128((const __m128i*) (c + 1));
+		__m128i c2 = _mm_loadu_si128((const __m128i*) (c + 2));
+
+		sse2_sobel8(_mm_unpacklo_epi8(a0, zero),
+			_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(a2, zero),
+			_mm_unpacklo_epi8(b0, zero), _mm_unpacklo_epi8(b2, zero),
+			_mm_unpacklo_epi8(c0, zero), _mm_unpacklo_epi8(c1, zero),
+			_mm_unpacklo_epi8(c2, zero), dx + colIndex, dy + colIndex,
+			mag + colIndex);
+
+		sse2_sobel8(_mm_unpackhi_epi8(a0, zero),
+			_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(a2, zero),
+			_mm_unpackhi_epi8(b0, zero), _mm_unpackhi_epi8(b2, zero),
+			_mm_unpackhi_epi8(c0, zero), _mm_unpackhi_epi8(c1, zero),
+			_mm_unpackhi_epi8(c2, zero), dx + colIndex + 8,
+			dy + colIndex + 8, mag + colIndex + 8);
+	}
+
+	scalar_sobel(above + vectorWidth, row + vectorWidth,
+		below + vectorWidth, dx + vectorWidth, dy + vectorWidth,
+		mag + vectorWidth, width - vectorWidth);
+}
+
+SSE2_TARGET static void sse2_classify(const int16_t* dx,
+	const int16_t* dy, const int16_t* above, const int16_t* mag,
+	const int16_t* below, uint8_t* map, uint32_t width, int16_t low,
+	int16_t high)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i tan22 = _mm_set1_epi32(kTan22);
+	__m128i lowV = _mm_set1_epi16(low);
+	__m128i highV = _mm_set1_epi16(high);
+	__m128i one = _mm_set1_epi16(1);
+	__m128i strongV = _mm_set1_epi16(EDGE_STRONG);
+	uint32_t colIndex = 0;
+
+	for (; colIndex + 8 <= width; colIndex += 8) {
+		const int16_t* a = above + colIndex;
+		const int16_t* b = below + colIndex;
+		const int16_t* c = mag + colIndex;
+
+		__m128i x = _mm_loadu_si128((const __m128i*) (dx + colIndex));
+		__m128i y = _mm_loadu_si128((const __m128i*) (dy + colIndex));
+		__m128i m = _mm_loadu_si128((const __m128i*) c);
+
+		/* The tangents take 32 bits, in two halves */
+		__m128i ax = _mm_max_epi16(x, _mm_sub_epi16(zero, x));
+		__m128i ay = _mm_max_epi16(y, _mm_sub_epi16(zero, y));
+		__m128i halves[4];
+
+		for (int half = 0; half < 2; ++half) {
+			__m128i x32 = (half == 0 ? _mm_unpacklo_epi16(ax, zero) :
+				_mm_unpackhi_epi16(ax, zero));
+			__m128i y32 = _mm_slli_epi32(half == 0 ?
+				_mm_unpacklo_epi16(ay, zero) :
+				_mm_unpackhi_epi16(ay, zero), CANNY_SHIFT);
+			__m128i tg22x = _mm_madd_epi16(x32, tan22);
+			__m128i tg67x = _mm_add_epi32(tg22x,
+				_mm_slli_epi32(x32, CANNY_SHIFT + 1));
+
+			halves[half] = _mm_cmplt_epi32(y32, tg22x);
+			halves[half + 2] = _mm_cmpgt_epi32(y32, tg67x);
+		}
+
+		__m128i horizontal = _mm_packs_epi32(halves[0], halves[1]);
+		__m128i vertical = _mm_packs_epi32(halves[2], halves[3]);
+		__m128i diagonal = _mm_andnot_si128(
+			_mm_or_si128(horizontal, vertical), _mm_set1_epi16(-1));
+
+		/* m >= n is !(n > m) */
+		__m128i peakH = _mm_andnot_si128(
+			_mm_cmpgt_epi16(_mm_loadu_si128((const __m128i*) (c + 1)), m),
+			_mm_cmpgt_epi16(m, _mm_loadu_si128((const __m128i*) (c - 1))));
+		__m128i peakV = _mm_andnot_si128(
+			_mm_cmpgt_epi16(_mm_loadu_si128((const __m128i*) b), m),
+			_mm_cmpgt_epi16(m, _mm_loadu_si128((const __m128i*) a)));
+
+		/* Above right and below left when the signs differ */
+		__m128i differ = _mm_srai_epi16(_mm_xor_si128(x, y), 15);
+		__m128i rising = _mm_and_si128(
+			_mm_cmpgt_epi16(m, _mm_loadu_si128((const __m128i*) (a + 1))),
+			_mm_cmpgt_epi16(m, _mm_loadu_si128((const __m128i*) (b - 1))));
+		__m128i falling = _mm_and_si128(
+			_mm_cmpgt_epi16(m, _mm_loadu_si128((const __m128i*) (a - 1))),
+			_mm_cmpgt_epi16(m, _mm_loadu_si128((const __m128i*) (b + 1))));
+		__m128i peakD = _mm_or_si128(_mm_and_si128(differ, rising),
+			_mm_andnot_si128(differ, falling));
+
+		__m128i peak = _mm_or_si128(_mm_or_si128(
+			_mm_and_si128(horizontal, peakH),
+			_mm_and_si128(vertical, peakV)),
+			_mm_and_si128(diagonal, peakD));
+
+		peak = _mm_and_si128(peak, _mm_cmpgt_epi16(m, lowV));
+
+		__m128i strong = _mm_and_si128(peak, _mm_cmpgt_epi16(m, highV));
+		__m128i classes = _mm_or_si128(_mm_andnot_si128(peak, one),
+			_mm_and_si128(strong, strongV));
+
+		_mm_storel_epi64((__m128i*) (map + colIndex),
+			_mm_packus_epi16(classes, classes));
+	}
+
+	scalar_classify(dx + colIndex, dy + colIndex, above + colIndex,
+		mag + colIndex, below + colIndex, map + colIndex,
+		width - colIndex, low, high);
+}
+
+#endif /* EDGE_X86 */
+
+#ifdef EDGE_NEON
+
+static inline void neon_sobel8(int16x8_t a0, int16x8_t a1, int16x8_t a2,
+	int16x8_t b0, int16x8_t b2, int16x8_t c0, int16x8_t c1,
+	int16x8_t c2, int16_t* dx, int16_t* dy, int16_t* mag)
+{
+	int16x8_t x = vaddq_s16(vaddq_s16(vsubq_s16(a2, a0),
+		vshlq_n_s16(vsubq_s16(b2, b0), 1)), vsubq_s16(c2, c0));
+	int16x8_t y = vsubq_s16(
+		vaddq_s16(vaddq_s16(c0, vshlq_n_s16(c1, 1)), c2),
+		vaddq_s16(vaddq_s16(a0, vshlq_n_s16(a1, 1)), a2));
+
+	vst1q_s16(dx, x);
+	vst1q_s16(dy, y);
+	vst1q_s16(mag, vaddq_s16(vabsq_s16(x), vabsq_s16(y)));
+}
+
+static inline int16x8_t neon_low(uint8x16_t v)
+{
+	return vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v)));
+}
+
+static inline int16x8_t neon_high(uint8x16_t v)
+{
+	return vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v)));
+}
+
+static void neon_sobel(const uint8_t* above, const uint8_t* row,
+	const uint8_t* below, int16_t* dx, int16_t* dy, int16_t* mag,
+	uint32_t width)
+{
+	uint32_t vectorWidth = width & ~15u;
+
+	for (uint32_t colIndex = 0; colIndex < vectorWidth; colIndex += 16) {
+		const uint8_t* a = above + colIndex;
+		const uint8_t* b = row + colIndex;
+		const uint8_t* c = below + colIndex;
+
+		uint8x16_t a0 = vld1q_u8(a);
+		uint8x16_t a1 = vld1q_u8(a + 1);
+		uint8x16_t a2 = vld1q_u8(a + 2);
+		uint8x16_t b0 = vld1q_u8(b);
+		uint8x16_t b2 = vld1q_u8(b + 2);
+		uint8x16_t c0 = vld1q_u8(c);
+		uint8x16_t c1 = vld1q_u8(c + 1);
+		uint8x16_t c2 = vld1q_u8(c + 2);
+
+		neon_sobel8(neon_low(a0), neon_low(a1), neon_low(a2),
+			neon_low(b0), neon_low(b2), neon_low(c0), neon_low(c1),
+			neon_low(c2), dx + colIndex, dy + colIndex, mag + colIndex);
+
+		neon_sobel8(neon_high(a0), neon_high(a1), neon_high(a2),
+			neon_high(b0), neon_high(b2), neon_high(c0), neon_high(c1),
+			neon_high(c2), dx + colIndex + 8, dy + colIndex + 8,
+			mag + colIndex + 8);
+	}
+
+	scalar_sobel(above + vectorWidth, row + vectorWidth,
+		below + vectorWidth, dx + vectorWidth, dy + vectorWidth,
+		mag + vectorWidth, width - vectorWidth);
+}
+
+static inline uint16x8_t neon_peak(int16x8_t m, const int16_t* before,
+	const int16_t* after)
+{
+	/* m >= n is !(n > m) */
+	return vbicq_u16(vcgtq_s16(m, vld1q_s16(before)),
+		vcgtq_s16(vld1q_s16(after), m));
+}
+
+static void neon_classify(const int16_t* dx, const int16_t* dy,
+	const int16_t* above, const int16_t* mag, const int16_t* below,
+	uint8_t* map, uint32_t width, int16_t low, int16_t high)
+{
+	int16x8_t lowV = vdupq_n_s16(low);
+	int16x8_t highV = vdupq_n_s16(high);
+	uint16x8_t one = vdupq_n_u16(1);
+	uint16x8_t strongV = vdupq_n_u16(EDGE_STRONG);
+	uint32_t colIndex = 0;
+
+	for (; colIndex + 8 <= width; colIndex += 8) {
+		const int16_t* a = above + colIndex;
+		const int16_t* b = below + colIndex;
+		const int16_t* c = mag + colIndex;
+
+		int16x8_t x = vld1q_s16(dx + colIndex);
+		int16x8_t y = vld1q_s16(dy + colIndex);
+		int16x8_t m = vld1q_s16(c);
+
+		/* The tangents take 32 bits, in two halves */
+		int16x8_t ax = vabsq_s16(x);
+		int16x8_t ay = vabsq_s16(y);
+
+		int32x4_t tg22Low = vmull_n_s16(vget_low_s16(ax), kTan22);
+		int32x4_t tg22High = vmull_n_s16(vget_high_s16(ax), kTan22);
+		int32x4_t tg67Low = vaddq_s32(tg22Low,
+			vshll_n_s16(vget_low_s16(ax), CANNY_SHIFT + 1));
+		int32x4_t tg67High = vaddq_s32(tg22High,
+			vshll_n_s16(vget_high_s16(ax), CANNY_SHIFT + 1));
+		int32x4_t yLow = vshll_n_s16(vget_low_s16(ay), CANNY_SHIFT);
+		int32x4_t yHigh = vshll_n_s16(vget_high_s16(ay), CANNY_SHIFT);
+
+		uint16x8_t horizontal = vcombine_u16(
+			vmovn_u32(vcltq_s32(yLow, tg22Low)),
+			vmovn_u32(vcltq_s32(yHigh, tg22High)));
+		uint16x8_t vertical = vcombine_u16(
+			vmovn_u32(vcgtq_s32(yLow, tg67Low)),
+			vmovn_u32(vcgtq_s32(yHigh, tg67High)));
+
+		/* Above right and below left when the signs differ */
+		uint16x8_t differ = vcltq_s16(veorq_s16(x, y), vdupq_n_s16(0));
+		uint16x8_t rising = vandq_u16(vcgtq_s16(m, vld1q_s16(a + 1)),
+			vcgtq_s16(m, vld1q_s16(b - 1)));
+		uint16x8_t falling = vandq_u16(vcgtq_s16(m, vld1q_s16(a - 1)),
+			vcgtq_s16(m, vld1q_s16(b + 1)));
+
+		uint16x8_t peak = vbslq_u16(horizontal, neon_peak(m, c - 1, c + 1),
+			vbslq_u16(vertical, neon_peak(m, a, b),
+			vbslq_u16(differ, rising, falling)));
+
+		peak = vandq_u16(peak, vcgtq_s16(m, lowV));
+
+		uint16x8_t strong = vandq_u16(peak, vcgtq_s16(m, highV));
+		uint16x8_t classes = vorrq_u16(vbicq_u16(one, peak),
+			vandq_u16(strong, strongV));
+
+		vst1_u8(map + colIndex, vmovn_u16(classes));
+	}
+
+	scalar_classify(dx + colIndex, dy + colIndex, above + colIndex,
+		mag + colIndex, below + colIndex, map + colIndex,
+		width - colIndex, low, high);
+}
+
+#endif /* EDGE_NEON */
+
+static const EdgeKernels kScalar = { "scalar", scalar_sobel,
+	scalar_classify };
+#ifdef EDGE_X86
+static const EdgeKernels kSSE2 = { "sse2", sse2_sobel, sse2_classify };
+#endif
+#ifdef EDGE_NEON
+static const EdgeKernels kNEON = { "neon", neon_sobel, neon_classify };
+#endif
+
+/* From the fastest to the slowest */
+static const EdgeKernels* const kAllKernels[] = {
+#ifdef EDGE_X86
+	&kSSE2,
+#endif
+#ifdef EDGE_NEON
+	&kNEON,
+#endif
+	&kScalar
+};
+
+static bool cpuSupports(const EdgeKernels* kernels)
+{
+#ifdef EDGE_X86
+	__builtin_cpu_init();
+
+	if (kernels == &kSSE2)
+		return __builtin_cpu_supports("sse2");
+#endif
+
+#ifdef EDGE_NEON
+	if (kernels == &kNEON) {
+#ifdef __aarch64__
+		return true;
+#else
+		return (getauxval(AT_HWCAP) & HWCAP_ARM_NEON) != 0;
+#endif
+	}
+#endif
+
+	return (kernels == &kScalar);
+}
+
+EdgeDetector::EdgeDetector()
+{
+	m_kernels = &kScalar;
+	setKernels("auto");
+
+	m_low = 0;
+	m_high = 0;
+
+	m_width = 0;
+	m_height = 0;
+}
+
+/*
+ * As cv::Canny: the thresholds are rounded down and swapped if they
+ * come in the wrong order.
+ */
+void EdgeDetector::setThresholds(double low, double high)
+{
+	if (low > high) {
+		double swapped = low;
+		low = high;
+		high = swapped;
+	}
+
+	/* The magnitudes fit in 16 bits */
+	m_low = (int) floor(max(min(low, 32767.0), -32768.0));
+	m_high = (int) floor(max(min(high, 32767.0), -32768.0));
+}
+
+bool EdgeDetector::setKernels(const char* name)
+{
+	size_t count = sizeof(kAllKernels) / sizeof(kAllKernels[0]);
+	bool any = (strcmp(name, "auto") == 0);
+
+	for (size_t i = 0; i < count; ++i) {
+		if ((any || strcmp(kAllKernels[i]->name, name) == 0) &&
+			cpuSupports(kAllKernels[i])) {
+			m_kernels = kAllKernels[i];
+			return true;
+		}
+	}
+
+	cerr << messageHeader << "ERROR: Kernels not supported " << name <<
+		endl;
+
+	return false;
+}
+
+const char* EdgeDetector::kernels() const
+{
+	return m_kernels->name;
+}
+
+/*
+ * Sizes the buffers for a region of interest, they only grow.
+ */
+void EdgeDetector::prepare(uint32_t width, uint32_t height)
+{
+	if (width != m_width || height != m_height) {
+		m_width = width;
+		m_height = height;
+
+		m_padded.resize(3 * (width + 2));
+		m_dx.resize(3 * width);
+		m_dy.resize(3 * width);
+		m_mag.resize(3 * (width + 2));
+
+		/* The border of the map is never written afterwards */
+		size_t mapStride = width + 2;
+
+		m_map.assign(mapStride * (height + 2), 1);
+	}
+
+	/* The magnitudes above the first row and the borders are 0 */
+	memset(&m_mag[0], 0, m_mag.size() * sizeof(int16_t));
+
+	m_stack.clear();
+}
+
+/*
+ * Copies the row 'row' of the region of interest (-1 and its height
+ * for the rows around it) with the pixel on each side. Past the border
+ * of the frame the pixels are replicated, as cv::Canny does.
+ */
+void EdgeDetector::padRow(const Mat& src, const Rect& roi, int row,
+	uint8_t* padded)
+{
+	int y = min(max(roi.y + row, 0), src.rows - 1);
+	const uint8_t* pixels = src.ptr<uint8_t>(y);
+
+	memcpy(padded + 1, pixels + roi.x, roi.width);
+
+	padded[0] = pixels[max(roi.x - 1, 0)];
+	padded[roi.width + 1] = pixels[min(roi.x + roi.width, src.cols - 1)];
+}
+
+/*
+ * Non-maximum suppression of a row: a pixel can be an edge if its
+ * magnitude is above the low threshold and is a maximum along the
+ * direction of the gradient. It is a sure edge, and its neighbours are
+ * followed, if it is also above the high threshold and no sure edge
+ * has just been found on its left or above it (these will reach it).
+ */
+void EdgeDetector::suppressRow(uint32_t row, const int16_t* dx,
+	const int16_t* dy, const int16_t* above, const int16_t* mag,
+	const int16_t* below)
+{
+	ptrdiff_t mapStride = m_width + 2;
+	uint8_t* map = &m_map[(row + 1) * mapStride + 1];
+	uint8_t* end = map + m_width;
+
+	m_kernels->classify(dx, dy, above, mag, below, map, m_width, m_low,
+		m_high);
+
+	/* cv::Canny skips a strong maximum after a sure edge on its left
+	 * with only maxima in between, the classes are checked up to it */
+	bool prevFlag = false;
+	uint8_t* checked = map;
+	uint8_t* strong = map;
+
+	while ((strong = (uint8_t*) memchr(strong, EDGE_STRONG,
+		end - strong)) != NULL) {
+		if (prevFlag && memchr(checked, 1, strong - checked) != NULL)
+			prevFlag = false;
+
+		checked = strong;
+
+		if (!prevFlag && strong[-mapStride] != 2) {
+			*strong = 2;
+			m_stack.push_back(strong);
+			prevFlag = true;
+		}
+		else
+			*strong = EDGE_POSSIBLE;
+
+		strong++;
+	}
+}
+
+/*
+ * The possible edges touching a sure edge become edges in turn.
+ */
+void EdgeDetector::followEdges()
+{
+	ptrdiff_t mapStride = m_width + 2;
+	const ptrdiff_t neighbours[8] = {
+		-mapStride - 1, -mapStride, -mapStride + 1, -1, 1,
+		mapStride - 1, mapStride, mapStride + 1
+	};
+
+	while (!m_stack.empty()) {
+		uint8_t* edge = m_stack.back();
+		m_stack.pop_back();
+
+		for (int i = 0; i < 8; ++i) {
+			uint8_t* neighbour = edge + neighbours[i];
+
+			if (*neighbour == 0) {
+				*neighbour = 2;
+				m_stack.push_back(neighbour);
+			}
+		}
+	}
+}
+
+bool EdgeDetector::detect(const Mat& src, Mat& dst)
+{
+	return detect(src, dst, Rect(0, 0, src.cols, src.rows));
+}
+
+bool EdgeDetector::detect(const Mat& src, Mat& dst, const Rect& roi)
+{
+	if (src.type() != CV_8UC1) {
+		cerr << messageHeader << "ERROR: Not a gray image" << endl;
+		return false;
+	}
+
+	Rect area = roi & Rect(0, 0, src.cols, src.rows);
+
+	dst.create(src.size(), CV_8UC1);
+
+	if (area.width != src.cols || area.height != src.rows)
+		dst = Scalar(0);
+
+	if (area.width <= 0 || area.height <= 0)
+		return true;
+
+	uint32_t width = area.width;
+	uint32_t height = area.height;
+
+	prepare(width, height);
+
+	/* Row k of the region (from -1) is padded in the slot (k + 1) % 3,
+	 * the gradients of row k are in the slot k % 3 */
+	size_t padStride = width + 2;
+	size_t magStride = width + 2;
+
+	padRow(src, area, -1, &m_padded[0]);
+	padRow(src, area, 0, &m_padded[padStride]);
+
+	for (uint32_t rowIndex = 0; rowIndex <= height; ++rowIndex) {
+		uint32_t slot = rowIndex % 3;
+		int16_t* mag = &m_mag[slot * magStride + 1];
+
+		if (rowIndex < height) {
+			padRow(src, area, rowIndex + 1,
+				&m_padded[((rowIndex + 2) % 3) * padStride]);
+
+			m_kernels->sobel(&m_padded[slot * padStride],
+				&m_padded[((rowIndex + 1) % 3) * padStride],
+				&m_padded[((rowIndex + 2) % 3) * padStride],
+				&m_dx[slot * width], &m_dy[slot * width], mag, width);
+		}
+		else {
+			/* Nothing below the last row */
+			memset(mag, 0, width * sizeof(int16_t));
+		}
+
+		/* The row above is complete now that its neighbours are known */
+		if (rowIndex > 0) {
+			uint32_t previous = (rowIndex + 2) % 3;
+			uint32_t before = (rowIndex + 1) % 3;
+
+			suppressRow(rowIndex - 1, &m_dx[previous * width],
+				&m_dy[previous * width],
+				&m_mag[before * magStride + 1],
+				&m_mag[previous * magStride + 1], mag);
+		}
+	}
+
+	followEdges();
+
+	/* 2 (edge) becomes 255, 0 and 1 become 0 */
+	size_t mapStride = width + 2;
+
+	for (uint32_t rowIndex = 0; rowIndex < height; ++rowIndex) {
+		const uint8_t* map = &m_map[(rowIndex + 1) * mapStride + 1];
+		uint8_t* edges = dst.ptr<uint8_t>(area.y + rowIndex) + area.x;
+
+		for (uint32_t colIndex = 0; colIndex < width; ++colIndex)
+			edges[colIndex] = (uint8_t) -(map[colIndex] >> 1);
+	}
+
+	return true;
+}
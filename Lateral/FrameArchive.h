@@ -0,0 +1,167 @@
+/*
+ * FrameArchive - Records frames, raw or compressed, with their metadata
+ * in a single append-only file instead of a file per frame and .csv
+ * files of times.
+ *
+ * Layout, little endian whatever the board:
+ *   file header  "TFAR", version
+ *   records      one per frame, a 40 byte header followed by the data
+ *                padded to 8 bytes: "FRAM", size of the data, sequence,
+ *                time (ms), capture time (ns, monotonic clock, 0 if
+ *                unknown), format ("JPEG", "GREY", "YUYV", "MJPG"),
+ *                width and height (16 bits each), 0, checksum of the
+ *                header
+ *   index        written when the archive is closed: "FIDX", number of
+ *                frames, then the offset of every record (64 bits)
+ *   trailer      "TFIX", number of frames, offset of the index (64 bits)
+ *
+ * The index gives FrameArchiveReader every frame in constant time. A
+ * file that was never closed (crash, power cut) has no index, it is
+ * read by walking the records up to the last complete one. The
+ * framearchive tool lists the frames of an archive or extracts them.
+ *
+ * Given a storage, the archive is written by its thread like the logs
+ * (a record is appended whole or dropped, and reaches the card within
+ * STORAGE_FLUSH_MS); without one, with stdio from the appending thread.
+ */
+#ifndef FRAMEARCHIVE_H
+#define FRAMEARCHIVE_H
+
+#include <opencv2/core/core.hpp>
+
+#include "storage.h"
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define FRAME_ARCHIVE_VERSION 1
+#define FRAME_ARCHIVE_HEADER_SIZE 8
+#define FRAME_RECORD_HEADER_SIZE 40
+#define FRAME_ARCHIVE_TRAILER_SIZE 16
+
+/* Space reserved for an archive written through the storage */
+#define FRAME_ARCHIVE_PREALLOC (64 << 20)
+
+/*
+ * A frame of an archive and what is known about it.
+ */
+struct FrameRecord
+{
+    uint32_t sequence;
+    uint32_t time;
+    uint64_t capture_ns;
+
+    /* Four character code of the format, e.g. "JPEG" */
+    char format[5];
+    uint32_t width;
+    uint32_t height;
+
+    /* The data, in the mapping of the reader */
+    const uint8_t* data;
+    size_t size;
+};
+
+class FrameArchive
+{
+  public:
+    FrameArchive();
+    ~FrameArchive();
+
+    /*
+     * Create the file, written through 'storage' if not NULL. Returns
+     * false if it cannot be created.
+     */
+    bool open(const char* path, struct storage* storage = NULL);
+
+    /*
+     * Append a frame, 'format' is a four character code. Returns false
+     * when the archive is not open or on a write error.
+     */
+    bool append(const FrameRecord& record, const uint8_t* data,
+      size_t size);
+
+    /*
+     * Append an 8 bit gray image as "GREY", uncompressed.
+     */
+    bool append(const cv::Mat& gray, uint32_t sequence, uint32_t time,
+      uint64_t capture_ns);
+
+    /*
+     * Write the index and close the file.
+     */
+    void close();
+
+    bool isOpen() const;
+    uint32_t frames() const;
+    uint64_t bytes() const;
+
+  private:
+    FrameArchive(const FrameArchive&);
+    FrameArchive& operator=(const FrameArchive&);
+
+    bool write(const struct iovec* iov, int count);
+
+    /* One of them while open */
+    FILE* m_file;
+    struct storage_file* m_stored;
+    uint64_t m_offset;
+
+    /* Offset of every record, for the index */
+    std::vector<uint64_t> m_index;
+};
+
+class FrameArchiveReader
+{
+  public:
+    FrameArchiveReader();
+    ~FrameArchiveReader();
+
+    /*
+     * Map the archive. Returns false if it is not an archive.
+     */
+    bool open(const char* path);
+    void close();
+
+    bool isOpen() const;
+
+    /*
+     * Frames in the archive, and whether it was closed properly (with
+     * its index) or was recovered up to its last complete frame.
+     */
+    uint32_t frames() const;
+    bool complete() const;
+
+    /*
+     * The frame number 'index', in the order they were appended.
+     * The data stays valid until the archive is closed. Returns false
+     * if there is no such frame or its header is damaged.
+     */
+    bool frame(uint32_t index, FrameRecord& record) const;
+
+    /*
+     * The frame as an image: GREY and YUYV are wrapped without a copy
+     * (valid until the archive is closed), JPEG and MJPG are decoded.
+     */
+    bool image(uint32_t index, cv::Mat& image) const;
+
+  private:
+    FrameArchiveReader(const FrameArchiveReader&);
+    FrameArchiveReader& operator=(const FrameArchiveReader&);
+
+    bool readIndex();
+    void walkRecords();
+    uint64_t recordOffset(uint32_t index) const;
+
+    int m_file_handle;
+    const uint8_t* m_map;
+    size_t m_map_size;
+
+    /* The index of the file, or the offsets found walking the records */
+    const uint8_t* m_index;
+    std::vector<uint64_t> m_offsets;
+    uint32_t m_frames;
+};
+#endif
@@ -0,0 +1,175 @@
+/*
+ * FrameGraph - Runs the processing of a frame as a graph of nodes.
+ *
+ * Every node declares the images it reads and the image it produces,
+ * by name. The images fed by the caller for each frame (e.g. "gray")
+ * are the sources, every other image is produced by exactly one node,
+ * so an intermediate result (a half size image, the edges...) is
+ * computed once whatever the number of nodes reading it. A node
+ * without an output (e.g. saving or logging) is a sink.
+ *
+ * The nodes run in dependency order; with several threads the nodes
+ * that do not depend on each other run in parallel. The time spent
+ * in every node is kept, like the conversion times of the capture.
+ */
+#ifndef FRAMEGRAPH_H
+#define FRAMEGRAPH_H
+
+#include <opencv2/core/core.hpp>
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+struct work_pool;
+
+/*
+ * Computes 'output' from 'inputs', in the order they were declared.
+ * The output keeps its buffer from one frame to the next.
+ */
+typedef void (*frame_node_fn)(const std::vector<const cv::Mat*>& inputs,
+  cv::Mat& output, void* args);
+
+struct FrameNodeStats
+{
+    std::string name;
+    uint32_t runs;
+    uint64_t total_us;
+    uint64_t max_us;
+};
+
+/*
+ * Parameters of the 'edges' node.
+ */
+struct FrameEdgeParams
+{
+    double low_threshold;
+    double high_threshold;
+    int aperture;
+};
+
+class FrameGraph
+{
+  public:
+    FrameGraph();
+    ~FrameGraph();
+
+    /*
+     * Declare an image fed by the caller for every frame.
+     */
+    void addSource(const char* name);
+
+    /*
+     * Add a node computing 'output' (NULL for a sink) from the images
+     * in 'inputs', separated by commas. Returns false if the output is
+     * already produced by another node.
+     */
+    bool addNode(const char* name, const char* inputs, const char* output,
+      frame_node_fn fn, void* args = NULL);
+
+    /*
+     * Add a node computing the edges of 'input' into 'output' with
+     * 'params'. With the 3x3 aperture they are found by an EdgeDetector
+     * of this graph (the edges of cv::Canny, faster), with any other by
+     * cv::Canny as the 'edges' node.
+     */
+    bool addEdges(const char* name, const char* input, const char* output,
+      const FrameEdgeParams& params);
+
+    /*
+     * Threads running the nodes, 1 (the default) runs them in the
+     * calling thread.
+     */
+    bool setThreads(uint32_t threads);
+    uint32_t threads() const;
+
+    /*
+     * Feed a source image, the graph only keeps a reference so the
+     * data must not change until 'run' returns.
+     */
+    void setSource(const char* name, const cv::Mat& image);
+
+    /*
+     * Run every node once for the current sources. Returns false if
+     * the graph cannot run (an input nobody produces or a cycle).
+     */
+    bool run();
+
+    /*
+     * An image of the last frame, NULL if there is none with that name.
+     */
+    const cv::Mat* image(const char* name) const;
+
+    void getNodeStats(std::vector<FrameNodeStats>& stats) const;
+    void resetNodeStats();
+
+    /*
+     * Common nodes: half size with pixel averaging, and edges (cv::Canny,
+     * the reference of addEdges) with FrameEdgeParams as 'args'.
+     */
+    static void halfSize(const std::vector<const cv::Mat*>& inputs,
+      cv::Mat& output, void* args);
+    static void edges(const std::vector<const cv::Mat*>& inputs,
+      cv::Mat& output, void* args);
+
+  private:
+    FrameGraph(const FrameGraph&);
+    FrameGraph& operator=(const FrameGraph&);
+
+    struct Node {
+      std::string name;
+      std::vector<std::string> inputNames;
+      std::string outputName;
+      frame_node_fn fn;
+      void* args;
+
+      /* Indices of the images, and of the nodes to wait for */
+      std::vector<int> inputs;
+      int output;
+      std::vector<int> after;
+
+      std::vector<const cv::Mat*> inputImages;
+      cv::Mat sinkOutput;
+      volatile int done;
+
+      uint32_t runs;
+      uint64_t total_us;
+      uint64_t max_us;
+    };
+
+    int findImage(const std::string& name) const;
+    int addImage(const std::string& name);
+    bool prepare();
+
+    static void runNode(void* args, int index);
+
+    struct EdgeNode;
+    static void detectEdges(const std::vector<const cv::Mat*>& inputs,
+      cv::Mat& output, void* args);
+
+    std::vector<std::string> m_image_names;
+    std::vector<cv::Mat> m_images;
+    std::vector<bool> m_sources;
+
+    /*
+     * The nodes, sorted so every node comes after the nodes it reads
+     * from once the graph is prepared.
+     */
+    std::vector<Node> m_nodes;
+    bool m_prepared;
+
+    /* The detectors of the addEdges nodes, one per graph as they keep
+     * their buffers */
+    std::vector<EdgeNode*> m_edge_nodes;
+
+    /* The graph was found invalid, reported once until it changes */
+    bool m_invalid;
+
+    struct work_pool* m_pool;
+    uint32_t m_threads;
+
+    /* Signals the end of a node to the nodes waiting for it */
+    pthread_mutex_t m_lock;
+    pthread_cond_t m_node_done;
+};
+#endif
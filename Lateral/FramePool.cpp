@@ -0,0 +1,221 @@
+#include "FramePool.h"
+
+#include <iostream>
+#include <new>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+using namespace cv;
+using namespace std;
+
+static const char* messageHeader = "FramePool: ";
+
+/* Reference counts apart, the buffers are released from any thread */
+#define REFCOUNT_STRIDE (64 / sizeof(int))
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+FramePool* FramePool::s_default = NULL;
+
+FramePool::FramePool()
+{
+	m_memory = NULL;
+	m_memory_size = 0;
+	m_buffer_size = 0;
+
+	memset(&m_stats, 0, sizeof(m_stats));
+
+	pthread_mutex_init(&m_lock, NULL);
+}
+
+FramePool::~FramePool()
+{
+	if (s_default == this)
+		setDefault(NULL);
+
+	/* Images still holding buffers keep the memory, it goes with the
+	 * process */
+	if (m_memory != NULL && m_stats.in_use == 0)
+		munmap(m_memory, m_memory_size);
+
+	pthread_mutex_destroy(&m_lock);
+}
+
+bool FramePool::start(uint32_t buffers, size_t buffer_size, int options)
+{
+	if (m_memory != NULL || buffers == 0)
+		return false;
+
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	/* Every buffer starts on a page */
+	buffer_size = (buffer_size + page_size - 1) & ~(page_size - 1);
+	size_t memory_size = buffer_size * buffers;
+
+	void* memory = MAP_FAILED;
+	bool huge = false;
+
+	if (options & FRAME_POOL_HUGE) {
+		size_t huge_size = (memory_size + HUGE_PAGE_SIZE - 1) &
+			~(HUGE_PAGE_SIZE - 1);
+
+		memory = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+		if (memory != MAP_FAILED) {
+			memory_size = huge_size;
+			huge = true;
+		}
+		else {
+			cerr << messageHeader << "WARNING: No huge pages (" <<
+				strerror(errno) << "), using normal pages" << endl;
+		}
+	}
+
+	if (memory == MAP_FAILED) {
+		memory = mmap(NULL, memory_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+		if (memory == MAP_FAILED) {
+			cerr << messageHeader << "ERROR: No memory for " << buffers <<
+				" buffers of " << buffer_size << " bytes" << endl;
+			return false;
+		}
+
+		/* Transparent huge pages, if the kernel has them */
+		if (options & FRAME_POOL_HUGE)
+			madvise(memory, memory_size, MADV_HUGEPAGE);
+	}
+
+	/* Every page written now rather than on the first frame */
+	memset(memory, 0, memory_size);
+
+	bool locked = false;
+
+	if (options & FRAME_POOL_LOCK) {
+		if (mlock(memory, memory_size) == 0)
+			locked = true;
+		else {
+			cerr << messageHeader << "WARNING: Failed to lock " <<
+				memory_size << " bytes (" << strerror(errno) << ")" << endl;
+		}
+	}
+
+	m_memory = (uint8_t*) memory;
+	m_memory_size = memory_size;
+	m_buffer_size = buffer_size;
+
+	/* The first buffers are handed out first */
+	m_free.clear();
+
+	for (uint32_t i = buffers; i > 0; --i)
+		m_free.push_back(i - 1);
+
+	m_refcounts.assign(buffers * REFCOUNT_STRIDE, 0);
+
+	memset(&m_stats, 0, sizeof(m_stats));
+	m_stats.buffers = buffers;
+	m_stats.buffer_size = buffer_size;
+	m_stats.locked = locked;
+	m_stats.huge = huge;
+
+	return true;
+}
+
+bool FramePool::isRunning() const
+{
+	return (m_memory != NULL);
+}
+
+void FramePool::allocate(int dims, const int* sizes, int type,
+	int*& refcount, uchar*& datastart, uchar*& data, size_t* step)
+{
+	/* Continuous, as the heap would have it */
+	size_t total = CV_ELEM_SIZE(type);
+
+	for (int i = dims - 1; i >= 0; --i) {
+		step[i] = total;
+		total *= sizes[i];
+	}
+
+	pthread_mutex_lock(&m_lock);
+
+	if (total <= m_buffer_size && !m_free.empty()) {
+		uint32_t index = m_free.back();
+		m_free.pop_back();
+
+		m_stats.allocations++;
+		m_stats.in_use++;
+
+		if (m_stats.in_use > m_stats.in_use_max)
+			m_stats.in_use_max = m_stats.in_use;
+
+		pthread_mutex_unlock(&m_lock);
+
+		refcount = &m_refcounts[index * REFCOUNT_STRIDE];
+		*refcount = 1;
+		datastart = data = m_memory + (size_t) index * m_buffer_size;
+		return;
+	}
+
+	if (total > m_buffer_size)
+		m_stats.too_large++;
+	else
+		m_stats.exhausted++;
+
+	pthread_mutex_unlock(&m_lock);
+
+	/* From the heap, with the reference count after the image */
+	size_t size = (total + sizeof(int) - 1) & ~(sizeof(int) - 1);
+	void* memory = NULL;
+
+	if (posix_memalign(&memory, 64, size + sizeof(int)) != 0)
+		throw bad_alloc();
+
+	datastart = data = (uchar*) memory;
+	refcount = (int*) (data + size);
+	*refcount = 1;
+}
+
+void FramePool::deallocate(int* refcount, uchar* datastart, uchar* data)
+{
+	if (datastart < m_memory || datastart >= m_memory + m_memory_size) {
+		free(datastart);
+		return;
+	}
+
+	uint32_t index = (datastart - m_memory) / m_buffer_size;
+
+	pthread_mutex_lock(&m_lock);
+	m_free.push_back(index);
+	m_stats.in_use--;
+	pthread_mutex_unlock(&m_lock);
+}
+
+void FramePool::getStats(FramePoolStats& stats) const
+{
+	pthread_mutex_lock(&m_lock);
+	stats = m_stats;
+	pthread_mutex_unlock(&m_lock);
+}
+
+void FramePool::setDefault(FramePool* pool)
+{
+	__atomic_store_n(&s_default, pool, __ATOMIC_RELEASE);
+}
+
+void FramePool::prepare(Mat& mat)
+{
+	FramePool* pool = __atomic_load_n(&s_default, __ATOMIC_ACQUIRE);
+
+	if (pool == NULL || mat.allocator == pool)
+		return;
+
+	/* A buffer of the heap must go back to the heap */
+	if (mat.refcount == NULL)
+		mat.allocator = pool;
+}
@@ -0,0 +1,326 @@
+#include "FrameProcessPool.h"
+#include "FramePool.h"
+
+#include <iostream>
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+using namespace cv;
+using namespace std;
+
+static const char* messageHeader = "FrameProcessPool: ";
+
+FrameProcessPool::FrameProcessPool()
+{
+	m_running = false;
+
+	m_head = 0;
+	m_next_process = 0;
+	m_tail = 0;
+
+	m_done_fd = eventfd(0, EFD_NONBLOCK);
+
+	if (m_done_fd < 0)
+		perror("FrameProcessPool");
+
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_queued, NULL);
+	pthread_cond_init(&m_processed, NULL);
+}
+
+FrameProcessPool::~FrameProcessPool()
+{
+	stop();
+
+	for (size_t i = 0; i < m_workers.size(); ++i)
+		delete m_workers[i];
+
+	if (m_done_fd >= 0)
+		close(m_done_fd);
+
+	pthread_mutex_destroy(&m_lock);
+	pthread_cond_destroy(&m_queued);
+	pthread_cond_destroy(&m_processed);
+}
+
+bool FrameProcessPool::start(uint32_t workers, uint32_t depth,
+	const char* source, const char* result, frame_graph_fn setup,
+	void* args)
+{
+	if (m_running)
+		stop();
+
+	/* The graphs of the previous run are kept until now for the stats */
+	for (size_t i = 0; i < m_workers.size(); ++i)
+		delete m_workers[i];
+
+	m_workers.clear();
+
+	if (m_done_fd < 0)
+		return false;
+
+	if (workers < 1)
+		workers = 1;
+
+	/* Enough slots to keep every worker busy */
+	if (depth < workers)
+		depth = workers;
+
+	m_slots.clear();
+	m_slots.resize(depth);
+
+	for (uint32_t i = 0; i < depth; ++i)
+		m_slots[i].state = kFree;
+
+	m_source = source;
+	m_result = (result != NULL ? result : "");
+
+	m_head = 0;
+	m_next_process = 0;
+	m_tail = 0;
+
+	m_running = true;
+
+	for (uint32_t i = 0; i < workers; ++i) {
+		Worker* worker = new Worker;
+
+		worker->pool = this;
+		worker->job.sequence = 0;
+		worker->job.time = 0;
+		worker->job.capture_ns = 0;
+		worker->job.process_ns = 0;
+
+		setup(worker->graph, worker->job, args);
+
+		if (pthread_create(&worker->thread, NULL,
+			FrameProcessPool::worker, worker) != 0) {
+			delete worker;
+			break;
+		}
+
+		m_workers.push_back(worker);
+	}
+
+	if (m_workers.empty()) {
+		cerr << messageHeader << "ERROR: Failed to start the workers" <<
+			endl;
+		m_running = false;
+		return false;
+	}
+
+	return true;
+}
+
+void FrameProcessPool::stop()
+{
+	pthread_mutex_lock(&m_lock);
+
+	if (!m_running) {
+		pthread_mutex_unlock(&m_lock);
+		return;
+	}
+
+	m_running = false;
+	pthread_cond_broadcast(&m_queued);
+	pthread_cond_broadcast(&m_processed);
+	pthread_mutex_unlock(&m_lock);
+
+	for (size_t i = 0; i < m_workers.size(); ++i)
+		pthread_join(m_workers[i]->thread, NULL);
+}
+
+bool FrameProcessPool::isRunning() const
+{
+	return m_running;
+}
+
+bool FrameProcessPool::isFull() const
+{
+	return (m_tail - m_head == m_slots.size());
+}
+
+bool FrameProcessPool::submit(const Mat& frame, uint32_t sequence,
+	uint32_t time, uint64_t capture_ns)
+{
+	pthread_mutex_lock(&m_lock);
+
+	if (!m_running || isFull()) {
+		pthread_mutex_unlock(&m_lock);
+		return false;
+	}
+
+	Slot& slot = m_slots[m_tail % m_slots.size()];
+
+	/* The slot is free, nobody else touches it until it is queued */
+	pthread_mutex_unlock(&m_lock);
+
+	/* Into the buffer of an earlier frame of the same size */
+	FramePool::prepare(slot.job.frame);
+	frame.copyTo(slot.job.frame);
+	slot.job.sequence = sequence;
+	slot.job.time = time;
+	slot.job.capture_ns = capture_ns;
+	slot.job.process_ns = 0;
+
+	pthread_mutex_lock(&m_lock);
+
+	slot.state = kQueued;
+	m_tail++;
+
+	pthread_cond_signal(&m_queued);
+	pthread_mutex_unlock(&m_lock);
+
+	return true;
+}
+
+void* FrameProcessPool::worker(void* args)
+{
+	Worker* worker = (Worker*) args;
+	FrameProcessPool* pool = worker->pool;
+	FrameJob& job = worker->job;
+
+	pthread_mutex_lock(&pool->m_lock);
+
+	while (true) {
+		while (pool->m_running && pool->m_next_process == pool->m_tail)
+			pthread_cond_wait(&pool->m_queued, &pool->m_lock);
+
+		if (!pool->m_running)
+			break;
+
+		Slot& slot = pool->m_slots[pool->m_next_process %
+			pool->m_slots.size()];
+
+		pool->m_next_process++;
+		slot.state = kProcessing;
+
+		/* The slot belongs to this worker until it is processed, its
+		 * buffers go back to it afterwards */
+		job.sequence = slot.job.sequence;
+		job.time = slot.job.time;
+		job.capture_ns = slot.job.capture_ns;
+		cv::swap(job.frame, slot.job.frame);
+		cv::swap(job.result, slot.job.result);
+
+		pthread_mutex_unlock(&pool->m_lock);
+
+		struct timespec start;
+		struct timespec end;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		worker->graph.setSource(pool->m_source.c_str(), job.frame);
+		worker->graph.run();
+
+		if (!pool->m_result.empty()) {
+			const Mat* result = worker->graph.image(
+				pool->m_result.c_str());
+
+			if (result != NULL) {
+				FramePool::prepare(job.result);
+				result->copyTo(job.result);
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		pthread_mutex_lock(&pool->m_lock);
+
+		slot.job.process_ns = (end.tv_sec - start.tv_sec) *
+			1000000000LL + (end.tv_nsec - start.tv_nsec);
+
+		cv::swap(job.frame, slot.job.frame);
+		cv::swap(job.result, slot.job.result);
+		slot.state = kProcessed;
+
+		pthread_cond_broadcast(&pool->m_processed);
+
+		uint64_t one = 1;
+
+		if (write(pool->m_done_fd, &one, sizeof(one)) != sizeof(one))
+			perror("FrameProcessPool");
+	}
+
+	pthread_mutex_unlock(&pool->m_lock);
+
+	return NULL;
+}
+
+bool FrameProcessPool::next(FrameJob& job)
+{
+	return take(job, true);
+}
+
+bool FrameProcessPool::tryNext(FrameJob& job)
+{
+	return take(job, false);
+}
+
+bool FrameProcessPool::take(FrameJob& job, bool wait)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&m_lock);
+
+	while (m_running && m_head != m_tail) {
+		/* Frames are handed out in the order they were queued, even
+		 * if a later one is processed first */
+		Slot& slot = m_slots[m_head % m_slots.size()];
+
+		if (slot.state == kProcessed) {
+			/* Swap so the caller's buffers are reused by a later frame */
+			job.sequence = slot.job.sequence;
+			job.time = slot.job.time;
+			job.capture_ns = slot.job.capture_ns;
+			job.process_ns = slot.job.process_ns;
+			cv::swap(job.frame, slot.job.frame);
+			cv::swap(job.result, slot.job.result);
+			slot.state = kFree;
+			m_head++;
+			found = true;
+			break;
+		}
+
+		if (!wait)
+			break;
+
+		pthread_cond_wait(&m_processed, &m_lock);
+	}
+
+	pthread_mutex_unlock(&m_lock);
+
+	return found;
+}
+
+int FrameProcessPool::doneEvent() const
+{
+	return m_done_fd;
+}
+
+void FrameProcessPool::getNodeStats(vector<FrameNodeStats>& stats) const
+{
+	stats.clear();
+
+	/* Every graph has the same nodes, in the same order */
+	for (size_t i = 0; i < m_workers.size(); ++i) {
+		vector<FrameNodeStats> workerStats;
+		m_workers[i]->graph.getNodeStats(workerStats);
+
+		if (stats.empty()) {
+			stats = workerStats;
+			continue;
+		}
+
+		for (size_t j = 0; j < stats.size() && j < workerStats.size();
+			++j) {
+			stats[j].runs += workerStats[j].runs;
+			stats[j].total_us += workerStats[j].total_us;
+
+			if (workerStats[j].max_us > stats[j].max_us)
+				stats[j].max_us = workerStats[j].max_us;
+		}
+	}
+}
@@ -0,0 +1,1017 @@
+/*
+ * FrameSource - Frames from a camera, a recording or a generator and
+ * their conversion into OpenCV Mat wrappers
+ * 
+ * Written in 2012 by Martin Fox
+ * 
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ * 
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ * 
+ * Modified in 2013 by Bernardo Villalba Frias
+ */ 
+#include "FrameSource.h"
+#include "FramePool.h"
+#include "OCVCapture.h"
+#include "ReplaySource.h"
+#include "SyntheticSource.h"
+#include "YUYVKernels.h"
+#include "workpool.h"
+
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include <iostream>
+#include <iomanip>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <linux/videodev2.h>
+
+using namespace cv;
+using namespace std;
+
+/*
+ * A conversion of the rows of a frame split in stripes
+ */
+struct ConvertJob {
+	yuyv_kernel kernel;
+	const uint8_t* src;
+	size_t srcStride;
+	uint8_t* dst;
+	size_t dstStride;
+	uint32_t width;
+	uint32_t height;
+	uint32_t rows;
+};
+
+struct LumaJob {
+	FrameSource* capture;
+	const uint8_t* src;
+	size_t srcStride;
+	bool packed;
+	uint32_t width;
+	uint32_t height;
+	uint32_t rows;
+	Mat* gray;
+	Mat* half;
+	Mat* quarter;
+	uint32_t* histograms;
+	uint8_t* scratch;
+};
+
+OCVFrameLease::OCVFrameLease()
+{
+	m_owner = NULL;
+	m_generation = 0;
+	m_index = 0;
+	m_data = NULL;
+	m_size = 0;
+	bzero(&m_info, sizeof(m_info));
+}
+
+OCVFrameLease::~OCVFrameLease()
+{
+	release();
+}
+
+void OCVFrameLease::release()
+{
+	if (m_owner != NULL)
+		m_owner->releaseBuffer(m_index, m_generation);
+
+	m_owner = NULL;
+	m_data = NULL;
+	m_size = 0;
+}
+
+bool OCVFrameLease::isValid() const
+{
+	return (m_data != NULL);
+}
+
+const uint8_t* OCVFrameLease::data() const
+{
+	return m_data;
+}
+
+size_t OCVFrameLease::size() const
+{
+	return m_size;
+}
+
+void OCVFrameLease::copyTo(vector<uint8_t>& copy) const
+{
+	copy.resize(m_size);
+
+	if (m_size > 0)
+		memcpy(&copy[0], m_data, m_size);
+}
+
+const OCVFrameInfo& OCVFrameLease::info() const
+{
+	return m_info;
+}
+
+FrameSource::FrameSource()
+{
+	m_device_id = "/dev/video0";
+	m_desired_width = 640;
+	m_desired_height = 480;
+	m_desired_frame_rate = 5;
+	m_desired_pix_fmt = V4L2_PIX_FMT_YUYV;
+	m_desired_buffers = 4;
+	m_latest_frame = false;
+	m_queue_stats = false;
+	m_stop_fd = -1;
+
+	m_verbose = false;
+
+	m_kernel_name = "auto";
+	m_kernels = yuyvSelectKernels();
+
+	m_pool = NULL;
+	m_conversion_threads = 1;
+	m_conversion_stripes = 1;
+	resetConversionStats();
+
+	m_final_width = 0;
+	m_final_height = 0;
+	m_final_frame_rate = 0;
+
+	m_generation = 0;
+	m_raw_bytes_per_line = 0;
+
+	bzero(&m_capture_stats, sizeof(m_capture_stats));
+}
+
+FrameSource::~FrameSource()
+{
+	work_pool_destroy(m_pool);
+}
+
+static const char* messageHeader = "Capture: ";
+
+FrameSource* FrameSource::create(const char* spec)
+{
+	if (spec == NULL || spec[0] == '\0' || strcmp(spec, "camera") == 0)
+		return new OCVCapture();
+
+	if (strncmp(spec, "synthetic", 9) == 0 && 
+		(spec[9] == '\0' || spec[9] == ':')) {
+		/* synthetic[:<fps>] */
+		SyntheticSource* synthetic = new SyntheticSource();
+		char* end;
+
+		if (spec[9] == ':') {
+			long fps = strtol(spec + 10, &end, 10);
+
+			if (end == spec + 10 || *end != '\0' || fps < 0) {
+				cerr << messageHeader << "ERROR: Invalid frame rate " << 
+					spec + 10 << endl;
+				delete synthetic;
+				return NULL;
+			}
+
+			synthetic->setRate(fps);
+		}
+
+		return synthetic;
+	}
+
+	if (strncmp(spec, "replay:", 7) == 0) {
+		/* replay:<file>[,fast][,loop] */
+		string path = spec + 7;
+		bool fast = false;
+		bool loop = false;
+		size_t comma;
+
+		while ((comma = path.rfind(',')) != string::npos) {
+			string option = path.substr(comma + 1);
+
+			if (option == "fast")
+				fast = true;
+			else if (option == "loop")
+				loop = true;
+			else
+				break;
+
+			path.erase(comma);
+		}
+
+		ReplaySource* replay = new ReplaySource(path.c_str());
+		replay->setRealTime(!fast);
+		replay->setLoop(loop);
+
+		return replay;
+	}
+
+	cerr << messageHeader << "ERROR: Unknown frame source " << spec << endl;
+
+	return NULL;
+}
+
+/*
+ * Called by the sources when they are opened: picks the conversion
+ * kernels for this CPU and clears the counters.
+ */
+void FrameSource::openSource()
+{
+	if (strcmp(m_kernel_name, "auto") == 0)
+		m_kernels = yuyvSelectKernels();
+	else
+		m_kernels = yuyvKernels(m_kernel_name);
+
+	if (m_verbose) {
+		cout << messageHeader << "conversion kernel " << 
+			m_kernels->name << endl;
+	}
+
+	bzero(&m_capture_stats, sizeof(m_capture_stats));
+}
+
+/*
+ * Called by the sources when they are closed, before their buffers
+ * go away.
+ */
+void FrameSource::closeSource()
+{
+	m_current.release();
+	m_generation++;
+
+	m_raw_bytes_per_line = 0;
+
+	m_final_height = 0;
+	m_final_width = 0;
+	m_final_frame_rate = 0;
+}
+
+/*
+ * Lease the buffer 'index' of the source to the caller, the buffer is
+ * given back to 'releaseBuffer' when the lease is released.
+ */
+OCVFrameInfo& FrameSource::leaseFrame(OCVFrameLease& lease, 
+	uint32_t index, const uint8_t* data, size_t size)
+{
+	lease.m_owner = this;
+	lease.m_generation = m_generation;
+	lease.m_index = index;
+	lease.m_data = data;
+	lease.m_size = size;
+	bzero(&lease.m_info, sizeof(lease.m_info));
+
+	m_capture_stats.grabbed++;
+
+	return lease.m_info;
+}
+
+void FrameSource::configureCapture(char* id, uint32_t width, 
+  uint32_t height, uint32_t fps, char* pixfmt)
+{
+	/* Check if device is open */
+	if (isOpen()) {
+		reportError("ERROR: Can't configure device while open");
+		return;
+	}
+
+	/* Set the id of the device */
+	if (id != m_device_id)
+		m_device_id = id;
+
+	/* Set the width of the capture */
+	if (width != m_desired_width)
+		m_desired_width = width;
+		
+	/* Set the height of the capture */
+	if (height != m_desired_height)
+		m_desired_height = height;
+
+	/* Set the frame rate of the capture */
+	if (fps != m_desired_frame_rate)
+		m_desired_frame_rate = fps;
+
+	// Set the pixel format of the capture
+	if (strcmp(pixfmt,"YUYV") == 0) {
+		m_desired_pix_fmt = V4L2_PIX_FMT_YUYV;
+	} 
+	else if (strcmp(pixfmt,"MJPEG") == 0) {
+		m_desired_pix_fmt = V4L2_PIX_FMT_MJPEG;
+	} 
+	else {
+		reportError("ERROR: The pixel format is not handled");
+		return;
+	}
+}
+
+void FrameSource::setBufferCount(uint32_t count)
+{
+	/* Check if device is open */
+	if (isOpen()) {
+		reportError("ERROR: Can't change the buffers while open");
+		return;
+	}
+
+	m_desired_buffers = (count > 0 ? count : 1);
+}
+
+uint32_t FrameSource::bufferCount() const
+{
+	return m_desired_buffers;
+}
+
+void FrameSource::setLatestFrame(bool latest)
+{
+	m_latest_frame = latest;
+}
+
+bool FrameSource::latestFrame() const
+{
+	return m_latest_frame;
+}
+
+void FrameSource::setQueueStats(bool enable)
+{
+	m_queue_stats = enable;
+}
+
+bool FrameSource::queueStats() const
+{
+	return m_queue_stats;
+}
+
+void FrameSource::setStopEvent(int fd)
+{
+	m_stop_fd = fd;
+}
+
+int FrameSource::stopEvent() const
+{
+	return m_stop_fd;
+}
+
+bool FrameSource::waitUntil(uint64_t due_ns)
+{
+	struct pollfd stop;
+
+	stop.fd = m_stop_fd;
+	stop.events = POLLIN;
+	stop.revents = 0;
+
+	while (true) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		uint64_t now_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+		if (now_ns >= due_ns)
+			return true;
+
+		struct timespec timeout;
+		timeout.tv_sec = (due_ns - now_ns) / 1000000000ULL;
+		timeout.tv_nsec = (due_ns - now_ns) % 1000000000ULL;
+
+		/* Without a stop event this is a plain sleep */
+		int numReady = ppoll(&stop, (m_stop_fd >= 0 ? 1 : 0), &timeout, 
+			NULL);
+
+		if (numReady > 0 && (stop.revents & POLLIN))
+			return false;
+	}
+}
+
+void FrameSource::reportError(const char *error)
+{
+	cerr << messageHeader << error << endl;
+}
+
+void FrameSource::reportError(const char* error, int64_t value)
+{
+	cerr << messageHeader << error << " " << value << endl;
+}
+
+void FrameSource::setVerbose(bool verboseOn)
+{
+	m_verbose = verboseOn;
+}
+
+bool FrameSource::verbose() const
+{
+	return m_verbose;
+}
+
+bool FrameSource::setConversionKernel(const char* name)
+{
+	if (strcmp(name, "auto") != 0 && yuyvKernels(name) == NULL) {
+		reportError("ERROR: Conversion kernel not supported");
+		return false;
+	}
+
+	m_kernel_name = name;
+
+	return true;
+}
+
+const char* FrameSource::conversionKernel() const
+{
+	return m_kernels->name;
+}
+
+bool FrameSource::setConversionThreads(uint32_t threads, uint32_t stripes)
+{
+	if (threads < 1)
+		threads = 1;
+
+	if (stripes < 1)
+		stripes = threads;
+
+	if (threads != m_conversion_threads) {
+		work_pool_destroy(m_pool);
+		m_pool = NULL;
+
+		if (threads > 1) {
+			m_pool = work_pool_create(threads);
+
+			if (m_pool == NULL) {
+				reportError("ERROR: Failed to start the conversion threads");
+				m_conversion_threads = 1;
+				m_conversion_stripes = 1;
+				return false;
+			}
+
+			/* Not every worker could be started */
+			if ((uint32_t) work_pool_threads(m_pool) != threads)
+				reportError("conversion threads started", 
+					work_pool_threads(m_pool));
+		}
+
+		m_conversion_threads = work_pool_threads(m_pool);
+	}
+
+	m_conversion_stripes = stripes;
+
+	return true;
+}
+
+uint32_t FrameSource::conversionThreads() const
+{
+	return m_conversion_threads;
+}
+
+uint32_t FrameSource::conversionStripes() const
+{
+	return m_conversion_stripes;
+}
+
+void FrameSource::getConversionStats(OCVConversionStats& stats) const
+{
+	stats = m_conversion_stats;
+}
+
+void FrameSource::resetConversionStats()
+{
+	bzero(&m_conversion_stats, sizeof(m_conversion_stats));
+}
+
+void FrameSource::updateConversionStats(const struct timespec& start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	uint64_t elapsed = (end.tv_sec - start.tv_sec) * 1000000LL + 
+		(end.tv_nsec - start.tv_nsec) / 1000;
+
+	m_conversion_stats.frames++;
+	m_conversion_stats.total_us += elapsed;
+
+	if (elapsed > m_conversion_stats.max_us)
+		m_conversion_stats.max_us = elapsed;
+}
+
+void FrameSource::getCaptureStats(OCVCaptureStats& stats) const
+{
+	stats = m_capture_stats;
+}
+
+void FrameSource::countDroppedFrame()
+{
+	m_capture_stats.app_dropped++;
+}
+
+bool FrameSource::setDecodeScale(uint32_t scale)
+{
+	if (!m_decoder.setScale(scale)) {
+		reportError("ERROR: Decode scale not supported", scale);
+		return false;
+	}
+
+	return true;
+}
+
+uint32_t FrameSource::decodeScale() const
+{
+	return m_decoder.scale();
+}
+
+uint32_t FrameSource::corruptFrames() const
+{
+	return m_decoder.corruptFrames();
+}
+
+uint32_t FrameSource::getWidth() const
+{
+	return m_final_width;
+}
+
+uint32_t FrameSource::getHeight() const
+{
+	return m_final_height;
+}
+
+uint32_t FrameSource::getFrameRate() const
+{
+	return m_final_frame_rate;
+}
+
+uint32_t FrameSource::getBytesPerLine() const
+{
+	return m_raw_bytes_per_line;
+}
+
+bool FrameSource::grabFrame(uint32_t& time)
+{
+	/* The previous frame goes back to the driver before waiting */
+	m_current.release();
+
+	return grabFrame(m_current, time);
+}
+
+void FrameSource::resizeMat(Mat& mat, int matType)
+{
+	resizeMat(mat, matType, m_final_height, m_final_width);
+}
+
+void FrameSource::resizeMat(Mat& mat, int matType, uint32_t height, 
+	uint32_t width)
+{
+	if (mat.empty() || mat.rows != (int) height || 
+		mat.cols != (int) width || mat.type() != matType) {
+		/* A buffer of the pool when there is one */
+		mat.release();
+		FramePool::prepare(mat);
+		mat.create(height, width, matType);
+	}
+}
+
+/*
+ * Rows in each stripe of a frame. Stripes start on a multiple of 4
+ * rows so the luma downscaling never needs rows of another stripe.
+ */
+uint32_t FrameSource::stripeRows(uint32_t height) const
+{
+	uint32_t rows = (height + m_conversion_stripes - 1) / 
+		m_conversion_stripes;
+
+	return (rows + 3) & ~3;
+}
+
+void FrameSource::convertStripe(void* args, int index)
+{
+	ConvertJob* job = (ConvertJob*) args;
+	uint32_t firstRow = index * job->rows;
+	uint32_t rows = job->rows;
+
+	if (firstRow >= job->height)
+		return;
+
+	if (firstRow + rows > job->height)
+		rows = job->height - firstRow;
+
+	job->kernel(job->src + firstRow * job->srcStride, job->srcStride, 
+		job->dst + firstRow * job->dstStride, job->dstStride, 
+		job->width, rows);
+}
+
+void FrameSource::convertRows(yuyv_kernel kernel, const uint8_t* src, 
+	size_t srcStride, uint8_t* dst, size_t dstStride)
+{
+	if (m_conversion_stripes == 1) {
+		kernel(src, srcStride, dst, dstStride, m_final_width, 
+			m_final_height);
+		return;
+	}
+
+	ConvertJob job;
+	job.kernel = kernel;
+	job.src = src;
+	job.srcStride = srcStride;
+	job.dst = dst;
+	job.dstStride = dstStride;
+	job.width = m_final_width;
+	job.height = m_final_height;
+	job.rows = stripeRows(m_final_height);
+
+	work_pool_run(m_pool, convertStripe, &job, 
+		(m_final_height + job.rows - 1) / job.rows);
+}
+
+bool FrameSource::yuv2gray(Mat& grayMat)
+{
+	return yuv2gray(m_current, grayMat);
+}
+
+bool FrameSource::yuv2gray(const OCVFrameLease& frame, Mat& grayMat)
+{
+	if (!isOpen())
+		return false;
+
+	if (!frame.isValid())
+		return false;
+
+	resizeMat(grayMat, CV_8UC1);
+
+	convertRows(m_kernels->gray, frame.data(), m_raw_bytes_per_line, 
+		grayMat.data, grayMat.step);
+
+	return true;
+}
+
+bool FrameSource::yuv2rgb(Mat& rgbMat)
+{
+	return yuv2rgb(m_current, rgbMat);
+}
+
+bool FrameSource::yuv2rgb(const OCVFrameLease& frame, Mat& rgbMat)
+{
+	if (!isOpen())
+		return false;
+
+	if (!frame.isValid())
+		return false;
+
+	resizeMat(rgbMat, CV_8UC3);
+
+	/* The YCbCr standard is chosen at compile time, see YUYVKernels.h */
+	convertRows(m_kernels->rgb, frame.data(), m_raw_bytes_per_line, 
+		rgbMat.data, rgbMat.step);
+
+	return true;
+}
+
+bool FrameSource::yuv2yuv(Mat& yuvMat)
+{
+	return yuv2yuv(m_current, yuvMat);
+}
+
+bool FrameSource::yuv2yuv(const OCVFrameLease& frame, Mat& yuvMat)
+{
+	if (!isOpen())
+		return false;
+
+	if (!frame.isValid())
+		return false;
+
+	resizeMat(yuvMat, CV_8UC3);
+
+	convertRows(m_kernels->yuv, frame.data(), m_raw_bytes_per_line, 
+		yuvMat.data, yuvMat.step);
+
+	return true;
+}
+
+bool FrameSource::mjpeg2gray(Mat& grayMat)
+{
+	return mjpeg2gray(m_current, grayMat);
+}
+
+bool FrameSource::mjpeg2gray(const OCVFrameLease& frame, Mat& grayMat)
+{
+	if (!isOpen())
+		return false;
+
+	if (!frame.isValid())
+		return false;
+
+	/* Only the luma is decoded, into the Mat of the previous frame */
+	return m_decoder.gray(frame.data(), frame.size(), grayMat);
+}
+
+bool FrameSource::mjpeg2rgb(Mat& rgbMat)
+{
+	return mjpeg2rgb(m_current, rgbMat);
+}
+
+bool FrameSource::mjpeg2rgb(const OCVFrameLease& frame, Mat& rgbMat)
+{
+	if (!isOpen())
+		return false;
+
+	if (!frame.isValid())
+		return false;
+
+	return m_decoder.rgb(frame.data(), frame.size(), rgbMat);
+}
+
+bool FrameSource::gray(Mat& grayMat)
+{
+	return gray(m_current, grayMat);
+}
+
+bool FrameSource::gray(const OCVFrameLease& frame, Mat& grayMat)
+{
+	struct timespec start;
+	bool result;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	switch (m_desired_pix_fmt) {
+		case V4L2_PIX_FMT_YUYV:
+			result = FrameSource::yuv2gray(frame, grayMat);
+			break;
+		case V4L2_PIX_FMT_MJPEG:
+			result = FrameSource::mjpeg2gray(frame, grayMat);
+			break;
+		default:
+			reportError("ERROR: Can't parse that pixel format");
+			return -1;
+	}
+
+	if (result)
+		updateConversionStats(start);
+
+	return result;
+}
+
+bool FrameSource::rgb(Mat& rgbMat)
+{
+	return rgb(m_current, rgbMat);
+}
+
+bool FrameSource::rgb(const OCVFrameLease& frame, Mat& rgbMat)
+{
+	struct timespec start;
+	bool result;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	switch (m_desired_pix_fmt){
+		case V4L2_PIX_FMT_YUYV:
+			result = FrameSource::yuv2rgb(frame, rgbMat);
+			break;
+		case V4L2_PIX_FMT_MJPEG:
+			result = FrameSource::mjpeg2rgb(frame, rgbMat);
+			break;
+		default:
+			reportError("Cannot parse that pixel format");
+			return -1;
+	}
+
+	if (result)
+		updateConversionStats(start);
+
+	return result;
+}
+
+bool FrameSource::luma(Mat* grayMat, Mat* halfMat, Mat* quarterMat, 
+	OCVLumaStats* stats)
+{
+	return luma(m_current, grayMat, halfMat, quarterMat, stats);
+}
+
+bool FrameSource::luma(const OCVFrameLease& frame, Mat* grayMat, 
+	Mat* halfMat, Mat* quarterMat, OCVLumaStats* stats)
+{
+	if (!isOpen())
+		return false;
+
+	if (!frame.isValid())
+		return false;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	const uint8_t* src = NULL;
+	size_t srcStride = 0;
+	bool packed = true;
+	uint32_t width = m_final_width;
+	uint32_t height = m_final_height;
+
+	switch (m_desired_pix_fmt) {
+		case V4L2_PIX_FMT_YUYV:
+			src = frame.data();
+			srcStride = m_raw_bytes_per_line;
+
+			if (grayMat != NULL)
+				resizeMat(*grayMat, CV_8UC1);
+			break;
+		case V4L2_PIX_FMT_MJPEG: {
+			/* The luma only exists once the frame is decoded, the
+			 * rest of the outputs are computed from it */
+			Mat* decoded = (grayMat != NULL ? grayMat : &m_luma_decoded);
+
+			if (!mjpeg2gray(frame, *decoded) || decoded->empty())
+				return false;
+
+			src = decoded->data;
+			srcStride = decoded->step;
+			packed = false;
+			width = decoded->cols;
+			height = decoded->rows;
+			grayMat = NULL;
+			break;
+		}
+		default:
+			reportError("ERROR: Can't parse that pixel format");
+			return false;
+	}
+
+	if (halfMat != NULL)
+		resizeMat(*halfMat, CV_8UC1, height / 2, width / 2);
+
+	if (quarterMat != NULL)
+		resizeMat(*quarterMat, CV_8UC1, height / 4, width / 4);
+
+	/* Each stripe counts its own histogram and keeps its last four
+	 * luma rows when the gray image is not wanted */
+	LumaJob job;
+	job.capture = this;
+	job.src = src;
+	job.srcStride = srcStride;
+	job.packed = packed;
+	job.width = width;
+	job.height = height;
+	job.rows = stripeRows(height);
+	job.gray = grayMat;
+	job.half = halfMat;
+	job.quarter = quarterMat;
+	job.histograms = NULL;
+
+	uint32_t stripes = (height + job.rows - 1) / job.rows;
+
+	m_luma_rows.resize(stripes * 4 * width + 1);
+	job.scratch = &m_luma_rows[0];
+
+	if (stats != NULL) {
+		bzero(stats, sizeof(*stats));
+
+		if (stripes > 1) {
+			m_luma_histograms.assign(stripes * 256, 0);
+			job.histograms = &m_luma_histograms[0];
+		}
+		else
+			job.histograms = stats->histogram;
+	}
+
+	work_pool_run(m_pool, lumaStripe, &job, stripes);
+
+	if (stats != NULL) {
+		uint64_t sum = 0;
+
+		if (stripes > 1) {
+			for (uint32_t i = 0; i < stripes; ++i) {
+				uint32_t* histogram = job.histograms + i * 256;
+
+				for (int value = 0; value < 256; ++value)
+					stats->histogram[value] += histogram[value];
+			}
+		}
+
+		for (int value = 0; value < 256; ++value)
+			sum += (uint64_t) value * stats->histogram[value];
+
+		stats->pixels = width * height;
+		stats->mean = (stats->pixels > 0 ? 
+			(double) sum / stats->pixels : 0.0);
+	}
+
+	updateConversionStats(start);
+
+	return true;
+}
+
+void FrameSource::lumaStripe(void* args, int index)
+{
+	LumaJob* job = (LumaJob*) args;
+	uint32_t firstRow = index * job->rows;
+	uint32_t lastRow = firstRow + job->rows;
+
+	if (firstRow >= job->height)
+		return;
+
+	if (lastRow > job->height)
+		lastRow = job->height;
+
+	job->capture->lumaRows(job->src, job->srcStride, job->packed, 
+		job->width, firstRow, lastRow, job->gray, job->half, job->quarter, 
+		(job->histograms != NULL ? job->histograms + index * 256 : NULL), 
+		job->scratch + index * 4 * job->width);
+}
+
+/*
+ * Produces the luma outputs for the rows firstRow to lastRow, which
+ * must start on a multiple of 4. Each source row is read once, the
+ * downscaled rows and the histogram are computed from the luma rows
+ * while they are still in the cache.
+ */
+void FrameSource::lumaRows(const uint8_t* src, size_t srcStride, 
+	bool packed, uint32_t width, uint32_t firstRow, uint32_t lastRow, 
+	Mat* grayMat, Mat* halfMat, Mat* quarterMat, uint32_t* histogram, 
+	uint8_t* scratch)
+{
+	const uint8_t* rows[4] = { NULL, NULL, NULL, NULL };
+
+	/* Counting in separate tables avoids stalls on repeated values */
+	uint32_t counts[4][256];
+
+	if (histogram != NULL)
+		bzero(counts, sizeof(counts));
+
+	for (uint32_t rowIndex = firstRow; rowIndex < lastRow; ++rowIndex) {
+		const uint8_t* getIt = src + rowIndex * srcStride;
+		const uint8_t* row = getIt;
+
+		if (packed) {
+			uint8_t* putIt = (grayMat != NULL ? grayMat->ptr(rowIndex) :
+				scratch + (rowIndex & 3) * width);
+
+			m_kernels->gray(getIt, srcStride, putIt, width, width, 1);
+			row = putIt;
+		}
+
+		rows[rowIndex & 3] = row;
+
+		if (histogram != NULL) {
+			uint32_t colIndex = 0;
+
+			for (; colIndex + 4 <= width; colIndex += 4) {
+				counts[0][row[colIndex]]++;
+				counts[1][row[colIndex + 1]]++;
+				counts[2][row[colIndex + 2]]++;
+				counts[3][row[colIndex + 3]]++;
+			}
+
+			for (; colIndex < width; ++colIndex)
+				counts[0][row[colIndex]]++;
+		}
+
+		/* Average 2x2 blocks once the second row is there */
+		if (halfMat != NULL && (rowIndex & 1) == 1 && 
+			(int) (rowIndex / 2) < halfMat->rows) {
+			const uint8_t* top = rows[(rowIndex - 1) & 3];
+			uint8_t* putIt = halfMat->ptr(rowIndex / 2);
+
+			for (int colIndex = 0; colIndex < halfMat->cols; ++colIndex) {
+				int x = 2 * colIndex;
+				putIt[colIndex] = (top[x] + top[x + 1] + row[x] + 
+					row[x + 1] + 2) >> 2;
+			}
+		}
+
+		/* Average 4x4 blocks once the fourth row is there */
+		if (quarterMat != NULL && (rowIndex & 3) == 3 && 
+			(int) (rowIndex / 4) < quarterMat->rows) {
+			uint8_t* putIt = quarterMat->ptr(rowIndex / 4);
+
+			for (int colIndex = 0; colIndex < quarterMat->cols; 
+				++colIndex) {
+				int x = 4 * colIndex;
+				int sum = 8;
+
+				for (int i = 0; i < 4; ++i) {
+					sum += rows[i][x] + rows[i][x + 1] + rows[i][x + 2] + 
+						rows[i][x + 3];
+				}
+
+				putIt[colIndex] = sum >> 4;
+			}
+		}
+	}
+
+	if (histogram != NULL) {
+		for (int value = 0; value < 256; ++value) {
+			histogram[value] += counts[0][value] + counts[1][value] + 
+				counts[2][value] + counts[3][value];
+		}
+	}
+}
+
+const OCVFrameInfo& FrameSource::frameInfo() const
+{
+	return m_current.info();
+}
+
+bool FrameSource::keepFrame(vector<uint8_t>& copy) const
+{
+	if (!m_current.isValid())
+		return false;
+
+	m_current.copyTo(copy);
+
+	return true;
+}
@@ -0,0 +1,466 @@
+/*
+ * FrameSource - Frames from a camera, a recording or a generator and
+ * their conversion into OpenCV Mat wrappers
+ * 
+ * Written in 2012 by Martin Fox
+ * 
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ * 
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ * 
+ * The capture and processing code only talks to a FrameSource, so it
+ * runs the same on frames from the camera (OCVCapture), from a
+ * recording (ReplaySource) or from a pattern generator
+ * (SyntheticSource). The sources only deliver raw YUYV or MJPEG
+ * frames, the conversions are shared.
+ * 
+ * Modified in 2013 by Bernardo Villalba Frias
+ */
+#ifndef FRAMESOURCE_H
+#define FRAMESOURCE_H
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <vector>
+#include <string>
+
+#include "YUYVKernels.h"
+#include "MJPEGDecoder.h"
+
+class FrameSource;
+struct work_pool;
+
+/*
+ * Brightness statistics of the luma of a frame.
+ */
+struct OCVLumaStats
+{
+    uint32_t histogram[256];
+    uint32_t pixels;
+    double mean;
+};
+
+/*
+ * What the driver tells about a grabbed frame.
+ */
+struct OCVFrameInfo
+{
+    /* Counted by the driver, gaps are frames it dropped */
+    uint32_t sequence;
+    uint32_t dropped;
+
+    /* Capture time, CLOCK_MONOTONIC when 'monotonic' is set */
+    uint64_t timestamp_ns;
+    bool monotonic;
+
+    /* Time from the capture to the dequeue, -1 if unknown */
+    int64_t latency_ns;
+
+    uint32_t bytesused;
+
+    /* The driver flagged the data as (possibly) corrupt */
+    bool error;
+
+    /* Older ready frames given back unused (latest frame mode) */
+    uint32_t skipped;
+
+    /* Newer frames already waiting when this one was delivered and
+     * how much newer the newest of them is (0 unless setQueueStats) */
+    uint32_t behind;
+    uint64_t behind_ns;
+};
+
+/*
+ * Running frame counters since the camera was opened. The frames
+ * dropped by the driver are the gaps in the sequence numbers, which
+ * happen when no buffer is queued because the application holds them
+ * all. The application reports the frames it grabbed but discarded.
+ */
+struct OCVCaptureStats
+{
+    uint32_t grabbed;
+    uint32_t driver_dropped;
+    uint32_t error_frames;
+    uint32_t app_dropped;
+
+    /* Frames skipped to deliver the latest one */
+    uint32_t skipped;
+
+    /* How stale the delivered frames were, see OCVFrameInfo */
+    uint64_t behind_total;
+    uint32_t behind_max;
+    uint64_t behind_max_ns;
+};
+
+/*
+ * Time spent in the conversions ('gray', 'rgb' and 'luma') since the
+ * statistics were last reset.
+ */
+struct OCVConversionStats
+{
+    uint32_t frames;
+    uint64_t total_us;
+    uint64_t max_us;
+};
+
+/*
+ * A lease on one of the buffers of a frame source (e.g. the memory
+ * mapped buffers of the driver). While the lease is held the buffer
+ * stays dequeued and the frame can be read in place, without copying
+ * it. Releasing the lease (or letting it go out of scope) puts the
+ * buffer back on the driver queue, so do not hold on to it for longer
+ * than needed: the driver has only a few buffers. Leases cannot be
+ * copied, use 'copyTo' to keep a frame.
+ */
+class OCVFrameLease
+{
+  public:
+    OCVFrameLease();
+    ~OCVFrameLease();
+
+    /*
+     * Give the buffer back to the driver. Releasing an empty lease
+     * does nothing.
+     */
+    void release();
+    bool isValid() const;
+
+    /*
+     * Read-only view of the raw frame, only 'size' bytes (the bytes
+     * actually used by the driver) are meaningful.
+     */
+    const uint8_t* data() const;
+    size_t size() const;
+
+    /*
+     * Copy the raw frame so it can be kept after the lease is gone.
+     */
+    void copyTo(std::vector<uint8_t>& copy) const;
+
+    /*
+     * Sequence number, timestamp and flags of the frame.
+     */
+    const OCVFrameInfo& info() const;
+
+  private:
+    OCVFrameLease(const OCVFrameLease&);
+    OCVFrameLease& operator=(const OCVFrameLease&);
+
+    friend class FrameSource;
+
+    FrameSource* m_owner;
+    uint32_t m_generation;
+    uint32_t m_index;
+    const uint8_t* m_data;
+    size_t m_size;
+    OCVFrameInfo m_info;
+};
+
+class FrameSource
+{
+  public:
+    FrameSource();
+    virtual ~FrameSource();
+
+    /*
+     * Create the source described by 'spec': "camera" (or NULL) for
+     * the camera, "synthetic[:<fps>]" for generated frames (at the
+     * configured rate, or <fps>, 0 for as fast as they are grabbed) and
+     * "replay:<file>[,fast][,loop]" to replay a recording made with
+     * AVIRecorder. Returns NULL if the spec is not valid.
+     */
+    static FrameSource* create(const char* spec);
+
+    /*
+     * You can turn on verbose mode to which will cause the capture
+     * object to spew debug messages to cout.
+     */
+    void setVerbose(bool verboseOn);
+    bool verbose() const;
+
+    /*
+     * The YUYV conversions use the fastest kernels supported by the
+     * CPU, picked when the capture object is opened. A kernel can be
+     * forced by name ("scalar", "sse2", "avx2", "neon") to compare
+     * them, "auto" goes back to the automatic choice. Returns false if
+     * the kernel is not supported.
+     */
+    bool setConversionKernel(const char* name);
+    const char* conversionKernel() const;
+
+    /*
+     * The conversions can split the frame into row stripes converted
+     * in parallel by a pool of threads, the calling thread being one
+     * of them. The result is the same as converting serially. By
+     * default there is a single thread; 'stripes' set to 0 means one
+     * stripe per thread. More stripes than threads balances the load
+     * better when the cores are also busy with other work. The
+     * conversion times can be compared for different thread counts
+     * with 'getConversionStats'.
+     */
+    bool setConversionThreads(uint32_t threads, uint32_t stripes = 0);
+    uint32_t conversionThreads() const;
+    uint32_t conversionStripes() const;
+
+    void getConversionStats(OCVConversionStats& stats) const;
+    void resetConversionStats();
+
+    /*
+     * Frame counters, 'countDroppedFrame' is called by the application
+     * for each grabbed frame it does not use.
+     */
+    void getCaptureStats(OCVCaptureStats& stats) const;
+    void countDroppedFrame();
+
+    /*
+     * MJPEG frames can be decoded at 1/2, 1/4 or 1/8 of the captured
+     * size (scale 2, 4 or 8), which is much faster than decoding them
+     * whole. The size of the decoded images is then not the size
+     * returned by 'getWidth' and 'getHeight'. Truncated or corrupt
+     * frames are not converted and are counted by 'corruptFrames'.
+     */
+    bool setDecodeScale(uint32_t scale);
+    uint32_t decodeScale() const;
+    uint32_t corruptFrames() const;
+
+    /*
+     * When the capture object is closed you can set the size. At the
+     * time the capture object is opened the hardware will be queried
+     * for a supported size which may differ from the requested size,
+     * so do not assume the images you retrieve from the capture object
+     * are the requested size.
+     */
+    void configureCapture(char* id, uint32_t width, uint32_t height, 
+      uint32_t fps, char* pixfmt);
+
+    /*
+     * Number of buffers requested to the driver when the capture
+     * object is opened (4 by default). More buffers absorb longer
+     * processing hiccups without dropping frames, fewer keep the
+     * frames fresher.
+     */
+    void setBufferCount(uint32_t count);
+    uint32_t bufferCount() const;
+
+    /*
+     * By default 'grabFrame' returns the oldest frame in the queue, so
+     * no frame is lost but when the processing falls behind the frames
+     * are several periods old. In latest frame mode every ready frame
+     * is dequeued, the newest one is returned and the others go back
+     * to the driver. The staleness of the frames is in OCVFrameInfo.
+     */
+    void setLatestFrame(bool latest);
+    bool latestFrame() const;
+
+    /*
+     * Count the newer frames waiting behind every delivered one (the
+     * 'behind' fields), off by default: for a camera it queries every
+     * other buffer of the driver at each frame. Not counted in latest
+     * frame mode, which leaves nothing behind.
+     */
+    void setQueueStats(bool enable);
+    bool queueStats() const;
+
+    /*
+     * 'grabFrame' returns false, without a frame, as soon as 'fd'
+     * becomes readable (e.g. an eventfd written by the thread stopping
+     * the capture) instead of waiting for the next frame. The event is
+     * left for the caller to read. -1 (the default) disables it.
+     */
+    void setStopEvent(int fd);
+    int stopEvent() const;
+
+    /*
+     * Before capturing images you must open the capture object.
+     * The open call returns true if it was successful.
+     * Open to read from the camera.
+     */
+    virtual bool openCamera() = 0;
+
+    /*
+     * Returns true if the capture object is open.
+     */
+    virtual bool isOpen() const = 0;
+
+    /*
+     * After the capture object is opened you can query for the final
+     * size that it negotiated with the camera.
+     */
+    uint32_t getWidth() const;
+    uint32_t getHeight() const;
+    uint32_t getFrameRate() const;
+
+    /*
+     * Bytes from a row of the raw frames to the next, 0 when they are
+     * compressed. Only frames with rows packed (twice the width in
+     * YUYV) can be recorded as they are.
+     */
+    uint32_t getBytesPerLine() const;
+
+    /*
+     * Close the capture object. This releases the video device and
+     * frees up driver-related memory. You can change the desired image
+     * size while the object is closed.
+     */
+    virtual void closeCamera() = 0;
+
+    /*
+     * The capturing process is divided into two parts. In the first
+     * step you call 'grabFrame' to actually grab the (RAW) image. Then
+     * later you call 'gray' to convert the grabbed image to the
+     * desired color space depending on the pixel format chosen.
+     * The grabbed frame is not copied: it stays leased from the driver
+     * until the next call to 'grabFrame' and the conversions read it
+     * in place. Call 'keepFrame' to copy the raw data of the frame
+     * and 'frameInfo' for its sequence number, timestamp and flags.
+     */
+    bool grabFrame(uint32_t& time);
+    bool gray(cv::Mat& gray);
+    bool rgb(cv::Mat& rgb);
+    bool keepFrame(std::vector<uint8_t>& copy) const;
+    const OCVFrameInfo& frameInfo() const;
+
+    /*
+     * Grab a frame into a lease owned by the caller instead. The frame
+     * stays out of the driver queue until the lease is released, which
+     * can happen from any thread. Leases must be released before the
+     * camera is closed.
+     */
+    virtual bool grabFrame(OCVFrameLease& lease, uint32_t& time) = 0;
+    bool gray(const OCVFrameLease& frame, cv::Mat& gray);
+    bool rgb(const OCVFrameLease& frame, cv::Mat& rgb);
+
+    /*
+     * Reads the luma of the grabbed frame in a single pass and produces
+     * any set of: the gray image, the gray image downscaled by 2 and by
+     * 4 (averaging blocks of 2x2 and 4x4 pixels) and the histogram of
+     * the luma with its mean. Pass NULL for the outputs not needed.
+     * Compressed frames are decoded to gray first.
+     */
+    bool luma(cv::Mat* gray, cv::Mat* half, cv::Mat* quarter, 
+      OCVLumaStats* stats);
+    bool luma(const OCVFrameLease& frame, cv::Mat* gray, cv::Mat* half, 
+      cv::Mat* quarter, OCVLumaStats* stats);
+
+    bool yuv2rgb(cv::Mat& rgb);
+    bool yuv2gray(cv::Mat& gray);
+    bool yuv2yuv(cv::Mat& yuv);
+    bool mjpeg2rgb(cv::Mat& rgb);
+    bool mjpeg2gray(cv::Mat& gray);
+
+  protected:
+    friend class OCVFrameLease;
+
+    /*
+     * Give back a buffer leased with 'leaseFrame'. Buffers of an older
+     * generation (before the source was closed) must be ignored.
+     */
+    virtual void releaseBuffer(uint32_t index, uint32_t generation) = 0;
+
+    void openSource();
+    void closeSource();
+    OCVFrameInfo& leaseFrame(OCVFrameLease& lease, uint32_t index, 
+      const uint8_t* data, size_t size);
+
+    void reportError(const char* error);
+    void reportError(const char* error, int64_t value);
+
+    /*
+     * Sleep until 'due_ns' on the monotonic clock, returns false if
+     * woken by the stop event.
+     */
+    bool waitUntil(uint64_t due_ns);
+
+  private:
+    bool yuv2rgb(const OCVFrameLease& frame, cv::Mat& rgb);
+    bool yuv2gray(const OCVFrameLease& frame, cv::Mat& gray);
+    bool yuv2yuv(const OCVFrameLease& frame, cv::Mat& yuv);
+    bool mjpeg2rgb(const OCVFrameLease& frame, cv::Mat& rgb);
+    bool mjpeg2gray(const OCVFrameLease& frame, cv::Mat& gray);
+
+    void resizeMat(cv::Mat& mat, int matType);
+    void resizeMat(cv::Mat& mat, int matType, uint32_t height, 
+      uint32_t width);
+
+    uint32_t stripeRows(uint32_t height) const;
+    void convertRows(yuyv_kernel kernel, const uint8_t* src, 
+      size_t srcStride, uint8_t* dst, size_t dstStride);
+    static void convertStripe(void* args, int index);
+    static void lumaStripe(void* args, int index);
+    void updateConversionStats(const struct timespec& start);
+
+    void lumaRows(const uint8_t* src, size_t srcStride, bool packed, 
+      uint32_t width, uint32_t firstRow, uint32_t lastRow, cv::Mat* gray, 
+      cv::Mat* half, cv::Mat* quarter, uint32_t* histogram, 
+      uint8_t* scratch);
+
+  protected:
+    const char* m_device_id;
+
+    /*
+     * What the client wants...
+     */
+    uint32_t m_desired_width;
+    uint32_t m_desired_height;
+    uint32_t m_desired_frame_rate;
+    uint32_t m_desired_pix_fmt;
+    uint32_t m_desired_buffers;
+    bool m_latest_frame;
+    bool m_queue_stats;
+    bool m_verbose;
+
+    int m_stop_fd;
+
+    /*
+     * The size of the frames delivered by the source.
+     */
+    uint32_t m_final_width;
+    uint32_t m_final_height;
+    uint32_t m_final_frame_rate;
+    uint32_t m_raw_bytes_per_line;
+
+    /*
+     * The most recently grabbed raw frame, leased from the source.
+     * The generation changes every time the source is closed so stale
+     * leases are not given back.
+     */
+    OCVFrameLease m_current;
+    uint32_t m_generation;
+
+    OCVCaptureStats m_capture_stats;
+
+  private:
+    const char* m_kernel_name;
+
+    /*
+     * The conversion kernels chosen for this CPU.
+     */
+    const YUYVKernels* m_kernels;
+
+    /*
+     * Decoder of the compressed frames.
+     */
+    MJPEGDecoder m_decoder;
+
+    /*
+     * Workers of the striped conversions (NULL when serial).
+     */
+    struct work_pool* m_pool;
+    uint32_t m_conversion_threads;
+    uint32_t m_conversion_stripes;
+    OCVConversionStats m_conversion_stats;
+
+    /*
+     * Working memory of the single pass luma conversion.
+     */
+    std::vector<uint8_t> m_luma_rows;
+    std::vector<uint32_t> m_luma_histograms;
+    cv::Mat m_luma_decoded;
+};
+#endif
@@ -0,0 +1,197 @@
+#include "MJPEGDecoder.h"
+#include "FramePool.h"
+
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+using namespace cv;
+
+/*
+ * libjpeg reports fatal errors through 'error_exit', which must not
+ * return: jump back to the decode call instead of exiting.
+ */
+struct MJPEGDecoderState {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr error;
+	jmp_buf recover;
+};
+
+static void decoderError(j_common_ptr cinfo)
+{
+	MJPEGDecoderState* state = (MJPEGDecoderState*) cinfo->client_data;
+
+	longjmp(state->recover, 1);
+}
+
+/* Warnings (e.g. corrupt entropy data) are not worth a message per frame */
+static void decoderMessage(j_common_ptr cinfo)
+{
+}
+
+MJPEGDecoder::MJPEGDecoder()
+{
+	m_state = new MJPEGDecoderState;
+	m_scale = 1;
+	m_corrupt_frames = 0;
+
+	m_state->cinfo.err = jpeg_std_error(&m_state->error);
+	m_state->error.error_exit = decoderError;
+	m_state->error.output_message = decoderMessage;
+	m_state->cinfo.client_data = m_state;
+
+	jpeg_create_decompress(&m_state->cinfo);
+}
+
+MJPEGDecoder::~MJPEGDecoder()
+{
+	jpeg_destroy_decompress(&m_state->cinfo);
+
+	delete m_state;
+}
+
+bool MJPEGDecoder::setScale(uint32_t scale)
+{
+	if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+		return false;
+
+	m_scale = scale;
+
+	return true;
+}
+
+uint32_t MJPEGDecoder::scale() const
+{
+	return m_scale;
+}
+
+uint32_t MJPEGDecoder::corruptFrames() const
+{
+	return m_corrupt_frames;
+}
+
+size_t MJPEGDecoder::frameSize(const uint8_t* data, size_t size)
+{
+	if (data == NULL || size < 4)
+		return 0;
+
+	/* Start of image */
+	if (data[0] != 0xFF || data[1] != 0xD8)
+		return 0;
+
+	/* End of image, the drivers may leave some padding after it. Inside
+	 * the entropy coded data 0xFF is always followed by 0x00 or a
+	 * restart marker so the first match from the end is the real one */
+	for (size_t i = size - 1; i >= 3; --i) {
+		if (data[i] == 0xD9 && data[i - 1] == 0xFF)
+			return i + 1;
+	}
+
+	return 0;
+}
+
+bool MJPEGDecoder::gray(const uint8_t* data, size_t size, Mat& grayMat)
+{
+	return decode(data, size, grayMat, false);
+}
+
+bool MJPEGDecoder::rgb(const uint8_t* data, size_t size, Mat& rgbMat)
+{
+	return decode(data, size, rgbMat, true);
+}
+
+bool MJPEGDecoder::decode(const uint8_t* data, size_t size, Mat& mat,
+	bool color)
+{
+	struct jpeg_decompress_struct* cinfo = &m_state->cinfo;
+
+	/* Refuse truncated frames before doing any work on them */
+	size = frameSize(data, size);
+
+	if (size == 0) {
+		m_corrupt_frames++;
+		return false;
+	}
+
+	if (setjmp(m_state->recover)) {
+		jpeg_abort_decompress(cinfo);
+		m_corrupt_frames++;
+		return false;
+	}
+
+	jpeg_mem_src(cinfo, (unsigned char*) data, size);
+
+	if (jpeg_read_header(cinfo, TRUE) != JPEG_HEADER_OK) {
+		jpeg_abort_decompress(cinfo);
+		m_corrupt_frames++;
+		return false;
+	}
+
+	/* The gray image is the luma component alone, the chroma is not
+	 * even decompressed */
+	if (!color)
+		cinfo->out_color_space = JCS_GRAYSCALE;
+	else {
+#ifdef JCS_EXTENSIONS
+		cinfo->out_color_space = JCS_EXT_BGR;
+#else
+		cinfo->out_color_space = JCS_RGB;
+#endif
+	}
+
+	/* Scaling is done by the inverse DCT using fewer coefficients */
+	cinfo->scale_num = 1;
+	cinfo->scale_denom = m_scale;
+
+	jpeg_start_decompress(cinfo);
+
+	int type = (color ? CV_8UC3 : CV_8UC1);
+
+	if (mat.empty() || mat.rows != (int) cinfo->output_height ||
+		mat.cols != (int) cinfo->output_width || mat.type() != type) {
+		mat.release();
+		FramePool::prepare(mat);
+		mat.create(cinfo->output_height, cinfo->output_width, type);
+	}
+
+	while (cinfo->output_scanline < cinfo->output_height) {
+		JSAMPROW rows[4];
+		int count = cinfo->rec_outbuf_height;
+
+		if (count > 4)
+			count = 4;
+
+		for (int i = 0; i < count; ++i) {
+			uint32_t rowIndex = cinfo->output_scanline + i;
+
+			if (rowIndex >= cinfo->output_height)
+				rowIndex = cinfo->output_height - 1;
+
+			rows[i] = mat.ptr(rowIndex);
+		}
+
+		JDIMENSION read = jpeg_read_scanlines(cinfo, rows, count);
+
+#ifndef JCS_EXTENSIONS
+		/* OpenCV wants blue first */
+		if (color) {
+			for (JDIMENSION i = 0; i < read; ++i) {
+				uint8_t* pixel = rows[i];
+
+				for (int colIndex = 0; colIndex < mat.cols; ++colIndex) {
+					uint8_t red = pixel[0];
+					pixel[0] = pixel[2];
+					pixel[2] = red;
+					pixel += 3;
+				}
+			}
+		}
+#else
+		(void) read;
+#endif
+	}
+
+	jpeg_finish_decompress(cinfo);
+
+	return true;
+}
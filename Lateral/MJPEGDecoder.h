@@ -0,0 +1,68 @@
+/*
+ * MJPEGDecoder - Decodes the JPEG frames delivered by MJPEG cameras
+ * straight into OpenCV Mat wrappers using libjpeg(-turbo).
+ *
+ * Compared to imdecode the output Mat is reused from frame to frame,
+ * only the bytes actually used by the frame are read, the gray images
+ * are decoded from the luma component alone (the chroma is never
+ * decompressed) and the frames can be scaled by 1/2, 1/4 or 1/8 in the
+ * DCT domain, which is much cheaper than decoding at full size and
+ * resizing afterwards.
+ */
+#ifndef MJPEGDECODER_H
+#define MJPEGDECODER_H
+
+#include <opencv2/core/core.hpp>
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct MJPEGDecoderState;
+
+class MJPEGDecoder
+{
+  public:
+    MJPEGDecoder();
+    ~MJPEGDecoder();
+
+    /*
+     * The decoded frames are 1/scale of the size of the compressed
+     * ones, the scale can be 1, 2, 4 or 8. Returns false otherwise.
+     */
+    bool setScale(uint32_t scale);
+    uint32_t scale() const;
+
+    /*
+     * Decode a frame, the Mat is only reallocated when the size or the
+     * type of the frame changes. Returns false when the frame is
+     * truncated or corrupt; truncated frames are refused before
+     * anything is decoded, so the Mat keeps the previous frame.
+     */
+    bool gray(const uint8_t* data, size_t size, cv::Mat& gray);
+    bool rgb(const uint8_t* data, size_t size, cv::Mat& rgb);
+
+    /*
+     * Number of frames refused since the decoder was created.
+     */
+    uint32_t corruptFrames() const;
+
+    /*
+     * Checks that the frame starts with a start of image marker and
+     * ends with an end of image marker (the padding after it is
+     * ignored). Returns the size of the frame up to the end marker or
+     * 0 if it is not complete.
+     */
+    static size_t frameSize(const uint8_t* data, size_t size);
+
+  private:
+    MJPEGDecoder(const MJPEGDecoder&);
+    MJPEGDecoder& operator=(const MJPEGDecoder&);
+
+    bool decode(const uint8_t* data, size_t size, cv::Mat& mat,
+      bool color);
+
+    MJPEGDecoderState* m_state;
+    uint32_t m_scale;
+    uint32_t m_corrupt_frames;
+};
+#endif
@@ -35,19 +35,15 @@
 #ifndef OCVCAPTURE_H
 #define OCVCAPTURE_H
 
-#include <opencv2/core/core.hpp>
-#include <opencv2/highgui/highgui.hpp>
+#include "FrameSource.h"
 
-#include <vector>
-#include <string>
-
-class OCVCapture
+class OCVCapture : public FrameSource
 {
   public:
 
     /*
      * Instantiate a Capture object.
-     * The default size is 320 x 240.
+     * The default size is 640 x 480.
      */
     OCVCapture();
 
@@ -57,97 +53,36 @@ class OCVCapture
     virtual ~OCVCapture();
 
     /*
-     * You can turn on verbose mode to which will cause the capture
-     * object to spew debug messages to cout.
-     */
-    void setVerbose(bool verboseOn);
-    bool verbose() const;
-
-    /*
-     * When the capture object is closed you can set the size. At the
-     * time the capture object is opened the hardware will be queried
-     * for a supported size which may differ from the requested size,
-     * so do not assume the images you retrieve from the capture object
-     * are the requested size.
-     */
-    void configureCapture(char* id, uint32_t width, uint32_t height, 
-      uint32_t fps, char* pixfmt);
-
-    /*
-     * Before capturing images you must open the capture object.
-     * The open call returns true if it was successful.
-     * Open to read from the camera.
+     * Opens the V4L2 device configured with 'configureCapture' and
+     * negotiates the size, the frame rate and the buffers with the
+     * driver.
      */
     bool openCamera();
-
-    /*
-     * Returns true if the capture object is open.
-     */
     bool isOpen() const;
-
-    /*
-     * After the capture object is opened you can query for the final
-     * size that it negotiated with the camera.
-     */
-    uint32_t getWidth() const;
-    uint32_t getHeight() const;
-    uint32_t getFrameRate() const;
-
-    /*
-     * Close the capture object. This releases the video device and
-     * frees up driver-related memory. You can change the desired image
-     * size while the object is closed.
-     */
     void closeCamera();
 
-    /*
-     * The capturing process is divided into two parts. In the first
-     * step you call 'grabFrame' to actually grab the (RAW) image. Then
-     * later you call 'gray' to convert the grabbed image to the
-     * desired color space depending on the pixel format chosen.
-     */
-    bool grabFrame(uint32_t& time);
-    bool gray(cv::Mat& gray);
-    bool rgb(cv::Mat& rgb);
-    bool yuv2rgb(cv::Mat& rgb);
-    bool yuv2gray(cv::Mat& gray);
-    bool yuv2yuv(cv::Mat& yuv);
-    bool mjpeg2rgb(cv::Mat& rgb);
-    bool mjpeg2gray(cv::Mat& gray);
+    using FrameSource::grabFrame;
+    bool grabFrame(OCVFrameLease& lease, uint32_t& time);
+
+  protected:
+    void releaseBuffer(uint32_t index, uint32_t generation);
 
   private:
+    uint32_t sequenceGap(const struct v4l2_buffer& buffer);
+    void fillFrameInfo(const struct v4l2_buffer& buffer, 
+      OCVFrameInfo& info);
+    void queueAge(const struct v4l2_buffer& buffer, OCVFrameInfo& info);
+
     int retry_ioctl(int request, void* argument);
     bool firstGrabSetup();
-    void reportError(const char* error);
-    void reportError(const char* error, int64_t value);
-
-    void resizeMat(cv::Mat& mat, int matType);
 
   private:
-    const char* m_device_id;
-
-    /*
-     * What the client wants...
-     */
-    uint32_t m_desired_width;
-    uint32_t m_desired_height;
-    uint32_t m_desired_frame_rate;
-    uint32_t m_desired_pix_fmt;
-    bool m_verbose;
-
     /*
      * Internal bookkeeping for the camera
      */
     int m_camera_handle;
     bool m_first_grab;
 
-    /*
-     * The size we negotitated with the driver.
-     */
-    uint32_t m_final_width;
-    uint32_t m_final_height;
-    uint32_t m_final_frame_rate;
-
     /*
      * These are the memory mapped image buffers
      * provided by the camera driver.
@@ -156,11 +91,10 @@ class OCVCapture
     std::vector<size_t>	m_mapped_buffer_lens;
 
     /*
-     * A copy of the mostly recently grabbed raw data.
+     * Sequence number of the last frame dequeued, to detect the frames
+     * dropped by the driver.
      */
-    std::vector<uint8_t> dataBuffer;
-    size_t m_raw_image_size;
-    uint8_t* m_raw_image_data;
-    uint32_t m_raw_bytes_per_line;
+    bool m_have_sequence;
+    uint32_t m_last_sequence;
 };
 #endif
@@ -4,7 +4,9 @@
 #include <iostream>
 #include <iomanip>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include <net/if.h>
 #include <sys/ioctl.h>
@@ -12,15 +14,108 @@
 #include <linux/can/raw.h>
 
 #include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/eventfd.h>
 
 #include "periodic.h"
-#include "OCVCapture.h"
-
+#include "triplebuf.h"
+#include "FrameGraph.h"
+#include "FrameProcessPool.h"
+#include "FrameAdmission.h"
+#include "FrameWriter.h"
+#include "FrameSource.h"
+#include "FrameBus.h"
+#include "FramePool.h"
+#include "storage.h"
+#include "telemetry.h"
+
+/* Scale of the processed frames, the capture can produce 0.5 or 0.25 */
 #define SCALE 0.5
 
+/* Threads converting the frames, compare the conversion times printed
+ * when the capture stops to find the best count for the board */
+#define CONVERSION_THREADS 1
+
+/* Buffers queued to the driver and whether only the newest ready frame
+ * is used (lower latency, the older frames are skipped) */
+#define CAPTURE_BUFFERS 4
+#define LATEST_FRAME 0
+
+/* Count the frames left waiting behind every one (printed when the
+ * capture stops), an ioctl per buffer at each frame */
+#define QUEUE_STATS 0
+
+/* Analyses of the processed frames, run as a graph of nodes on
+ * PROCESS_THREADS threads (the time of every node is printed when the
+ * processing pauses). SAVE_EDGES writes the edges of every frame
+ * (frames/frame%u.jpg) */
+#define PROCESS_THREADS 1
+#define DETECT_EDGES 0
+#define SAVE_EDGES 0
+
+/* The saved frames are encoded and written by SAVE_WORKERS threads in
+ * the background, with at most SAVE_DEPTH frames waiting. When they
+ * cannot keep up the new frames are dropped, or waited for with
+ * SAVE_BLOCK (slowing the processing down) */
+#define SAVE_WORKERS 1
+#define SAVE_DEPTH 8
+#define SAVE_BLOCK 0
+#define SAVE_QUALITY 95
+
+/* The saved frames go to a single archive per processing run with
+ * their number and times (frames/frames%u.tfa, see FrameArchive.h)
+ * rather than a file each, as JPEG or raw when SAVE_QUALITY is 0 */
+#define SAVE_ARCHIVE 1
+
+/* The edges are found by an EdgeDetector, the edges of cv::Canny in
+ * less time. CHECK_EDGES runs cv::Canny too ("canny" in the node
+ * times) and counts the pixels where they differ */
+#define CHECK_EDGES 0
+
+/* Frames processed at once, each by its own worker when the analyses
+ * take longer than a frame period, with at most PROCESS_DEPTH frames in
+ * flight. They are logged in capture order whatever the worker */
+#define PROCESS_WORKERS 1
+#define PROCESS_DEPTH 2
+
+/* Which frames are processed when the processing is slower than the
+ * capture: "newest", "every:N" or "budget:MS" (see FrameAdmission.h).
+ * The frames processed and skipped and their age are printed when the
+ * processing pauses */
+#define PROCESS_ADMISSION "newest"
+
+/* Buffers of the logs and of the frame archive, written in the
+ * background by the storage thread. The logs are binary (.tlm,
+ * telemetry_csv prints them as the .csv files): records kept until the
+ * drainer writes them, and space reserved when each log is created */
+#define STORAGE_BUFFERS 32
+#define STORAGE_BUFFER_SIZE 65536
+#define CAPTURE_LOG_RECORDS 256
+#define PROCESS_LOG_RECORDS 256
+#define CAPTURE_LOG_PREALLOC (1 << 20)
+#define PROCESS_LOG_PREALLOC (256 << 10)
+
+/* Publish the downscaled gray frames in shared memory for other
+ * processes, in a ring of FRAME_BUS_SLOTS frames (see FrameBus.h and
+ * framebus_view) */
+#define PUBLISH_FRAMES 1
+#define FRAME_BUS_NAME "/tartufino_frames"
+#define FRAME_BUS_SLOTS 4
+
+/* The images of the pipeline take FRAME_POOL_BUFFERS buffers of a gray
+ * frame, mapped and faulted in when the camera opens (locked in memory
+ * with FRAME_POOL_LOCK, on huge pages with FRAME_POOL_HUGE), instead of
+ * the heap. Their use is printed when the capture stops */
+#define FRAME_POOL_BUFFERS 32
+#define FRAME_POOL_OPTIONS FRAME_POOL_LOCK
+
 using namespace cv;
 using namespace std;
 
+/* Memory of the images, before them so it goes after them at exit */
+static FramePool frame_pool;
+
 /* Variables for the names of the saved frames */
 static int num_frames = 0;
 
@@ -29,56 +124,171 @@ static int sock_can;
 static const char* can_interface = "can0";
 
 /* Variables for the log file */
-static FILE *capt_file;
-static FILE *proc_file;
-uint32_t timestamp_ms;
+static struct storage *storage;
+static struct telemetry *telemetry;
+static struct telemetry_log *capt_file;
+static struct telemetry_log *proc_file;
 
+/* Capture and processing threads, each stopped by writing its eventfd
+ * (it wakes the thread wherever it waits) */
 static pthread_t capture_th, process_th;
+static int capture_stop = -1;
+static int process_stop = -1;
+static int process_file_index;
 
-/* Mutex and condition variable to control the access to the new frame */
-pthread_mutex_t lock_new_frame;
-pthread_cond_t cond_new_frame;
-int new_frame = 0;
 int grabbed_frames = 0;
 
-/* Variables to identify the camera */
-OCVCapture camera;
+/* Variables to identify the camera, created when the capture starts */
+FrameSource* camera = NULL;
 
-/* Structure for the arguments of the threads */
-struct video_th_params {
-	int file_index;
+/* The captured frames, handed to the processing thread without a lock:
+ * the capture fills one slot while the processing reads another */
+struct captured_frame {
+	Mat small;
+	uint32_t timestamp_ms;
+
+	/* Number among the frames handed over, and capture time on the
+	 * monotonic clock */
+	uint32_t sequence;
+	uint64_t capture_ns;
 };
 
-/* Structures for the captured frames */
-Mat gray = Mat::zeros(240, 320, CV_8U);
-Mat edge = Mat::zeros(240*SCALE, 320*SCALE, CV_8U);
+static captured_frame captured[3];
+static struct triple_buf handoff;
 
-static void stopCapture()
+/* Frames for the other processes, only used by the capture thread */
+static FrameBus frame_bus;
+
+/* Parameters of the analyses */
+static FrameEdgeParams edge_params = { 0, 30, 3 };
+
+/* Writer of the saved frames, running while the frames are processed */
+static FrameWriter frame_writer;
+
+/* Pixels of the edges that differ from cv::Canny, with CHECK_EDGES */
+static volatile uint32_t edge_mismatches = 0;
+
+static void signalStop(int fd)
 {
-	fclose(capt_file);
+	uint64_t one = 1;
 
-	pthread_mutex_destroy(&lock_new_frame);
-	pthread_cond_destroy(&cond_new_frame);
-	
-	camera.closeCamera();
-	
-	close(sock_can);
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+		perror("eventfd");
+}
 
-	cout << "Capture:  Disabled" << endl;
+static uint64_t monotonicNow()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static bool stopRequested(int fd)
+{
+	struct pollfd stop;
+
+	stop.fd = fd;
+	stop.events = POLLIN;
+
+	return (poll(&stop, 1, 0) > 0);
 }
 
 static void pauseProcessing()
 {
-	pthread_mutex_unlock(&lock_new_frame);
-	
-	fclose(proc_file);
+	if (process_stop < 0)
+		return;
+
+	/* The frame being processed is finished first */
+	signalStop(process_stop);
+	pthread_join(process_th, NULL);
+
+	close(process_stop);
+	process_stop = -1;
+
+	telemetry_close(proc_file);
+}
+
+static void stopCapture()
+{
+	if (capture_stop < 0)
+		return;
+
+	pauseProcessing();
+
+	/* The capture thread leaves as soon as it sees the event */
+	signalStop(capture_stop);
+	pthread_join(capture_th, NULL);
+
+	close(capture_stop);
+	capture_stop = -1;
+
+	triple_buf_destroy(&handoff);
+
+	/* The capture never started */
+	if (camera == NULL)
+		return;
+
+	if (frame_bus.isOpen()) {
+		cout << "Capture:  " << frame_bus.getPublished() << 
+			" frames published on " << FRAME_BUS_NAME << endl;
+		frame_bus.close();
+	}
+
+	if (frame_pool.isRunning()) {
+		FramePoolStats pool;
+		frame_pool.getStats(pool);
+
+		cout << "Capture:  " << pool.in_use_max << " of " << pool.buffers << 
+			" frame buffers used at most (" << pool.buffer_size << " bytes" << 
+			(pool.locked ? ", locked" : "") << 
+			(pool.huge ? ", huge pages" : "") << "), " << 
+			pool.too_large + pool.exhausted << " images from the heap (" << 
+			pool.too_large << " too large)" << endl;
+	}
+
+	OCVConversionStats stats;
+
+	OCVCaptureStats counters;
+
+	telemetry_close(capt_file);
+
+	camera->getCaptureStats(counters);
+
+	cout << "Capture:  " << counters.grabbed << " frames grabbed, " << 
+		counters.driver_dropped << " dropped by the driver, " << 
+		counters.app_dropped << " dropped by the application, " << 
+		counters.error_frames << " with errors" << endl;
+
+	if (counters.grabbed > 0) {
+		cout << "Capture:  " << counters.skipped << " frames skipped, " << 
+			(double) counters.behind_total / counters.grabbed << 
+			" frames behind on average (max " << counters.behind_max << 
+			", " << counters.behind_max_ns / 1000000 << " ms)" << endl;
+	}
+
+	camera->getConversionStats(stats);
+
+	if (stats.frames > 0) {
+		cout << "Capture:  " << stats.frames << " frames converted in " << 
+			stats.total_us / stats.frames << " us on average (max " << 
+			stats.max_us << " us, " << camera->conversionThreads() << 
+			" threads)" << endl;
+	}
+
+	camera->closeCamera();
+
+	delete camera;
+	camera = NULL;
+
+	cout << "Capture:  Disabled" << endl;
 }
 
 static void sendParameters()
 {
-    int width = camera.getWidth();
-    int height = camera.getHeight();
-    int fps = camera.getFrameRate();
+    int width = camera->getWidth();
+    int height = camera->getHeight();
+    int fps = camera->getFrameRate();
     
     uint8_t frame[8];
 
@@ -113,29 +323,42 @@ static void sendParameters()
 
 static void *capture_frames(void *args)
 {
-	/* Avoid to cancel the thread during this period */
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	
+	/* The frames come from the camera unless FRAME_SOURCE says
+	 * otherwise ("synthetic" or "replay:<file>[,fast][,loop]") */
+	camera = FrameSource::create(getenv("FRAME_SOURCE"));
+
+	if (camera == NULL)
+		return NULL;
+
 	/* Set up the capture device */
-	camera.configureCapture((char*)"/dev/video0", 320, 240, 30, (char*)"YUYV");
+	camera->configureCapture((char*)"/dev/video0", 320, 240, 30, (char*)"YUYV");
+	camera->setConversionThreads(CONVERSION_THREADS);
+	camera->setBufferCount(CAPTURE_BUFFERS);
+	camera->setLatestFrame(LATEST_FRAME);
+	camera->setQueueStats(QUEUE_STATS);
+
+	/* Waiting for a frame ends when the capture is stopped */
+	camera->setStopEvent(capture_stop);
 
 	/* Open the capture device */
-	camera.openCamera();
+	camera->openCamera();
 
 	/* Open file descriptor */
-	capt_file = fopen("frames/capture.csv", "w");
-
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	capt_file = telemetry_open(telemetry, "frames/capture.tlm", 
+		CAPTURE_LOG_RECORDS, CAPTURE_LOG_PREALLOC);
 
 	/* Verify if the device is active */
-	if (!camera.isOpen()) {
+	if (!camera->isOpen()) {
 		cerr << "ERROR: Failed to open the local camera" << endl;
-		pthread_exit(NULL);
+		return NULL;
 	}
 
+	uint32_t grab_ms;
+	uint32_t handed_over = 0;
+
 	/* The first several frames tend to come out black */
-	for (int i = 0; i < 20; ++i) {
-		camera.grabFrame(timestamp_ms);
+	for (int i = 0; i < 20 && !stopRequested(capture_stop); ++i) {
+		camera->grabFrame(grab_ms);
 		usleep(1000);
 	}
 
@@ -143,90 +366,337 @@ static void *capture_frames(void *args)
 	sendParameters();
 	
 	/* Information about the remote capture parameters */
-	cout << "Capture:  Enabled (" << camera.getWidth() << "x" << 
-		camera.getHeight() << " - " << camera.getFrameRate() << " fps)" << endl;
+	cout << "Capture:  Enabled (" << camera->getWidth() << "x" << 
+		camera->getHeight() << " - " << camera->getFrameRate() << " fps)" << endl;
 
-	/* Initialize the mutex for the new captured frame */
-	pthread_mutex_init(&lock_new_frame, NULL);
-	pthread_cond_init(&cond_new_frame, NULL);
-	
-	/* Capture the frames in a gray-scale format */
-	while (1) {
-		
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-		pthread_mutex_lock(&lock_new_frame);
+	/* Once for the whole run, the images keep their buffers */
+	if (!frame_pool.isRunning() && frame_pool.start(FRAME_POOL_BUFFERS, 
+		camera->getWidth() * camera->getHeight(), FRAME_POOL_OPTIONS))
+		FramePool::setDefault(&frame_pool);
+
+	/* Room for gray frames up to the full size, one byte per pixel */
+	if (PUBLISH_FRAMES && frame_bus.create(FRAME_BUS_NAME, FRAME_BUS_SLOTS, 
+		camera->getWidth() * camera->getHeight()))
+		cout << "Capture:  Publishing on " << FRAME_BUS_NAME << endl;
+
+	/* Capture the frames in a gray-scale format, each one as soon as
+	 * the driver has it */
+	while (!stopRequested(capture_stop)) {
+
+		/* The slot is not seen by the processing until it is published */
+		captured_frame& slot = captured[triple_buf_back(&handoff)];
+
+		/* Grab the frame from the device, fails when stopped */
+		if (!camera->grabFrame(grab_ms))
+			continue;
 
-		/* Grab the frame from the device */
-		camera.grabFrame(timestamp_ms);
 		grabbed_frames++;
 		
-		fprintf(capt_file, "%d %d\n", grabbed_frames, timestamp_ms);
+		telemetry_write(capt_file, TELEMETRY_CAPTURE, grabbed_frames, grab_ms, 
+			camera->frameInfo().sequence, camera->frameInfo().dropped);
+
+		/* Downscale the luma of the frame in one pass, the full size
+		 * gray frame is not needed */
+		if (SCALE == 0.25)
+			camera->luma(NULL, NULL, &slot.small, NULL);
+		else
+			camera->luma(NULL, &slot.small, NULL, NULL);
+
+		slot.timestamp_ms = grab_ms;
+
+		/* Without a capture time from the driver, the frame is as old
+		 * as it is now */
+		slot.capture_ns = (camera->frameInfo().monotonic ? 
+			camera->frameInfo().timestamp_ns : monotonicNow());
+		slot.sequence = ++handed_over;
+
+		/* Copied out before the processing can see the slot */
+		if (frame_bus.isOpen())
+			frame_bus.publish(slot.small, slot.timestamp_ms, slot.capture_ns);
+
+		/* Hand the new frame over, the previous one was never processed
+		 * if it is still there */
+		if (triple_buf_publish(&handoff))
+			camera->countDroppedFrame();
+	}
 
-		/* Convert the frame to gray-scale */
-		camera.gray(gray);
+	return NULL;
+}
 
-		/* Notify to other threads that the new frame is ready */
-		new_frame = 1;
-		pthread_cond_signal(&cond_new_frame);
-		pthread_mutex_unlock(&lock_new_frame);
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+/* Sink node queuing its input to be saved with the frame of the
+ * FrameJob in 'args', in the archive or to frames/frame%u.jpg */
+static void saveImage(const vector<const Mat*>& inputs, Mat& output, 
+	void* args)
+{
+	const FrameJob* job = (const FrameJob*) args;
 
-		/* TODO: Define the priority to the keyboard and the capture*/
-		usleep(5000);
+	if (SAVE_ARCHIVE) {
+		frame_writer.submit(*inputs[0], job->sequence, job->time, 
+			job->capture_ns);
+		return;
 	}
 
-	pthread_exit(NULL);
+	char file_name[50];
+	sprintf(file_name, "frames/frame%u.jpg", job->sequence);
+
+	frame_writer.submit(*inputs[0], file_name);
 }
 
-static void *process_frames(void *args)
+/* Sink node counting the pixels where its two inputs differ, the
+ * output is only a scratch buffer */
+static void compareEdges(const vector<const Mat*>& inputs, Mat& output, 
+	void* args)
 {
-	/* Get index of the file */
-	struct video_th_params *params = (struct video_th_params *) args;
-	int file_index = params->file_index;
+	compare(*inputs[0], *inputs[1], output, CMP_NE);
 
+	uint32_t differing = countNonZero(output);
+
+	if (differing > 0)
+		__sync_fetch_and_add(&edge_mismatches, differing);
+}
+
+/* The analyses of every worker, the intermediate images are shared */
+static void buildGraph(FrameGraph& graph, const FrameJob& job, void* args)
+{
+	graph.addSource("small");
+	graph.setThreads(PROCESS_THREADS);
+
+	if (DETECT_EDGES || SAVE_EDGES || CHECK_EDGES)
+		graph.addEdges("edges", "small", "edges", edge_params);
+
+	if (CHECK_EDGES) {
+		graph.addNode("canny", "small", "canny", FrameGraph::edges, 
+			&edge_params);
+		graph.addNode("check", "edges,canny", NULL, compareEdges);
+	}
+
+	if (SAVE_EDGES)
+		graph.addNode("save", "edges", NULL, saveImage, (void*) &job);
+}
+
+static void logFrame(const FrameJob& job)
+{
+	telemetry_write(proc_file, TELEMETRY_PROCESS, job.sequence, job.time, 0, 
+		0);
+}
+
+static void printNodeStats(const FrameProcessPool& pool)
+{
+	vector<FrameNodeStats> stats;
+	pool.getNodeStats(stats);
+
+	for (size_t i = 0; i < stats.size(); ++i) {
+		if (stats[i].runs == 0)
+			continue;
+
+		cout << "Capture:  " << stats[i].name << ": " << stats[i].runs << 
+			" frames in " << stats[i].total_us / stats[i].runs << 
+			" us on average (max " << stats[i].max_us << " us)" << endl;
+	}
+}
+
+static void printAdmissionStats(const FrameAdmission& admission)
+{
+	FrameAdmissionStats stats;
+	admission.getStats(stats);
+
+	cout << "Capture:  " << admission.policy() << ": " << stats.admitted << 
+		" frames processed, " << stats.skipped << " skipped, " << 
+		stats.superseded << " superseded" << endl;
+
+	if (stats.processed > 0) {
+		cout << "Capture:  " << stats.age_total_us / stats.processed / 1000 
+			<< " ms old on average when processed (max " << 
+			stats.age_max_us / 1000 << " ms), " << stats.cost_us << 
+			" us of processing expected" << endl;
+	}
+}
+
+static void printWriterStats(const FrameWriter& writer)
+{
+	FrameWriterStats stats;
+	writer.getStats(stats);
+
+	if (stats.submitted == 0)
+		return;
+
+	uint32_t queued = stats.submitted - stats.dropped;
+
+	cout << "Capture:  " << stats.written << " frames saved, " << 
+		stats.dropped << " dropped, " << stats.failed << " failed, " << 
+		(queued > 0 ? (double) stats.depth_total / queued : 0.0) << 
+		" waiting on average (max " << stats.depth_max << ")" << endl;
+
+	uint32_t done = stats.written + stats.failed;
+
+	if (done > 0) {
+		cout << "Capture:  " << stats.encode_total_us / done << 
+			" us to encode a frame on average (max " << 
+			stats.encode_max_us << " us), " << 
+			stats.write_total_us / done << " us to write it, " << 
+			stats.bytes / 1024 << " kB written" << endl;
+	}
+
+	if (stats.blocked > 0) {
+		cout << "Capture:  " << stats.blocked << " frames waited " << 
+			stats.blocked_us / 1000 << " ms for the writer" << endl;
+	}
+}
+
+static void *process_frames(void *args)
+{
 	/* Open file descriptor */
 	char file_name[50];
-	sprintf(file_name, "frames/file%u.csv", file_index);
+	sprintf(file_name, "frames/file%u.tlm", process_file_index);
 	
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	proc_file = fopen(file_name, "w");
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-		
-	char name_edge[50];
-	char full_name_edge[50];
+	proc_file = telemetry_open(telemetry, file_name, PROCESS_LOG_RECORDS, 
+		PROCESS_LOG_PREALLOC);
+
+	/* Every worker processes its own frame */
+	FrameProcessPool pool;
+	FrameJob done;
+
+	/* Which of the frames are worth processing */
+	FrameAdmission admission;
+	admission.setPolicy(PROCESS_ADMISSION);
+
+	edge_mismatches = 0;
+
+	/* The edges are saved in the background */
+	if (SAVE_EDGES) {
+		sprintf(file_name, "frames/frames%u.tfa", process_file_index);
+
+		frame_writer.resetStats();
+		frame_writer.start(SAVE_WORKERS, SAVE_DEPTH, SAVE_BLOCK, 
+			SAVE_QUALITY, (SAVE_ARCHIVE ? file_name : NULL), storage);
+	}
+
+	if (!pool.start(PROCESS_WORKERS, PROCESS_DEPTH, "small", NULL, 
+		buildGraph, NULL)) {
+		/* Nothing is saved, the archive is closed */
+		frame_writer.stop();
+		return NULL;
+	}
+
+	/* Wait for a new frame, for a processed one or for the pause */
+	struct pollfd events[3];
+
+	events[0].fd = triple_buf_fd(&handoff);
+
+	events[1].fd = pool.doneEvent();
+	events[1].events = POLLIN;
+
+	events[2].fd = process_stop;
+	events[2].events = POLLIN;
 
 	/* Process the gray-scale frames */
 	while (1) {
+		/* With every worker busy and the ring full, the new frames are
+		 * left to be replaced (and counted as dropped) by the capture */
+		events[0].events = (pool.isFull() ? 0 : POLLIN);
+
+		if (poll(events, 3, -1) == -1 && errno != EINTR) {
+			perror("Capture");
+			break;
+		}
+
+		if (events[2].revents & POLLIN)
+			break;
+
+		/* Log the processed frames in capture order */
+		if (events[1].revents & POLLIN) {
+			uint64_t count;
+
+			if (read(events[1].fd, &count, sizeof(count)) == -1 && 
+				errno != EAGAIN)
+				perror("Capture");
+		}
+
+		while (pool.tryNext(done)) {
+			admission.processed(done.capture_ns, done.process_ns);
+			logFrame(done);
+		}
+
+		if (pool.isFull())
+			continue;
+
+		/* The latest frame, it stays put until the next take */
+		int index = triple_buf_try_take(&handoff);
+
+		if (index < 0)
+			continue;
 
-		/* Define the name of the new frame */
+		const captured_frame& slot = captured[index];
+
+		if (!admission.admit(slot.sequence, slot.capture_ns))
+			continue;
+
+		/* Number the new frame, the pool keeps a copy of it */
 		num_frames++;
-		sprintf(name_edge, "frame%u.jpg", num_frames);
-		sprintf(full_name_edge, "frames/frame%u.jpg", num_frames);
+		pool.submit(slot.small, num_frames, slot.timestamp_ms, 
+			slot.capture_ns);
+	}
 
-		pthread_mutex_lock(&lock_new_frame);
+	/* The frames in flight are finished first */
+	while (pool.next(done)) {
+		admission.processed(done.capture_ns, done.process_ns);
+		logFrame(done);
+	}
 
-		/* Block until a new frame is available */
-		while (!new_frame)
-			pthread_cond_wait(&cond_new_frame, &lock_new_frame);
-				
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-		
-		/* Apply the edge filter and save the resulting frame */
-		//resize(gray, edge, edge.size(), 0, 0, INTER_AREA);
-		//Canny(edge, edge, 0, 30, 3);
-		//imwrite(full_name_edge, edge);
-		fprintf(proc_file, "%s %d\n", name_edge, timestamp_ms);
+	pool.stop();
 
-		new_frame = 0;
-		pthread_mutex_unlock(&lock_new_frame);
+	/* The frames still waiting are written before the pause */
+	frame_writer.stop();
 
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	printNodeStats(pool);
+	printAdmissionStats(admission);
+	printWriterStats(frame_writer);
 
-		usleep(5000);
+	if (CHECK_EDGES) {
+		cout << "Capture:  " << edge_mismatches << 
+			" edge pixels differ from cv::Canny" << endl;
 	}
 
-	pthread_exit(NULL);
-}	
+	return NULL;
+}
+
+static void startCapture()
+{
+	if (capture_stop >= 0)
+		return;
+
+	capture_stop = eventfd(0, 0);
+
+	/* Nothing to process until the first frame is published */
+	if (capture_stop < 0 || triple_buf_init(&handoff) < 0) {
+		perror("Capture");
+		return;
+	}
+
+	pthread_create(&capture_th, NULL, capture_frames, NULL);
+}
+
+static void startProcessing(int file_index)
+{
+	if (process_stop >= 0)
+		return;
+
+	/* The frames come from the capture */
+	if (capture_stop < 0) {
+		cerr << "ERROR: The camera is not capturing" << endl;
+		return;
+	}
+
+	process_stop = eventfd(0, 0);
+
+	if (process_stop < 0) {
+		perror("Capture");
+		return;
+	}
+
+	process_file_index = file_index;
+	pthread_create(&process_th, NULL, process_frames, NULL);
+}
 
 static void enableCommunication()
 {
@@ -269,11 +739,21 @@ int main(int argc, char** argv)
 	cout << "************************" << endl << endl;
 
 	enableCommunication();
+
+	/* The log files and the saved frames, written without the capture
+	 * waiting for the card */
+	storage = storage_create(STORAGE_BUFFERS, STORAGE_BUFFER_SIZE, 
+		STORAGE_AUTO);
+	telemetry = telemetry_create(storage);
+
+	if (telemetry == NULL)
+		cerr << "ERROR: No log files" << endl;
+	else
+		cout << "Storage:  Enabled (" << storage_backend(storage) << ")" << endl;
 	
 	/* Image processing service settings */
 	int processing_active = 0;
 	int index_video_file = 0;
-	struct video_th_params proc_params;
 
   	while (1) {
 
@@ -286,7 +766,7 @@ int main(int argc, char** argv)
 
 			/* The pilot sent the setup command */
 			if (m.data[2] == 0x66) {
-				pthread_create(&capture_th, NULL, capture_frames, NULL);
+				startCapture();
 			}
 
 			/* The pilot sent the start command (s)*/
@@ -296,9 +776,8 @@ int main(int argc, char** argv)
 				if (!processing_active) {
 					processing_active = 1;
 					index_video_file++;
-					proc_params.file_index = index_video_file;
 
-					pthread_create(&process_th, NULL, process_frames, &proc_params);
+					startProcessing(index_video_file);
 				}
 			}
 		
@@ -308,8 +787,6 @@ int main(int argc, char** argv)
 				/* Stop processing the frames from the camera */ 
 				if (processing_active) {
 					processing_active = 0;
-					pthread_cancel(process_th);
-					pthread_join(process_th, NULL);
 					pauseProcessing();
 				}
 			}
@@ -318,26 +795,37 @@ int main(int argc, char** argv)
 			else if (m.data[2] == 0x33) {
 
 				/* Stop capturing & processing the frames from the local camera */ 
-				if (processing_active) //{
-					//processing_active = 0;
-					pthread_cancel(process_th);
-				pthread_cancel(capture_th);
-				
-				if (processing_active)
-					pthread_join(process_th, NULL);
-				pthread_join(capture_th, NULL);
-
-				if (processing_active)
-					pauseProcessing();
+				pauseProcessing();
 				stopCapture();
-				//}
 				processing_active = 0;
+
+				close(sock_can);
 			
 				break;
 			}
 		}
 	}
 
+	/* Everything logged is on the card once the storage is destroyed */
+	if (telemetry != NULL) {
+		struct telemetry_stats records;
+		telemetry_destroy(telemetry, &records);
+
+		cout << "Storage:  " << records.records << " records logged, " << 
+			records.dropped << " dropped" << endl;
+	}
+
+	if (storage != NULL) {
+		struct storage_stats stats;
+		storage_destroy(storage, &stats);
+
+		cout << "Storage:  " << stats.writes << " writes (" << 
+			stats.bytes / 1024 << " KB), " << stats.failed << " failed, " << 
+			stats.dropped_bytes / 1024 << " KB dropped, " << 
+			stats.latency_max_us / 1000 << " ms max latency, " << 
+			stats.inflight_max << " in flight max" << endl;
+	}
+
 	usleep(20000);
 
 	cout << endl << "************************" << endl;
@@ -0,0 +1,434 @@
+#include "ReplaySource.h"
+
+#include <iostream>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/videodev2.h>
+
+using namespace std;
+
+static const char* messageHeader = "Replay: ";
+
+static uint32_t fourcc(const char* code)
+{
+	return (uint32_t) code[0] | ((uint32_t) code[1] << 8) |
+		((uint32_t) code[2] << 16) | ((uint32_t) code[3] << 24);
+}
+
+/* AVI is little endian whatever the board */
+static uint32_t get32(const uint8_t* getIt)
+{
+	return (uint32_t) getIt[0] | ((uint32_t) getIt[1] << 8) |
+		((uint32_t) getIt[2] << 16) | ((uint32_t) getIt[3] << 24);
+}
+
+static uint64_t monotonicNow()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+ReplaySource::ReplaySource(const char* path)
+{
+	m_path = path;
+	m_file_handle = -1;
+	m_map = NULL;
+	m_map_size = 0;
+
+	m_real_time = true;
+	m_loop = false;
+
+	m_next = 0;
+	m_loops = 0;
+	m_loop_offset = 0;
+
+	m_started = false;
+	m_start_ns = 0;
+}
+
+ReplaySource::~ReplaySource()
+{
+	closeCamera();
+}
+
+void ReplaySource::setRealTime(bool realTime)
+{
+	m_real_time = realTime;
+}
+
+bool ReplaySource::realTime() const
+{
+	return m_real_time;
+}
+
+void ReplaySource::setLoop(bool loop)
+{
+	m_loop = loop;
+}
+
+bool ReplaySource::loop() const
+{
+	return m_loop;
+}
+
+bool ReplaySource::isOpen() const
+{
+	return (m_map != NULL);
+}
+
+uint32_t ReplaySource::frames() const
+{
+	return m_offsets.size();
+}
+
+bool ReplaySource::openCamera()
+{
+	if (isOpen())
+		return true;
+
+	openSource();
+
+	m_file_handle = open(m_path.c_str(), O_RDONLY);
+
+	if (m_file_handle < 0) {
+		perror(m_path.c_str());
+		closeCamera();
+		return false;
+	}
+
+	struct stat status;
+
+	if (fstat(m_file_handle, &status) == -1 || status.st_size < 12) {
+		reportError("ERROR: Not a recording");
+		closeCamera();
+		return false;
+	}
+
+	void* mapped = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE,
+		m_file_handle, 0);
+
+	if (mapped == MAP_FAILED) {
+		reportError("ERROR: Failed to map the recording", errno);
+		closeCamera();
+		return false;
+	}
+
+	m_map = (const uint8_t*) mapped;
+	m_map_size = status.st_size;
+
+	if (!parseHeaders()) {
+		closeCamera();
+		return false;
+	}
+
+	readTimes();
+
+	m_next = 0;
+	m_loops = 0;
+	m_loop_offset = 0;
+	m_started = false;
+
+	if (m_verbose) {
+		cout << messageHeader << m_path << " " << m_final_width << " x "
+			<< m_final_height << " at " << m_final_frame_rate <<
+			" fps, " << frames() << " frames" << endl;
+	}
+
+	return true;
+}
+
+/*
+ * Reads the size, the format and the frame rate of the video stream
+ * and finds the frames. The chunks of the header lists are walked as
+ * if they were at the top level.
+ */
+bool ReplaySource::parseHeaders()
+{
+	if (get32(m_map) != fourcc("RIFF") ||
+		get32(m_map + 8) != fourcc("AVI ")) {
+		reportError("ERROR: Not an AVI file");
+		return false;
+	}
+
+	uint32_t handler = 0;
+	uint32_t usPerFrame = 0;
+	uint32_t rate = 0;
+	uint32_t scale = 0;
+
+	m_offsets.clear();
+	m_sizes.clear();
+
+	/* The RIFF size is only right if the recording was closed */
+	size_t offset = 12;
+
+	while (offset + 8 <= m_map_size) {
+		uint32_t tag = get32(m_map + offset);
+		uint32_t size = get32(m_map + offset + 4);
+		const uint8_t* data = m_map + offset + 8;
+
+		if (tag == fourcc("LIST") && offset + 12 <= m_map_size) {
+			uint32_t type = get32(data);
+
+			if (type == fourcc("movi")) {
+				size_t end = offset + 8 + size;
+
+				/* Not closed, the frames go on to the end of the file */
+				if (size <= 4 || end > m_map_size)
+					end = m_map_size;
+
+				parseFrames(offset + 12, end);
+				offset = end;
+			}
+			else if (type == fourcc("hdrl") || type == fourcc("strl"))
+				offset += 12;
+			else
+				offset += 8 + size + (size & 1);
+
+			continue;
+		}
+
+		if (size > m_map_size - offset - 8)
+			break;
+
+		if (tag == fourcc("avih") && size >= 40) {
+			usPerFrame = get32(data);
+			m_final_width = get32(data + 32);
+			m_final_height = get32(data + 36);
+		}
+		else if (tag == fourcc("strh") && size >= 28 &&
+			get32(data) == fourcc("vids") && handler == 0) {
+			handler = get32(data + 4);
+			scale = get32(data + 20);
+			rate = get32(data + 24);
+		}
+
+		offset += 8 + size + (size & 1);
+	}
+
+	if (handler == fourcc("MJPG"))
+		m_desired_pix_fmt = V4L2_PIX_FMT_MJPEG;
+	else if (handler == fourcc("YUY2") || handler == fourcc("YUYV"))
+		m_desired_pix_fmt = V4L2_PIX_FMT_YUYV;
+	else {
+		reportError("ERROR: Can't replay that pixel format", handler);
+		return false;
+	}
+
+	if (m_final_width == 0 || m_final_height == 0) {
+		reportError("ERROR: No frame size in the recording");
+		return false;
+	}
+
+	/* The raw frames are stored as the driver delivered them */
+	m_raw_bytes_per_line = (m_desired_pix_fmt == V4L2_PIX_FMT_YUYV ?
+		m_final_width * 2 : 0);
+
+	if (scale > 0 && rate > 0)
+		m_final_frame_rate = (rate + scale / 2) / scale;
+	else if (usPerFrame > 0)
+		m_final_frame_rate = (1000000 + usPerFrame / 2) / usPerFrame;
+
+	if (m_final_frame_rate == 0)
+		m_final_frame_rate = (m_desired_frame_rate > 0 ?
+			m_desired_frame_rate : 1);
+
+	if (m_offsets.empty()) {
+		reportError("ERROR: No frames in the recording");
+		return false;
+	}
+
+	return true;
+}
+
+void ReplaySource::parseFrames(uint32_t offset, uint32_t end)
+{
+	size_t frameSize = (size_t) m_final_width * m_final_height * 2;
+
+	while (offset + 8 <= end) {
+		uint32_t tag = get32(m_map + offset);
+		uint32_t size = get32(m_map + offset + 4);
+
+		if (tag == fourcc("LIST")) {
+			/* Frames grouped in 'rec ' lists */
+			offset += 12;
+			continue;
+		}
+
+		if (tag == fourcc("idx1"))
+			break;
+
+		/* The last frame of a recording cut short may be incomplete */
+		if (size > end - offset - 8)
+			break;
+
+		/* Frames of the first stream, compressed or not */
+		if (tag == fourcc("00dc") || tag == fourcc("00db")) {
+			/* An uncompressed frame must be whole to be converted */
+			if (m_desired_pix_fmt != V4L2_PIX_FMT_YUYV ||
+				size >= frameSize) {
+				m_offsets.push_back(offset + 8);
+				m_sizes.push_back(size);
+			}
+		}
+
+		offset += 8 + size + (size & 1);
+	}
+}
+
+/*
+ * The capture times are in the .csv file written by AVIRecorder, one
+ * "frame time" line per frame. Missing times follow the frame rate.
+ */
+void ReplaySource::readTimes()
+{
+	uint32_t period = 1000 / m_final_frame_rate;
+
+	m_times.clear();
+
+	string timesPath = m_path;
+	size_t extension = timesPath.rfind('.');
+
+	if (extension != string::npos &&
+		timesPath.find('/', extension) == string::npos)
+		timesPath.erase(extension);
+
+	timesPath += ".csv";
+
+	FILE* times = fopen(timesPath.c_str(), "r");
+
+	if (times != NULL) {
+		uint32_t frame;
+		uint32_t time;
+
+		while (m_times.size() < frames() &&
+			fscanf(times, "%u %u", &frame, &time) == 2)
+			m_times.push_back(time);
+
+		fclose(times);
+	}
+	else if (m_verbose)
+		cout << messageHeader << "no times, " << period << " ms apart" <<
+			endl;
+
+	while (m_times.size() < frames())
+		m_times.push_back(m_times.empty() ? 0 : m_times.back() + period);
+}
+
+/*
+ * When a frame is due, on the monotonic clock.
+ */
+uint64_t ReplaySource::dueTime(uint32_t index) const
+{
+	return m_start_ns + (uint64_t) (m_loop_offset + m_times[index] -
+		m_times[0]) * 1000000ULL;
+}
+
+bool ReplaySource::grabFrame(OCVFrameLease& lease, uint32_t& time)
+{
+	lease.release();
+
+	if (!isOpen())
+		return false;
+
+	if (m_next >= frames()) {
+		if (!m_loop)
+			return false;
+
+		/* Carry on one frame period after the last one */
+		m_loop_offset += m_times.back() - m_times[0] +
+			1000 / m_final_frame_rate;
+		m_loops++;
+		m_next = 0;
+	}
+
+	uint64_t now = monotonicNow();
+	uint32_t skipped = 0;
+
+	if (!m_started) {
+		m_started = true;
+		m_start_ns = now;
+	}
+
+	if (m_real_time) {
+		/* Skip the frames a camera would have replaced already */
+		while (m_latest_frame && m_next + 1 < frames() &&
+			dueTime(m_next + 1) <= now) {
+			m_next++;
+			skipped++;
+		}
+
+		/* The frame stays next if the wait is stopped */
+		if (!waitUntil(dueTime(m_next)))
+			return false;
+	}
+
+	uint32_t index = m_next++;
+
+	/* Leased straight from the mapping, nothing to give back */
+	OCVFrameInfo& info = leaseFrame(lease, index, m_map + m_offsets[index],
+		m_sizes[index]);
+
+	info.sequence = m_loops * frames() + index;
+	info.timestamp_ns = (m_real_time ? dueTime(index) : monotonicNow());
+	info.monotonic = true;
+	info.latency_ns = (m_real_time ?
+		(int64_t) (monotonicNow() - info.timestamp_ns) : 0);
+	info.bytesused = m_sizes[index];
+	info.skipped = skipped;
+	m_capture_stats.skipped += skipped;
+
+	/* Frames already due behind this one, as in the driver queue */
+	if (m_queue_stats && m_real_time) {
+		now = monotonicNow();
+
+		for (uint32_t i = index + 1; i < frames() && dueTime(i) <= now;
+			++i) {
+			info.behind++;
+			info.behind_ns = dueTime(i) - info.timestamp_ns;
+		}
+
+		m_capture_stats.behind_total += info.behind;
+
+		if (info.behind > m_capture_stats.behind_max)
+			m_capture_stats.behind_max = info.behind;
+
+		if (info.behind_ns > m_capture_stats.behind_max_ns)
+			m_capture_stats.behind_max_ns = info.behind_ns;
+	}
+
+	time = m_times[index] + m_loop_offset;
+
+	return true;
+}
+
+void ReplaySource::releaseBuffer(uint32_t index, uint32_t generation)
+{
+}
+
+void ReplaySource::closeCamera()
+{
+	closeSource();
+
+	if (m_map != NULL)
+		munmap((void*) m_map, m_map_size);
+
+	m_map = NULL;
+	m_map_size = 0;
+
+	if (m_file_handle >= 0)
+		close(m_file_handle);
+
+	m_file_handle = -1;
+
+	m_offsets.clear();
+	m_sizes.clear();
+	m_times.clear();
+}
@@ -0,0 +1,668 @@
+/*
+ * YUYVKernels - Conversion kernels from packed YUYV (YCbCr 4:2:2)
+ * frames to gray, BGR and YCbCr images.
+ *
+ * A YUYV row is made of macropixels of four bytes (Y1 Cb Y2 Cr) that
+ * hold two pixels sharing the same chroma. The vectorized kernels
+ * handle 8 (SSE2) or 16 (AVX2, NEON) pixels per iteration and leave
+ * the end of the row to the scalar code.
+ */
+#include "YUYVKernels.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define YUYV_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON) || defined(__aarch64__)
+#define YUYV_NEON
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_ARM_NEON
+#define HWCAP_ARM_NEON 4096
+#endif
+#endif
+
+/*
+ * For speed we use fixed point with 8 bits of fractional precision.
+ * Every output component is computed as
+ *
+ *   clamp((kYScale * (Y - kYOffset) + chroma + 128) >> 8)
+ *
+ * which fits in 32 bits, so the vector kernels use 32 bit lanes for
+ * the products and give the same result as the scalar code.
+ */
+#define Fixed(n) ((int)((n) * 255.0 + 0.5))
+
+#if YCBCR_STANDARD == YCBCR_JFIF
+/* Cb and Cr are moved to the range -0.5 to 0.5 */
+enum {
+	kYOffset = 0,
+	kYScale = 256,
+	kRCr = Fixed(1.403),
+	kGCb = Fixed(-0.344),
+	kGCr = Fixed(-.714),
+	kBCb = Fixed(1.770)
+};
+#elif YCBCR_STANDARD == YCBCR_BT601
+/* This is the solution provided by Microsoft */
+enum {
+	kYOffset = 16,
+	kYScale = 298,
+	kRCr = 409,
+	kGCb = -100,
+	kGCr = -208,
+	kBCb = 516
+};
+#elif YCBCR_STANDARD == YCBCR_BT709
+enum {
+	kYOffset = 16,
+	kYScale = 298,
+	kRCr = 459,
+	kGCb = -55,
+	kGCr = -136,
+	kBCb = 541
+};
+#else
+#error "Unknown YCBCR_STANDARD"
+#endif
+
+/*
+ * Scalar kernels, they also handle the end of the rows for the
+ * vectorized ones.
+ */
+static inline uint8_t clamp8(int v)
+{
+	return (v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+static void scalar_gray_row(const uint8_t* getIt, uint8_t* putIt,
+	uint32_t width)
+{
+	for (uint32_t colIndex = 0; colIndex < width; ++colIndex) {
+		*putIt++ = *getIt;
+		getIt += 2;
+	}
+}
+
+static void scalar_rgb_row(const uint8_t* getIt, uint8_t* putIt,
+	uint32_t width)
+{
+	for (uint32_t colIndex = 0; colIndex < width; colIndex += 2) {
+		int y1 = (*getIt++ - kYOffset) * kYScale + 128;
+		int cb = *getIt++ - 128;
+		int y2 = (*getIt++ - kYOffset) * kYScale + 128;
+		int cr = *getIt++ - 128;
+
+		int rAdd = kRCr * cr;
+		int gAdd = kGCb * cb + kGCr * cr;
+		int bAdd = kBCb * cb;
+
+		*putIt++ = clamp8((y1 + bAdd) >> 8);
+		*putIt++ = clamp8((y1 + gAdd) >> 8);
+		*putIt++ = clamp8((y1 + rAdd) >> 8);
+
+		*putIt++ = clamp8((y2 + bAdd) >> 8);
+		*putIt++ = clamp8((y2 + gAdd) >> 8);
+		*putIt++ = clamp8((y2 + rAdd) >> 8);
+	}
+}
+
+static void scalar_yuv_row(const uint8_t* getIt, uint8_t* putIt,
+	uint32_t width)
+{
+	for (uint32_t colIndex = 0; colIndex < width; colIndex += 2) {
+		uint8_t y1 = *getIt++;
+		uint8_t cb = *getIt++;
+		uint8_t y2 = *getIt++;
+		uint8_t cr = *getIt++;
+
+		*putIt++ = y1;
+		*putIt++ = cb;
+		*putIt++ = cr;
+		*putIt++ = y2;
+		*putIt++ = cb;
+		*putIt++ = cr;
+	}
+}
+
+#define FRAME_KERNEL(name, row) \
+	static void name(const uint8_t* src, size_t srcStride, \
+		uint8_t* dst, size_t dstStride, uint32_t width, uint32_t height) \
+	{ \
+		for (uint32_t rowIndex = 0; rowIndex < height; ++rowIndex) \
+			row(src + rowIndex * srcStride, dst + rowIndex * dstStride, \
+				width); \
+	}
+
+FRAME_KERNEL(scalar_gray, scalar_gray_row)
+FRAME_KERNEL(scalar_rgb, scalar_rgb_row)
+FRAME_KERNEL(scalar_yuv, scalar_yuv_row)
+
+#ifdef YUYV_X86
+
+#ifdef __x86_64__
+#define SSE2_TARGET
+#else
+#define SSE2_TARGET __attribute__((target("sse2")))
+#endif
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+/*
+ * Drops the fourth byte of the four pixels in 'p' and stores the
+ * remaining 12 bytes. SSE2 has no byte shuffle so the bytes are moved
+ * with shifts and masks.
+ */
+SSE2_TARGET static inline void sse2_store12(uint8_t* putIt, __m128i p)
+{
+	/* Pack the two pixels of each 64 bit half into 6 bytes */
+	__m128i lo = _mm_and_si128(p,
+		_mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF));
+	__m128i hi = _mm_and_si128(_mm_srli_epi64(p, 8),
+		_mm_set_epi32(0x0000FFFF, (int) 0xFF000000,
+			0x0000FFFF, (int) 0xFF000000));
+	__m128i x = _mm_or_si128(lo, hi);
+
+	/* Then join the two halves */
+	x = _mm_or_si128(
+		_mm_and_si128(x, _mm_set_epi32(0, 0, 0x0000FFFF, -1)),
+		_mm_and_si128(_mm_srli_si128(x, 2),
+			_mm_set_epi32(0, -1, (int) 0xFFFF0000, 0)));
+
+	_mm_storel_epi64((__m128i*) putIt, x);
+	uint32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(x, 8));
+	memcpy(putIt + 8, &tail, 4);
+}
+
+/*
+ * Interleaves the 8 bytes in the low half of each component and
+ * stores them as 8 pixels of three bytes.
+ */
+SSE2_TARGET static inline void sse2_store3(uint8_t* putIt, __m128i c0,
+	__m128i c1, __m128i c2)
+{
+	__m128i c01 = _mm_unpacklo_epi8(c0, c1);
+	__m128i c2z = _mm_unpacklo_epi8(c2, _mm_setzero_si128());
+
+	sse2_store12(putIt, _mm_unpacklo_epi16(c01, c2z));
+	sse2_store12(putIt + 12, _mm_unpackhi_epi16(c01, c2z));
+}
+
+/*
+ * Adds the chroma of each macropixel to the luma of its two pixels
+ * and brings the result back to 8 bits.
+ */
+SSE2_TARGET static inline __m128i sse2_component(__m128i y03,
+	__m128i y47, __m128i chroma)
+{
+	__m128i lo = _mm_add_epi32(y03,
+		_mm_shuffle_epi32(chroma, _MM_SHUFFLE(1, 1, 0, 0)));
+	__m128i hi = _mm_add_epi32(y47,
+		_mm_shuffle_epi32(chroma, _MM_SHUFFLE(3, 3, 2, 2)));
+
+	lo = _mm_srai_epi32(lo, 8);
+	hi = _mm_srai_epi32(hi, 8);
+
+	/* The saturation of packus is the clamp to 0..255 */
+	__m128i c = _mm_packs_epi32(lo, hi);
+	return _mm_packus_epi16(c, c);
+}
+
+/*
+ * Converts 8 pixels, the components end in the low half of b, g, r.
+ */
+SSE2_TARGET static inline void sse2_rgb8(__m128i v, __m128i& b,
+	__m128i& g, __m128i& r)
+{
+	/* Luma in 16 bit lanes, Cb and Cr alternating in 16 bit lanes */
+	__m128i y = _mm_and_si128(v, _mm_set1_epi16(0x00FF));
+	__m128i c = _mm_sub_epi16(_mm_srli_epi16(v, 8),
+		_mm_set1_epi16(128));
+
+	/* Chroma terms, one 32 bit lane per macropixel */
+	__m128i rAdd = _mm_madd_epi16(c, _mm_set_epi16(kRCr, 0, kRCr, 0,
+		kRCr, 0, kRCr, 0));
+	__m128i gAdd = _mm_madd_epi16(c, _mm_set_epi16(kGCr, kGCb, kGCr,
+		kGCb, kGCr, kGCb, kGCr, kGCb));
+	__m128i bAdd = _mm_madd_epi16(c, _mm_set_epi16(0, kBCb, 0, kBCb,
+		0, kBCb, 0, kBCb));
+
+	/* Luma terms, one 32 bit lane per pixel */
+	y = _mm_sub_epi16(y, _mm_set1_epi16(kYOffset));
+	__m128i yLo = _mm_mullo_epi16(y, _mm_set1_epi16(kYScale));
+	__m128i yHi = _mm_mulhi_epi16(y, _mm_set1_epi16(kYScale));
+	__m128i y03 = _mm_add_epi32(_mm_unpacklo_epi16(yLo, yHi),
+		_mm_set1_epi32(128));
+	__m128i y47 = _mm_add_epi32(_mm_unpackhi_epi16(yLo, yHi),
+		_mm_set1_epi32(128));
+
+	b = sse2_component(y03, y47, bAdd);
+	g = sse2_component(y03, y47, gAdd);
+	r = sse2_component(y03, y47, rAdd);
+}
+
+/*
+ * Splits 8 pixels into Y, Cb and Cr, the components end in the low
+ * half of y, cb, cr.
+ */
+SSE2_TARGET static inline void sse2_yuv8(__m128i v, __m128i& y,
+	__m128i& cb, __m128i& cr)
+{
+	y = _mm_and_si128(v, _mm_set1_epi16(0x00FF));
+	y = _mm_packus_epi16(y, y);
+
+	/* Each macropixel holds the chroma of two pixels */
+	cb = _mm_and_si128(_mm_srli_epi32(v, 8), _mm_set1_epi32(0xFF));
+	cb = _mm_or_si128(cb, _mm_slli_epi32(cb, 16));
+	cb = _mm_packus_epi16(cb, cb);
+
+	cr = _mm_srli_epi32(v, 24);
+	cr = _mm_or_si128(cr, _mm_slli_epi32(cr, 16));
+	cr = _mm_packus_epi16(cr, cr);
+}
+
+SSE2_TARGET static void sse2_gray_row(const uint8_t* getIt,
+	uint8_t* putIt, uint32_t width)
+{
+	uint32_t vectorWidth = width & ~15u;
+	const __m128i mask = _mm_set1_epi16(0x00FF);
+
+	for (uint32_t colIndex = 0; colIndex < vectorWidth; colIndex += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*) getIt);
+		__m128i b = _mm_loadu_si128((const __m128i*) (getIt + 16));
+
+		_mm_storeu_si128((__m128i*) putIt, _mm_packus_epi16(
+			_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+
+		getIt += 32;
+		putIt += 16;
+	}
+
+	scalar_gray_row(getIt, putIt, width - vectorWidth);
+}
+
+SSE2_TARGET static void sse2_rgb_row(const uint8_t* getIt,
+	uint8_t* putIt, uint32_t width)
+{
+	uint32_t vectorWidth = width & ~7u;
+
+	for (uint32_t colIndex = 0; colIndex < vectorWidth; colIndex += 8) {
+		__m128i b, g, r;
+		sse2_rgb8(_mm_loadu_si128((const __m128i*) getIt), b, g, r);
+		sse2_store3(putIt, b, g, r);
+
+		getIt += 16;
+		putIt += 24;
+	}
+
+	scalar_rgb_row(getIt, putIt, width - vectorWidth);
+}
+
+SSE2_TARGET static void sse2_yuv_row(const uint8_t* getIt,
+	uint8_t* putIt, uint32_t width)
+{
+	uint32_t vectorWidth = width & ~7u;
+
+	for (uint32_t colIndex = 0; colIndex < vectorWidth; colIndex += 8) {
+		__m128i y, cb, cr;
+		sse2_yuv8(_mm_loadu_si128((const __m128i*) getIt), y, cb, cr);
+		sse2_store3(putIt, y, cb, cr);
+
+		getIt += 16;
+		putIt += 24;
+	}
+
+	scalar_yuv_row(getIt, putIt, width - vectorWidth);
+}
+
+FRAME_KERNEL(sse2_gray, sse2_gray_row)
+FRAME_KERNEL(sse2_rgb, sse2_rgb_row)
+FRAME_KERNEL(sse2_yuv, sse2_yuv_row)
+
+/*
+ * The AVX2 kernels do the arithmetic on 16 pixels at a time. The
+ * instructions work on each 128 bit lane separately so every lane
+ * ends up like the SSE2 version, and is stored the same way.
+ */
+AVX2_TARGET static inline __m256i avx2_component(__m256i y03,
+	__m256i y47, __m256i chroma)
+{
+	__m256i lo = _mm256_add_epi32(y03,
+		_mm256_shuffle_epi32(chroma, _MM_SHUFFLE(1, 1, 0, 0)));
+	__m256i hi = _mm256_add_epi32(y47,
+		_mm256_shuffle_epi32(chroma, _MM_SHUFFLE(3, 3, 2, 2)));
+
+	lo = _mm256_srai_epi32(lo, 8);
+	hi = _mm256_srai_epi32(hi, 8);
+
+	__m256i c = _mm256_packs_epi32(lo, hi);
+	return _mm256_packus_epi16(c, c);
+}
+
+/*
+ * Same as sse2_store3 but AVX2 implies SSSE3, so the fourth byte of
+ * the pixels is dropped with a byte shuffle.
+ */
+AVX2_TARGET static inline void avx2_store3_half(uint8_t* putIt,
+	__m128i c0, __m128i c1, __m128i c2)
+{
+	const __m128i pack = _mm_set_epi8(-1, -1, -1, -1, 14, 13, 12, 10,
+		9, 8, 6, 5, 4, 2, 1, 0);
+
+	__m128i c01 = _mm_unpacklo_epi8(c0, c1);
+	__m128i c2z = _mm_unpacklo_epi8(c2, _mm_setzero_si128());
+	__m128i p03 = _mm_shuffle_epi8(_mm_unpacklo_epi16(c01, c2z), pack);
+	__m128i p47 = _mm_shuffle_epi8(_mm_unpackhi_epi16(c01, c2z), pack);
+
+	_mm_storeu_si128((__m128i*) putIt,
+		_mm_or_si128(p03, _mm_slli_si128(p47, 12)));
+	_mm_storel_epi64((__m128i*) (putIt + 16), _mm_srli_si128(p47, 4));
+}
+
+AVX2_TARGET static inline void avx2_store3(uint8_t* putIt, __m256i c0,
+	__m256i c1, __m256i c2)
+{
+	avx2_store3_half(putIt, _mm256_castsi256_si128(c0),
+		_mm256_castsi256_si128(c1), _mm256_castsi256_si128(c2));
+	avx2_store3_half(putIt + 24, _mm256_extracti128_si256(c0, 1),
+		_mm256_extracti128_si256(c1, 1),
+		_mm256_extracti128_si256(c2, 1));
+}
+
+AVX2_TARGET static void avx2_gray_row(const uint8_t* getIt,
+	uint8_t* putIt, uint32_t width)
+{
+	uint32_t vectorWidth = width & ~31u;
+	const __m256i mask = _mm256_set1_epi16(0x00FF);
+
+	for (uint32_t colIndex = 0; colIndex < vectorWidth; colIndex += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*) getIt);
+		__m256i b = _mm256_loadu_si256((const __m256i*) (getIt + 32));
+
+		/* packus works per lane, put the quarters back in order */
+		__m256i y = _mm256_packus_epi16(_mm256_and_si256(a, mask),
+			_mm256_and_si256(b, mask));
+		y = _mm256_permute4x64_epi64(y, _MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256((__m256i*) putIt, y);
+
+		getIt += 64;
+		putIt += 32;
+	}
+
+	sse2_gray_row(getIt, putIt, width - vectorWidth);
+}
+
+AVX2_TARGET static void avx2_rgb_row(const uint8_t* getIt,
+	uint8_t* putIt, uint32_t width)
+{
+	uint32_t vectorWidth = width & ~15u;
+
+	const __m256i kR = _mm256_set_epi16(kRCr, 0, kRCr, 0, kRCr, 0,
+		kRCr, 0, kRCr, 0, kRCr, 0, kRCr, 0, kRCr, 0);
+	const __m256i kG = _mm256_set_epi16(kGCr, kGCb, kGCr, kGCb, kGCr,
+		kGCb, kGCr, kGCb, kGCr, kGCb, kGCr, kGCb, kGCr, kGCb, kGCr,
+		kGCb);
+	const __m256i kB = _mm256_set_epi16(0, kBCb, 0, kBCb, 0, kBCb, 0,
+		kBCb, 0, kBCb, 0, kBCb, 0, kBCb, 0, kBCb);
+
+	for (uint32_t colIndex = 0; colIndex < vectorWidth; colIndex += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) getIt);
+
+		__m256i y = _mm256_and_si256(v, _mm256_set1_epi16(0x00FF));
+		__m256i c = _mm256_sub_epi16(_mm256_srli_epi16(v, 8),
+			_mm256_set1_epi16(128));
+
+		__m256i rAdd = _mm256_madd_epi16(c, kR);
+		__m256i gAdd = _mm256_madd_epi16(c, kG);
+		__m256i bAdd = _mm256_madd_epi16(c, kB);
+
+		y = _mm256_sub_epi16(y, _mm256_set1_epi16(kYOffset));
+		__m256i yLo = _mm256_mullo_epi16(y, _mm256_set1_epi16(kYScale));
+		__m256i yHi = _mm256_mulhi_epi16(y, _mm256_set1_epi16(kYScale));
+		__m256i y03 = _mm256_add_epi32(_mm256_unpacklo_epi16(yLo, yHi),
+			_mm256_set1_epi32(128));
+		__m256i y47 = _mm256_add_epi32(_mm256_unpackhi_epi16(yLo, yHi),
+			_mm256_set1_epi32(128));
+
+		avx2_store3(putIt, avx2_component(y03, y47, bAdd),
+			avx2_component(y03, y47, gAdd),
+			avx2_component(y03, y47, rAdd));
+
+		getIt += 32;
+		putIt += 48;
+	}
+
+	sse2_rgb_row(getIt, putIt, width - vectorWidth);
+}
+
+AVX2_TARGET static void avx2_yuv_row(const uint8_t* getIt,
+	uint8_t* putIt, uint32_t width)
+{
+	uint32_t vectorWidth = width & ~15u;
+
+	for (uint32_t colIndex = 0; colIndex < vectorWidth; colIndex += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) getIt);
+
+		__m256i y = _mm256_and_si256(v, _mm256_set1_epi16(0x00FF));
+		y = _mm256_packus_epi16(y, y);
+
+		__m256i cb = _mm256_and_si256(_mm256_srli_epi32(v, 8),
+			_mm256_set1_epi32(0xFF));
+		cb = _mm256_or_si256(cb, _mm256_slli_epi32(cb, 16));
+		cb = _mm256_packus_epi16(cb, cb);
+
+		__m256i cr = _mm256_srli_epi32(v, 24);
+		cr = _mm256_or_si256(cr, _mm256_slli_epi32(cr, 16));
+		cr = _mm256_packus_epi16(cr, cr);
+
+		avx2_store3(putIt, y, cb, cr);
+
+		getIt += 32;
+		putIt += 48;
+	}
+
+	sse2_yuv_row(getIt, putIt, width - vectorWidth);
+}
+
+FRAME_KERNEL(avx2_gray, avx2_gray_row)
+FRAME_KERNEL(avx2_rgb, avx2_rgb_row)
+FRAME_KERNEL(avx2_yuv, avx2_yuv_row)
+
+#endif /* YUYV_X86 */
+
+#ifdef YUYV_NEON
+
+/*
+ * vld4 splits 8 macropixels into the luma of the even pixels, Cb, the
+ * luma of the odd pixels and Cr, and vst3 interleaves the output.
+ */
+static void neon_gray_row(const uint8_t* getIt, uint8_t* putIt,
+	uint32_t width)
+{
+	uint32_t vectorWidth = width & ~15u;
+
+	for (uint32_t colIndex = 0; colIndex < vectorWidth; colIndex += 16) {
+		uint8x16x2_t v = vld2q_u8(getIt);
+		vst1q_u8(putIt, v.val[0]);
+
+		getIt += 32;
+		putIt += 16;
+	}
+
+	scalar_gray_row(getIt, putIt, width - vectorWidth);
+}
+
+static inline uint8x8_t neon_component(int32x4_t yLo, int32x4_t yHi,
+	int32x4_t chromaLo, int32x4_t chromaHi)
+{
+	int32x4_t lo = vshrq_n_s32(vaddq_s32(yLo, chromaLo), 8);
+	int32x4_t hi = vshrq_n_s32(vaddq_s32(yHi, chromaHi), 8);
+
+	/* The saturating narrow is the clamp to 0..255 */
+	return vqmovun_s16(vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+}
+
+static void neon_rgb_row(const uint8_t* getIt, uint8_t* putIt,
+	uint32_t width)
+{
+	uint32_t vectorWidth = width & ~15u;
+	const int32x4_t round = vdupq_n_s32(128);
+
+	for (uint32_t colIndex = 0; colIndex < vectorWidth; colIndex += 16) {
+		uint8x8x4_t v = vld4_u8(getIt);
+
+		int16x8_t y1 = vreinterpretq_s16_u16(vsubl_u8(v.val[0],
+			vdup_n_u8(kYOffset)));
+		int16x8_t cb = vreinterpretq_s16_u16(vsubl_u8(v.val[1],
+			vdup_n_u8(128)));
+		int16x8_t y2 = vreinterpretq_s16_u16(vsubl_u8(v.val[2],
+			vdup_n_u8(kYOffset)));
+		int16x8_t cr = vreinterpretq_s16_u16(vsubl_u8(v.val[3],
+			vdup_n_u8(128)));
+
+		/* Chroma terms, one 32 bit lane per macropixel */
+		int32x4_t rLo = vmull_n_s16(vget_low_s16(cr), kRCr);
+		int32x4_t rHi = vmull_n_s16(vget_high_s16(cr), kRCr);
+		int32x4_t gLo = vmlal_n_s16(vmull_n_s16(vget_low_s16(cb), kGCb),
+			vget_low_s16(cr), kGCr);
+		int32x4_t gHi = vmlal_n_s16(vmull_n_s16(vget_high_s16(cb), kGCb),
+			vget_high_s16(cr), kGCr);
+		int32x4_t bLo = vmull_n_s16(vget_low_s16(cb), kBCb);
+		int32x4_t bHi = vmull_n_s16(vget_high_s16(cb), kBCb);
+
+		/* Luma terms of the even and odd pixels */
+		int32x4_t y1Lo = vmlal_n_s16(round, vget_low_s16(y1), kYScale);
+		int32x4_t y1Hi = vmlal_n_s16(round, vget_high_s16(y1), kYScale);
+		int32x4_t y2Lo = vmlal_n_s16(round, vget_low_s16(y2), kYScale);
+		int32x4_t y2Hi = vmlal_n_s16(round, vget_high_s16(y2), kYScale);
+
+		uint8x8x2_t b = vzip_u8(neon_component(y1Lo, y1Hi, bLo, bHi),
+			neon_component(y2Lo, y2Hi, bLo, bHi));
+		uint8x8x2_t g = vzip_u8(neon_component(y1Lo, y1Hi, gLo, gHi),
+			neon_component(y2Lo, y2Hi, gLo, gHi));
+		uint8x8x2_t r = vzip_u8(neon_component(y1Lo, y1Hi, rLo, rHi),
+			neon_component(y2Lo, y2Hi, rLo, rHi));
+
+		uint8x8x3_t out;
+		for (int half = 0; half < 2; ++half) {
+			out.val[0] = b.val[half];
+			out.val[1] = g.val[half];
+			out.val[2] = r.val[half];
+			vst3_u8(putIt + half * 24, out);
+		}
+
+		getIt += 32;
+		putIt += 48;
+	}
+
+	scalar_rgb_row(getIt, putIt, width - vectorWidth);
+}
+
+static void neon_yuv_row(const uint8_t* getIt, uint8_t* putIt,
+	uint32_t width)
+{
+	uint32_t vectorWidth = width & ~15u;
+
+	for (uint32_t colIndex = 0; colIndex < vectorWidth; colIndex += 16) {
+		uint8x8x4_t v = vld4_u8(getIt);
+
+		uint8x8x2_t y = vzip_u8(v.val[0], v.val[2]);
+		uint8x8x2_t cb = vzip_u8(v.val[1], v.val[1]);
+		uint8x8x2_t cr = vzip_u8(v.val[3], v.val[3]);
+
+		uint8x8x3_t out;
+		for (int half = 0; half < 2; ++half) {
+			out.val[0] = y.val[half];
+			out.val[1] = cb.val[half];
+			out.val[2] = cr.val[half];
+			vst3_u8(putIt + half * 24, out);
+		}
+
+		getIt += 32;
+		putIt += 48;
+	}
+
+	scalar_yuv_row(getIt, putIt, width - vectorWidth);
+}
+
+FRAME_KERNEL(neon_gray, neon_gray_row)
+FRAME_KERNEL(neon_rgb, neon_rgb_row)
+FRAME_KERNEL(neon_yuv, neon_yuv_row)
+
+#endif /* YUYV_NEON */
+
+static const YUYVKernels kScalar =
+	{ "scalar", scalar_gray, scalar_rgb, scalar_yuv };
+#ifdef YUYV_X86
+static const YUYVKernels kSSE2 =
+	{ "sse2", sse2_gray, sse2_rgb, sse2_yuv };
+static const YUYVKernels kAVX2 =
+	{ "avx2", avx2_gray, avx2_rgb, avx2_yuv };
+#endif
+#ifdef YUYV_NEON
+static const YUYVKernels kNEON =
+	{ "neon", neon_gray, neon_rgb, neon_yuv };
+#endif
+
+/* From the fastest to the slowest */
+static const YUYVKernels* const kAllKernels[] = {
+#ifdef YUYV_X86
+	&kAVX2,
+	&kSSE2,
+#endif
+#ifdef YUYV_NEON
+	&kNEON,
+#endif
+	&kScalar
+};
+
+static bool cpuSupports(const YUYVKernels* kernels)
+{
+#ifdef YUYV_X86
+	__builtin_cpu_init();
+
+	if (kernels == &kSSE2)
+		return __builtin_cpu_supports("sse2");
+
+	if (kernels == &kAVX2)
+		return __builtin_cpu_supports("avx2");
+#endif
+
+#ifdef YUYV_NEON
+	if (kernels == &kNEON) {
+#ifdef __aarch64__
+		return true;
+#else
+		return (getauxval(AT_HWCAP) & HWCAP_ARM_NEON) != 0;
+#endif
+	}
+#endif
+
+	return (kernels == &kScalar);
+}
+
+const YUYVKernels* yuyvSelectKernels()
+{
+	size_t count = sizeof(kAllKernels) / sizeof(kAllKernels[0]);
+
+	for (size_t i = 0; i < count; ++i) {
+		if (cpuSupports(kAllKernels[i]))
+			return kAllKernels[i];
+	}
+
+	return &kScalar;
+}
+
+const YUYVKernels* yuyvKernels(const char* name)
+{
+	size_t count = sizeof(kAllKernels) / sizeof(kAllKernels[0]);
+
+	for (size_t i = 0; i < count; ++i) {
+		if (strcmp(kAllKernels[i]->name, name) == 0)
+			return cpuSupports(kAllKernels[i]) ? kAllKernels[i] : NULL;
+	}
+
+	return NULL;
+}
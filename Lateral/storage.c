@@ -0,0 +1,989 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if defined(__has_include) && defined(__NR_io_uring_setup)
+#if __has_include(<linux/io_uring.h>)
+#define STORAGE_URING
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include "storage.h"
+
+struct storage_buffer {
+	struct storage_file *file;
+
+	/* Where the data goes in the file, and how much of it is written
+	 * (a write can be short) */
+	uint64_t offset;
+	size_t used;
+	size_t written;
+
+	/* When it was handed to the storage thread */
+	uint64_t ready_ns;
+
+	struct iovec iov;
+	char *data;
+	struct storage_buffer *next;
+};
+
+struct storage_file {
+	struct storage *st;
+	char *path;
+	uint64_t prealloc;
+
+	/* Opened by the storage thread, 'failed' if it could not be */
+	int fd;
+	int failed;
+
+	/* The buffer being filled and the size of the file so far, under
+	 * the lock of the file */
+	pthread_mutex_t lock;
+	struct storage_buffer *current;
+	uint64_t size;
+
+	/* Under the lock of the storage: buffers handed to the storage
+	 * thread and not written yet, and whether the file is closed */
+	unsigned int inflight;
+	int closing;
+
+	struct storage_file *next;
+};
+
+#ifdef STORAGE_URING
+/* The rings shared with the kernel, set up without liburing */
+struct uring {
+	int fd;
+
+	/* eventfd signalled on every completion */
+	int done;
+
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Entries queued but not submitted yet */
+	unsigned int to_submit;
+};
+#endif
+
+struct storage {
+	int backend;
+	size_t buffer_size;
+	unsigned int buffer_count;
+	struct storage_buffer *buffers;
+	char *memory;
+
+	pthread_t thread;
+
+	/* eventfd waking the storage thread up */
+	int wake;
+
+	/* The free buffers, the buffers ready to be written in order, the
+	 * files and the counters */
+	pthread_mutex_t lock;
+	struct storage_buffer *free_list;
+	unsigned int free_count;
+	struct storage_buffer *ready_head;
+	struct storage_buffer *ready_tail;
+	struct storage_file *files;
+	unsigned int inflight;
+	int stop;
+
+	struct storage_stats stats;
+	uint64_t start_ns;
+
+#ifdef STORAGE_URING
+	struct uring ring;
+#endif
+};
+
+static uint64_t monotonic_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void wake_up(struct storage *st)
+{
+	uint64_t one = 1;
+
+	if (write(st->wake, &one, sizeof(one)) != sizeof(one))
+		perror("Storage");
+}
+
+static void drain_event(int fd)
+{
+	uint64_t count;
+
+	if (fd >= 0 && read(fd, &count, sizeof(count)) == -1 &&
+		errno != EAGAIN)
+		perror("Storage");
+}
+
+/* Hand a buffer to the storage thread, with the lock of its file */
+static void queue_ready(struct storage *st, struct storage_buffer *buf)
+{
+	buf->written = 0;
+	buf->ready_ns = monotonic_now();
+	buf->next = NULL;
+
+	pthread_mutex_lock(&st->lock);
+
+	if (st->ready_tail != NULL)
+		st->ready_tail->next = buf;
+	else
+		st->ready_head = buf;
+
+	st->ready_tail = buf;
+
+	buf->file->inflight++;
+
+	if (++st->inflight > st->stats.inflight_max)
+		st->stats.inflight_max = st->inflight;
+
+	pthread_mutex_unlock(&st->lock);
+}
+
+/* A buffer is done with, its data written or lost */
+static void complete_buffer(struct storage *st, struct storage_buffer *buf,
+	int ok)
+{
+	uint64_t latency_us = (monotonic_now() - buf->ready_ns) / 1000;
+
+	pthread_mutex_lock(&st->lock);
+
+	if (ok) {
+		st->stats.writes++;
+		st->stats.bytes += buf->used;
+	}
+	else
+		st->stats.failed++;
+
+	st->stats.latency_total_us += latency_us;
+
+	if (latency_us > st->stats.latency_max_us)
+		st->stats.latency_max_us = latency_us;
+
+	buf->file->inflight--;
+	st->inflight--;
+
+	buf->file = NULL;
+	buf->next = st->free_list;
+	st->free_list = buf;
+	st->free_count++;
+
+	pthread_mutex_unlock(&st->lock);
+}
+
+#ifdef STORAGE_URING
+
+static void uring_destroy(struct uring *ring)
+{
+	if (ring->sqes != NULL)
+		munmap(ring->sqes, ring->sqes_size);
+
+	if (ring->cq_map != NULL && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+
+	if (ring->sq_map != NULL)
+		munmap(ring->sq_map, ring->sq_map_size);
+
+	if (ring->done >= 0)
+		close(ring->done);
+
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+	ring->done = -1;
+}
+
+static void *uring_map(int fd, size_t size, off_t offset)
+{
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, offset);
+
+	return (map == MAP_FAILED ? NULL : map);
+}
+
+/* Submit the queued entries, and wait for 'wait' completions */
+static int uring_enter(struct uring *ring, unsigned int wait)
+{
+	int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+		wait, (wait > 0 ? IORING_ENTER_GETEVENTS : 0), NULL, 0);
+
+	if (ret < 0)
+		return -errno;
+
+	ring->to_submit -= ret;
+
+	return ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	/* Only the storage thread moves the tail */
+	unsigned int tail = *ring->sq_tail;
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (tail - head == ring->sq_entries)
+		return NULL;
+
+	unsigned int index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+
+	return sqe;
+}
+
+static void uring_queue_sqe(struct uring *ring)
+{
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+}
+
+static int uring_init(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->done = -1;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+
+	if (ring->fd < 0) {
+		ring->fd = -1;
+		return -1;
+	}
+
+	ring->sq_map_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned int);
+	ring->cq_map_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+
+	/* Both rings in one mapping on the kernels that allow it */
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_map_size > ring->sq_map_size)
+			ring->sq_map_size = ring->cq_map_size;
+
+		ring->sq_map = uring_map(ring->fd, ring->sq_map_size,
+			IORING_OFF_SQ_RING);
+		ring->cq_map = ring->sq_map;
+	}
+	else {
+		ring->sq_map = uring_map(ring->fd, ring->sq_map_size,
+			IORING_OFF_SQ_RING);
+		ring->cq_map = uring_map(ring->fd, ring->cq_map_size,
+			IORING_OFF_CQ_RING);
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *) uring_map(ring->fd,
+		ring->sqes_size, IORING_OFF_SQES);
+
+	if (ring->sq_map == NULL || ring->cq_map == NULL ||
+		ring->sqes == NULL) {
+		uring_destroy(ring);
+		return -1;
+	}
+
+	char *sq = (char *) ring->sq_map;
+	char *cq = (char *) ring->cq_map;
+
+	ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+
+	ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	/* The completions wake the storage thread like the new buffers */
+	ring->done = eventfd(0, EFD_NONBLOCK);
+
+	if (ring->done < 0 || syscall(__NR_io_uring_register, ring->fd,
+		IORING_REGISTER_EVENTFD, &ring->done, 1) < 0) {
+		uring_destroy(ring);
+		return -1;
+	}
+
+	/* A container can have the setup but not the rest, a no-op tells */
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+	sqe->opcode = IORING_OP_NOP;
+	uring_queue_sqe(ring);
+
+	if (uring_enter(ring, 1) != 1) {
+		uring_destroy(ring);
+		return -1;
+	}
+
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+	drain_event(ring->done);
+
+	return 0;
+}
+
+static void uring_submit(struct storage *st, struct storage_buffer *buf)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&st->ring);
+
+	/* Never full, there are as many entries as buffers */
+	if (sqe == NULL) {
+		complete_buffer(st, buf, 0);
+		return;
+	}
+
+	buf->iov.iov_base = buf->data + buf->written;
+	buf->iov.iov_len = buf->used - buf->written;
+
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = buf->file->fd;
+	sqe->addr = (uint64_t) (uintptr_t) &buf->iov;
+	sqe->len = 1;
+	sqe->off = buf->offset + buf->written;
+	sqe->user_data = (uint64_t) (uintptr_t) buf;
+
+	uring_queue_sqe(&st->ring);
+}
+
+static void uring_reap(struct storage *st)
+{
+	struct uring *ring = &st->ring;
+	unsigned int head = *ring->cq_head;
+	struct storage_buffer *retry = NULL;
+
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		struct storage_buffer *buf =
+			(struct storage_buffer *) (uintptr_t) cqe->user_data;
+		int res = cqe->res;
+
+		head++;
+
+		if (res > 0 && buf->written + res < buf->used) {
+			/* Short write, the rest goes again */
+			buf->written += res;
+			buf->next = retry;
+			retry = buf;
+		}
+		else if (res == -EINTR || res == -EAGAIN) {
+			buf->next = retry;
+			retry = buf;
+		}
+		else {
+			/* Nothing written with data left (e.g. the card is
+			 * full) is a failure, as for pwrite */
+			complete_buffer(st, buf, (res >= 0 &&
+				buf->written + res >= buf->used));
+		}
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	while (retry != NULL) {
+		struct storage_buffer *buf = retry;
+
+		retry = buf->next;
+		uring_submit(st, buf);
+	}
+}
+
+#endif /* STORAGE_URING */
+
+/* The fallback, the storage thread writes the buffer itself */
+static void thread_write(struct storage *st, struct storage_buffer *buf)
+{
+	while (buf->written < buf->used) {
+		ssize_t written = pwrite(buf->file->fd, buf->data + buf->written,
+			buf->used - buf->written, buf->offset + buf->written);
+
+		if (written < 0 && errno == EINTR)
+			continue;
+
+		if (written <= 0) {
+			complete_buffer(st, buf, 0);
+			return;
+		}
+
+		buf->written += written;
+	}
+
+	complete_buffer(st, buf, 1);
+}
+
+/* Open the new files, their buffers can only be written afterwards */
+static void open_files(struct storage_file *files)
+{
+	struct storage_file *file;
+
+	for (file = files; file != NULL; file = file->next) {
+		if (file->fd >= 0 || file->failed)
+			continue;
+
+		file->fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC |
+			O_CLOEXEC, 0644);
+
+		if (file->fd < 0) {
+			fprintf(stderr, "Storage: ERROR: Failed to open %s: %s\n",
+				file->path, strerror(errno));
+			file->failed = 1;
+			continue;
+		}
+
+		/* The blocks are reserved up front, the size stays that of
+		 * the data so a file cut short is still clean */
+		if (file->prealloc > 0 && fallocate(file->fd, FALLOC_FL_KEEP_SIZE,
+			0, file->prealloc) != 0 && errno != EOPNOTSUPP)
+			perror("Storage");
+	}
+}
+
+/* Hand over the partly filled buffers, of every file on a flush or of
+ * the files being closed */
+static void flush_files(struct storage *st, struct storage_file *files,
+	int all)
+{
+	struct storage_file *file;
+
+	for (file = files; file != NULL; file = file->next) {
+		pthread_mutex_lock(&st->lock);
+		int closing = file->closing;
+		pthread_mutex_unlock(&st->lock);
+
+		if (!all && !closing)
+			continue;
+
+		pthread_mutex_lock(&file->lock);
+
+		if (file->current != NULL && file->current->used > 0) {
+			queue_ready(st, file->current);
+			file->current = NULL;
+		}
+
+		pthread_mutex_unlock(&file->lock);
+	}
+}
+
+static void write_ready(struct storage *st)
+{
+	pthread_mutex_lock(&st->lock);
+	struct storage_buffer *buf = st->ready_head;
+	st->ready_head = NULL;
+	st->ready_tail = NULL;
+	pthread_mutex_unlock(&st->lock);
+
+	struct storage_buffer *later = NULL;
+	struct storage_buffer *later_tail = NULL;
+
+	while (buf != NULL) {
+		struct storage_buffer *next = buf->next;
+
+		/* A file opened since open_files, its buffers wait a turn */
+		if (buf->file->fd < 0 && !buf->file->failed) {
+			buf->next = NULL;
+
+			if (later_tail != NULL)
+				later_tail->next = buf;
+			else
+				later = buf;
+
+			later_tail = buf;
+		}
+		else if (buf->file->failed)
+			complete_buffer(st, buf, 0);
+#ifdef STORAGE_URING
+		else if (st->backend == STORAGE_AUTO)
+			uring_submit(st, buf);
+#endif
+		else
+			thread_write(st, buf);
+
+		buf = next;
+	}
+
+	if (later != NULL) {
+		pthread_mutex_lock(&st->lock);
+
+		later_tail->next = st->ready_head;
+		st->ready_head = later;
+
+		if (st->ready_tail == NULL)
+			st->ready_tail = later_tail;
+
+		pthread_mutex_unlock(&st->lock);
+
+		wake_up(st);
+	}
+
+#ifdef STORAGE_URING
+	if (st->backend == STORAGE_AUTO && st->ring.to_submit > 0) {
+		int ret = uring_enter(&st->ring, 0);
+
+		if (ret < 0 && ret != -EAGAIN && ret != -EBUSY && ret != -EINTR)
+			fprintf(stderr, "Storage: ERROR: io_uring_enter: %s\n",
+				strerror(-ret));
+	}
+#endif
+}
+
+/* Close the files whose data is all written, returns the files left */
+static struct storage_file *close_files(struct storage *st)
+{
+	pthread_mutex_lock(&st->lock);
+
+	struct storage_file **link = &st->files;
+
+	while (*link != NULL) {
+		struct storage_file *file = *link;
+
+		if (!file->closing || file->inflight > 0) {
+			link = &file->next;
+			continue;
+		}
+
+		*link = file->next;
+		pthread_mutex_unlock(&st->lock);
+
+		/* The blocks reserved past the end are given back */
+		if (file->fd >= 0) {
+			if (ftruncate(file->fd, file->size) != 0)
+				perror("Storage");
+
+			close(file->fd);
+		}
+
+		/* An empty buffer may be left, it was never handed over */
+		pthread_mutex_lock(&st->lock);
+
+		if (file->current != NULL) {
+			file->current->file = NULL;
+			file->current->next = st->free_list;
+			st->free_list = file->current;
+			st->free_count++;
+		}
+
+		pthread_mutex_unlock(&st->lock);
+
+		pthread_mutex_destroy(&file->lock);
+		free(file->path);
+		free(file);
+
+		pthread_mutex_lock(&st->lock);
+	}
+
+	struct storage_file *files = st->files;
+
+	pthread_mutex_unlock(&st->lock);
+
+	return files;
+}
+
+static void *storage_thread(void *args)
+{
+	struct storage *st = (struct storage *) args;
+	uint64_t flushed_ns = monotonic_now();
+	struct pollfd events[2];
+
+	events[0].fd = st->wake;
+	events[0].events = POLLIN;
+
+	/* Ignored by poll when there is no ring */
+	events[1].fd = -1;
+	events[1].events = POLLIN;
+
+#ifdef STORAGE_URING
+	if (st->backend == STORAGE_AUTO)
+		events[1].fd = st->ring.done;
+#endif
+
+	while (1) {
+		if (poll(events, 2, STORAGE_FLUSH_MS) == -1 && errno != EINTR)
+			perror("Storage");
+
+		drain_event(events[0].fd);
+		drain_event(events[1].fd);
+
+#ifdef STORAGE_URING
+		if (st->backend == STORAGE_AUTO)
+			uring_reap(st);
+#endif
+
+		/* The files are only added at the head, and only removed by
+		 * this thread */
+		pthread_mutex_lock(&st->lock);
+		struct storage_file *files = st->files;
+		int stop = st->stop;
+
+		if (stop) {
+			struct storage_file *file;
+
+			for (file = files; file != NULL; file = file->next)
+				file->closing = 1;
+		}
+
+		pthread_mutex_unlock(&st->lock);
+
+		uint64_t now = monotonic_now();
+		int flush = (now - flushed_ns >= STORAGE_FLUSH_MS * 1000000ULL);
+
+		if (flush)
+			flushed_ns = now;
+
+		open_files(files);
+		flush_files(st, files, flush);
+		write_ready(st);
+
+		files = close_files(st);
+
+		pthread_mutex_lock(&st->lock);
+		int done = (stop && files == NULL && st->inflight == 0);
+		pthread_mutex_unlock(&st->lock);
+
+		if (done)
+			break;
+	}
+
+	pthread_exit(NULL);
+}
+
+struct storage *storage_create(unsigned int buffers, size_t buffer_size,
+	int backend)
+{
+	struct storage *st;
+	unsigned int i;
+
+	if (buffers < 1 || buffer_size < 1)
+		return NULL;
+
+	st = (struct storage *) calloc(1, sizeof(struct storage));
+	if (st == NULL)
+		return NULL;
+
+	st->buffer_size = buffer_size;
+	st->buffer_count = buffers;
+	st->buffers = (struct storage_buffer *) calloc(buffers,
+		sizeof(struct storage_buffer));
+	st->memory = (char *) malloc(buffers * buffer_size);
+	st->wake = eventfd(0, EFD_NONBLOCK);
+
+	if (st->buffers == NULL || st->memory == NULL || st->wake < 0) {
+		if (st->wake >= 0)
+			close(st->wake);
+
+		free(st->memory);
+		free(st->buffers);
+		free(st);
+		return NULL;
+	}
+
+	for (i = 0; i < buffers; ++i) {
+		st->buffers[i].data = st->memory + (size_t) i * buffer_size;
+		st->buffers[i].next = st->free_list;
+		st->free_list = &st->buffers[i];
+	}
+
+	st->free_count = buffers;
+
+	pthread_mutex_init(&st->lock, NULL);
+
+	st->backend = STORAGE_THREAD;
+
+#ifdef STORAGE_URING
+	/* A ring entry for every buffer, so it is never full */
+	if (backend == STORAGE_AUTO && uring_init(&st->ring, buffers) == 0)
+		st->backend = STORAGE_AUTO;
+	else {
+		st->ring.fd = -1;
+		st->ring.done = -1;
+	}
+#endif
+
+	st->start_ns = monotonic_now();
+
+	if (pthread_create(&st->thread, NULL, storage_thread, st) != 0) {
+#ifdef STORAGE_URING
+		uring_destroy(&st->ring);
+#endif
+		pthread_mutex_destroy(&st->lock);
+		close(st->wake);
+		free(st->memory);
+		free(st->buffers);
+		free(st);
+		return NULL;
+	}
+
+	return st;
+}
+
+void storage_destroy(struct storage *st, struct storage_stats *stats)
+{
+	if (st == NULL)
+		return;
+
+	pthread_mutex_lock(&st->lock);
+	st->stop = 1;
+	pthread_mutex_unlock(&st->lock);
+
+	wake_up(st);
+	pthread_join(st->thread, NULL);
+
+	if (stats != NULL)
+		storage_get_stats(st, stats);
+
+#ifdef STORAGE_URING
+	if (st->backend == STORAGE_AUTO)
+		uring_destroy(&st->ring);
+#endif
+
+	pthread_mutex_destroy(&st->lock);
+	close(st->wake);
+	free(st->memory);
+	free(st->buffers);
+	free(st);
+}
+
+const char *storage_backend(struct storage *st)
+{
+	return (st->backend == STORAGE_AUTO ? "io_uring" : "thread");
+}
+
+struct storage_file *storage_open(struct storage *st, const char *path,
+	uint64_t prealloc)
+{
+	struct storage_file *file;
+
+	if (st == NULL)
+		return NULL;
+
+	file = (struct storage_file *) calloc(1, sizeof(struct storage_file));
+	if (file == NULL)
+		return NULL;
+
+	file->path = strdup(path);
+
+	if (file->path == NULL) {
+		free(file);
+		return NULL;
+	}
+
+	file->st = st;
+	file->prealloc = prealloc;
+	file->fd = -1;
+
+	pthread_mutex_init(&file->lock, NULL);
+
+	pthread_mutex_lock(&st->lock);
+	file->next = st->files;
+	st->files = file;
+	pthread_mutex_unlock(&st->lock);
+
+	wake_up(st);
+
+	return file;
+}
+
+int storage_write(struct storage_file *file, const void *data,
+	size_t size)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *) data;
+	iov.iov_len = size;
+
+	return storage_writev(file, &iov, 1);
+}
+
+int storage_writev(struct storage_file *file, const struct iovec *iov,
+	int count)
+{
+	if (file == NULL)
+		return -1;
+
+	struct storage *st = file->st;
+	struct storage_buffer *spare = NULL;
+	size_t size = 0;
+	int full = 0;
+	int i;
+
+	for (i = 0; i < count; ++i)
+		size += iov[i].iov_len;
+
+	pthread_mutex_lock(&file->lock);
+
+	size_t room = (file->current != NULL ?
+		st->buffer_size - file->current->used : 0);
+
+	/* Every buffer needed is taken at once, or the data is dropped
+	 * whole rather than cut */
+	if (size > room) {
+		unsigned int needed = (size - room + st->buffer_size - 1) /
+			st->buffer_size;
+
+		pthread_mutex_lock(&st->lock);
+
+		if (st->free_count < needed) {
+			st->stats.dropped_bytes += size;
+			pthread_mutex_unlock(&st->lock);
+			pthread_mutex_unlock(&file->lock);
+			return -1;
+		}
+
+		while (needed-- > 0) {
+			struct storage_buffer *buf = st->free_list;
+
+			st->free_list = buf->next;
+			st->free_count--;
+
+			buf->next = spare;
+			spare = buf;
+		}
+
+		pthread_mutex_unlock(&st->lock);
+	}
+
+	for (i = 0; i < count; ++i) {
+		const char *bytes = (const char *) iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+
+		while (left > 0) {
+			if (file->current == NULL) {
+				file->current = spare;
+				spare = spare->next;
+
+				file->current->file = file;
+				file->current->offset = file->size;
+				file->current->used = 0;
+			}
+
+			struct storage_buffer *buf = file->current;
+			size_t length = st->buffer_size - buf->used;
+
+			if (length > left)
+				length = left;
+
+			memcpy(buf->data + buf->used, bytes, length);
+			buf->used += length;
+			file->size += length;
+			bytes += length;
+			left -= length;
+
+			if (buf->used == st->buffer_size) {
+				queue_ready(st, buf);
+				file->current = NULL;
+				full = 1;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&file->lock);
+
+	/* Only a full buffer is worth a system call */
+	if (full)
+		wake_up(st);
+
+	return 0;
+}
+
+int storage_printf(struct storage_file *file, const char *format, ...)
+{
+	char line[256];
+	va_list args;
+
+	if (file == NULL)
+		return -1;
+
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+
+	if (length < 0)
+		return -1;
+
+	if ((size_t) length < sizeof(line))
+		return storage_write(file, line, length);
+
+	/* A longer line, rare enough to allocate */
+	char *longer = (char *) malloc(length + 1);
+
+	if (longer == NULL)
+		return -1;
+
+	va_start(args, format);
+	vsnprintf(longer, length + 1, format, args);
+	va_end(args);
+
+	int ret = storage_write(file, longer, length);
+
+	free(longer);
+
+	return ret;
+}
+
+void storage_close(struct storage_file *file)
+{
+	if (file == NULL)
+		return;
+
+	struct storage *st = file->st;
+
+	pthread_mutex_lock(&file->lock);
+
+	if (file->current != NULL && file->current->used > 0) {
+		queue_ready(st, file->current);
+		file->current = NULL;
+	}
+
+	pthread_mutex_unlock(&file->lock);
+
+	pthread_mutex_lock(&st->lock);
+	file->closing = 1;
+	pthread_mutex_unlock(&st->lock);
+
+	wake_up(st);
+}
+
+void storage_get_stats(struct storage *st, struct storage_stats *stats)
+{
+	pthread_mutex_lock(&st->lock);
+	*stats = st->stats;
+	pthread_mutex_unlock(&st->lock);
+
+	stats->elapsed_us = (monotonic_now() - st->start_ns) / 1000;
+}
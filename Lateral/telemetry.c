@@ -0,0 +1,361 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "telemetry.h"
+
+struct telemetry_log {
+	struct telemetry *tm;
+	struct storage_file *file;
+	struct telemetry_record *ring;
+	uint32_t mask;
+
+	/* Moved by the thread writing the log, on its own cache line */
+	char pad_writer[64];
+	uint32_t tail;
+	uint32_t dropped;
+
+	/* Moved by the drainer */
+	char pad_drainer[64];
+	uint32_t head;
+	uint32_t dropped_seen;
+
+	/* Under the lock of the telemetry */
+	int closing;
+	struct telemetry_log *next;
+};
+
+struct telemetry {
+	struct storage *st;
+	pthread_t thread;
+
+	/* eventfd stopping the drainer */
+	int stop;
+
+	/* The logs and the counters, and who sees the records */
+	pthread_mutex_t lock;
+	struct telemetry_log *logs;
+	struct telemetry_stats stats;
+	telemetry_tap tap;
+	void *tap_context;
+};
+
+/* The files are little endian whatever the board */
+static uint8_t *put32(uint8_t *put, uint32_t value)
+{
+	put[0] = value & 0xFF;
+	put[1] = (value >> 8) & 0xFF;
+	put[2] = (value >> 16) & 0xFF;
+	put[3] = value >> 24;
+
+	return put + 4;
+}
+
+void telemetry_pack_header(uint8_t *data)
+{
+	memcpy(data, "TTLM", 4);
+	data = put32(data + 4, TELEMETRY_VERSION);
+	data = put32(data, TELEMETRY_RECORD_SIZE);
+	put32(data, 0);
+}
+
+void telemetry_pack(const struct telemetry_record *record, uint8_t *data)
+{
+	data = put32(data, record->type);
+	data = put32(data, record->values[0]);
+	data = put32(data, record->values[1]);
+	data = put32(data, record->values[2]);
+	put32(data, record->values[3]);
+}
+
+static void drain_log(struct telemetry *tm, struct telemetry_log *log)
+{
+	uint8_t batch[TELEMETRY_BATCH * TELEMETRY_RECORD_SIZE];
+	struct telemetry_record copies[TELEMETRY_BATCH];
+	uint32_t head = log->head;
+	uint32_t tail = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+	uint64_t records = 0;
+	uint64_t lost = 0;
+
+	while (head != tail) {
+		uint8_t *put = batch;
+		unsigned int count = 0;
+
+		while (head != tail && count < TELEMETRY_BATCH) {
+			copies[count] = log->ring[head & log->mask];
+			telemetry_pack(&copies[count], put);
+
+			put += TELEMETRY_RECORD_SIZE;
+			head++;
+			count++;
+		}
+
+		/* The slots are free again once copied */
+		__atomic_store_n(&log->head, head, __ATOMIC_RELEASE);
+
+		/* Under the lock, so the tap is not removed while running */
+		pthread_mutex_lock(&tm->lock);
+		if (tm->tap != NULL)
+			tm->tap(copies, count, tm->tap_context);
+		pthread_mutex_unlock(&tm->lock);
+
+		if (storage_write(log->file, batch, put - batch) == 0)
+			records += count;
+		else
+			lost += count;
+	}
+
+	uint32_t dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+
+	lost += dropped - log->dropped_seen;
+	log->dropped_seen = dropped;
+
+	pthread_mutex_lock(&tm->lock);
+	tm->stats.records += records;
+	tm->stats.dropped += lost;
+	pthread_mutex_unlock(&tm->lock);
+}
+
+static void *telemetry_thread(void *args)
+{
+	struct telemetry *tm = (struct telemetry *) args;
+	struct pollfd stop;
+
+	stop.fd = tm->stop;
+	stop.events = POLLIN;
+
+	while (1) {
+		int stopping = (poll(&stop, 1, TELEMETRY_DRAIN_MS) > 0);
+
+		/* The logs are only added at the head, and only removed by
+		 * this thread */
+		pthread_mutex_lock(&tm->lock);
+		struct telemetry_log *log = tm->logs;
+		pthread_mutex_unlock(&tm->lock);
+
+		for (; log != NULL; log = log->next) {
+			pthread_mutex_lock(&tm->lock);
+			if (stopping)
+				log->closing = 1;
+			int closing = log->closing;
+			pthread_mutex_unlock(&tm->lock);
+
+			/* Nothing is written to a closed log, this is the last */
+			drain_log(tm, log);
+
+			if (closing) {
+				pthread_mutex_lock(&tm->lock);
+				log->closing = 2;
+				pthread_mutex_unlock(&tm->lock);
+			}
+		}
+
+		pthread_mutex_lock(&tm->lock);
+
+		struct telemetry_log **link = &tm->logs;
+
+		while (*link != NULL) {
+			struct telemetry_log *closed = *link;
+
+			if (closed->closing != 2) {
+				link = &closed->next;
+				continue;
+			}
+
+			*link = closed->next;
+
+			storage_close(closed->file);
+			free(closed->ring);
+			free(closed);
+		}
+
+		int done = (stopping && tm->logs == NULL);
+
+		pthread_mutex_unlock(&tm->lock);
+
+		if (done)
+			break;
+	}
+
+	pthread_exit(NULL);
+}
+
+struct telemetry *telemetry_create(struct storage *st)
+{
+	struct telemetry *tm;
+
+	if (st == NULL)
+		return NULL;
+
+	tm = (struct telemetry *) calloc(1, sizeof(struct telemetry));
+	if (tm == NULL)
+		return NULL;
+
+	tm->st = st;
+	tm->stop = eventfd(0, 0);
+
+	if (tm->stop < 0) {
+		free(tm);
+		return NULL;
+	}
+
+	pthread_mutex_init(&tm->lock, NULL);
+
+	if (pthread_create(&tm->thread, NULL, telemetry_thread, tm) != 0) {
+		pthread_mutex_destroy(&tm->lock);
+		close(tm->stop);
+		free(tm);
+		return NULL;
+	}
+
+	return tm;
+}
+
+void telemetry_destroy(struct telemetry *tm, struct telemetry_stats *stats)
+{
+	uint64_t one = 1;
+
+	if (tm == NULL)
+		return;
+
+	if (write(tm->stop, &one, sizeof(one)) != sizeof(one))
+		perror("Telemetry");
+
+	pthread_join(tm->thread, NULL);
+
+	if (stats != NULL)
+		telemetry_get_stats(tm, stats);
+
+	pthread_mutex_destroy(&tm->lock);
+	close(tm->stop);
+	free(tm);
+}
+
+struct telemetry_log *telemetry_open(struct telemetry *tm, const char *path,
+	unsigned int records, uint64_t prealloc)
+{
+	struct telemetry_log *log;
+	uint32_t capacity = 16;
+
+	if (tm == NULL)
+		return NULL;
+
+	while (capacity < records && capacity < (1U << 30))
+		capacity <<= 1;
+
+	log = (struct telemetry_log *) calloc(1, sizeof(struct telemetry_log));
+	if (log == NULL)
+		return NULL;
+
+	log->ring = (struct telemetry_record *) calloc(capacity,
+		sizeof(struct telemetry_record));
+	log->file = storage_open(tm->st, path, prealloc);
+
+	if (log->ring == NULL || log->file == NULL) {
+		storage_close(log->file);
+		free(log->ring);
+		free(log);
+		return NULL;
+	}
+
+	uint8_t header[TELEMETRY_HEADER_SIZE];
+	telemetry_pack_header(header);
+
+	storage_write(log->file, header, sizeof(header));
+
+	log->tm = tm;
+	log->mask = capacity - 1;
+
+	pthread_mutex_lock(&tm->lock);
+	log->next = tm->logs;
+	tm->logs = log;
+	pthread_mutex_unlock(&tm->lock);
+
+	return log;
+}
+
+int telemetry_write(struct telemetry_log *log, uint32_t type, uint32_t a,
+	uint32_t b, uint32_t c, uint32_t d)
+{
+	if (log == NULL)
+		return -1;
+
+	/* Only this thread moves the tail */
+	uint32_t tail = log->tail;
+
+	if (tail - __atomic_load_n(&log->head, __ATOMIC_ACQUIRE) > log->mask) {
+		__atomic_store_n(&log->dropped, log->dropped + 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	struct telemetry_record *record = &log->ring[tail & log->mask];
+
+	record->type = type;
+	record->values[0] = a;
+	record->values[1] = b;
+	record->values[2] = c;
+	record->values[3] = d;
+
+	/* The record is seen by the drainer with its values */
+	__atomic_store_n(&log->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void telemetry_close(struct telemetry_log *log)
+{
+	if (log == NULL)
+		return;
+
+	pthread_mutex_lock(&log->tm->lock);
+	log->closing = 1;
+	pthread_mutex_unlock(&log->tm->lock);
+}
+
+void telemetry_get_stats(struct telemetry *tm, struct telemetry_stats *stats)
+{
+	pthread_mutex_lock(&tm->lock);
+	*stats = tm->stats;
+	pthread_mutex_unlock(&tm->lock);
+}
+
+void telemetry_set_tap(struct telemetry *tm, telemetry_tap tap,
+	void *context)
+{
+	if (tm == NULL)
+		return;
+
+	pthread_mutex_lock(&tm->lock);
+	tm->tap = tap;
+	tm->tap_context = context;
+	pthread_mutex_unlock(&tm->lock);
+}
+
+int telemetry_format(const struct telemetry_record *record, char *line,
+	size_t size)
+{
+	const uint32_t *values = record->values;
+
+	switch (record->type) {
+	case TELEMETRY_ENCODER:
+		/* The right encoder is indented */
+		return snprintf(line, size, (values[0] == 1410 ?
+			"\t%d %d %d\n" : "%d %d %d\n"), (int) values[0],
+			(int) values[1], (int) values[2]);
+
+	case TELEMETRY_CAPTURE:
+		return snprintf(line, size, "%d %d %u %u\n", (int) values[0],
+			(int) values[1], values[2], values[3]);
+
+	case TELEMETRY_PROCESS:
+		return snprintf(line, size, "frame%u.jpg %d\n", values[0],
+			(int) values[1]);
+	}
+
+	return -1;
+}
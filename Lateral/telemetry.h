@@ -0,0 +1,95 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "storage.h"
+
+/*
+ * Binary logs of the readings (encoders, captured and processed
+ * frames) for the threads that cannot afford formatting text. Every log
+ * has a ring of fixed size records written by a single thread without
+ * a lock or a system call; a drainer thread empties the rings every
+ * TELEMETRY_DRAIN_MS into files written through the storage. A record
+ * that finds its ring full is dropped and counted.
+ *
+ * File layout, little endian whatever the board:
+ *   header   "TTLM", version, size of a record, 0
+ *   records  type, then 4 values (32 bits each)
+ *
+ * telemetry_csv turns a file back into the .csv layout of its records.
+ */
+struct telemetry;
+struct telemetry_log;
+
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_HEADER_SIZE 16
+#define TELEMETRY_RECORD_SIZE 20
+#define TELEMETRY_DRAIN_MS 100
+
+/* Records drained into a single write of the storage */
+#define TELEMETRY_BATCH 128
+
+/* Types of the records, and their values */
+#define TELEMETRY_ENCODER 1 /* can id, timestamp (ms), encoder, 0 */
+#define TELEMETRY_CAPTURE 2 /* frame, grab (ms), driver sequence, dropped */
+#define TELEMETRY_PROCESS 3 /* frame, time (ms), 0, 0 */
+
+struct telemetry_record {
+	uint32_t type;
+	uint32_t values[4];
+};
+
+/* Given the records as they are drained, 'count' at a time (up to
+ * TELEMETRY_BATCH). Called on the drainer thread, it must not block */
+typedef void (*telemetry_tap)(const struct telemetry_record *records,
+	unsigned int count, void *context);
+
+struct telemetry_stats {
+	/* Records written to the files, and dropped on a full ring */
+	uint64_t records;
+	uint64_t dropped;
+};
+
+/* Start the drainer, the files are written through 'st'. NULL if the
+ * thread cannot be started */
+struct telemetry *telemetry_create(struct storage *st);
+
+/* Drains and closes the logs left open, the final counters go to
+ * 'stats' if not NULL */
+void telemetry_destroy(struct telemetry *tm, struct telemetry_stats *stats);
+
+/* Create the file 'path' with a ring of 'records' (rounded up to a
+ * power of 2) and 'prealloc' bytes reserved. NULL if out of memory or
+ * 'tm' is NULL, the functions below ignore a NULL log */
+struct telemetry_log *telemetry_open(struct telemetry *tm, const char *path,
+	unsigned int records, uint64_t prealloc);
+
+/* Append a record, from the one thread writing the log. Returns -1 if
+ * the ring is full */
+int telemetry_write(struct telemetry_log *log, uint32_t type, uint32_t a,
+	uint32_t b, uint32_t c, uint32_t d);
+
+/* The records left are drained and the file closed in the background,
+ * the log must not be used anymore */
+void telemetry_close(struct telemetry_log *log);
+
+void telemetry_get_stats(struct telemetry *tm, struct telemetry_stats *stats);
+
+/* Have 'tap' see every record drained from now on (NULL for none).
+ * Once it returns the previous tap is not running anymore */
+void telemetry_set_tap(struct telemetry *tm, telemetry_tap tap,
+	void *context);
+
+/* The header of a file, and a record as it is in the files, into
+ * TELEMETRY_HEADER_SIZE and TELEMETRY_RECORD_SIZE bytes */
+void telemetry_pack_header(uint8_t *data);
+void telemetry_pack(const struct telemetry_record *record, uint8_t *data);
+
+/* The record as a line of the .csv files it replaces, returns the length
+ * of the line or -1 for an unknown type */
+int telemetry_format(const struct telemetry_record *record, char *line,
+	size_t size);
+
+#endif